@@ -0,0 +1,85 @@
+#pragma once
+
+#include "FrameAlloc.h"
+
+typedef std::string Error;
+
+// Rect is a half-open pixel rectangle, covering [X1,X2) horizontally and [Y1,Y2) vertically
+struct Rect {
+	int X1 = 0;
+	int Y1 = 0;
+	int X2 = 0;
+	int Y2 = 0;
+
+	Rect() {}
+	Rect(int x1, int y1, int x2, int y2) : X1(x1), Y1(y1), X2(x2), Y2(y2) {}
+
+	int  Width() const { return X2 - X1; }
+	int  Height() const { return Y2 - Y1; }
+	bool IsEmpty() const { return X2 <= X1 || Y2 <= Y1; }
+
+	Rect Intersection(const Rect& b) const {
+		Rect r(std::max(X1, b.X1), std::max(Y1, b.Y1), std::min(X2, b.X2), std::min(Y2, b.Y2));
+		if (r.IsEmpty())
+			return Rect();
+		return r;
+	}
+
+	Rect Union(const Rect& b) const {
+		if (IsEmpty())
+			return b;
+		if (b.IsEmpty())
+			return *this;
+		return Rect(std::min(X1, b.X1), std::min(Y1, b.Y1), std::max(X2, b.X2), std::max(Y2, b.Y2));
+	}
+
+	bool operator==(const Rect& b) const { return X1 == b.X1 && Y1 == b.Y1 && X2 == b.X2 && Y2 == b.Y2; }
+	bool operator!=(const Rect& b) const { return !(*this == b); }
+
+	// Returns true if b lies entirely inside this rectangle
+	bool Contains(const Rect& b) const {
+		return X1 <= b.X1 && Y1 <= b.Y1 && b.X2 <= X2 && b.Y2 <= Y2;
+	}
+
+	// Returns true if the two rectangles overlap, or share an edge
+	bool Touches(const Rect& b) const {
+		return X1 <= b.X2 && b.X1 <= X2 && Y1 <= b.Y2 && b.Y1 <= Y2;
+	}
+};
+
+// MoveOp describes a region of the previous frame that reappears, unchanged, at another position in the
+// current frame. Src is in the coordinates of the previous frame, and (DstX, DstY) is the top-left
+// corner of where it lands. Every MoveOp of a frame reads from the previous frame, so they must be
+// applied as if simultaneously.
+struct MoveOp {
+	Rect Src;
+	int  DstX = 0;
+	int  DstY = 0;
+
+	MoveOp() {}
+	MoveOp(const Rect& src, int dstX, int dstY) : Src(src), DstX(dstX), DstY(dstY) {}
+
+	Rect Dst() const { return Rect(DstX, DstY, DstX + Src.Width(), DstY + Src.Height()); }
+};
+
+// When a frame was produced, and how it got to us. Times are microseconds of MonotonicMicros() (see FrameTrace.h).
+struct FrameTiming {
+	uint64_t Seq           = 0; // Counts up by one for every captured frame. 0 means the frame wasn't captured.
+	int64_t  PresentMicros = 0; // When the OS presented the frame to the screen
+	int64_t  MouseMicros   = 0; // When the mouse last moved, or 0 if it didn't move since the previous frame
+	int64_t  AcquireMicros = 0; // When we acquired the frame from the OS
+	int64_t  ReadyMicros   = 0; // When the pixels were readable in Buf
+};
+
+// BGRA U8 Bitmap. Copying a Bitmap shares its pixels until one of the copies is written to.
+struct Bitmap {
+	int         Width  = 0;
+	int         Height = 0;
+	FrameBuf    Buf;
+	FrameTiming Timing;
+
+	int            Stride() const { return Width * 4; }
+	Rect           Bounds() const { return Rect(0, 0, Width, Height); }
+	uint8_t*       Row(int y) { return Buf.data() + (size_t) y * Stride(); }
+	const uint8_t* Row(int y) const { return Buf.data() + (size_t) y * Stride(); }
+};
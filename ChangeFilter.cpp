@@ -0,0 +1,223 @@
+#include "stdafx.h"
+#include "ChangeFilter.h"
+#include "Simd.h"
+
+// Luma weights (BT.601), scaled so that they sum to 256
+static const int LumaB = 29;
+static const int LumaG = 150;
+static const int LumaR = 77;
+
+static inline int Luma(const uint8_t* p) {
+	return (p[0] * LumaB + p[1] * LumaG + p[2] * LumaR) >> 8;
+}
+
+float LumaDiffStats::SSIM(int n) const {
+	if (n == 0)
+		return 1;
+	const double C1  = 6.5025;  // (0.01 * 255)^2
+	const double C2  = 58.5225; // (0.03 * 255)^2
+	double       ma  = (double) SumA / n;
+	double       mb  = (double) SumB / n;
+	double       va  = (double) SumAA / n - ma * ma;
+	double       vb  = (double) SumBB / n - mb * mb;
+	double       cov = (double) SumAB / n - ma * mb;
+	return (float) (((2 * ma * mb + C1) * (2 * cov + C2)) / ((ma * ma + mb * mb + C1) * (va + vb + C2)));
+}
+
+#ifdef WINDUP_SSE2
+// Convert 4 BGRA pixels into 4 x int32 luma values
+static inline __m128i Luma4(__m128i px) {
+	const __m128i zero    = _mm_setzero_si128();
+	const __m128i weights = _mm_setr_epi16(LumaB, LumaG, LumaR, 0, LumaB, LumaG, LumaR, 0);
+	__m128i       lo      = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), weights); // [p0 BG, p0 R, p1 BG, p1 R]
+	__m128i       hi      = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), weights);
+	lo                    = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+	hi                    = _mm_add_epi32(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+	__m128i y             = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0)));
+	return _mm_srli_epi32(y, 8);
+}
+
+// Convert 8 BGRA pixels into 8 x int16 luma values
+static inline __m128i Luma8(const uint8_t* p) {
+	__m128i a = Luma4(_mm_loadu_si128((const __m128i*) p));
+	__m128i b = Luma4(_mm_loadu_si128((const __m128i*) (p + 16)));
+	return _mm_packs_epi32(a, b);
+}
+
+static inline int64_t HorizontalSum32(__m128i v) {
+	int32_t t[4];
+	_mm_storeu_si128((__m128i*) t, v);
+	return (int64_t) t[0] + t[1] + t[2] + t[3];
+}
+#endif
+
+LumaDiffStats LumaDiff(const uint8_t* a, const uint8_t* b, int n, int pixelThreshold) {
+	LumaDiffStats s;
+	int           i = 0;
+#ifdef WINDUP_SSE2
+	// The 32-bit accumulators can't overflow for up to 8192 pixels, so we flush them in batches of that size
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i thr  = _mm_set1_epi16((short) pixelThreshold);
+	while (n - i >= 8) {
+		int     end     = std::min(i + 8192, n & ~7);
+		__m128i sa      = _mm_setzero_si128();
+		__m128i sb      = _mm_setzero_si128();
+		__m128i saa     = _mm_setzero_si128();
+		__m128i sbb     = _mm_setzero_si128();
+		__m128i sab     = _mm_setzero_si128();
+		__m128i changed = _mm_setzero_si128();
+		for (; i < end; i += 8) {
+			__m128i ya = Luma8(a + i * 4);
+			__m128i yb = Luma8(b + i * 4);
+			sa         = _mm_add_epi32(sa, _mm_madd_epi16(ya, ones));
+			sb         = _mm_add_epi32(sb, _mm_madd_epi16(yb, ones));
+			saa        = _mm_add_epi32(saa, _mm_madd_epi16(ya, ya));
+			sbb        = _mm_add_epi32(sbb, _mm_madd_epi16(yb, yb));
+			sab        = _mm_add_epi32(sab, _mm_madd_epi16(ya, yb));
+			__m128i d  = _mm_sub_epi16(ya, yb);
+			d          = _mm_max_epi16(d, _mm_sub_epi16(_mm_setzero_si128(), d));
+			changed    = _mm_add_epi32(changed, _mm_madd_epi16(_mm_and_si128(_mm_cmpgt_epi16(d, thr), ones), ones));
+		}
+		s.SumA += HorizontalSum32(sa);
+		s.SumB += HorizontalSum32(sb);
+		s.SumAA += HorizontalSum32(saa);
+		s.SumBB += HorizontalSum32(sbb);
+		s.SumAB += HorizontalSum32(sab);
+		s.Changed += (int) HorizontalSum32(changed);
+	}
+#endif
+	for (; i < n; i++) {
+		int ya = Luma(a + i * 4);
+		int yb = Luma(b + i * 4);
+		s.SumA += ya;
+		s.SumB += yb;
+		s.SumAA += ya * ya;
+		s.SumBB += yb * yb;
+		s.SumAB += ya * yb;
+		if (abs(ya - yb) > pixelThreshold)
+			s.Changed++;
+	}
+	return s;
+}
+
+void ChangeFilter::Reset() {
+	Reference = Bitmap();
+	Grid      = TileGrid();
+	Pending.clear();
+	IgnoreCover.clear();
+}
+
+void ChangeFilter::UpdateIgnoreCover() {
+	IgnoreMasksCached = Config.IgnoreMasks;
+	IgnoreCover.assign(Grid.Count(), 0);
+	for (int t = 0; t < Grid.Count(); t++) {
+		Rect tile    = Grid.TileRect(t);
+		int  covered = 0;
+		for (const auto& m : Config.IgnoreMasks) {
+			Rect c = m.Intersection(tile);
+			if (c.IsEmpty())
+				continue;
+			if (c == tile) {
+				covered = 2;
+				break;
+			}
+			covered = 1;
+		}
+		IgnoreCover[t] = covered;
+	}
+}
+
+bool ChangeFilter::TileIsSignificant(const Bitmap& img, int tile, int& changed) {
+	Rect r = Grid.TileRect(tile);
+	int  w = r.Width();
+	int  n = w * r.Height();
+
+	// Gather both tiles into contiguous buffers, so that the kernel doesn't need to deal with strides
+	ScratchA.resize(TileSize * TileSize * 4);
+	ScratchB.resize(TileSize * TileSize * 4);
+	for (int y = r.Y1; y < r.Y2; y++) {
+		memcpy(&ScratchA[(y - r.Y1) * w * 4], img.Row(y) + r.X1 * 4, w * 4);
+		memcpy(&ScratchB[(y - r.Y1) * w * 4], Reference.Row(y) + r.X1 * 4, w * 4);
+	}
+
+	// Pixels under a mask are made identical to the reference, so they can't contribute any change
+	if (IgnoreCover[tile] == 1) {
+		for (const auto& m : Config.IgnoreMasks) {
+			Rect c = m.Intersection(r);
+			for (int y = c.Y1; y < c.Y2; y++) {
+				size_t off = ((y - r.Y1) * w + (c.X1 - r.X1)) * 4;
+				memcpy(&ScratchA[off], &ScratchB[off], c.Width() * 4);
+			}
+		}
+	}
+
+	LumaDiffStats s = LumaDiff(ScratchA.data(), ScratchB.data(), n, Config.PixelThreshold);
+	changed         = s.Changed;
+	return s.Changed != 0 && s.SSIM(n) < Config.MaxTileSSIM;
+}
+
+// Make the reference frame equal to 'img', and produce Dirty from the accumulated tiles
+void ChangeFilter::AcceptPending(const Bitmap& img) {
+	Dirty.clear();
+	for (int ty = 0; ty < Grid.TilesY; ty++) {
+		// Merge horizontal runs of pending tiles into a single rectangle
+		for (int tx = 0; tx < Grid.TilesX; tx++) {
+			if (!Pending[ty * Grid.TilesX + tx])
+				continue;
+			int end = tx;
+			while (end + 1 < Grid.TilesX && Pending[ty * Grid.TilesX + end + 1])
+				end++;
+			Rect a = Grid.TileRect(ty * Grid.TilesX + tx);
+			Rect b = Grid.TileRect(ty * Grid.TilesX + end);
+			Dirty.push_back(a.Union(b));
+			tx = end;
+		}
+	}
+	for (const auto& r : Dirty) {
+		for (int y = r.Y1; y < r.Y2; y++)
+			memcpy(Reference.Row(y) + r.X1 * 4, img.Row(y) + r.X1 * 4, r.Width() * 4);
+	}
+	std::fill(Pending.begin(), Pending.end(), 0);
+}
+
+bool ChangeFilter::Consider(const Bitmap& img, const std::vector<Rect>& dirty) {
+	if (Reference.Width != img.Width || Reference.Height != img.Height) {
+		Reference.Width  = img.Width;
+		Reference.Height = img.Height;
+		Reference.Buf    = img.Buf;
+		Grid.Reset(img.Width, img.Height);
+		Pending.assign(Grid.Count(), 0);
+		UpdateIgnoreCover();
+		Dirty.clear();
+		Dirty.push_back(img.Bounds());
+		Passed++;
+		return true;
+	}
+
+	if (Config.IgnoreMasks.size() != IgnoreMasksCached.size() || !std::equal(Config.IgnoreMasks.begin(), Config.IgnoreMasks.end(), IgnoreMasksCached.begin()))
+		UpdateIgnoreCover();
+
+	Grid.MarkRects(dirty, Pending.data());
+
+	// Pending tiles may have changed and then changed back, so every one of them needs to be checked
+	int  total       = 0;
+	bool significant = false;
+	for (int t = 0; t < Grid.Count() && !significant; t++) {
+		if (!Pending[t] || IgnoreCover[t] == 2)
+			continue;
+		int changed = 0;
+		if (TileIsSignificant(img, t, changed))
+			total += changed;
+		significant = total >= Config.MinChangedPixels;
+	}
+
+	if (!significant) {
+		Suppressed++;
+		Dirty.clear();
+		return false;
+	}
+
+	AcceptPending(img);
+	Passed++;
+	return true;
+}
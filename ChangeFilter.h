@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Tiles.h"
+
+// ChangeFilter decides whether a captured frame differs from the last frame that was passed
+// downstream in a way that anybody would care about. Blinking carets, tray animations and
+// font smoothing jitter all produce frames, but they're not worth a copy and an encode.
+//
+// Changes in suppressed frames are not lost. They accumulate, so that when a frame does pass,
+// Dirty covers everything that changed since the previous passed frame.
+
+struct ChangeFilterConfig {
+	std::vector<Rect> IgnoreMasks;                // Changes inside these regions never make a frame significant
+	int               PixelThreshold   = 12;      // Luma difference (0..255) below which a pixel is considered unchanged
+	float             MaxTileSSIM      = 0.99f;   // Tiles that are more similar than this (by luma SSIM) are considered unchanged
+	int               MinChangedPixels = 64;      // A frame is significant if at least this many pixels changed, in tiles that changed
+};
+
+// Statistics of the luma difference between two runs of BGRA pixels
+struct LumaDiffStats {
+	int     Changed = 0; // Number of pixels whose luma differs by more than the threshold
+	int64_t SumA    = 0;
+	int64_t SumB    = 0;
+	int64_t SumAA   = 0;
+	int64_t SumBB   = 0;
+	int64_t SumAB   = 0;
+
+	float SSIM(int n) const;
+};
+
+// Compute the luma difference statistics of n pixels
+LumaDiffStats LumaDiff(const uint8_t* a, const uint8_t* b, int n, int pixelThreshold);
+
+class ChangeFilter {
+public:
+	ChangeFilterConfig Config;
+	std::vector<Rect>  Dirty;          // After a frame passes, this holds the regions that changed since the previous passed frame
+	uint64_t           Passed     = 0; // Number of frames that were significant
+	uint64_t           Suppressed = 0; // Number of frames that were dropped
+
+	// Returns true if 'img' is significantly different from the last frame that passed.
+	// 'dirty' is the list of regions that changed since the previous call.
+	bool Consider(const Bitmap& img, const std::vector<Rect>& dirty);
+
+	// Forget the reference frame, so that the next frame always passes
+	void Reset();
+
+private:
+	Bitmap               Reference; // The last frame that passed
+	TileGrid             Grid;
+	std::vector<uint8_t> Pending;     // Tiles that have changed since the last frame that passed
+	std::vector<uint8_t> IgnoreCover; // 0 = tile is not masked, 1 = partially masked, 2 = fully masked
+	std::vector<Rect>    IgnoreMasksCached;
+	std::vector<uint8_t> ScratchA;
+	std::vector<uint8_t> ScratchB;
+
+	void UpdateIgnoreCover();
+	bool TileIsSignificant(const Bitmap& img, int tile, int& changed);
+	void AcceptPending(const Bitmap& img);
+};
@@ -0,0 +1,227 @@
+#include "stdafx.h"
+#include "FrameAlloc.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+static const size_t HugePageSize  = 2 * 1024 * 1024;
+static const size_t HugeThreshold = 1024 * 1024;
+
+FrameAllocator::~FrameAllocator() {
+	Trim();
+}
+
+// Never destroyed, because global Bitmaps, such as the ones in windup.cpp, free their buffers into
+// it during static destruction, which can run after a function-local static would be gone.
+FrameAllocator& FrameAllocator::Global() {
+	static FrameAllocator* global = new FrameAllocator();
+	return *global;
+}
+
+// Frames come in a handful of sizes, so we don't need fine-grained classes. Small buffers are
+// rounded up to a power of two, and big ones to a whole number of huge pages.
+size_t FrameAllocator::SizeClass(size_t size) {
+	if (size >= HugeThreshold)
+		return (size + HugePageSize - 1) & ~(HugePageSize - 1);
+	size_t c = 4096;
+	while (c < size)
+		c *= 2;
+	return c;
+}
+
+void* FrameAllocator::OSAlloc(size_t capacity) {
+#ifdef _WIN32
+	if (capacity >= HugeThreshold && UseHugePages && !HugeFailed) {
+		size_t large = GetLargePageMinimum();
+		if (large != 0 && capacity % large == 0) {
+			void* p = VirtualAlloc(nullptr, capacity, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (p) {
+				Stat.HugeAllocs++;
+				return p;
+			}
+			// Most likely we don't have SeLockMemoryPrivilege, so don't keep trying
+			HugeFailed = true;
+		}
+	}
+	if (capacity >= HugeThreshold)
+		return VirtualAlloc(nullptr, capacity, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	return _aligned_malloc(capacity, FrameAlign);
+#else
+	if (capacity >= HugeThreshold) {
+		void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return nullptr;
+#ifdef MADV_HUGEPAGE
+		if (UseHugePages && madvise(p, capacity, MADV_HUGEPAGE) == 0)
+			Stat.HugeAllocs++;
+#endif
+		return p;
+	}
+	void* p = nullptr;
+	if (posix_memalign(&p, FrameAlign, capacity) != 0)
+		return nullptr;
+	return p;
+#endif
+}
+
+void FrameAllocator::OSFree(void* p, size_t capacity) {
+#ifdef _WIN32
+	if (capacity >= HugeThreshold)
+		VirtualFree(p, 0, MEM_RELEASE);
+	else
+		_aligned_free(p);
+#else
+	if (capacity >= HugeThreshold)
+		munmap(p, capacity);
+	else
+		free(p);
+#endif
+}
+
+void* FrameAllocator::Alloc(size_t size, size_t& capacity) {
+	capacity = SizeClass(size);
+	std::lock_guard<std::mutex> lock(Lock);
+	Stat.Allocs++;
+	for (size_t i = 0; i < Pool.size(); i++) {
+		if (Pool[i].first == capacity) {
+			void* p = Pool[i].second;
+			Pool[i] = Pool.back();
+			Pool.pop_back();
+			Stat.PoolHits++;
+			Stat.CachedBytes -= capacity;
+			return p;
+		}
+	}
+	Stat.OSAllocs++;
+	void* p = OSAlloc(capacity);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void FrameAllocator::Free(void* p, size_t capacity) {
+	if (!p)
+		return;
+	std::lock_guard<std::mutex> lock(Lock);
+	if (Stat.CachedBytes + capacity > MaxCachedBytes) {
+		OSFree(p, capacity);
+		return;
+	}
+	Pool.push_back({capacity, p});
+	Stat.CachedBytes += capacity;
+}
+
+void FrameAllocator::Trim() {
+	std::lock_guard<std::mutex> lock(Lock);
+	for (auto& b : Pool)
+		OSFree(b.second, b.first);
+	Pool.clear();
+	Stat.CachedBytes = 0;
+}
+
+FrameAllocStats FrameAllocator::Stats() {
+	std::lock_guard<std::mutex> lock(Lock);
+	return Stat;
+}
+
+FrameBuf::FrameBuf(const FrameBuf& b) : B(b.B), Size(b.Size) {
+	if (B)
+		B->Refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+FrameBuf::FrameBuf(FrameBuf&& b) : B(b.B), Size(b.Size) {
+	b.B    = nullptr;
+	b.Size = 0;
+}
+
+FrameBuf::~FrameBuf() {
+	Release();
+}
+
+FrameBuf& FrameBuf::operator=(const FrameBuf& b) {
+	if (B != b.B) {
+		if (b.B)
+			b.B->Refs.fetch_add(1, std::memory_order_relaxed);
+		Release();
+		B = b.B;
+	}
+	Size = b.Size;
+	return *this;
+}
+
+FrameBuf& FrameBuf::operator=(FrameBuf&& b) {
+	if (this != &b) {
+		Release();
+		B      = b.B;
+		Size   = b.Size;
+		b.B    = nullptr;
+		b.Size = 0;
+	}
+	return *this;
+}
+
+void FrameBuf::Release() {
+	if (B && B->Refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		FrameAllocator::Global().Free(B->Data, B->Capacity);
+		delete B;
+	}
+	B = nullptr;
+}
+
+size_t FrameBuf::capacity() const {
+	return B ? B->Capacity : 0;
+}
+
+const uint8_t* FrameBuf::data() const {
+	return B ? B->Data : nullptr;
+}
+
+uint8_t* FrameBuf::data() {
+	MakeUnique();
+	return B ? B->Data : nullptr;
+}
+
+bool FrameBuf::IsShared() const {
+	return B && B->Refs.load(std::memory_order_acquire) != 1;
+}
+
+void FrameBuf::MakeUnique() {
+	if (!IsShared())
+		return;
+	Block* nb = new Block();
+	nb->Refs.store(1);
+	nb->Data = (uint8_t*) FrameAllocator::Global().Alloc(Size, nb->Capacity);
+	memcpy(nb->Data, B->Data, Size);
+	Release();
+	B = nb;
+}
+
+void FrameBuf::resize(size_t size) {
+	if (B && !IsShared() && size <= B->Capacity) {
+		Size = size;
+		return;
+	}
+	if (size == 0) {
+		clear();
+		return;
+	}
+	Block* nb = new Block();
+	nb->Refs.store(1);
+	nb->Data = (uint8_t*) FrameAllocator::Global().Alloc(size, nb->Capacity);
+	if (B)
+		memcpy(nb->Data, B->Data, std::min(size, Size));
+	Release();
+	B    = nb;
+	Size = size;
+}
+
+void FrameBuf::assign(size_t size, uint8_t value) {
+	resize(size);
+	memset(data(), value, size);
+}
+
+void FrameBuf::clear() {
+	Release();
+	Size = 0;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+// FrameAllocator hands out large, 64-byte aligned buffers for frames, and keeps freed buffers
+// in per-size pools, so that steady-state capture does not hit the OS allocator at all.
+// Buffers of 1 MB and up are backed by huge pages where the OS allows it (MADV_HUGEPAGE on
+// linux, MEM_LARGE_PAGES on Windows when the process holds SeLockMemoryPrivilege), which cuts
+// TLB misses when walking a 4K frame.
+//
+// FrameBuf is a reference counted handle to one of these buffers. Copying a FrameBuf shares the
+// buffer, so several consumers can hold the same frame without copying it. Any non-const access
+// first makes the buffer unique (copy on write), so a consumer never sees a frame change under it.
+// A frame that is updated in place, a few dirty rects at a time, should go through a FramePool
+// (see FramePool.h), so that a consumer that holds on to it doesn't cost a copy of the whole frame.
+
+static const size_t FrameAlign = 64;
+
+struct FrameAllocStats {
+	uint64_t Allocs      = 0; // Total calls to Alloc
+	uint64_t PoolHits    = 0; // Allocs that were satisfied from a pool
+	uint64_t OSAllocs    = 0; // Allocs that went to the OS
+	uint64_t HugeAllocs  = 0; // OS allocs that are backed by huge pages
+	size_t   CachedBytes = 0; // Bytes sitting in the pools
+};
+
+class FrameAllocator {
+public:
+	size_t MaxCachedBytes = 1024 * 1024 * 1024; // Freed buffers beyond this are returned to the OS
+	bool   UseHugePages   = true;
+
+	~FrameAllocator();
+
+	static FrameAllocator& Global();
+
+	// Returns a buffer of at least 'size' bytes. The actual capacity is written to 'capacity'.
+	void* Alloc(size_t size, size_t& capacity);
+	void  Free(void* p, size_t capacity);
+	void  Trim(); // Return all pooled buffers to the OS
+
+	FrameAllocStats Stats();
+	static size_t   SizeClass(size_t size);
+
+private:
+	std::mutex                            Lock;
+	std::vector<std::pair<size_t, void*>> Pool; // (capacity, buffer)
+	FrameAllocStats                       Stat;
+	bool                                  HugeFailed = false;
+
+	void* OSAlloc(size_t capacity);
+	void  OSFree(void* p, size_t capacity);
+};
+
+class FrameBuf {
+public:
+	FrameBuf() {}
+	FrameBuf(const FrameBuf& b);
+	FrameBuf(FrameBuf&& b);
+	~FrameBuf();
+
+	FrameBuf& operator=(const FrameBuf& b);
+	FrameBuf& operator=(FrameBuf&& b);
+
+	size_t         size() const { return Size; }
+	size_t         capacity() const;
+	const uint8_t* data() const;
+	uint8_t*       data(); // Makes the buffer unique before returning it
+
+	// Change the size. Existing contents up to the new size are preserved, but unlike std::vector,
+	// new bytes are not initialized.
+	void resize(size_t size);
+	void assign(size_t size, uint8_t value);
+	void clear();
+
+	bool IsShared() const;
+	void MakeUnique();
+
+private:
+	struct Block {
+		std::atomic<int> Refs;
+		size_t           Capacity;
+		uint8_t*         Data;
+	};
+	Block* B    = nullptr;
+	size_t Size = 0;
+
+	void Release();
+};
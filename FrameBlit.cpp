@@ -0,0 +1,94 @@
+#include "stdafx.h"
+#include "FrameBlit.h"
+
+void BlitRects(uint8_t* dst, int dstStride, const Bitmap& src, const std::vector<Rect>& rects) {
+	Rect bounds = src.Bounds();
+	for (const auto& dirty : rects) {
+		Rect r = dirty.Intersection(bounds);
+		if (r.IsEmpty())
+			continue;
+		size_t rowBytes = (size_t) r.Width() * 4;
+		if (r.X1 == 0 && r.Width() == src.Width && dstStride == src.Stride()) {
+			// whole rows, so we can do it in a single copy
+			memcpy(dst + (size_t) r.Y1 * dstStride, src.Row(r.Y1), rowBytes * r.Height());
+			continue;
+		}
+		for (int y = r.Y1; y < r.Y2; y++)
+			memcpy(dst + (size_t) y * dstStride + r.X1 * 4, src.Row(y) + r.X1 * 4, rowBytes);
+	}
+}
+
+void PresentSize(int srcW, int srcH, int winW, int winH, int& outW, int& outH) {
+	if (srcW <= winW && srcH <= winH) {
+		outW = srcW;
+		outH = srcH;
+		return;
+	}
+	// Compare winW/srcW against winH/srcH without floating point
+	if ((int64_t) winW * srcH <= (int64_t) winH * srcW) {
+		outW = winW;
+		outH = (int) ((int64_t) srcH * winW / srcW);
+	} else {
+		outW = (int) ((int64_t) srcW * winH / srcH);
+		outH = winH;
+	}
+	outW = std::max(outW, 1);
+	outH = std::max(outH, 1);
+}
+
+Rect ScaleRect(const Rect& r, int srcW, int srcH, int dstW, int dstH) {
+	if (srcW == dstW && srcH == dstH)
+		return r;
+	Rect s;
+	s.X1 = (int) ((int64_t) r.X1 * dstW / srcW);
+	s.Y1 = (int) ((int64_t) r.Y1 * dstH / srcH);
+	s.X2 = (int) (((int64_t) r.X2 * dstW + srcW - 1) / srcW);
+	s.Y2 = (int) (((int64_t) r.Y2 * dstH + srcH - 1) / srcH);
+	// The scaler samples neighbouring pixels, so grow by one to be safe
+	s.X1 = std::max(s.X1 - 1, 0);
+	s.Y1 = std::max(s.Y1 - 1, 0);
+	s.X2 = std::min(s.X2 + 1, dstW);
+	s.Y2 = std::min(s.Y2 + 1, dstH);
+	return s;
+}
+
+void InvalidationRects(const std::vector<Rect>& dirty, int srcW, int srcH, int dstW, int dstH, size_t maxRects, std::vector<Rect>& out) {
+	out.clear();
+	if (srcW <= 0 || srcH <= 0 || dstW <= 0 || dstH <= 0)
+		return;
+
+	Rect bounds(0, 0, srcW, srcH);
+	for (const auto& d : dirty) {
+		Rect r = d.Intersection(bounds);
+		if (r.IsEmpty())
+			continue;
+		r = ScaleRect(r, srcW, srcH, dstW, dstH);
+		if (r.IsEmpty())
+			continue;
+
+		// Merge with any existing rectangles that we touch. Merging can cause the grown
+		// rectangle to touch others, so keep going until it's stable.
+		bool merged = true;
+		while (merged) {
+			merged = false;
+			for (size_t i = 0; i < out.size(); i++) {
+				if (out[i].Touches(r)) {
+					r      = r.Union(out[i]);
+					out[i] = out.back();
+					out.pop_back();
+					merged = true;
+					break;
+				}
+			}
+		}
+		out.push_back(r);
+	}
+
+	if (out.size() > maxRects) {
+		Rect all;
+		for (const auto& r : out)
+			all = all.Union(r);
+		out.clear();
+		out.push_back(all);
+	}
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// Helpers for presenting a captured Bitmap incrementally. These are kept free of any
+// windowing API so that the same logic can drive a GDI window, or any other surface.
+
+// Copy the given rectangles from 'src' into 'dst', which must have the same dimensions as 'src'.
+// Rectangles are clipped to the bounds of 'src'.
+void BlitRects(uint8_t* dst, int dstStride, const Bitmap& src, const std::vector<Rect>& rects);
+
+// Compute the size at which an image of srcW x srcH is presented inside a window of winW x winH.
+// If the image fits, it is presented 1:1. Otherwise it is shrunk to fit, preserving aspect ratio.
+void PresentSize(int srcW, int srcH, int winW, int winH, int& outW, int& outH);
+
+// Scale a source rectangle into destination space, rounding outwards, so that the
+// result always covers every destination pixel that the source rectangle touches.
+Rect ScaleRect(const Rect& r, int srcW, int srcH, int dstW, int dstH);
+
+// Translate capture dirty rectangles into window invalidation rectangles.
+// Rectangles are scaled to dstW x dstH, and rectangles that touch each other are merged.
+// If more than maxRects remain, they are collapsed into their bounding box, because at that
+// point the per-rectangle overhead of the windowing system dominates.
+void InvalidationRects(const std::vector<Rect>& dirty, int srcW, int srcH, int dstW, int dstH, size_t maxRects, std::vector<Rect>& out);
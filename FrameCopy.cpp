@@ -0,0 +1,235 @@
+#include "stdafx.h"
+#include "FrameCopy.h"
+#include "FrameTrace.h"
+#include "Simd.h"
+
+// Copies smaller than this always use Rows. They are over too quickly for the strategy to matter,
+// and the next stages of the pipeline find their bytes in the cache.
+static const size_t MinStrategyBytes = 64 * 1024;
+
+// Number of rows ahead of the current row whose source bytes Prefetch asks for
+static const int PrefetchRows = 2;
+
+// Strips smaller than this aren't worth a thread of their own
+static const size_t MinStripBytes = 256 * 1024;
+
+// Beyond this, more threads only fight over the same memory bandwidth
+static const int MaxCopyThreads = 4;
+
+// Calibrate times each strategy over CalibrateRounds rounds, and in each round it repeats the
+// copy for at least CalibrateMicros. The best round counts.
+static const int     CalibrateRounds = 5;
+static const int64_t CalibrateMicros = 2000;
+
+const char* CopyStrategyName(CopyStrategy s) {
+	switch (s) {
+	case CopyStrategy::Rows: return "rows";
+	case CopyStrategy::Prefetch: return "prefetch";
+	case CopyStrategy::Streaming: return "streaming";
+	case CopyStrategy::Threaded: return "threaded";
+	}
+	return "?";
+}
+
+// Copy n bytes with non-temporal stores, which need an aligned destination
+static void StreamBytes(uint8_t* dst, const uint8_t* src, size_t n) {
+#ifdef WINDUP_SSE2
+	size_t head = std::min(n, (size_t)((16 - ((uintptr_t) dst & 15)) & 15));
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	n -= head;
+	for (; n >= 64; n -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i*) src);
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*) (src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*) (src + 48));
+		_mm_stream_si128((__m128i*) dst, a);
+		_mm_stream_si128((__m128i*) (dst + 16), b);
+		_mm_stream_si128((__m128i*) (dst + 32), c);
+		_mm_stream_si128((__m128i*) (dst + 48), d);
+	}
+	for (; n >= 16; n -= 16, dst += 16, src += 16)
+		_mm_stream_si128((__m128i*) dst, _mm_loadu_si128((const __m128i*) src));
+#endif
+	memcpy(dst, src, n);
+}
+
+// Copy 'rows' rows of rowBytes each, with any strategy but Threaded
+static void CopyBlock(CopyStrategy s, uint8_t* dst, size_t dstPitch, const uint8_t* src, size_t srcPitch, size_t rowBytes, int rows) {
+	if (rowBytes == dstPitch && rowBytes == srcPitch) {
+		rowBytes *= rows;
+		rows = 1;
+	}
+	switch (s) {
+#ifdef WINDUP_SSE2
+	case CopyStrategy::Prefetch:
+		for (int y = 0; y < rows; y++) {
+			if (y + PrefetchRows < rows) {
+				const char* ahead = (const char*) src + (y + PrefetchRows) * srcPitch;
+				for (size_t i = 0; i < rowBytes; i += 64)
+					_mm_prefetch(ahead + i, _MM_HINT_NTA);
+			}
+			memcpy(dst + y * dstPitch, src + y * srcPitch, rowBytes);
+		}
+		break;
+	case CopyStrategy::Streaming:
+		for (int y = 0; y < rows; y++)
+			StreamBytes(dst + y * dstPitch, src + y * srcPitch, rowBytes);
+		// Streaming stores are weakly ordered, so make them visible before anyone looks at dst
+		_mm_sfence();
+		break;
+#endif
+	default:
+		for (int y = 0; y < rows; y++)
+			memcpy(dst + y * dstPitch, src + y * srcPitch, rowBytes);
+		break;
+	}
+}
+
+FrameCopier::~FrameCopier() {
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Stopping = true;
+	}
+	Wake.notify_all();
+	for (auto& t : Workers)
+		t.join();
+}
+
+void FrameCopier::Copy(uint8_t* dst, int dstPitch, const uint8_t* src, int srcPitch, const Rect& r) {
+	if (r.IsEmpty())
+		return;
+	CopyStrategy s = (size_t) r.Width() * 4 * r.Height() < MinStrategyBytes ? CopyStrategy::Rows : Strategy;
+	if (s == CopyStrategy::Threaded) {
+		CopyThreaded(dst, dstPitch, src, srcPitch, r);
+		return;
+	}
+	size_t offset = (size_t) r.X1 * 4;
+	CopyBlock(s, dst + (size_t) r.Y1 * dstPitch + offset, dstPitch, src + (size_t) r.Y1 * srcPitch + offset, srcPitch, (size_t) r.Width() * 4, r.Height());
+}
+
+void FrameCopier::CopyThreaded(uint8_t* dst, int dstPitch, const uint8_t* src, int srcPitch, const Rect& r) {
+	int threads = Threads;
+	if (threads <= 0)
+		threads = (int) std::max(1u, std::min((unsigned) MaxCopyThreads, std::thread::hardware_concurrency()));
+	size_t bytes = (size_t) r.Width() * 4 * r.Height();
+
+	Job job;
+	job.Dst      = dst;
+	job.DstPitch = dstPitch;
+	job.Src      = src;
+	job.SrcPitch = srcPitch;
+	job.R        = r;
+	job.Strips   = (int) std::min(std::min((size_t) threads, bytes / MinStripBytes), (size_t) r.Height());
+	if (job.Strips <= 1) {
+		job.Strips = 1;
+		CopyStrip(job, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		while ((int) Workers.size() < job.Strips - 1) {
+			int      index = (int) Workers.size() + 1;
+			uint64_t seen  = JobSeq;
+			Workers.emplace_back([this, index, seen] { WorkerThread(index, seen); });
+		}
+		Current = job;
+		Pending = job.Strips - 1;
+		JobSeq++;
+	}
+	Wake.notify_all();
+	CopyStrip(job, 0);
+	std::unique_lock<std::mutex> lock(Lock);
+	Done.wait(lock, [&] { return Pending == 0; });
+}
+
+void FrameCopier::CopyStrip(const Job& job, int strip) {
+	int          y1     = job.R.Y1 + (int) ((int64_t) job.R.Height() * strip / job.Strips);
+	int          y2     = job.R.Y1 + (int) ((int64_t) job.R.Height() * (strip + 1) / job.Strips);
+	size_t       offset = (size_t) job.R.X1 * 4;
+	CopyStrategy s      = StripStrategy == CopyStrategy::Threaded ? CopyStrategy::Rows : StripStrategy;
+	CopyBlock(s, job.Dst + (size_t) y1 * job.DstPitch + offset, job.DstPitch, job.Src + (size_t) y1 * job.SrcPitch + offset, job.SrcPitch, (size_t) job.R.Width() * 4, y2 - y1);
+}
+
+// Worker 'index' copies strip 'index' of every job that has that many strips
+void FrameCopier::WorkerThread(int index, uint64_t seen) {
+	while (true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(Lock);
+			Wake.wait(lock, [&] { return Stopping || JobSeq != seen; });
+			if (Stopping)
+				return;
+			seen = JobSeq;
+			job  = Current;
+		}
+		if (index < job.Strips) {
+			CopyStrip(job, index);
+			std::lock_guard<std::mutex> lock(Lock);
+			if (--Pending == 0)
+				Done.notify_one();
+		}
+	}
+}
+
+std::vector<CopyTiming> FrameCopier::Calibrate(uint8_t* dst, int dstPitch, const uint8_t* src, int srcPitch, const Rect& r) {
+	std::vector<CopyTiming> timings;
+	if (r.IsEmpty())
+		return timings;
+	CopyStrategy            fastest = CopyStrategy::Rows;
+	double                  best    = 0;
+	for (int i = 0; i < NumCopyStrategies; i++) {
+		CopyTiming t;
+		t.Strategy = (CopyStrategy) i;
+		// Threaded splits the copy between threads that each use the fastest of the others
+		Strategy = t.Strategy;
+		if (t.Strategy == CopyStrategy::Threaded)
+			StripStrategy = fastest;
+		for (int round = 0; round < CalibrateRounds; round++) {
+			int64_t start = MonotonicMicros();
+			int64_t now   = start;
+			int     n     = 0;
+			for (; n == 0 || now - start < CalibrateMicros; n++) {
+				Copy(dst, dstPitch, src, srcPitch, r);
+				now = MonotonicMicros();
+			}
+			double micros = (double) (now - start) / n;
+			if (round == 0 || micros < t.Micros)
+				t.Micros = micros;
+		}
+		t.GBPerSec = (double) r.Width() * 4 * r.Height() / (t.Micros * 1000);
+		if (i == 0 || t.Micros < best) {
+			fastest = t.Strategy;
+			best    = t.Micros;
+		}
+		timings.push_back(t);
+	}
+	Strategy = fastest;
+	Calibrations.push_back({r.Width(), r.Height(), dstPitch, srcPitch, Strategy, StripStrategy});
+	return timings;
+}
+
+bool FrameCopier::Recall(int dstPitch, int srcPitch, const Rect& r) {
+	for (const auto& c : Calibrations) {
+		if (c.Width == r.Width() && c.Height == r.Height() && c.DstPitch == dstPitch && c.SrcPitch == srcPitch) {
+			Strategy      = c.Strategy;
+			StripStrategy = c.StripStrategy;
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<CopyTiming> BenchmarkFrameCopy(int width, int height, int srcPitch, const Rect& r) {
+	// Fill both buffers, so that every page is faulted in before the timing starts
+	std::vector<uint8_t> src((size_t) srcPitch * height);
+	for (size_t i = 0; i < src.size(); i++)
+		src[i] = (uint8_t) (i * 7);
+	FrameBuf dst;
+	dst.assign((size_t) width * 4 * height, 0);
+
+	FrameCopier copier;
+	return copier.Calibrate(dst.data(), width * 4, src.data(), srcPitch, r.Intersection(Rect(0, 0, width, height)));
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// FrameCopier copies rectangles out of a pitched buffer, such as a mapped staging texture, into a
+// frame. This is the readback at the end of every capture, and for a full 4K frame it moves 33 MB.
+//
+// Mapped staging memory is often uncached or write-combined, and the destination is a large frame
+// that the next stages read back soon after, so which copy is fastest depends on the machine. There
+// are several strategies, and Calibrate times all of them on the real buffers and picks the fastest.
+// Small rectangles, such as a line of text, are always copied row by row. Whatever the strategy,
+// a rectangle whose rows are contiguous in both buffers is copied as one block.
+
+enum class CopyStrategy {
+	Rows,      // memcpy per row
+	Prefetch,  // memcpy per row, prefetching the source rows ahead
+	Streaming, // Non-temporal stores, which bypass the cache on the way to the destination
+	Threaded,  // Horizontal strips on several threads, each of which uses StripStrategy
+};
+
+static const int NumCopyStrategies = 4;
+
+const char* CopyStrategyName(CopyStrategy s);
+
+struct CopyTiming {
+	CopyStrategy Strategy = CopyStrategy::Rows;
+	double       Micros   = 0; // Best time of one copy
+	double       GBPerSec = 0;
+};
+
+class FrameCopier {
+public:
+	CopyStrategy Strategy      = CopyStrategy::Rows;
+	CopyStrategy StripStrategy = CopyStrategy::Rows; // What every thread of Threaded uses
+	int          Threads       = 0;                  // Threads that Threaded uses, including the caller. 0 = one per core, up to 4.
+
+	~FrameCopier();
+
+	// Copy r from src into dst. r is in the coordinates of both buffers.
+	void Copy(uint8_t* dst, int dstPitch, const uint8_t* src, int srcPitch, const Rect& r);
+
+	// Time every strategy copying r from src into dst, and switch to the fastest. The copies
+	// write the same bytes as Copy would. Returns the timings, in the order of CopyStrategy.
+	std::vector<CopyTiming> Calibrate(uint8_t* dst, int dstPitch, const uint8_t* src, int srcPitch, const Rect& r);
+
+	// Switch to the strategy that Calibrate picked for a copy of r's size, between buffers with these
+	// pitches, if it has timed one. Returns false if it hasn't. A staging texture that is recreated at
+	// a size that we've seen before, such as after a desktop switch, doesn't need to be timed again.
+	bool Recall(int dstPitch, int srcPitch, const Rect& r);
+
+private:
+	struct Job {
+		uint8_t*       Dst      = nullptr;
+		int            DstPitch = 0;
+		const uint8_t* Src      = nullptr;
+		int            SrcPitch = 0;
+		Rect           R;
+		int            Strips = 0;
+	};
+
+	// The result of a Calibrate
+	struct Calibration {
+		int          Width;
+		int          Height;
+		int          DstPitch;
+		int          SrcPitch;
+		CopyStrategy Strategy;
+		CopyStrategy StripStrategy;
+	};
+
+	std::vector<Calibration> Calibrations;
+	std::vector<std::thread> Workers;
+	std::mutex               Lock;
+	std::condition_variable  Wake;
+	std::condition_variable  Done;
+	Job                      Current;
+	uint64_t                 JobSeq   = 0;
+	int                      Pending  = 0; // Strips of Current that workers haven't finished
+	bool                     Stopping = false;
+
+	void CopyThreaded(uint8_t* dst, int dstPitch, const uint8_t* src, int srcPitch, const Rect& r);
+	void CopyStrip(const Job& job, int strip);
+	void WorkerThread(int index, uint64_t seen);
+};
+
+// Microbenchmark of every strategy, on heap buffers that emulate a width x height staging texture
+// whose rows are srcPitch bytes apart, copying r. Calibrate is the real thing, but this runs anywhere.
+std::vector<CopyTiming> BenchmarkFrameCopy(int width, int height, int srcPitch, const Rect& r);
@@ -0,0 +1,207 @@
+#include "stdafx.h"
+#include "FrameCoro.h"
+#include "FrameTrace.h"
+
+#ifdef WINDUP_COROUTINES
+
+CoExecutor::CoExecutor(int threads) {
+	for (int i = 0; i < std::max(threads, 1); i++)
+		Threads.emplace_back([this] { WorkerThread(); });
+}
+
+CoExecutor::~CoExecutor() {
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Stopping = true;
+	}
+	Wake.notify_all();
+	for (auto& t : Threads)
+		t.join();
+}
+
+void CoExecutor::Post(std::coroutine_handle<> h) {
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Queue.push_back(h);
+	}
+	Wake.notify_one();
+}
+
+void CoExecutor::PostAfter(int64_t micros, std::function<void()> fn) {
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Timer                       t;
+		t.Due = MonotonicMicros() + micros;
+		t.Seq = NextTimer++;
+		t.Fn  = std::move(fn);
+		Timers.push_back(std::move(t));
+		std::push_heap(Timers.begin(), Timers.end());
+	}
+	// Whoever wakes up works out how long to sleep until the soonest timer
+	Wake.notify_one();
+}
+
+void CoExecutor::WorkerThread() {
+	std::unique_lock<std::mutex> lock(Lock);
+	while (!Stopping) {
+		int64_t now = MonotonicMicros();
+		if (Timers.size() != 0 && Timers.front().Due <= now) {
+			std::pop_heap(Timers.begin(), Timers.end());
+			Timer t = std::move(Timers.back());
+			Timers.pop_back();
+			lock.unlock();
+			t.Fn();
+			lock.lock();
+		} else if (Queue.size() != 0) {
+			auto h = Queue.front();
+			Queue.pop_front();
+			lock.unlock();
+			h.resume();
+			lock.lock();
+		} else if (Timers.size() != 0) {
+			Wake.wait_for(lock, std::chrono::microseconds(Timers.front().Due - now));
+		} else {
+			Wake.wait(lock);
+		}
+	}
+}
+
+void CancelToken::Cancel() {
+	std::vector<std::pair<const void*, std::function<void()>>> callbacks;
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		if (Cancelled)
+			return;
+		Cancelled = true;
+		callbacks.swap(Callbacks);
+	}
+	for (auto& c : callbacks)
+		c.second();
+}
+
+bool CancelToken::IsCancelled() {
+	std::lock_guard<std::mutex> lock(Lock);
+	return Cancelled;
+}
+
+bool CancelToken::Register(const void* key, std::function<void()> fn) {
+	std::lock_guard<std::mutex> lock(Lock);
+	if (Cancelled)
+		return false;
+	Callbacks.emplace_back(key, std::move(fn));
+	return true;
+}
+
+void CancelToken::Unregister(const void* key) {
+	std::lock_guard<std::mutex> lock(Lock);
+	for (size_t i = 0; i < Callbacks.size(); i++) {
+		if (Callbacks[i].first == key) {
+			Callbacks.erase(Callbacks.begin() + i);
+			return;
+		}
+	}
+}
+
+AsyncFrameSource::AsyncFrameSource(CoExecutor& exec) : Exec(exec), NumPublished(0), NumReplaced(0), Stopping(false) {
+}
+
+AsyncFrameSource::~AsyncFrameSource() {
+	Stop();
+	Close();
+}
+
+void AsyncFrameSource::Start(CaptureFn capture) {
+	Stop();
+	Stopping = false;
+	Pump     = std::thread([this, capture] {
+		while (!Stopping) {
+			FrameRef frame;
+			if (capture(frame) && frame)
+				Publish(frame);
+		}
+	});
+}
+
+void AsyncFrameSource::Stop() {
+	Stopping = true;
+	if (Pump.joinable())
+		Pump.join();
+}
+
+void AsyncFrameSource::Publish(FrameRef frame) {
+	std::lock_guard<std::mutex> lock(Lock);
+	if (Closed)
+		return;
+	NumPublished++;
+	if (Waiting) {
+		WaiterPtr w = std::move(Waiting);
+		Waiting     = nullptr;
+		// The waiter may have timed out, or been cancelled, in the meantime
+		if (Resume(Exec, w, frame))
+			return;
+	}
+	if (Pending) {
+		Pending = MergeDirty(Pending, frame);
+		NumReplaced++;
+	} else {
+		Pending = frame;
+	}
+}
+
+void AsyncFrameSource::Close() {
+	std::lock_guard<std::mutex> lock(Lock);
+	Closed  = true;
+	Pending = nullptr;
+	if (Waiting) {
+		Resume(Exec, Waiting, nullptr);
+		Waiting = nullptr;
+	}
+}
+
+AsyncGenerator<FrameRef> AsyncFrameSource::Frames(int64_t timeoutMicros, CancelToken* cancel) {
+	while (true) {
+		FrameRef frame = co_await NextFrame(timeoutMicros, cancel);
+		if (!frame)
+			co_return;
+		co_yield frame;
+	}
+}
+
+// Called from await_suspend. Returns false, with the result in 'frame', if NextFrame doesn't need to
+// wait. Once the waiter is published in Waiting, or registered with the token, the coroutine may be
+// resumed on another thread at any moment, so nothing that belongs to the coroutine may be touched after that.
+bool AsyncFrameSource::Suspend(std::coroutine_handle<> h, int64_t timeoutMicros, CancelToken* cancel, FrameRef& frame, WaiterPtr& waiter) {
+	auto w    = std::make_shared<FrameWaiter>();
+	w->Handle = h;
+	waiter    = w;
+
+	CoExecutor&                  exec = Exec;
+	std::unique_lock<std::mutex> lock(Lock);
+	if (Pending || Closed) {
+		frame   = std::move(Pending);
+		Pending = nullptr;
+		waiter  = nullptr;
+		return false;
+	}
+	if (cancel && !cancel->Register(w.get(), [&exec, w] { Resume(exec, w, nullptr); })) {
+		waiter = nullptr;
+		return false;
+	}
+	Waiting = w;
+	lock.unlock();
+
+	if (timeoutMicros >= 0)
+		exec.PostAfter(timeoutMicros, [&exec, w] { Resume(exec, w, nullptr); });
+	return true;
+}
+
+// Resume the waiter with 'frame', unless something else got to it first
+bool AsyncFrameSource::Resume(CoExecutor& exec, const WaiterPtr& w, FrameRef frame) {
+	if (w->Done.exchange(true))
+		return false;
+	w->Frame = std::move(frame);
+	exec.Post(w->Handle);
+	return true;
+}
+
+#endif
@@ -0,0 +1,251 @@
+#pragma once
+
+#include "FrameGraph.h"
+
+// Coroutine interface to capture, for services that are written with C++20 coroutines.
+//
+//   CoExecutor       exec(2);
+//   AsyncFrameSource source(exec);
+//   source.Start([&](FrameRef& f) { ... capture a frame into f, or return false ... });
+//
+//   CoTask Consume(AsyncFrameSource& source) {
+//       auto frames = source.Frames();
+//       while (co_await frames.Next())
+//           Process(frames.Value());
+//   }
+//
+// CoExecutor runs coroutines on a few threads, and also runs their timeouts. Capture is a blocking
+// call, so AsyncFrameSource runs it on a thread of its own, and hands every frame straight to the
+// coroutine that is waiting for it. That is the only thread switch per frame. Whatever the coroutine
+// does next, such as processing or I/O, interleaves with other coroutines on the executor threads.
+//
+// The source holds at most one frame for its consumer. If the consumer falls behind, the newest
+// frame replaces the one that is waiting, and inherits its dirty rects, like a DropOldest edge of
+// a FrameGraph. A source has one consumer at a time.
+//
+// This needs a compiler with C++20 coroutines. Otherwise WINDUP_COROUTINES is not defined, and none
+// of this is available.
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define WINDUP_COROUTINES 1
+#include <coroutine>
+
+// A coroutine that starts running as soon as it's called, and that nobody waits for. Its first
+// suspension point is usually co_await exec.Schedule(), to move it onto the executor.
+struct CoTask {
+	struct promise_type {
+		CoTask             get_return_object() { return CoTask(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void               return_void() {}
+		void               unhandled_exception() { std::terminate(); }
+	};
+};
+
+// Coroutines that are suspended when the executor is destroyed are never resumed, so stop them first
+class CoExecutor {
+public:
+	explicit CoExecutor(int threads = 1);
+	~CoExecutor();
+
+	// Resume h on an executor thread
+	void Post(std::coroutine_handle<> h);
+
+	// Run fn on an executor thread, once 'micros' have passed. It should be quick.
+	void PostAfter(int64_t micros, std::function<void()> fn);
+
+	// co_await exec.Schedule() continues on an executor thread
+	auto Schedule() {
+		struct Awaiter {
+			CoExecutor* Exec;
+			bool        await_ready() { return false; }
+			void        await_suspend(std::coroutine_handle<> h) { Exec->Post(h); }
+			void        await_resume() {}
+		};
+		return Awaiter{this};
+	}
+
+	// co_await exec.Sleep(micros) continues on an executor thread, once 'micros' have passed
+	auto Sleep(int64_t micros) {
+		struct Awaiter {
+			CoExecutor* Exec;
+			int64_t     Micros;
+			bool        await_ready() { return false; }
+			void        await_suspend(std::coroutine_handle<> h) { Exec->PostAfter(Micros, [exec = Exec, h] { exec->Post(h); }); }
+			void        await_resume() {}
+		};
+		return Awaiter{this, micros};
+	}
+
+private:
+	struct Timer {
+		int64_t               Due = 0;
+		uint64_t              Seq = 0; // Timers that are due at the same time run in the order they were added
+		std::function<void()> Fn;
+
+		bool operator<(const Timer& b) const { return Due != b.Due ? Due > b.Due : Seq > b.Seq; } // For a min-heap
+	};
+
+	std::mutex                          Lock;
+	std::condition_variable             Wake;
+	std::deque<std::coroutine_handle<>> Queue;
+	std::vector<Timer>                  Timers; // Heap, soonest first
+	uint64_t                            NextTimer = 0;
+	std::vector<std::thread>            Threads;
+	bool                                Stopping = false;
+
+	void WorkerThread();
+};
+
+// Cancels every NextFrame that was given this token, and every one that is given it later
+class CancelToken {
+public:
+	void Cancel();
+	bool IsCancelled();
+
+	// Call fn when the token is cancelled. Returns false, without calling fn, if it already is.
+	// 'key' identifies the callback for Unregister.
+	bool Register(const void* key, std::function<void()> fn);
+	void Unregister(const void* key);
+
+private:
+	std::mutex                                                 Lock;
+	bool                                                       Cancelled = false;
+	std::vector<std::pair<const void*, std::function<void()>>> Callbacks;
+};
+
+// A coroutine that yields values of T. The consumer calls co_await Next() to run the generator
+// until it yields, which returns true, or finishes, which returns false. Value() is what it yielded.
+template <typename T>
+class AsyncGenerator {
+public:
+	struct promise_type;
+	typedef std::coroutine_handle<promise_type> Handle;
+
+	// Suspends the generator, and resumes its consumer on the same thread
+	struct ResumeConsumer {
+		bool                    await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(Handle h) noexcept { return h.promise().Consumer; }
+		void                    await_resume() noexcept {}
+	};
+
+	struct promise_type {
+		T                       Value;
+		bool                    HasValue = false;
+		std::coroutine_handle<> Consumer;
+
+		AsyncGenerator      get_return_object() { return AsyncGenerator(Handle::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		ResumeConsumer      final_suspend() noexcept { return {}; }
+		void                return_void() {}
+		void                unhandled_exception() { std::terminate(); }
+		ResumeConsumer      yield_value(T v) {
+			Value    = std::move(v);
+			HasValue = true;
+			return {};
+		}
+	};
+
+	AsyncGenerator(AsyncGenerator&& g) : H(g.H) { g.H = nullptr; }
+	AsyncGenerator(const AsyncGenerator&) = delete;
+	~AsyncGenerator() {
+		if (H)
+			H.destroy();
+	}
+
+	auto Next() {
+		struct Awaiter {
+			Handle G;
+			bool   await_ready() { return G.done(); }
+			Handle await_suspend(std::coroutine_handle<> consumer) {
+				G.promise().Consumer = consumer;
+				G.promise().HasValue = false;
+				return G;
+			}
+			bool await_resume() { return !G.done() && G.promise().HasValue; }
+		};
+		return Awaiter{H};
+	}
+
+	T& Value() { return H.promise().Value; }
+
+private:
+	Handle H;
+
+	explicit AsyncGenerator(Handle h) : H(h) {}
+};
+
+class AsyncFrameSource {
+public:
+	// Fills in a frame, and returns true, or returns false if there was no frame, for example
+	// because it timed out. It is called over and over on a thread of its own.
+	typedef std::function<bool(FrameRef& frame)> CaptureFn;
+
+	explicit AsyncFrameSource(CoExecutor& exec);
+	~AsyncFrameSource();
+
+	void Start(CaptureFn capture); // Start calling capture, and publishing what it returns
+	void Stop();
+
+	// Hand a frame to the consumer, from any thread. Start does this for you.
+	void Publish(FrameRef frame);
+
+	// Every NextFrame returns null from now on, including those that are waiting
+	void Close();
+
+	// co_await source.NextFrame() returns the next frame, or null if it times out, is cancelled, or the
+	// source is closed. A negative timeout waits forever. If it suspends, it resumes on an executor thread.
+	auto NextFrame(int64_t timeoutMicros = -1, CancelToken* cancel = nullptr) {
+		struct Awaiter {
+			AsyncFrameSource* Source;
+			int64_t           TimeoutMicros;
+			CancelToken*      Cancel;
+			FrameRef          Frame;
+			WaiterPtr         Waiter;
+
+			bool await_ready() { return false; }
+			bool await_suspend(std::coroutine_handle<> h) { return Source->Suspend(h, TimeoutMicros, Cancel, Frame, Waiter); }
+			FrameRef await_resume() {
+				if (Waiter) {
+					if (Cancel)
+						Cancel->Unregister(Waiter.get());
+					Frame = Waiter->Frame;
+				}
+				return Frame;
+			}
+		};
+		return Awaiter{this, timeoutMicros, cancel, nullptr, nullptr};
+	}
+
+	// Every frame, until one NextFrame returns null
+	AsyncGenerator<FrameRef> Frames(int64_t timeoutMicros = -1, CancelToken* cancel = nullptr);
+
+	uint64_t Published() const { return NumPublished; }
+	uint64_t Replaced() const { return NumReplaced; } // Frames that the consumer never saw, because a newer one replaced them
+
+private:
+	// A suspended NextFrame. Whichever of a frame, the timeout or the cancellation gets to it first resumes it.
+	struct FrameWaiter {
+		std::atomic<bool>       Done;
+		std::coroutine_handle<> Handle;
+		FrameRef                Frame;
+
+		FrameWaiter() : Done(false) {}
+	};
+	typedef std::shared_ptr<FrameWaiter> WaiterPtr;
+
+	CoExecutor&           Exec;
+	std::mutex            Lock;
+	FrameRef              Pending; // Published, but not yet taken
+	WaiterPtr             Waiting;
+	bool                  Closed = false;
+	std::atomic<uint64_t> NumPublished;
+	std::atomic<uint64_t> NumReplaced;
+	std::thread           Pump;
+	std::atomic<bool>     Stopping;
+
+	bool        Suspend(std::coroutine_handle<> h, int64_t timeoutMicros, CancelToken* cancel, FrameRef& frame, WaiterPtr& waiter);
+	static bool Resume(CoExecutor& exec, const WaiterPtr& w, FrameRef frame);
+};
+
+#endif
@@ -0,0 +1,250 @@
+#include "stdafx.h"
+#include "FrameGraph.h"
+#include "FrameTrace.h"
+
+// When a dropped frame passes its dirty rects on, and the frame behind it ends up with more than
+// this many, they are collapsed into their bounding box
+static const size_t MaxMergedRects = 64;
+
+FrameRef MergeDirty(const FrameRef& dropped, const FrameRef& next) {
+	auto merged = std::make_shared<GraphFrame>(*next);
+	merged->Moves.clear();
+	merged->Redrawn.clear();
+	merged->Dirty.insert(merged->Dirty.end(), dropped->Dirty.begin(), dropped->Dirty.end());
+	if (merged->Dirty.size() > MaxMergedRects) {
+		Rect bounds;
+		for (const auto& r : merged->Dirty)
+			bounds = bounds.Union(r);
+		merged->Dirty.clear();
+		merged->Dirty.push_back(bounds);
+	}
+	return merged;
+}
+
+FrameGraph::~FrameGraph() {
+	Stop();
+}
+
+int FrameGraph::AddSource(const std::string& name) {
+	return AddStage(name, nullptr);
+}
+
+int FrameGraph::AddStage(const std::string& name, StageFn fn) {
+	Stage s;
+	s.Name = name;
+	s.Fn   = fn;
+	Stages.push_back(s);
+	return (int) Stages.size() - 1;
+}
+
+void FrameGraph::Connect(int from, int to, EdgePolicy policy, size_t capacity) {
+	Edge e;
+	e.From     = from;
+	e.To       = to;
+	e.Policy   = policy;
+	e.Capacity = std::max(capacity, (size_t) 1);
+	Edges.push_back(e);
+	Stages[from].Outputs.push_back((int) Edges.size() - 1);
+	Stages[to].Inputs.push_back((int) Edges.size() - 1);
+}
+
+Error FrameGraph::Start() {
+	if (Started)
+		return "Frame graph is already running";
+
+	// Kahn's algorithm. Whatever can't be sorted is part of a cycle.
+	std::vector<int> inputs(Stages.size());
+	std::vector<int> sorted;
+	for (size_t i = 0; i < Stages.size(); i++) {
+		inputs[i] = (int) Stages[i].Inputs.size();
+		if (inputs[i] == 0)
+			sorted.push_back((int) i);
+		else if (!Stages[i].Fn)
+			return tsf::fmt("Source %v has inputs", Stages[i].Name);
+	}
+	for (size_t i = 0; i < sorted.size(); i++) {
+		for (int e : Stages[sorted[i]].Outputs) {
+			if (--inputs[Edges[e].To] == 0)
+				sorted.push_back(Edges[e].To);
+		}
+	}
+	if (sorted.size() != Stages.size())
+		return "Frame graph has a cycle";
+
+	int threads = Threads;
+	if (threads <= 0)
+		threads = (int) std::max(1u, std::thread::hardware_concurrency());
+	Started  = true;
+	Stopping = false;
+	for (int i = 0; i < threads; i++)
+		Workers.emplace_back([this] { WorkerThread(); });
+	return "";
+}
+
+void FrameGraph::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Stopping = true;
+	}
+	Wake.notify_all();
+	Space.notify_all();
+	Idle.notify_all();
+	for (auto& t : Workers)
+		t.join();
+	Workers.clear();
+	for (auto& e : Edges)
+		e.Queue.clear();
+	// Stages that were waiting in Ready never ran, so they are still marked as scheduled, and
+	// counted as active. Clear that, or a restarted graph would never schedule them again.
+	for (auto& s : Stages) {
+		s.Scheduled = false;
+		s.Running   = false;
+	}
+	Ready.clear();
+	Active  = 0;
+	Started = false;
+}
+
+void FrameGraph::Push(int source, FrameRef frame) {
+	std::unique_lock<std::mutex> lock(Lock);
+	Space.wait(lock, [&] { return Stopping || HasSpace(Stages[source]); });
+	if (Stopping || !Started)
+		return;
+	Stages[source].Frames++;
+	Deliver(source, frame, MonotonicMicros());
+}
+
+void FrameGraph::Drain() {
+	std::unique_lock<std::mutex> lock(Lock);
+	Idle.wait(lock, [&] {
+		if (Stopping)
+			return true;
+		if (Active != 0)
+			return false;
+		for (const auto& e : Edges) {
+			if (e.Queue.size() != 0)
+				return false;
+		}
+		return true;
+	});
+}
+
+std::vector<StageStats> FrameGraph::Stats() {
+	std::lock_guard<std::mutex> lock(Lock);
+	std::vector<StageStats>     stats;
+	for (const auto& s : Stages) {
+		StageStats st;
+		st.Name             = s.Name;
+		st.QueueDepth       = QueueDepth(s);
+		st.MaxQueueDepth    = s.MaxQueueDepth;
+		st.Frames           = s.Frames;
+		st.Dropped          = s.Dropped;
+		st.MaxMicros        = s.MaxMicros;
+		st.MaxLatencyMicros = s.MaxLatency;
+		if (s.Frames != 0 && s.Fn) {
+			st.AvgMicros        = (double) s.TotalMicros / s.Frames;
+			st.AvgLatencyMicros = (double) s.TotalLatency / s.Frames;
+		}
+		stats.push_back(st);
+	}
+	return stats;
+}
+
+// True if none of the Block edges that the stage feeds is full
+bool FrameGraph::HasSpace(const Stage& s) const {
+	for (int e : s.Outputs) {
+		if (Edges[e].Policy == EdgePolicy::Block && Edges[e].Queue.size() >= Edges[e].Capacity)
+			return false;
+	}
+	return true;
+}
+
+bool FrameGraph::CanRun(const Stage& s) const {
+	return !s.Running && !s.Scheduled && QueueDepth(s) != 0 && HasSpace(s);
+}
+
+size_t FrameGraph::QueueDepth(const Stage& s) const {
+	size_t n = 0;
+	for (int e : s.Inputs)
+		n += Edges[e].Queue.size();
+	return n;
+}
+
+void FrameGraph::Schedule(int stage) {
+	Stage& s = Stages[stage];
+	if (!s.Fn || !CanRun(s))
+		return;
+	s.Scheduled = true;
+	Active++;
+	Ready.push_back(stage);
+	Wake.notify_one();
+}
+
+void FrameGraph::Deliver(int stage, const FrameRef& frame, int64_t now) {
+	for (int i : Stages[stage].Outputs) {
+		Edge&  e  = Edges[i];
+		Stage& to = Stages[e.To];
+		Queued q;
+		q.Frame          = frame;
+		q.EnqueuedMicros = now;
+		q.Order          = NextOrder++;
+		if (e.Queue.size() >= e.Capacity) {
+			// Only a DropOldest edge can be full here, because a stage doesn't run while any of its Block edges are full
+			FrameRef dropped = e.Queue.front().Frame;
+			e.Queue.pop_front();
+			if (e.Queue.size() != 0)
+				e.Queue.front().Frame = MergeDirty(dropped, e.Queue.front().Frame);
+			else
+				q.Frame = MergeDirty(dropped, q.Frame);
+			to.Dropped++;
+		}
+		e.Queue.push_back(q);
+		to.MaxQueueDepth = std::max(to.MaxQueueDepth, QueueDepth(to));
+		Schedule(e.To);
+	}
+}
+
+void FrameGraph::WorkerThread() {
+	std::unique_lock<std::mutex> lock(Lock);
+	while (true) {
+		Wake.wait(lock, [&] { return Stopping || Ready.size() != 0; });
+		if (Stopping)
+			return;
+		int    id = Ready.front();
+		Stage& s  = Stages[id];
+		Ready.pop_front();
+		s.Scheduled = false;
+		s.Running   = true;
+
+		// Take the frame that arrived first, from whichever input it's in
+		Edge* from = nullptr;
+		for (int e : s.Inputs) {
+			if (Edges[e].Queue.size() != 0 && (!from || Edges[e].Queue.front().Order < from->Queue.front().Order))
+				from = &Edges[e];
+		}
+		Queued in = from->Queue.front();
+		from->Queue.pop_front();
+		if (from->Policy == EdgePolicy::Block) {
+			Space.notify_all();
+			Schedule(from->From);
+		}
+
+		lock.unlock();
+		int64_t  start = MonotonicMicros();
+		FrameRef out   = s.Fn(in.Frame);
+		int64_t  end   = MonotonicMicros();
+		lock.lock();
+
+		s.Frames++;
+		s.TotalMicros += end - start;
+		s.MaxMicros = std::max(s.MaxMicros, end - start);
+		s.TotalLatency += end - in.EnqueuedMicros;
+		s.MaxLatency = std::max(s.MaxLatency, end - in.EnqueuedMicros);
+		if (out && !Stopping)
+			Deliver(id, out, end);
+		s.Running = false;
+		Active--;
+		Schedule(id);
+		Idle.notify_all();
+	}
+}
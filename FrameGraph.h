@@ -0,0 +1,126 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// FrameGraph is a small dataflow runtime for the stages that consume captured frames, such as
+// filtering, masking, publishing, indexing and recording.
+//
+// A stage is a function that takes a frame and returns the frame to pass on, or nothing. Sources
+// are stages without a function, which are fed by Push. Edges connect the output of one stage to
+// the input of another. An output may feed any number of edges, and a stage with several inputs
+// sees their frames in the order that they arrived.
+//
+// Frames flow as shared, immutable GraphFrames, and copying a Bitmap shares its pixels, so fan-out
+// costs no copies. Every edge has a bounded queue, with one of two policies for when it's full:
+// drop the oldest frame, or make the stage that feeds it wait. A dropped frame passes its dirty
+// rects on to the frame behind it, so a stage that only looks at what changed never misses a change.
+//
+// Stages run on a shared pool of threads. A stage only ever processes one frame at a time, and in
+// order, so it may keep state from frame to frame, but independent branches run in parallel.
+
+struct GraphFrame {
+	Bitmap              Img;     // Shares its pixels with every other copy of the frame
+	std::vector<Rect>   Dirty;   // Regions that changed since the previous frame on the same edge
+	std::vector<MoveOp> Moves;   // Content that moved since that frame. Their destinations are also in Dirty. Stages that change Dirty drop these.
+	std::vector<Rect>   Redrawn; // With Moves, the part of Dirty that was drawn after the moves were applied. Dropped along with Moves.
+};
+
+typedef std::shared_ptr<const GraphFrame> FrameRef;
+
+// A copy of 'next' whose dirty rects also cover those of 'dropped', for when 'dropped' is skipped.
+// The moves of 'next' are relative to 'dropped', so they are dropped too, along with Redrawn.
+FrameRef MergeDirty(const FrameRef& dropped, const FrameRef& next);
+
+enum class EdgePolicy {
+	DropOldest, // When the queue is full, drop the oldest frame in it
+	Block,      // When the queue is full, the stage that feeds it waits
+};
+
+struct StageStats {
+	std::string Name;
+	size_t      QueueDepth       = 0; // Frames waiting in the inputs of the stage
+	size_t      MaxQueueDepth    = 0;
+	uint64_t    Frames           = 0; // Frames that the stage has processed, or that were pushed into a source
+	uint64_t    Dropped          = 0; // Frames that were dropped from the inputs of the stage
+	double      AvgMicros        = 0; // Time spent in the stage function, per frame
+	int64_t     MaxMicros        = 0;
+	double      AvgLatencyMicros = 0; // From entering an input of the stage, to the stage being done with it
+	int64_t     MaxLatencyMicros = 0;
+};
+
+class FrameGraph {
+public:
+	// Returns the frame to pass on to the outputs of the stage, which may be 'in' itself, or null to pass nothing on
+	typedef std::function<FrameRef(const FrameRef& in)> StageFn;
+
+	int Threads = 0; // Threads that run the stages. 0 = one per core.
+
+	~FrameGraph();
+
+	// Build the graph before calling Start. The returned ID identifies the stage.
+	int  AddSource(const std::string& name);
+	int  AddStage(const std::string& name, StageFn fn);
+	void Connect(int from, int to, EdgePolicy policy = EdgePolicy::DropOldest, size_t capacity = 2);
+
+	Error Start(); // Fails if the graph has a cycle, or is already running
+	void  Stop();  // Frames that are still queued are discarded. The graph may be started again.
+
+	// Feed a frame into a source. Waits while any Block edge of the source is full.
+	void Push(int source, FrameRef frame);
+
+	// Wait until every frame that was pushed has made its way through the graph
+	void Drain();
+
+	std::vector<StageStats> Stats();
+
+private:
+	struct Queued {
+		FrameRef Frame;
+		int64_t  EnqueuedMicros = 0;
+		uint64_t Order          = 0; // Arrival order, across all edges
+	};
+
+	struct Edge {
+		int                From     = 0;
+		int                To       = 0;
+		EdgePolicy         Policy   = EdgePolicy::DropOldest;
+		size_t             Capacity = 0;
+		std::deque<Queued> Queue;
+	};
+
+	struct Stage {
+		std::string      Name;
+		StageFn          Fn;
+		std::vector<int> Inputs; // Edges
+		std::vector<int> Outputs;
+		bool             Scheduled     = false; // Waiting in Ready
+		bool             Running       = false;
+		uint64_t         Frames        = 0;
+		uint64_t         Dropped       = 0;
+		size_t           MaxQueueDepth = 0;
+		int64_t          TotalMicros   = 0;
+		int64_t          MaxMicros     = 0;
+		int64_t          TotalLatency  = 0;
+		int64_t          MaxLatency    = 0;
+	};
+
+	std::mutex               Lock;
+	std::condition_variable  Wake;  // Signals workers that Ready is not empty
+	std::condition_variable  Space; // Signals Push that a Block edge has room
+	std::condition_variable  Idle;  // Signals Drain that a stage finished
+	std::vector<Stage>       Stages;
+	std::vector<Edge>        Edges;
+	std::deque<int>          Ready; // Stages that can run
+	std::vector<std::thread> Workers;
+	uint64_t                 NextOrder = 0;
+	int                      Active    = 0; // Stages that are scheduled or running
+	bool                     Started   = false;
+	bool                     Stopping  = false;
+
+	bool   CanRun(const Stage& s) const;
+	bool   HasSpace(const Stage& s) const;
+	void   Schedule(int stage);
+	void   Deliver(int stage, const FrameRef& frame, int64_t now);
+	size_t QueueDepth(const Stage& s) const;
+	void   WorkerThread();
+};
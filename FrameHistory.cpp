@@ -0,0 +1,337 @@
+#include "stdafx.h"
+#include "FrameHistory.h"
+
+// Frames per segment. Frames is reserved to this size, so it can never reallocate.
+static const size_t MaxSegmentFrames = 1024;
+
+// Start a new segment once the open one holds this fraction of MaxBytes, so that the oldest
+// segment can be dropped without losing most of the history
+static const size_t MaxSegmentFraction = 8;
+
+FrameHistory::FrameHistory() : CurrentBytes(0) {
+}
+
+FrameHistory::~FrameHistory() {
+	Stop();
+}
+
+void FrameHistory::Start() {
+	Stop();
+	Stopping = false;
+	Thinner  = std::thread([this] { ThinThread(); });
+}
+
+void FrameHistory::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Stopping = true;
+	}
+	Wake.notify_all();
+	if (Thinner.joinable())
+		Thinner.join();
+}
+
+void FrameHistory::Add(const Bitmap& img, const std::vector<Rect>& dirty, int64_t timestamp) {
+	bool resized = Grid.Width != img.Width || Grid.Height != img.Height;
+	if (resized) {
+		Grid.Reset(img.Width, img.Height);
+		Current.clear();
+		Current.resize(Grid.Count());
+		CurrentBytes = 0;
+		Changed.assign(Grid.Count(), 1);
+	} else {
+		Changed.assign(Grid.Count(), 0);
+		Grid.MarkRects(dirty, Changed.data());
+	}
+
+	// Encode the tiles that changed, skipping those that were reported dirty, but came out identical
+	Frame f;
+	f.Timestamp    = timestamp;
+	size_t current = CurrentBytes;
+	for (int t = 0; t < Grid.Count(); t++) {
+		if (!Changed[t])
+			continue;
+		size_t offset = f.Data.size();
+		size_t size   = TileEncode(img, Grid.TileRect(t), f.Data);
+		auto&  cur    = Current[t];
+		if (!resized && size == cur.size() && memcmp(cur.data(), &f.Data[offset], size) == 0) {
+			f.Data.resize(offset);
+			continue;
+		}
+		current -= cur.capacity();
+		cur.assign(f.Data.begin() + offset, f.Data.end());
+		current += cur.capacity();
+		f.Tiles.push_back({(uint32_t) t, (uint32_t) offset, (uint32_t) size});
+	}
+	CurrentBytes = current;
+	if (f.Tiles.size() == 0)
+		return; // The previous frame still stands
+	f.Tiles.shrink_to_fit();
+	f.Data.shrink_to_fit();
+
+	bool key = resized || !Open || Open->Frames.size() == Open->Frames.capacity() ||
+	           timestamp - Open->Frames[0].Timestamp >= KeyframeMicros ||
+	           Open->Bytes > MaxBytes / MaxSegmentFraction;
+	if (key) {
+		// The keyframe already contains this frame's tiles
+		auto                        seg = NewSegment(timestamp);
+		std::lock_guard<std::mutex> lock(Lock);
+		Segments.push_back(seg);
+		SegmentBytes += seg->Bytes;
+		Open = seg;
+		Evict();
+	} else {
+		size_t                      bytes = f.Bytes();
+		std::lock_guard<std::mutex> lock(Lock);
+		Open->Frames.push_back(std::move(f));
+		Open->Bytes += bytes;
+		SegmentBytes += bytes;
+		Evict();
+	}
+}
+
+// Build a keyframe out of the encoded tiles of the current screen
+FrameHistory::SegmentPtr FrameHistory::NewSegment(int64_t timestamp) {
+	auto seg    = std::make_shared<Segment>();
+	seg->Width  = Grid.Width;
+	seg->Height = Grid.Height;
+	seg->Frames.reserve(MaxSegmentFrames);
+	seg->Frames.emplace_back();
+	Frame& key    = seg->Frames[0];
+	key.Timestamp = timestamp;
+	key.Tiles.resize(Grid.Count());
+	key.Data.resize(CurrentBytes);
+	size_t offset = 0;
+	for (int t = 0; t < Grid.Count(); t++) {
+		const auto& cur = Current[t];
+		memcpy(&key.Data[offset], cur.data(), cur.size());
+		key.Tiles[t] = {(uint32_t) t, (uint32_t) offset, (uint32_t) cur.size()};
+		offset += cur.size();
+	}
+	key.Data.resize(offset);
+	key.Data.shrink_to_fit();
+	seg->Bytes = SegmentOverhead(MaxSegmentFrames) + key.Bytes();
+	return seg;
+}
+
+// Drop the oldest segments until we're within budget. Lock must be held.
+void FrameHistory::Evict() {
+	while (Segments.size() > 1 && SegmentBytes + CurrentBytes > MaxBytes) {
+		SegmentBytes -= Segments.front()->Bytes;
+		Segments.pop_front();
+	}
+}
+
+bool FrameHistory::FrameAt(int64_t timestamp, Bitmap& img, int64_t* frameTimestamp) {
+	SegmentPtr seg;
+	size_t     index;
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		auto s = std::upper_bound(Segments.begin(), Segments.end(), timestamp, [](int64_t t, const SegmentPtr& p) { return t < p->Frames[0].Timestamp; });
+		if (s == Segments.begin())
+			return false;
+		seg    = *(s - 1);
+		auto f = std::upper_bound(seg->Frames.begin(), seg->Frames.end(), timestamp, [](int64_t t, const Frame& p) { return t < p.Timestamp; });
+		index  = (f - seg->Frames.begin()) - 1;
+	}
+	// Frames that have been added are never modified, so we don't need the lock to read them
+	Rebuild(*seg, index, img);
+	if (frameTimestamp)
+		*frameTimestamp = seg->Frames[index].Timestamp;
+	return true;
+}
+
+void FrameHistory::Rebuild(const Segment& seg, size_t index, Bitmap& img) {
+	TileGrid grid(seg.Width, seg.Height);
+	img.Width  = seg.Width;
+	img.Height = seg.Height;
+	img.Timing = FrameTiming();
+	img.Buf.resize((size_t) img.Stride() * img.Height);
+
+	std::vector<uint8_t> done(grid.Count(), 0);
+	int                  remaining = grid.Count();
+	for (size_t i = index + 1; i-- > 0 && remaining != 0;) {
+		const Frame& f = seg.Frames[i];
+		for (const auto& t : f.Tiles) {
+			if (done[t.Tile])
+				continue;
+			done[t.Tile] = 1;
+			remaining--;
+			TileDecode(&f.Data[t.Offset], t.Size, img, grid.TileRect(t.Tile));
+		}
+	}
+}
+
+void FrameHistory::Thin() {
+	while (true) {
+		SegmentPtr prev;
+		SegmentPtr src;
+		{
+			std::lock_guard<std::mutex> lock(Lock);
+			if (Segments.size() == 0)
+				return;
+			int64_t newest = Segments.back()->Frames.back().Timestamp;
+			// The newest segment is still growing
+			for (size_t i = 0; i + 1 < Segments.size(); i++) {
+				const auto& s = Segments[i];
+				if (!s->Thinned && newest - s->Frames.back().Timestamp >= ThinAfterMicros) {
+					src = s;
+					if (i != 0 && CanAppend(*Segments[i - 1], *s))
+						prev = Segments[i - 1];
+					break;
+				}
+			}
+		}
+		if (!src)
+			return;
+
+		auto dst = ThinSegment(prev.get(), *src);
+
+		// Either segment may have been evicted while we were thinning
+		std::lock_guard<std::mutex> lock(Lock);
+		auto s = std::find(Segments.begin(), Segments.end(), src);
+		if (s == Segments.end() || (prev && (s == Segments.begin() || *(s - 1) != prev)))
+			continue;
+		SegmentBytes = SegmentBytes - src->Bytes + dst->Bytes;
+		*s           = dst;
+		if (prev) {
+			SegmentBytes -= prev->Bytes;
+			Segments.erase(s - 1);
+		}
+	}
+}
+
+// A thinned segment doesn't need a keyframe of its own when it can continue from the end of the
+// segment before it. Stop joining at the size at which Add starts a new segment.
+bool FrameHistory::CanAppend(const Segment& prev, const Segment& src) const {
+	return prev.Thinned && prev.Width == src.Width && prev.Height == src.Height && prev.Bytes < MaxBytes / MaxSegmentFraction;
+}
+
+// The tiles of 'key' that differ from the last frame of 'prev'. The codec is deterministic, so
+// equal pixels have equal encodings, and we can compare the encoded bytes.
+FrameHistory::Frame FrameHistory::KeyframeDelta(const Segment& prev, const Frame& key) {
+	TileGrid                            grid(prev.Width, prev.Height);
+	std::vector<const uint8_t*>         data(grid.Count(), nullptr);
+	std::vector<uint32_t>               size(grid.Count(), 0);
+	int                                 remaining = grid.Count();
+	for (size_t i = prev.Frames.size(); i-- > 0 && remaining != 0;) {
+		const Frame& f = prev.Frames[i];
+		for (const auto& t : f.Tiles) {
+			if (data[t.Tile])
+				continue;
+			data[t.Tile] = &f.Data[t.Offset];
+			size[t.Tile] = t.Size;
+			remaining--;
+		}
+	}
+
+	Frame delta;
+	delta.Timestamp = key.Timestamp;
+	for (const auto& t : key.Tiles) {
+		if (t.Size == size[t.Tile] && memcmp(data[t.Tile], &key.Data[t.Offset], t.Size) == 0)
+			continue;
+		delta.Tiles.push_back({t.Tile, (uint32_t) delta.Data.size(), t.Size});
+		delta.Data.insert(delta.Data.end(), key.Data.begin() + t.Offset, key.Data.begin() + t.Offset + t.Size);
+	}
+	return delta;
+}
+
+// Keep at most one frame per ThinMicros. Every kept frame receives the newest version of each
+// tile that changed since the previous kept frame. Without 'prev', the keyframe is always kept.
+// With 'prev', the result is 'prev' followed by the thinned frames of 'src', and the keyframe of
+// 'src' is reduced to a delta against the end of 'prev'.
+FrameHistory::SegmentPtr FrameHistory::ThinSegment(const Segment* prev, const Segment& src) {
+	Frame key;
+	if (prev)
+		key = KeyframeDelta(*prev, src.Frames[0]);
+	auto frame = [&](size_t i) -> const Frame& { return i == 0 && prev ? key : src.Frames[i]; };
+
+	size_t              n    = src.Frames.size();
+	int64_t             last = prev ? prev->Frames.back().Timestamp : src.Frames[0].Timestamp;
+	std::vector<size_t> keep;
+	for (size_t i = prev ? 0 : 1; i < n; i++) {
+		if (frame(i).Timestamp - last >= ThinMicros || i + 1 == n) {
+			keep.push_back(i);
+			last = frame(i).Timestamp;
+		}
+	}
+
+	auto dst     = std::make_shared<Segment>();
+	dst->Width   = src.Width;
+	dst->Height  = src.Height;
+	dst->Thinned = true;
+	dst->Frames.reserve((prev ? prev->Frames.size() : 1) + keep.size());
+	if (prev)
+		dst->Frames = prev->Frames;
+	else
+		dst->Frames.push_back(src.Frames[0]);
+
+	TileGrid            grid(src.Width, src.Height);
+	std::vector<size_t> seen(grid.Count(), 0); // The last k that took this tile, plus one
+	size_t              from = prev ? 0 : 1;   // First frame that isn't covered by a kept frame yet
+	for (size_t k = 0; k < keep.size(); k++) {
+		Frame merged;
+		merged.Timestamp = src.Frames[keep[k]].Timestamp;
+		for (size_t i = keep[k] + 1; i-- > from;) {
+			const Frame& f = frame(i);
+			for (const auto& t : f.Tiles) {
+				if (seen[t.Tile] == k + 1)
+					continue;
+				seen[t.Tile] = k + 1;
+				merged.Tiles.push_back({t.Tile, (uint32_t) merged.Data.size(), t.Size});
+				merged.Data.insert(merged.Data.end(), f.Data.begin() + t.Offset, f.Data.begin() + t.Offset + t.Size);
+			}
+		}
+		from = keep[k] + 1;
+		if (merged.Tiles.size() == 0)
+			continue;
+		merged.Tiles.shrink_to_fit();
+		merged.Data.shrink_to_fit();
+		dst->Frames.push_back(std::move(merged));
+	}
+
+	dst->Frames.shrink_to_fit();
+	dst->Bytes = SegmentOverhead(dst->Frames.capacity());
+	for (const auto& f : dst->Frames)
+		dst->Bytes += f.Bytes();
+	return dst;
+}
+
+void FrameHistory::ThinThread() {
+	std::unique_lock<std::mutex> lock(Lock);
+	while (!Stopping) {
+		Wake.wait_for(lock, std::chrono::seconds(1), [this] { return Stopping; });
+		if (Stopping)
+			break;
+		lock.unlock();
+		Thin();
+		lock.lock();
+	}
+}
+
+void FrameHistory::Clear() {
+	std::lock_guard<std::mutex> lock(Lock);
+	Segments.clear();
+	SegmentBytes = 0;
+	Open         = nullptr;
+	Grid         = TileGrid();
+	Current.clear();
+	CurrentBytes = 0;
+}
+
+FrameHistoryStats FrameHistory::Stats() {
+	std::lock_guard<std::mutex> lock(Lock);
+	FrameHistoryStats           s;
+	s.Bytes    = SegmentBytes + CurrentBytes;
+	s.Segments = Segments.size();
+	for (const auto& seg : Segments) {
+		s.Frames += seg->Frames.size();
+		s.ThinnedSegments += seg->Thinned ? 1 : 0;
+		s.ThinnedBytes += seg->Thinned ? seg->Bytes : 0;
+	}
+	if (Segments.size() != 0) {
+		s.OldestMicros = Segments.front()->Frames[0].Timestamp;
+		s.NewestMicros = Segments.back()->Frames.back().Timestamp;
+	}
+	return s;
+}
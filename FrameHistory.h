@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Tiles.h"
+
+// FrameHistory keeps the last few minutes of the screen in memory, so that any recent moment can be
+// brought back instantly, for example to save a screenshot of something that is already gone.
+//
+// The history is a list of segments. A segment starts with a keyframe, which holds every tile of
+// the screen, followed by one delta per frame, which holds only the tiles that changed in that
+// frame. Tiles are compressed with TileEncode. A frame is rebuilt by walking back from it to the
+// keyframe, taking the newest version of every tile along the way. Keyframes cost no encoding,
+// because the history keeps the encoded form of every tile of the current screen.
+//
+// Once a segment is old enough, a background thread thins it, so that it keeps at most one frame
+// per ThinMicros. The tiles of the dropped frames are folded into the frames that are kept, so every
+// kept frame is still exact, and the tile versions that only the dropped frames could see are freed.
+// Typing and video produce many versions of the same tiles, so this is where most memory is won.
+//
+// When the history grows beyond MaxBytes, the oldest segments are dropped. Frames are found by
+// binary search on their timestamps.
+
+struct FrameHistoryStats {
+	size_t  Bytes           = 0; // Everything, including the encoded tiles of the current screen
+	size_t  Frames          = 0;
+	size_t  Segments        = 0;
+	size_t  ThinnedSegments = 0;
+	size_t  ThinnedBytes    = 0; // Part of Bytes that is in thinned segments
+	int64_t OldestMicros    = 0; // Timestamp of the oldest frame that can be rebuilt
+	int64_t NewestMicros    = 0;
+};
+
+class FrameHistory {
+public:
+	size_t  MaxBytes        = 256 * 1024 * 1024; // The oldest segments are dropped beyond this. The newest segment is always kept.
+	int64_t KeyframeMicros  = 10 * 1000000;      // Start a new segment at least this often
+	int64_t ThinAfterMicros = 30 * 1000000;      // Thin segments that ended this long before the newest frame
+	int64_t ThinMicros      = 1000000;           // Thinned segments keep at most one frame per this interval
+
+	FrameHistory();
+	~FrameHistory();
+
+	void Start(); // Start thinning old segments in the background
+	void Stop();
+
+	// Record a frame. 'dirty' is the list of regions that changed since the previous call.
+	// Timestamps are in microseconds, and may not go backwards.
+	void Add(const Bitmap& img, const std::vector<Rect>& dirty, int64_t timestamp);
+
+	// Rebuild the newest frame at or before 'timestamp'. Returns false if the history doesn't reach
+	// that far back. The timestamp of the frame that was found is written to 'frameTimestamp'.
+	bool FrameAt(int64_t timestamp, Bitmap& img, int64_t* frameTimestamp = nullptr);
+
+	// Thin every segment that is due, without waiting for the background thread
+	void Thin();
+
+	void              Clear(); // Must be called from the thread that calls Add
+	FrameHistoryStats Stats();
+
+private:
+	struct TileRef {
+		uint32_t Tile;
+		uint32_t Offset; // Position of the encoded tile in Frame::Data
+		uint32_t Size;
+	};
+
+	struct Frame {
+		int64_t              Timestamp = 0;
+		std::vector<TileRef> Tiles;
+		std::vector<uint8_t> Data;
+
+		size_t Bytes() const { return Tiles.capacity() * sizeof(TileRef) + Data.capacity(); }
+	};
+
+	// Frames[0] is the keyframe. The capacity of Frames is reserved up front, and never exceeded,
+	// so that FrameAt can read the frames of the newest segment while Add appends to it.
+	struct Segment {
+		int                Width   = 0;
+		int                Height  = 0;
+		std::vector<Frame> Frames;
+		size_t             Bytes   = 0;
+		bool               Thinned = false;
+	};
+
+	typedef std::shared_ptr<Segment> SegmentPtr;
+
+	// Owned by the thread that calls Add
+	TileGrid                          Grid;
+	std::vector<std::vector<uint8_t>> Current; // Encoded tiles of the most recent frame
+	std::vector<uint8_t>              Changed;
+	SegmentPtr                        Open; // The segment that new frames go into
+
+	std::mutex              Lock;
+	std::condition_variable Wake;
+	std::deque<SegmentPtr>  Segments;         // Oldest first
+	size_t                  SegmentBytes = 0; // Sum of Segment::Bytes
+	std::atomic<size_t>     CurrentBytes;     // Capacity of Current
+	bool                    Stopping = false;
+	std::thread             Thinner;
+
+	static size_t SegmentOverhead(size_t frames) { return sizeof(Segment) + frames * sizeof(Frame); }
+
+	SegmentPtr NewSegment(int64_t timestamp);
+	SegmentPtr ThinSegment(const Segment* prev, const Segment& src);
+	bool       CanAppend(const Segment& prev, const Segment& src) const;
+	Frame      KeyframeDelta(const Segment& prev, const Frame& key);
+	void       Rebuild(const Segment& seg, size_t index, Bitmap& img);
+	void       Evict();
+	void       ThinThread();
+};
@@ -0,0 +1,425 @@
+#include "stdafx.h"
+#include "FrameIndex.h"
+#include "Simd.h"
+#include "Tiles.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// The index grows in steps of at least this many entries
+static const size_t MinGrowEntries = 64 * 1024;
+
+// Beyond this chunk distance, probing the neighbouring buckets costs more than a linear scan
+static const int MaxProbeDistance = 2;
+
+// Scan every entry when the buckets of a query hold more than 1/LinearScanRatio of them
+static const size_t LinearScanRatio = 8;
+
+// Tiles whose 8x8 blocks all have an average luma within this many levels of each other are too
+// flat to hash. Their hash is 0, or noise, and they would all land in the same few buckets.
+static const uint32_t MinTileContrast = 8;
+
+int HammingDistance(uint64_t a, uint64_t b) {
+#ifdef _MSC_VER
+#ifdef _M_X64
+	return (int) __popcnt64(a ^ b);
+#else
+	return (int) (__popcnt((uint32_t)(a ^ b)) + __popcnt((uint32_t)((a ^ b) >> 32)));
+#endif
+#else
+	return __builtin_popcountll(a ^ b);
+#endif
+}
+
+// Sum of (B + 2G + R) over the 8x8 block of BGRA pixels at p, which is 4x its average luma, times 64
+static uint32_t BlockSum8x8(const uint8_t* p, size_t stride) {
+#ifdef WINDUP_SSE2
+	// _mm_sad_epu8 adds up 8 bytes at a time, so we mask out the channels that we don't want
+	const __m128i brMask = _mm_set1_epi32(0x00ff00ff);
+	const __m128i gMask  = _mm_set1_epi32(0x0000ff00);
+	const __m128i zero   = _mm_setzero_si128();
+	__m128i       br     = _mm_setzero_si128();
+	__m128i       g      = _mm_setzero_si128();
+	for (int y = 0; y < 8; y++, p += stride) {
+		__m128i a = _mm_loadu_si128((const __m128i*) p);
+		__m128i b = _mm_loadu_si128((const __m128i*) (p + 16));
+		br        = _mm_add_epi64(br, _mm_add_epi64(_mm_sad_epu8(_mm_and_si128(a, brMask), zero), _mm_sad_epu8(_mm_and_si128(b, brMask), zero)));
+		g         = _mm_add_epi64(g, _mm_add_epi64(_mm_sad_epu8(_mm_and_si128(a, gMask), zero), _mm_sad_epu8(_mm_and_si128(b, gMask), zero)));
+	}
+	__m128i all = _mm_add_epi64(br, _mm_add_epi64(g, g));
+	all         = _mm_add_epi64(all, _mm_unpackhi_epi64(all, all));
+	return (uint32_t) _mm_cvtsi128_si32(all);
+#else
+	uint32_t sum = 0;
+	for (int y = 0; y < 8; y++, p += stride) {
+		for (int x = 0; x < 32; x += 4)
+			sum += p[x] + 2 * p[x + 1] + p[x + 2];
+	}
+	return sum;
+#endif
+}
+
+// Same as BlockSum8x8, but for blocks that are cut short by the edge of the image
+static uint32_t BlockSum(const uint8_t* p, size_t stride, int w, int h) {
+	uint32_t sum = 0;
+	for (int y = 0; y < h; y++, p += stride) {
+		for (int x = 0; x < w * 4; x += 4)
+			sum += p[x] + 2 * p[x + 1] + p[x + 2];
+	}
+	return sum;
+}
+
+// Compute the sums of the 8x8 blocks that cover r. The blocks are written to
+// out[by * outStride + bx], where (bx,by) are relative to the top-left of r.
+static void BlockSums(const Bitmap& img, const Rect& r, uint32_t* out, int outStride) {
+	size_t stride = img.Stride();
+	for (int y = r.Y1; y < r.Y2; y += 8) {
+		uint32_t* o = out + (size_t)((y - r.Y1) / 8) * outStride;
+		int       h = std::min(8, r.Y2 - y);
+		for (int x = r.X1; x < r.X2; x += 8) {
+			int            w = std::min(8, r.X2 - x);
+			const uint8_t* p = img.Row(y) + x * 4;
+			*o++             = w == 8 && h == 8 ? BlockSum8x8(p, stride) : BlockSum(p, stride, w, h);
+		}
+	}
+}
+
+// Compute the hash of a w x h pixel region, from the sums of its 8x8 blocks.
+// The blocks are split into an 8x8 grid of cells, and bit (y*8 + x) is set when cell (x,y)
+// is brighter than the cell to its right, wrapping around at the end of the row.
+static uint64_t GridHash(const uint32_t* blocks, int stride, int w, int h) {
+	int bw = (w + 7) / 8;
+	int bh = (h + 7) / 8;
+	int cx[9], cy[9];
+	for (int i = 0; i <= 8; i++) {
+		cx[i] = i * bw / 8;
+		cy[i] = i * bh / 8;
+	}
+	uint64_t sum[8][8];
+	uint64_t area[8][8];
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++) {
+			uint64_t s = 0;
+			for (int by = cy[y]; by < cy[y + 1]; by++) {
+				const uint32_t* row = blocks + (size_t) by * stride;
+				for (int bx = cx[x]; bx < cx[x + 1]; bx++)
+					s += row[bx];
+			}
+			// Only the last row and column of blocks can be partial
+			int pw     = std::min(cx[x + 1] * 8, w) - cx[x] * 8;
+			int ph     = std::min(cy[y + 1] * 8, h) - cy[y] * 8;
+			sum[y][x]  = s;
+			area[y][x] = (uint64_t) pw * ph;
+		}
+	}
+
+	// Cells can differ in area, so compare averages, by cross multiplying
+	uint64_t hash = 0;
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++) {
+			int n = (x + 1) & 7;
+			if (sum[y][x] * area[y][n] > sum[y][n] * area[y][x])
+				hash |= (uint64_t) 1 << (y * 8 + x);
+		}
+	}
+	return hash;
+}
+
+// Returns true if the whole 8x8 blocks of a w x h pixel region are all about as bright as each other
+static bool IsFlat(const uint32_t* blocks, int stride, int w, int h) {
+	uint32_t lo = UINT32_MAX;
+	uint32_t hi = 0;
+	for (int by = 0; by < h / 8; by++) {
+		const uint32_t* row = blocks + (size_t) by * stride;
+		for (int bx = 0; bx < w / 8; bx++) {
+			lo = std::min(lo, row[bx]);
+			hi = std::max(hi, row[bx]);
+		}
+	}
+	// A block sum is 4 x 64 times the average luma of the block
+	return hi - lo < MinTileContrast * 4 * 64;
+}
+
+uint64_t DHash(const Bitmap& img, const Rect& r) {
+	int                   bw = (r.Width() + 7) / 8;
+	std::vector<uint32_t> blocks((size_t) bw * ((r.Height() + 7) / 8));
+	BlockSums(img, r, blocks.data(), bw);
+	return GridHash(blocks.data(), bw, r.Width(), r.Height());
+}
+
+FrameIndex::~FrameIndex() {
+	Close();
+}
+
+Error FrameIndex::Open(const std::string& filename) {
+	Close();
+	size_t size = 0;
+	auto   err  = OpenFile(filename, size);
+	if (err != "")
+		return err;
+	bool created = size == 0;
+	if (created)
+		size = sizeof(FrameIndexHeader) + MinGrowEntries * sizeof(FrameIndexEntry);
+	else if (size < sizeof(FrameIndexHeader))
+		err = tsf::fmt("%v is not a frame index", filename);
+	if (err == "")
+		err = Map(size);
+	if (err != "") {
+		Close();
+		return err;
+	}
+
+	if (created) {
+		Header->Magic     = FrameIndexMagic;
+		Header->Version   = FrameIndexVersion;
+		Header->EntrySize = sizeof(FrameIndexEntry);
+		Header->Reserved  = 0;
+		Header->Count     = 0;
+	} else if (Header->Magic != FrameIndexMagic || Header->Version != FrameIndexVersion || Header->EntrySize != sizeof(FrameIndexEntry) || Header->Count > Capacity()) {
+		// Unmap first, so that Close doesn't truncate somebody else's file
+		Unmap();
+		Close();
+		return tsf::fmt("%v is not a frame index, or it is damaged", filename);
+	}
+
+	Buckets.resize(NumChunks * NumBuckets);
+	for (size_t i = 0; i < Size(); i++)
+		Insert(i);
+	return "";
+}
+
+void FrameIndex::Close() {
+	// Drop the unused tail that we reserved for growth
+	size_t used = Header ? sizeof(FrameIndexHeader) + Size() * sizeof(FrameIndexEntry) : 0;
+	Unmap();
+	CloseFile(used);
+	Buckets.clear();
+	Buckets.shrink_to_fit();
+}
+
+void FrameIndex::Insert(size_t i) {
+	uint64_t hash = Entries()[i].Hash;
+	for (int c = 0; c < NumChunks; c++) {
+		uint32_t chunk = (uint32_t)(hash >> (c * ChunkBits)) & (NumBuckets - 1);
+		Buckets[c * NumBuckets + chunk].push_back((uint32_t) i);
+	}
+}
+
+Error FrameIndex::Add(const FrameIndexEntry* entries, size_t n) {
+	if (!Header)
+		return "Frame index is not open";
+	size_t count = Size();
+	if (count + n > Capacity()) {
+		size_t cap = std::max(count + n, std::max(Capacity() * 2, MinGrowEntries));
+		auto   err = Map(sizeof(FrameIndexHeader) + cap * sizeof(FrameIndexEntry));
+		if (err != "")
+			return err;
+	}
+	memcpy(Entries() + count, entries, n * sizeof(FrameIndexEntry));
+	Header->Count = count + n;
+	for (size_t i = count; i < count + n; i++)
+		Insert(i);
+	return "";
+}
+
+Error FrameIndex::AddFrame(const Bitmap& img, const std::vector<Rect>& dirty, uint32_t frameSeq, int64_t timestampMicros) {
+	if (img.Width < HashMinSize || img.Height < HashMinSize)
+		return "";
+
+	// Bring the block sums up to date, but only inside the tiles that changed
+	TileGrid grid(img.Width, img.Height);
+	int      blocksX = (img.Width + 7) / 8;
+	if (img.Width != BlocksWidth || img.Height != BlocksHeight) {
+		BlocksWidth  = img.Width;
+		BlocksHeight = img.Height;
+		Blocks.resize((size_t) blocksX * ((img.Height + 7) / 8));
+		TileFlags.assign(grid.Count(), 1);
+	} else {
+		TileFlags.assign(grid.Count(), 0);
+		grid.MarkRects(dirty, TileFlags.data());
+	}
+
+	Scratch.clear();
+	FrameIndexEntry e;
+	e.TimestampMicros = timestampMicros;
+	e.FrameSeq        = frameSeq;
+	for (int i = 0; i < grid.Count(); i++) {
+		if (!TileFlags[i])
+			continue;
+		Rect      r      = grid.TileRect(i);
+		uint32_t* blocks = &Blocks[(size_t)(r.Y1 / 8) * blocksX + r.X1 / 8];
+		BlockSums(img, r, blocks, blocksX);
+		// Slivers on the right and bottom edges are too small to hash
+		if (r.Width() < HashMinSize || r.Height() < HashMinSize || IsFlat(blocks, blocksX, r.Width(), r.Height()))
+			continue;
+		e.Hash  = GridHash(blocks, blocksX, r.Width(), r.Height());
+		e.TileX = (int16_t)(i % grid.TilesX);
+		e.TileY = (int16_t)(i / grid.TilesX);
+		Scratch.push_back(e);
+	}
+	if (Scratch.size() == 0)
+		return "";
+
+	e.Hash  = GridHash(Blocks.data(), blocksX, img.Width, img.Height);
+	e.TileX = -1;
+	e.TileY = -1;
+	Scratch.insert(Scratch.begin(), e);
+	return Add(Scratch.data(), Scratch.size());
+}
+
+size_t FrameIndex::LargestBucket() const {
+	size_t largest = 0;
+	for (const auto& b : Buckets)
+		largest = std::max(largest, b.size());
+	return largest;
+}
+
+void FrameIndex::Query(uint64_t hash, int maxDistance, std::vector<size_t>& results) const {
+	results.clear();
+	if (!Header)
+		return;
+	const FrameIndexEntry* entries = Entries();
+	size_t                 count   = Size();
+
+	// The buckets within 'probe' bits of each of the query's chunks
+	int                   probe = maxDistance / NumChunks;
+	std::vector<uint32_t> probes;
+	size_t                total = 0;
+	for (int c = 0; c < NumChunks && probe <= MaxProbeDistance; c++) {
+		uint32_t q = (uint32_t)(hash >> (c * ChunkBits)) & (NumBuckets - 1);
+		probes.push_back(c * NumBuckets + q);
+		for (int b1 = 0; b1 < ChunkBits && probe >= 1; b1++) {
+			probes.push_back(c * NumBuckets + (q ^ (1u << b1)));
+			for (int b2 = b1 + 1; b2 < ChunkBits && probe >= 2; b2++)
+				probes.push_back(c * NumBuckets + (q ^ (1u << b1) ^ (1u << b2)));
+		}
+	}
+	for (auto p : probes)
+		total += Buckets[p].size();
+
+	// Sorting the candidates costs several times as much as checking an entry, so when they are
+	// a large part of the index, such as near the bucket of mostly blank tiles, scan instead
+	if (probe > MaxProbeDistance || total * LinearScanRatio > count) {
+		for (size_t i = 0; i < count; i++) {
+			if (HammingDistance(entries[i].Hash, hash) <= maxDistance)
+				results.push_back(i);
+		}
+		return;
+	}
+
+	std::vector<uint32_t> candidates;
+	candidates.reserve(total);
+	for (auto p : probes)
+		candidates.insert(candidates.end(), Buckets[p].begin(), Buckets[p].end());
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	for (auto i : candidates) {
+		if (HammingDistance(entries[i].Hash, hash) <= maxDistance)
+			results.push_back(i);
+	}
+}
+
+#ifdef _WIN32
+
+Error FrameIndex::OpenFile(const std::string& filename, size_t& size) {
+	File = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (File == INVALID_HANDLE_VALUE)
+		return tsf::fmt("Failed to open %v: %v", filename, GetLastError());
+	LARGE_INTEGER li;
+	GetFileSizeEx(File, &li);
+	size = (size_t) li.QuadPart;
+	return "";
+}
+
+void FrameIndex::CloseFile(size_t finalSize) {
+	if (File == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER li;
+	li.QuadPart = (LONGLONG) finalSize;
+	if (finalSize != 0 && SetFilePointerEx(File, li, nullptr, FILE_BEGIN))
+		SetEndOfFile(File);
+	CloseHandle(File);
+	File = INVALID_HANDLE_VALUE;
+}
+
+// Map the first 'size' bytes of the file, growing the file if necessary
+Error FrameIndex::Map(size_t size) {
+	Unmap();
+	Mapping = CreateFileMappingW(File, nullptr, PAGE_READWRITE, (DWORD)((uint64_t) size >> 32), (DWORD) size, nullptr);
+	if (!Mapping)
+		return tsf::fmt("CreateFileMapping failed: %v", GetLastError());
+	Header = (FrameIndexHeader*) MapViewOfFile(Mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!Header) {
+		auto err = tsf::fmt("MapViewOfFile failed: %v", GetLastError());
+		Unmap();
+		return err;
+	}
+	MapSize = size;
+	return "";
+}
+
+void FrameIndex::Unmap() {
+	if (Header)
+		UnmapViewOfFile(Header);
+	if (Mapping)
+		CloseHandle(Mapping);
+	Header  = nullptr;
+	Mapping = nullptr;
+	MapSize = 0;
+}
+
+#else
+
+Error FrameIndex::OpenFile(const std::string& filename, size_t& size) {
+	File = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+	if (File == -1)
+		return tsf::fmt("Failed to open %v: %v", filename, strerror(errno));
+	struct stat st;
+	if (fstat(File, &st) != 0) {
+		auto err = tsf::fmt("fstat failed: %v", strerror(errno));
+		CloseFile(0);
+		return err;
+	}
+	size = (size_t) st.st_size;
+	return "";
+}
+
+void FrameIndex::CloseFile(size_t finalSize) {
+	if (File == -1)
+		return;
+	// If this fails, the unused tail is simply ignored when the index is reopened
+	if (finalSize != 0)
+		(void) !ftruncate(File, (off_t) finalSize);
+	close(File);
+	File = -1;
+}
+
+// Map the first 'size' bytes of the file, growing the file if necessary
+Error FrameIndex::Map(size_t size) {
+	Unmap();
+	struct stat st;
+	if (fstat(File, &st) != 0)
+		return tsf::fmt("fstat failed: %v", strerror(errno));
+	if ((size_t) st.st_size < size && ftruncate(File, (off_t) size) != 0)
+		return tsf::fmt("ftruncate failed: %v", strerror(errno));
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, File, 0);
+	if (p == MAP_FAILED)
+		return tsf::fmt("mmap failed: %v", strerror(errno));
+	Header  = (FrameIndexHeader*) p;
+	MapSize = size;
+	return "";
+}
+
+void FrameIndex::Unmap() {
+	if (Header)
+		munmap(Header, MapSize);
+	Header  = nullptr;
+	MapSize = 0;
+}
+
+#endif
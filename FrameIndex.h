@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// FrameIndex records perceptual hashes of captured frames, so that we can later answer questions
+// such as "when was this dialog on screen?" across days of capture.
+//
+// Every frame contributes one hash of the whole frame, plus one hash for every tile that changed
+// in that frame, unless the tile is nearly flat, such as empty background or a blank page. Tiles are the same 64x64 grid that the streaming protocol uses (see Tiles.h).
+// The hash is a 64-bit dHash, so two images are similar when the Hamming distance between their
+// hashes is small (roughly, <= 10 is a near duplicate). Hashes are computed from the average luma
+// of 8x8 pixel blocks. We keep those block averages for the whole frame, and only recompute them
+// inside dirty tiles, so the cost of indexing is proportional to the amount of change.
+//
+// File layout (append only):
+//   FrameIndexHeader
+//   Count x FrameIndexEntry
+//
+// The file is memory mapped, and grown in large steps. Count is only advanced after the entries
+// have been written, so a crash leaves a valid index behind.
+//
+// Queries use multi-index hashing: the 64-bit hash is split into four 16-bit chunks, and each
+// chunk has its own table from chunk value to entries. If two hashes are within distance d,
+// then at least one of their chunks is within distance d/4 (pigeonhole), so we only need to
+// probe the buckets near each chunk of the query, instead of scanning every entry.
+
+static const uint32_t FrameIndexMagic   = 0x58444946; // 'FIDX'
+static const uint32_t FrameIndexVersion = 1;
+
+struct FrameIndexHeader {
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t EntrySize;
+	uint32_t Reserved;
+	uint64_t Count; // Number of valid entries
+};
+
+struct FrameIndexEntry {
+	int64_t  TimestampMicros; // Wall clock, microseconds since the Unix epoch
+	uint64_t Hash;
+	uint32_t FrameSeq;
+	int16_t  TileX; // -1 if this is a hash of the whole frame
+	int16_t  TileY;
+
+	bool IsFrame() const { return TileX < 0; }
+};
+
+// Regions smaller than this, in either dimension, are not hashed
+static const int HashMinSize = 32;
+
+// 64-bit difference hash of the region 'r'. The region is box filtered down to 8x8 luma cells,
+// and bit (y*8 + x) is set when cell (x,y) is brighter than cell (x+1,y), where the last cell
+// of each row is compared against the first. The region must be at least HashMinSize pixels
+// on each side. The hash of a tile is the same as the hash that FrameIndex records for it.
+uint64_t DHash(const Bitmap& img, const Rect& r);
+int      HammingDistance(uint64_t a, uint64_t b);
+
+class FrameIndex {
+public:
+	~FrameIndex();
+
+	Error  Open(const std::string& filename); // Opens an existing index, or creates a new one
+	void   Close();
+	bool   IsOpen() const { return Header != nullptr; }
+	size_t Size() const { return Header ? (size_t) Header->Count : 0; }
+
+	const FrameIndexEntry& At(size_t i) const { return Entries()[i]; }
+
+	// Hash and record the whole frame, and every tile touched by 'dirty'. Frames that don't change
+	// any hashable tile are not recorded.
+	Error AddFrame(const Bitmap& img, const std::vector<Rect>& dirty, uint32_t frameSeq, int64_t timestampMicros);
+	Error Add(const FrameIndexEntry* entries, size_t n);
+
+	// Find all entries whose hash is within maxDistance of 'hash'. Results are entry numbers, in ascending order.
+	void Query(uint64_t hash, int maxDistance, std::vector<size_t>& results) const;
+
+	// Number of entries in the fullest bucket. Queries near a full bucket have to check all of it.
+	size_t LargestBucket() const;
+
+private:
+	static const int ChunkBits  = 16;
+	static const int NumChunks  = 64 / ChunkBits;
+	static const int NumBuckets = 1 << ChunkBits;
+
+	FrameIndexHeader*                  Header  = nullptr;
+	size_t                             MapSize = 0;
+	std::vector<std::vector<uint32_t>> Buckets; // NumChunks * NumBuckets lists of entry numbers
+	std::vector<FrameIndexEntry>       Scratch;
+	std::vector<uint8_t>               TileFlags;
+	std::vector<uint32_t>              Blocks; // Sums of (B + 2G + R) over every 8x8 block of the last frame
+	int                                BlocksWidth  = 0;
+	int                                BlocksHeight = 0;
+#ifdef _WIN32
+	HANDLE File    = INVALID_HANDLE_VALUE;
+	HANDLE Mapping = nullptr;
+#else
+	int File = -1;
+#endif
+
+	FrameIndexEntry*       Entries() { return (FrameIndexEntry*) (Header + 1); }
+	const FrameIndexEntry* Entries() const { return (const FrameIndexEntry*) (Header + 1); }
+	size_t                 Capacity() const { return (MapSize - sizeof(FrameIndexHeader)) / sizeof(FrameIndexEntry); }
+
+	Error OpenFile(const std::string& filename, size_t& size);
+	void  CloseFile(size_t finalSize); // If finalSize is not zero, truncate the file to that size
+	Error Map(size_t size);
+	void  Unmap();
+	void  Insert(size_t i);
+};
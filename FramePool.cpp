@@ -0,0 +1,98 @@
+#include "stdafx.h"
+#include "FramePool.h"
+
+// Beyond this many stale regions, rewriting the whole frame is about as cheap
+static const size_t MaxStaleRects = 256;
+
+const std::vector<Rect>& FramePool::Acquire(Bitmap& img, const std::vector<Rect>& rewrite) {
+	Stale.clear();
+	Switched = -1;
+	if (!img.Buf.IsShared())
+		return Stale;
+
+	// The most recent spare that nobody else holds. It has the fewest changes to catch up on.
+	int best = -1;
+	for (int i = 0; i < (int) Spares.size(); i++) {
+		const auto& s = Spares[i];
+		if (s.Buf.IsShared() || s.Buf.size() != img.Buf.size())
+			continue;
+		if (best == -1 || s.Version > Spares[best].Version)
+			best = i;
+	}
+
+	if (best == -1) {
+		// Every spare is held. Keep this buffer as a spare, in place of the oldest, and copy it.
+		Spare s;
+		s.Buf     = img.Buf;
+		s.Version = Version;
+		if ((int) Spares.size() < MaxSpares) {
+			Spares.push_back(std::move(s));
+		} else if (MaxSpares > 0) {
+			auto oldest = std::min_element(Spares.begin(), Spares.end(), [](const Spare& a, const Spare& b) { return a.Version < b.Version; });
+			*oldest     = std::move(s);
+		}
+		img.Buf.MakeUnique();
+		Stat.Copies++;
+		return Stale;
+	}
+
+	Spare&   s      = Spares[best];
+	uint64_t missed = Version - s.Version;
+	std::swap(img.Buf, s.Buf);
+	Switched        = best;
+	SwitchedVersion = s.Version;
+	s.Version       = Version;
+	Stat.Switches++;
+
+	if (missed > History.size()) {
+		Stale.push_back(img.Bounds());
+	} else {
+		for (size_t i = History.size() - (size_t) missed; i < History.size(); i++)
+			Stale.insert(Stale.end(), History[i].begin(), History[i].end());
+		if (Stale.size() > MaxStaleRects)
+			Stale.assign(1, img.Bounds());
+	}
+	auto covered = [&](const Rect& r) {
+		for (const auto& w : rewrite) {
+			if (w.Contains(r))
+				return true;
+		}
+		return false;
+	};
+	Stale.erase(std::remove_if(Stale.begin(), Stale.end(), covered), Stale.end());
+	for (const auto& r : Stale)
+		Stat.StaleRows += r.Height();
+	return Stale;
+}
+
+void FramePool::Commit(const std::vector<Rect>& changed) {
+	Switched = -1;
+	Version++;
+	Stat.Versions++;
+	if (MaxHistory <= 0)
+		return;
+	if ((int) History.size() >= MaxHistory) {
+		// Reuse the oldest entry's memory
+		History.push_back(std::move(History.front()));
+		History.pop_front();
+		History.back().assign(changed.begin(), changed.end());
+	} else {
+		History.push_back(changed);
+	}
+}
+
+void FramePool::Revert(Bitmap& img) {
+	if (Switched != -1) {
+		Spare& s = Spares[Switched];
+		std::swap(img.Buf, s.Buf);
+		s.Version = SwitchedVersion;
+		Switched  = -1;
+	}
+}
+
+void FramePool::Reset() {
+	Switched = -1;
+	Spares.clear();
+	History.clear();
+	Stale.clear();
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// FramePool stops a frame that is updated in place, such as the capture buffer, or the masked
+// frame, from being copied whole whenever a consumer still holds its previous version.
+//
+// Writing to a Bitmap whose buffer is shared copies all of it first (see FrameBuf), which is
+// 33 MB at 4K, even if only a line of text changed. Instead, Acquire switches the Bitmap to a
+// spare buffer that no consumer holds any more, and returns the regions of that buffer which are
+// out of date: those that changed since it was last written. The caller brings them up to date
+// along with its own changes, and then reports what it changed with Commit, which the pool
+// remembers for the next switch.
+//
+// The buffer that was switched away from becomes a spare, and the pool holds on to it, so that it
+// can be reused as soon as its consumers are done. Only when every spare is still held does Acquire
+// fall back to the copy. Spares cost memory: up to MaxSpares frames.
+
+struct FramePoolStats {
+	uint64_t Versions  = 0; // Calls to Commit
+	uint64_t Switches  = 0; // Acquires that switched to a spare
+	uint64_t Copies    = 0; // Acquires that had to copy the whole frame, because every spare was held
+	uint64_t StaleRows = 0; // Rows of the regions that Acquire returned, as a measure of what switching cost
+};
+
+class FramePool {
+public:
+	int MaxSpares  = 3;  // Buffers kept besides the one in use
+	int MaxHistory = 64; // Versions whose changes are remembered. A spare older than that is rewritten whole.
+
+	// Make img writable without copying its buffer, if possible. img must already have the size of
+	// the next version. Returns the regions of img that are out of date, which the caller must
+	// rewrite, in addition to whatever changes in this version. Out of date regions that lie inside
+	// one of 'rewrite', the regions that the caller rewrites anyway, are left out.
+	const std::vector<Rect>& Acquire(Bitmap& img, const std::vector<Rect>& rewrite = {});
+
+	// The regions of img that changed in this version, compared to the one before
+	void Commit(const std::vector<Rect>& changed);
+
+	// Undo the Acquire, for when the caller can't produce this version after all. If Acquire switched
+	// img to a spare, img goes back to the buffer that it had, which still holds the previous version
+	// in full. Call it before writing anything into img, instead of Commit.
+	void Revert(Bitmap& img);
+
+	// Forget the spares and the history, for example when the frame changes size
+	void Reset();
+
+	FramePoolStats Stats() const { return Stat; }
+
+private:
+	struct Spare {
+		FrameBuf Buf;
+		uint64_t Version = 0; // Version of the frame that Buf holds
+	};
+
+	uint64_t                      Version = 0; // Version of the frame in the buffer that's in use
+	std::vector<Spare>            Spares;
+	std::deque<std::vector<Rect>> History; // Changes of the last History.size() versions, oldest first
+	std::vector<Rect>             Stale;
+	FramePoolStats                Stat;
+	int                           Switched        = -1; // Spare that the last Acquire switched img away from, until Commit or Revert
+	uint64_t                      SwitchedVersion = 0;  // Version of the buffer that img was switched to
+};
@@ -0,0 +1,479 @@
+#include "stdafx.h"
+#include "FramePreview.h"
+#include <math.h>
+
+// Rebuild the palette once colours that it was not built from make up more than 1/RebuildFraction
+// of the pixels observed since, but only after MinRebuildPixels, so that a few stray pixels don't.
+static const int      RebuildFraction  = 64;
+static const uint64_t MinRebuildPixels = 4096;
+
+// Run-length tokens are one byte: the op in the top two bits, and the count - 1 in the rest
+static const uint8_t RunLiteral = 0x00; // 'count' symbols follow
+static const uint8_t RunRepeat  = 0x40; // Repeat the previous symbol
+static const uint8_t RunAbove   = 0x80; // Copy the symbols from the row above
+static const int     MaxRun     = 64;
+
+// Expand a 5 or 6 bit channel to 8 bits, so that the maximum maps to 255
+static uint32_t Expand5(uint32_t v) {
+	return (v << 3) | (v >> 2);
+}
+
+static uint32_t Expand6(uint32_t v) {
+	return (v << 2) | (v >> 4);
+}
+
+static uint32_t RGB555ToBGRA(uint32_t c) {
+	return 0xff000000 | (Expand5((c >> 10) & 31) << 16) | (Expand5((c >> 5) & 31) << 8) | Expand5(c & 31);
+}
+
+static uint32_t RGB565ToBGRA(uint32_t c) {
+	return 0xff000000 | (Expand5((c >> 11) & 31) << 16) | (Expand6((c >> 5) & 63) << 8) | Expand5(c & 31);
+}
+
+static bool IsValidScale(int scale) {
+	return scale == 1 || scale == 2 || scale == 4 || scale == 8;
+}
+
+Rect PreviewRect(const Rect& r, int scale) {
+	return Rect(r.X1 / scale, r.Y1 / scale, (r.X2 + scale - 1) / scale, (r.Y2 + scale - 1) / scale);
+}
+
+// Append n symbols, w to a row, as run-length tokens. Runs continue from the end of one row onto
+// the next. A run of one is worth a token when it saves a literal of two bytes, or starts one.
+template <typename T>
+static void RunEncode(const T* px, int n, int w, std::vector<uint8_t>& out) {
+	// Worst case is one token per symbol
+	size_t start = out.size();
+	out.resize(start + (size_t) n * (sizeof(T) + 1));
+	uint8_t* o       = out.data() + start;
+	uint8_t* literal = nullptr; // Token of the literal run that is still growing
+	int      count   = 0;       // Symbols in that run
+	for (int i = 0; i < n;) {
+		int repeat = 0;
+		int above  = 0;
+		if (i > 0) {
+			while (i + repeat < n && repeat < MaxRun && px[i + repeat] == px[i - 1])
+				repeat++;
+		}
+		if (i >= w) {
+			while (i + above < n && above < MaxRun && px[i + above] == px[i + above - w])
+				above++;
+		}
+		int run = std::max(repeat, above);
+		if (run >= 2 || (run == 1 && (sizeof(T) > 1 || count == 0))) {
+			*o++  = (uint8_t)((repeat >= above ? RunRepeat : RunAbove) | (run - 1));
+			count = 0;
+			i += run;
+			continue;
+		}
+		if (count == 0 || count == MaxRun) {
+			literal = o++;
+			count   = 0;
+		}
+		memcpy(o, &px[i], sizeof(T));
+		o += sizeof(T);
+		*literal = (uint8_t)(RunLiteral | count);
+		count++;
+		i++;
+	}
+	out.resize(o - out.data());
+}
+
+// Decode exactly len bytes of RunEncode output into n symbols, w to a row
+template <typename T>
+static bool RunDecode(const uint8_t* p, size_t len, T* px, int n, int w) {
+	const uint8_t* end = p + len;
+	for (int i = 0; i < n;) {
+		if (p == end)
+			return false;
+		uint8_t op    = *p & 0xc0;
+		int     count = (*p & 0x3f) + 1;
+		p++;
+		if (i + count > n)
+			return false;
+		if (op == RunLiteral) {
+			if ((size_t)(end - p) < count * sizeof(T))
+				return false;
+			memcpy(px + i, p, count * sizeof(T));
+			p += count * sizeof(T);
+		} else if (op == RunRepeat && i > 0) {
+			for (int k = 0; k < count; k++)
+				px[i + k] = px[i - 1];
+		} else if (op == RunAbove && i >= w) {
+			for (int k = 0; k < count; k++)
+				px[i + k] = px[i + k - w];
+		} else {
+			return false;
+		}
+		i += count;
+	}
+	return p == end;
+}
+
+AdaptivePalette::AdaptivePalette() : Histogram(32768, 0), Cache(32768, -1), Known(32768, 0) {
+	memset(Colors, 0, sizeof(Colors));
+}
+
+void AdaptivePalette::Observe(const uint16_t* px, int n) {
+	for (int i = 0; i < n; i++) {
+		uint16_t c = px[i] & 0x7fff;
+		if (Histogram[c] != UINT32_MAX)
+			Histogram[c]++;
+		NewPixels += Known[c] ^ 1;
+	}
+	Observed += n;
+}
+
+bool AdaptivePalette::Update() {
+	if (Observed == 0 || (Size != 0 && (Observed < MinRebuildPixels || NewPixels * RebuildFraction <= Observed)))
+		return false;
+	Build();
+	return true;
+}
+
+// Median cut. Split the box with the largest product of pixel count and extent, along its longest
+// side, at the median pixel, until there are 256 boxes, or no box has more than one colour.
+void AdaptivePalette::Build() {
+	struct Box {
+		int      Begin = 0;
+		int      End   = 0;
+		uint64_t Count = 0;
+		int      Axis  = 0; // Shift of the longest channel
+		int      Range = 0; // Extent along it
+	};
+	std::vector<uint16_t> colors;
+	for (int c = 0; c < 32768; c++) {
+		if (Histogram[c] != 0)
+			colors.push_back((uint16_t) c);
+	}
+	auto measure = [&](Box& b) {
+		int lo[3] = {31, 31, 31};
+		int hi[3] = {0, 0, 0};
+		b.Count   = 0;
+		for (int i = b.Begin; i < b.End; i++) {
+			for (int k = 0; k < 3; k++) {
+				int v = (colors[i] >> (k * 5)) & 31;
+				lo[k] = std::min(lo[k], v);
+				hi[k] = std::max(hi[k], v);
+			}
+			b.Count += Histogram[colors[i]];
+		}
+		b.Axis  = 0;
+		b.Range = 0;
+		for (int k = 0; k < 3; k++) {
+			if (hi[k] - lo[k] > b.Range) {
+				b.Axis  = k * 5;
+				b.Range = hi[k] - lo[k];
+			}
+		}
+	};
+
+	std::vector<Box> boxes;
+	if (colors.size() != 0) {
+		Box all;
+		all.End = (int) colors.size();
+		measure(all);
+		boxes.push_back(all);
+	}
+	while (boxes.size() < 256) {
+		int      split = -1;
+		uint64_t best  = 0;
+		for (size_t i = 0; i < boxes.size(); i++) {
+			uint64_t score = boxes[i].Count * boxes[i].Range;
+			if (boxes[i].End - boxes[i].Begin > 1 && score > best) {
+				split = (int) i;
+				best  = score;
+			}
+		}
+		if (split < 0)
+			break;
+		Box& b    = boxes[split];
+		int  axis = b.Axis;
+		std::sort(colors.begin() + b.Begin, colors.begin() + b.End, [axis](uint16_t x, uint16_t y) { return ((x >> axis) & 31) < ((y >> axis) & 31); });
+		// The median pixel, but leave at least one colour on each side
+		uint64_t half = 0;
+		int      mid  = b.Begin + 1;
+		for (; mid < b.End - 1; mid++) {
+			half += Histogram[colors[mid - 1]];
+			if (half * 2 >= b.Count)
+				break;
+		}
+		Box upper;
+		upper.Begin = mid;
+		upper.End   = b.End;
+		b.End       = mid;
+		measure(b);
+		measure(upper);
+		boxes.push_back(upper);
+	}
+
+	// Every entry is the average colour of its box, weighted by pixel count
+	Size = (int) boxes.size();
+	for (int i = 0; i < Size; i++) {
+		uint64_t sum[3] = {0, 0, 0};
+		for (int j = boxes[i].Begin; j < boxes[i].End; j++) {
+			uint32_t bgra = RGB555ToBGRA(colors[j]);
+			for (int k = 0; k < 3; k++)
+				sum[k] += (uint64_t)((bgra >> (k * 8)) & 0xff) * Histogram[colors[j]];
+		}
+		uint64_t n = std::max(boxes[i].Count, (uint64_t) 1);
+		Colors[i]  = 0xff000000 | (uint32_t)((sum[2] + n / 2) / n) << 16 | (uint32_t)((sum[1] + n / 2) / n) << 8 | (uint32_t)((sum[0] + n / 2) / n);
+	}
+
+	// Halve the history, so that the palette follows what's on screen now
+	for (int c = 0; c < 32768; c++) {
+		Known[c] = Histogram[c] != 0;
+		Histogram[c] /= 2;
+	}
+	std::fill(Cache.begin(), Cache.end(), -1);
+	Observed  = 0;
+	NewPixels = 0;
+}
+
+// Nearest palette entry by squared distance, with green weighted the most, and blue the least
+uint8_t AdaptivePalette::Search(uint16_t c) {
+	uint32_t bgra = RGB555ToBGRA(c);
+	int      b    = bgra & 0xff;
+	int      g    = (bgra >> 8) & 0xff;
+	int      r    = (bgra >> 16) & 0xff;
+	int      best = 0;
+	int      dist = INT32_MAX;
+	for (int i = 0; i < Size; i++) {
+		int db = (int) (Colors[i] & 0xff) - b;
+		int dg = (int) ((Colors[i] >> 8) & 0xff) - g;
+		int dr = (int) ((Colors[i] >> 16) & 0xff) - r;
+		int d  = 2 * db * db + 4 * dg * dg + 3 * dr * dr;
+		if (d < dist) {
+			best = i;
+			dist = d;
+		}
+	}
+	Cache[c] = (int16_t) best;
+	return (uint8_t) best;
+}
+
+size_t PreviewEncoder::PendingTiles() const {
+	return std::count(Pending.begin(), Pending.end(), 1);
+}
+
+// Bring the pixels of Scaled that tile r of img covers up to date
+void PreviewEncoder::Downscale(const Bitmap& img, const Rect& r) {
+	Rect pr = PreviewRect(r, Scale);
+	if (Scale == 1) {
+		for (int y = r.Y1; y < r.Y2; y++)
+			memcpy(Scaled.Row(y) + r.X1 * 4, img.Row(y) + r.X1 * 4, r.Width() * 4);
+		return;
+	}
+	const auto& k = PixelKernels();
+	int         w = r.Width();
+	Sums.resize(w * 4);
+	for (int py = pr.Y1; py < pr.Y2; py++) {
+		int y1 = py * Scale;
+		int y2 = std::min(y1 + Scale, img.Height);
+		std::fill(Sums.begin(), Sums.end(), 0);
+		for (int y = y1; y < y2; y++)
+			k.AddRow16(Sums.data(), img.Row(y) + r.X1 * 4, w);
+		uint8_t* out = Scaled.Row(py) + pr.X1 * 4;
+		for (int px = pr.X1; px < pr.X2; px++, out += 4) {
+			int x1   = px * Scale - r.X1;
+			int x2   = std::min(x1 + Scale, w);
+			int area = (x2 - x1) * (y2 - y1);
+			for (int c = 0; c < 4; c++) {
+				int sum = 0;
+				for (int x = x1; x < x2; x++)
+					sum += Sums[x * 4 + c];
+				out[c] = (uint8_t)((sum + area / 2) / area);
+			}
+		}
+	}
+}
+
+size_t PreviewEncoder::Encode(const Bitmap& img, const std::vector<Rect>& dirty, std::vector<uint8_t>& out) {
+	if (!IsValidScale(Scale) || img.Width > 65535 || img.Height > 65535)
+		return 0;
+	bool          palette = Format == PreviewFormat::Palette8;
+	Pixel16Format packing = Format == PreviewFormat::RGB565 ? Pixel16Format::RGB565 : Pixel16Format::RGB555;
+	if (img.Width != Grid.Width || img.Height != Grid.Height || Format != LastFormat || Scale != LastScale) {
+		Grid.Reset(img.Width, img.Height);
+		LastFormat    = Format;
+		LastScale     = Scale;
+		Scaled.Width  = (img.Width + Scale - 1) / Scale;
+		Scaled.Height = (img.Height + Scale - 1) / Scale;
+		Scaled.Buf.resize((size_t) Scaled.Stride() * Scaled.Height);
+		Packed.resize((size_t) Scaled.Width * Scaled.Height);
+		Pending.assign(Grid.Count(), 0);
+		TileFlags.assign(Grid.Count(), 1);
+		NextTile = 0;
+		Palette  = AdaptivePalette();
+		memset(SentColors, 0, sizeof(SentColors));
+	} else {
+		TileFlags.assign(Grid.Count(), 0);
+		Grid.MarkRects(dirty, TileFlags.data());
+	}
+
+	// Downscale and dither what changed, and show it to the palette
+	for (int i = 0; i < Grid.Count(); i++) {
+		if (!TileFlags[i])
+			continue;
+		Rect r  = Grid.TileRect(i);
+		Rect pr = PreviewRect(r, Scale);
+		Downscale(img, r);
+		uint16_t* packed = Packed.data() + (size_t) pr.Y1 * Scaled.Width + pr.X1;
+		DitherRect(Scaled, pr, packing, packed, Scaled.Width);
+		if (palette) {
+			for (int y = 0; y < pr.Height(); y++)
+				Palette.Observe(packed + (size_t) y * Scaled.Width, pr.Width());
+		}
+		Pending[i] = 1;
+	}
+
+	size_t             start = out.size();
+	PreviewFrameHeader h;
+	h.Type      = PreviewMsgFrame;
+	h.Format    = (uint8_t) Format;
+	h.Scale     = (uint8_t) Scale;
+	h.Pad       = 0;
+	h.Width     = (uint16_t) img.Width;
+	h.Height    = (uint16_t) img.Height;
+	h.NumColors = 0;
+	h.NumTiles  = 0;
+	out.resize(start + sizeof(h));
+
+	if (palette) {
+		Palette.Update();
+		for (int i = 0; i < Palette.Size; i++) {
+			if (Palette.Colors[i] == SentColors[i])
+				continue;
+			uint32_t     c = Palette.Colors[i];
+			PreviewColor pc;
+			pc.Index = (uint8_t) i;
+			pc.B     = (uint8_t) c;
+			pc.G     = (uint8_t)(c >> 8);
+			pc.R     = (uint8_t)(c >> 16);
+			out.insert(out.end(), (const uint8_t*) &pc, (const uint8_t*) (&pc + 1));
+			SentColors[i] = c;
+			h.NumColors++;
+		}
+	}
+
+	int count = Grid.Count();
+	for (int n = 0; n < count; n++) {
+		int i = (NextTile + n) % count;
+		if (!Pending[i])
+			continue;
+		Rect            pr     = PreviewRect(Grid.TileRect(i), Scale);
+		int             w      = pr.Width();
+		int             npx    = w * pr.Height();
+		const uint16_t* packed = Packed.data() + (size_t) pr.Y1 * Scaled.Width + pr.X1;
+		TileBytes.clear();
+		if (palette) {
+			TileIndexes.resize(npx);
+			for (int y = 0; y < pr.Height(); y++) {
+				for (int x = 0; x < w; x++)
+					TileIndexes[y * w + x] = Palette.Nearest(packed[(size_t) y * Scaled.Width + x]);
+			}
+			RunEncode(TileIndexes.data(), npx, w, TileBytes);
+		} else {
+			TilePixels.resize(npx);
+			for (int y = 0; y < pr.Height(); y++)
+				memcpy(&TilePixels[y * w], packed + (size_t) y * Scaled.Width, w * 2);
+			RunEncode(TilePixels.data(), npx, w, TileBytes);
+		}
+		if (MaxBytes != 0 && h.NumTiles != 0 && out.size() - start + sizeof(PreviewTile) + TileBytes.size() > MaxBytes) {
+			// Out of budget. Start with this tile next time.
+			NextTile = i;
+			break;
+		}
+		PreviewTile t;
+		t.Tile   = (uint16_t) i;
+		t.Length = (uint16_t) TileBytes.size();
+		out.insert(out.end(), (const uint8_t*) &t, (const uint8_t*) (&t + 1));
+		out.insert(out.end(), TileBytes.begin(), TileBytes.end());
+		Pending[i] = 0;
+		h.NumTiles++;
+	}
+
+	if (h.NumTiles == 0 && h.NumColors == 0) {
+		out.resize(start);
+		return 0;
+	}
+	memcpy(&out[start], &h, sizeof(h));
+	return out.size() - start;
+}
+
+Error PreviewDecoder::Decode(const uint8_t* p, size_t n, size_t& used) {
+	PreviewFrameHeader h;
+	if (n < sizeof(h))
+		return "Truncated preview frame";
+	memcpy(&h, p, sizeof(h));
+	if (h.Type != PreviewMsgFrame || h.Format > (uint8_t) PreviewFormat::Palette8 || !IsValidScale(h.Scale))
+		return "Not a preview frame";
+	size_t at = sizeof(h);
+	if (n - at < h.NumColors * sizeof(PreviewColor))
+		return "Truncated preview palette";
+	for (int i = 0; i < h.NumColors; i++, at += sizeof(PreviewColor)) {
+		PreviewColor c;
+		memcpy(&c, p + at, sizeof(c));
+		Palette[c.Index] = 0xff000000 | (c.R << 16) | (c.G << 8) | c.B;
+	}
+
+	int scale  = h.Scale;
+	int width  = (h.Width + scale - 1) / scale;
+	int height = (h.Height + scale - 1) / scale;
+	if (Frame.Width != width || Frame.Height != height) {
+		Frame.Width  = width;
+		Frame.Height = height;
+		Frame.Buf.assign((size_t) Frame.Stride() * height, 0);
+	}
+
+	TileGrid grid(h.Width, h.Height);
+	uint16_t pixels[TileSize * TileSize];
+	uint8_t  indexes[TileSize * TileSize];
+	for (int i = 0; i < h.NumTiles; i++) {
+		PreviewTile t;
+		if (n - at < sizeof(t))
+			return "Truncated preview tile";
+		memcpy(&t, p + at, sizeof(t));
+		at += sizeof(t);
+		if (t.Tile >= grid.Count() || n - at < t.Length)
+			return "Invalid preview tile";
+		Rect pr  = PreviewRect(grid.TileRect(t.Tile), scale);
+		int  w   = pr.Width();
+		int  npx = w * pr.Height();
+		bool ok  = h.Format == (uint8_t) PreviewFormat::Palette8 ? RunDecode(p + at, t.Length, indexes, npx, w) : RunDecode(p + at, t.Length, pixels, npx, w);
+		if (!ok)
+			return tsf::fmt("Preview tile %v is corrupt", t.Tile);
+		at += t.Length;
+		for (int y = 0; y < pr.Height(); y++) {
+			uint32_t* row = (uint32_t*) Frame.Row(pr.Y1 + y) + pr.X1;
+			for (int x = 0; x < w; x++) {
+				int k = y * w + x;
+				switch ((PreviewFormat) h.Format) {
+				case PreviewFormat::RGB565: row[x] = RGB565ToBGRA(pixels[k]); break;
+				case PreviewFormat::RGB555: row[x] = RGB555ToBGRA(pixels[k]); break;
+				case PreviewFormat::Palette8: row[x] = Palette[indexes[k]]; break;
+				}
+			}
+		}
+	}
+	used = at;
+	return "";
+}
+
+double PSNR(const Bitmap& a, const Bitmap& b) {
+	uint64_t sse = 0;
+	for (int y = 0; y < a.Height; y++) {
+		const uint8_t* pa = a.Row(y);
+		const uint8_t* pb = b.Row(y);
+		for (int x = 0; x < a.Width * 4; x += 4) {
+			for (int c = 0; c < 3; c++) {
+				int d = pa[x + c] - pb[x + c];
+				sse += d * d;
+			}
+		}
+	}
+	if (sse == 0)
+		return 99;
+	double mse = (double) sse / (3.0 * a.Width * a.Height);
+	return 10 * log10(255.0 * 255.0 / mse);
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "Tiles.h"
+#include "PixelKernels.h"
+
+// FramePreview encodes a small, colour-reduced preview of the screen, for remote observers on a
+// slow link, where FrameStream's lossless tiles would be far too big.
+//
+// The frame is box filtered down by Scale, and quantized to RGB565, RGB555, or an adaptive 8-bit
+// palette, with ordered dithering. Like FrameStream, only the 64x64 tiles of the source frame that
+// changed are sent, and each becomes a (64/Scale)-pixel square tile of the preview. Quantized tiles
+// are run-length coded, with runs of the previous pixel and runs copied from the row above.
+//
+// The palette is built from a 15-bit colour histogram of the tiles that changed, with median cut.
+// It's rebuilt when enough colours that it has never seen turn up, and the entries that changed
+// are sent along with the next frame. Every preview pixel is dithered to RGB555 first, and a
+// 32K-entry cache maps that to the nearest palette entry, so the nearest colour search only runs
+// once per distinct colour between rebuilds.
+//
+// A preview frame can be given a byte budget, such as 12 KB for 10 frames per second over 1 Mbit.
+// Tiles that don't fit wait for the next frame, oldest first, and are sent with their newest content.
+//
+// Wire format (little endian). A frame is:
+//   PreviewFrameHeader
+//   NumColors x PreviewColor
+//   NumTiles x (PreviewTile, followed by Length bytes of run-length coded pixels)
+//
+// The decoder converts every tile to BGRA as it arrives, so a palette change only affects the
+// tiles that come after it.
+
+enum class PreviewFormat {
+	RGB565,
+	RGB555,
+	Palette8,
+};
+
+static const uint8_t PreviewMsgFrame = 1;
+
+struct PreviewFrameHeader {
+	uint8_t  Type;   // PreviewMsgFrame
+	uint8_t  Format; // PreviewFormat
+	uint8_t  Scale;
+	uint8_t  Pad;
+	uint16_t Width; // Size of the source frame. The preview is Width / Scale, rounded up.
+	uint16_t Height;
+	uint16_t NumColors;
+	uint16_t NumTiles;
+};
+
+struct PreviewColor {
+	uint8_t Index;
+	uint8_t B;
+	uint8_t G;
+	uint8_t R;
+};
+
+struct PreviewTile {
+	uint16_t Tile; // Index into the TileGrid of the source frame
+	uint16_t Length;
+};
+
+// 8-bit palette that adapts to the colours that it's shown
+class AdaptivePalette {
+public:
+	uint32_t Colors[256]; // BGRA, with alpha 255
+	int      Size = 0;
+
+	AdaptivePalette();
+
+	// Count n pixels, which are RGB555, into the histogram
+	void Observe(const uint16_t* px, int n);
+
+	// Rebuild the palette, if enough new colours have been observed since it was last built.
+	// Returns true if it was rebuilt.
+	bool Update();
+
+	// Index of the palette entry that is nearest to an RGB555 colour
+	uint8_t Nearest(uint16_t c) {
+		int16_t i = Cache[c];
+		return i >= 0 ? (uint8_t) i : Search(c);
+	}
+
+private:
+	std::vector<uint32_t> Histogram;     // Pixel count of every RGB555 colour
+	std::vector<int16_t>  Cache;         // Nearest entry of every RGB555 colour, or -1
+	std::vector<uint8_t>  Known;         // 1 for every colour that the palette was built from
+	uint64_t              Observed  = 0; // Pixels observed since the palette was built
+	uint64_t              NewPixels = 0; // Of those, pixels whose colour was not known
+
+	uint8_t Search(uint16_t c);
+	void    Build();
+};
+
+class PreviewEncoder {
+public:
+	PreviewFormat Format   = PreviewFormat::Palette8;
+	int           Scale    = 2; // 1, 2, 4 or 8
+	size_t        MaxBytes = 0; // Budget for one frame, or 0 for no limit. At least one tile is always sent.
+	Bitmap        Scaled;       // The downscaled frame, before quantization
+
+	// Append a preview of img to 'out'. 'dirty' describes the regions that changed since the
+	// previous call. Changing Format or Scale, or the size of img, sends every tile again.
+	// Returns the number of bytes appended, which is zero if there was nothing to send.
+	size_t Encode(const Bitmap& img, const std::vector<Rect>& dirty, std::vector<uint8_t>& out);
+
+	size_t PendingTiles() const; // Tiles that changed, but didn't fit into the budget yet
+
+private:
+	TileGrid              Grid;
+	PreviewFormat         LastFormat = PreviewFormat::Palette8;
+	int                   LastScale  = 0;
+	std::vector<uint8_t>  Pending;      // 1 for every tile that changed since it was last sent
+	int                   NextTile = 0; // Where the next frame starts looking for pending tiles
+	AdaptivePalette       Palette;
+	uint32_t              SentColors[256];
+	std::vector<uint16_t> Packed; // Scaled, dithered to 16 bits. RGB555 for Palette8.
+	std::vector<uint16_t> Sums;
+	std::vector<uint8_t>  TileFlags;
+	std::vector<uint16_t> TilePixels;
+	std::vector<uint8_t>  TileIndexes;
+	std::vector<uint8_t>  TileBytes;
+
+	void Downscale(const Bitmap& img, const Rect& r);
+};
+
+class PreviewDecoder {
+public:
+	Bitmap Frame; // The preview, at the size of the source frame divided by its Scale
+
+	// Decode one preview frame, and update Frame. Returns the number of bytes consumed in 'used'.
+	Error Decode(const uint8_t* p, size_t n, size_t& used);
+
+private:
+	uint32_t Palette[256] = {};
+};
+
+// The rectangle that tile r of the source frame covers in a preview at 'scale'
+Rect PreviewRect(const Rect& r, int scale);
+
+// Peak signal to noise ratio of the BGR channels of two images of the same size, in decibels.
+// Identical images are reported as 99 dB.
+double PSNR(const Bitmap& a, const Bitmap& b);
@@ -0,0 +1,384 @@
+#include "stdafx.h"
+#include "FrameShm.h"
+#include "FrameTrace.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+static const size_t SlotHeaderSize = (sizeof(FrameShmSlot) + 63) & ~(size_t) 63;
+static const size_t RingHeaderSize = (sizeof(FrameShmHeader) + 63) & ~(size_t) 63;
+
+static FrameShmSlot* SlotPtr(FrameShmHeader* header, uint64_t seq) {
+	size_t idx = (size_t)(seq % header->NumSlots);
+	return (FrameShmSlot*) ((uint8_t*) header + RingHeaderSize + idx * (size_t) header->SlotSize);
+}
+
+int64_t FrameShmNowMicros() {
+	return MonotonicMicros();
+}
+
+FrameShmMapping::~FrameShmMapping() {
+	Close();
+}
+
+FrameShmMapping& FrameShmMapping::operator=(FrameShmMapping&& b) {
+	if (this == &b)
+		return *this;
+	Close();
+	std::swap(Base, b.Base);
+	std::swap(MapSize, b.MapSize);
+	std::swap(Owner, b.Owner);
+	std::swap(Name, b.Name);
+#ifdef _WIN32
+	std::swap(Handle, b.Handle);
+#endif
+	return *this;
+}
+
+#ifdef _WIN32
+
+Error FrameShmMapping::Create(const std::string& name, size_t size) {
+	Close();
+	std::wstring wname = L"Local\\" + std::wstring(name.begin(), name.end());
+	Handle             = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t) size >> 32), (DWORD) size, wname.c_str());
+	if (!Handle)
+		return tsf::fmt("CreateFileMapping failed: %v", GetLastError());
+	if (GetLastError() == ERROR_ALREADY_EXISTS) {
+		// Another process still has a section of this name open, and it may be smaller than 'size'.
+		// Unlike a POSIX name, it can't be unlinked, so it must not be reused.
+		Close();
+		return tsf::fmt("Shared memory %v is still open in another process", name);
+	}
+	Base = (uint8_t*) MapViewOfFile(Handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!Base) {
+		auto err = tsf::fmt("MapViewOfFile failed: %v", GetLastError());
+		Close();
+		return err;
+	}
+	MapSize = size;
+	Owner   = true;
+	Name    = name;
+	return "";
+}
+
+Error FrameShmMapping::Open(const std::string& name) {
+	Close();
+	std::wstring wname = L"Local\\" + std::wstring(name.begin(), name.end());
+	Handle             = OpenFileMappingW(FILE_MAP_READ, FALSE, wname.c_str());
+	if (!Handle)
+		return tsf::fmt("OpenFileMapping failed: %v", GetLastError());
+	Base = (uint8_t*) MapViewOfFile(Handle, FILE_MAP_READ, 0, 0, 0);
+	if (!Base) {
+		auto err = tsf::fmt("MapViewOfFile failed: %v", GetLastError());
+		Close();
+		return err;
+	}
+	MEMORY_BASIC_INFORMATION info;
+	VirtualQuery(Base, &info, sizeof(info));
+	MapSize = info.RegionSize;
+	Name    = name;
+	return "";
+}
+
+void FrameShmMapping::Close() {
+	if (Base)
+		UnmapViewOfFile(Base);
+	if (Handle)
+		CloseHandle(Handle);
+	Base    = nullptr;
+	Handle  = nullptr;
+	MapSize = 0;
+	Owner   = false;
+	Name    = "";
+}
+
+#else
+
+Error FrameShmMapping::Create(const std::string& name, size_t size) {
+	Close();
+	std::string path = "/" + name;
+	// Remove any ring left behind by a previous writer that crashed
+	shm_unlink(path.c_str());
+	int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd == -1)
+		return tsf::fmt("shm_open(%v) failed: %v", path, strerror(errno));
+	if (ftruncate(fd, (off_t) size) != 0) {
+		auto err = tsf::fmt("ftruncate failed: %v", strerror(errno));
+		close(fd);
+		shm_unlink(path.c_str());
+		return err;
+	}
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(path.c_str());
+		return tsf::fmt("mmap failed: %v", strerror(errno));
+	}
+	Base    = (uint8_t*) p;
+	MapSize = size;
+	Owner   = true;
+	Name    = path;
+	return "";
+}
+
+Error FrameShmMapping::Open(const std::string& name) {
+	Close();
+	std::string path = "/" + name;
+	int         fd   = shm_open(path.c_str(), O_RDONLY, 0);
+	if (fd == -1)
+		return tsf::fmt("shm_open(%v) failed: %v", path, strerror(errno));
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return tsf::fmt("fstat failed: %v", strerror(errno));
+	}
+	void* p = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return tsf::fmt("mmap failed: %v", strerror(errno));
+	Base    = (uint8_t*) p;
+	MapSize = (size_t) st.st_size;
+	Name    = path;
+	return "";
+}
+
+void FrameShmMapping::Close() {
+	if (Base)
+		munmap(Base, MapSize);
+	if (Owner)
+		shm_unlink(Name.c_str());
+	Base    = nullptr;
+	MapSize = 0;
+	Owner   = false;
+	Name    = "";
+}
+
+#endif
+
+static std::string RingName(const std::string& name, uint32_t generation) {
+	return tsf::fmt("%v.%v", name, generation);
+}
+
+FrameShmWriter::~FrameShmWriter() {
+	Close();
+}
+
+Error FrameShmWriter::Create(const std::string& name, int numSlots, int maxWidth, int maxHeight) {
+	if (numSlots < 2)
+		return "FrameShm needs at least 2 slots";
+	size_t pixelBytes = ((size_t) maxWidth * maxHeight * 4 + 63) & ~(size_t) 63;
+	size_t slotSize   = SlotHeaderSize + pixelBytes;
+	if (slotSize > 0xffffffff)
+		return "FrameShm slot size is too large";
+
+	if (Directory == nullptr || name != Name) {
+		Close();
+		auto err = DirMap.Create(name, sizeof(FrameShmDirectory));
+		if (err != "")
+			return err;
+		Directory = (FrameShmDirectory*) DirMap.Data();
+		memset((void*) Directory, 0, sizeof(FrameShmDirectory));
+		Directory->Version = FrameShmVersion;
+		std::atomic_thread_fence(std::memory_order_release);
+		Directory->Magic = FrameShmDirMagic;
+		Name             = name;
+	}
+
+	// The new ring gets a name of its own, because readers may still have the old one mapped, and
+	// on Windows, a section lives for as long as anybody has it mapped. A name can still be taken
+	// by a ring of a previous writer process that some reader holds on to, so skip those.
+	FrameShmMapping map;
+	Error           err;
+	for (int attempt = 0; attempt < 8; attempt++) {
+		Generation++;
+		err = map.Create(RingName(name, Generation), RingHeaderSize + numSlots * slotSize);
+		if (err == "")
+			break;
+	}
+	if (err != "")
+		return err;
+
+	memset(map.Data(), 0, RingHeaderSize + numSlots * SlotHeaderSize);
+	auto header       = (FrameShmHeader*) map.Data();
+	header->NumSlots  = numSlots;
+	header->MaxWidth  = maxWidth;
+	header->MaxHeight = maxHeight;
+	header->SlotSize  = (uint32_t) slotSize;
+	header->Closed.store(0);
+	header->LatestSeq.store(0);
+	for (int i = 0; i < numSlots; i++) {
+		auto slot = (FrameShmSlot*) (map.Data() + RingHeaderSize + i * slotSize);
+		slot->Lock.store(0);
+	}
+	// Readers check the magic number, so it must be written last
+	header->Version = FrameShmVersion;
+	std::atomic_thread_fence(std::memory_order_release);
+	header->Magic = FrameShmMagic;
+
+	// Point new readers at the new ring, and only then tell the readers of the old ring to reopen
+	Directory->Generation.store(Generation, std::memory_order_release);
+	CloseRing();
+	Map    = std::move(map);
+	Header = header;
+	return "";
+}
+
+void FrameShmWriter::CloseRing() {
+	if (Header)
+		Header->Closed.store(1, std::memory_order_release);
+	Header = nullptr;
+	Map.Close();
+}
+
+void FrameShmWriter::Close() {
+	if (Directory)
+		Directory->Generation.store(0, std::memory_order_release);
+	CloseRing();
+	Directory = nullptr;
+	DirMap.Close();
+	Name = "";
+}
+
+bool FrameShmWriter::Fits(int width, int height) const {
+	return Header && width <= (int) Header->MaxWidth && height <= (int) Header->MaxHeight;
+}
+
+bool FrameShmWriter::Publish(const Bitmap& img, const std::vector<Rect>& dirty, int64_t timestampMicros) {
+	if (!Fits(img.Width, img.Height))
+		return false;
+
+	uint64_t      seq  = Header->LatestSeq.load(std::memory_order_relaxed) + 1;
+	FrameShmSlot* slot = SlotPtr(Header, seq);
+
+	uint32_t lock = slot->Lock.load(std::memory_order_relaxed);
+	slot->Lock.store(lock + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->Width           = img.Width;
+	slot->Height          = img.Height;
+	slot->Stride          = img.Stride();
+	slot->Seq             = seq;
+	slot->TimestampMicros = timestampMicros;
+	if (dirty.size() > FrameShmMaxDirty) {
+		Rect all;
+		for (const auto& r : dirty)
+			all = all.Union(r);
+		slot->NumDirty = 1;
+		slot->Dirty[0] = all;
+	} else {
+		slot->NumDirty = (uint32_t) dirty.size();
+		std::copy(dirty.begin(), dirty.end(), slot->Dirty);
+	}
+	memcpy((uint8_t*) slot + SlotHeaderSize, img.Buf.data(), (size_t) img.Stride() * img.Height);
+
+	slot->Lock.store(lock + 2, std::memory_order_release);
+	Header->LatestSeq.store(seq, std::memory_order_release);
+	return true;
+}
+
+Error FrameShmReader::Open(const std::string& name) {
+	Close();
+	FrameShmMapping dirMap;
+	auto            err = dirMap.Open(name);
+	if (err != "")
+		return err;
+	auto dir = (const FrameShmDirectory*) dirMap.Data();
+	if (dirMap.Size() < sizeof(FrameShmDirectory) || dir->Magic != FrameShmDirMagic)
+		return "FrameShm ring is not initialized";
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (dir->Version != FrameShmVersion)
+		return tsf::fmt("FrameShm version mismatch (ring is %v, we are %v)", dir->Version, FrameShmVersion);
+	uint32_t generation = dir->Generation.load(std::memory_order_acquire);
+	if (generation == 0)
+		return "FrameShm writer is closed";
+	dirMap.Close();
+
+	err = Map.Open(RingName(name, generation));
+	if (err != "")
+		return err;
+	auto header = (FrameShmHeader*) Map.Data();
+	if (Map.Size() < RingHeaderSize || header->Magic != FrameShmMagic) {
+		Map.Close();
+		return "FrameShm ring is not initialized";
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (header->Version != FrameShmVersion) {
+		Map.Close();
+		return tsf::fmt("FrameShm version mismatch (ring is %v, we are %v)", header->Version, FrameShmVersion);
+	}
+	if (Map.Size() < RingHeaderSize + (size_t) header->NumSlots * header->SlotSize) {
+		Map.Close();
+		return "FrameShm ring is truncated";
+	}
+	Header = header;
+	return "";
+}
+
+void FrameShmReader::Close() {
+	Header = nullptr;
+	Map.Close();
+}
+
+bool FrameShmReader::WriterClosed() const {
+	return !Header || Header->Closed.load(std::memory_order_acquire) != 0;
+}
+
+uint64_t FrameShmReader::LatestSeq() const {
+	if (!Header)
+		return 0;
+	return Header->LatestSeq.load(std::memory_order_acquire);
+}
+
+const FrameShmSlot* FrameShmReader::SlotAt(uint64_t seq) const {
+	return SlotPtr(Header, seq);
+}
+
+bool FrameShmReader::Begin(uint64_t seq, FrameShmView& view) const {
+	if (!Header || seq == 0)
+		return false;
+	const FrameShmSlot* slot = SlotAt(seq);
+	uint32_t            lock = slot->Lock.load(std::memory_order_acquire);
+	if (lock & 1)
+		return false;
+	if (slot->Seq != seq || slot->Width > Header->MaxWidth || slot->Height > Header->MaxHeight)
+		return false;
+	view.Slot    = slot;
+	view.Pixels  = (const uint8_t*) slot + SlotHeaderSize;
+	view.LockSeq = lock;
+	return true;
+}
+
+bool FrameShmReader::End(const FrameShmView& view) const {
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return view.Slot->Lock.load(std::memory_order_relaxed) == view.LockSeq;
+}
+
+uint64_t FrameShmReader::CopyLatest(Bitmap& img, std::vector<Rect>* dirty) const {
+	// If we keep losing the race, then the writer is lapping us, and there's no point in trying forever
+	for (int attempt = 0; attempt < 4; attempt++) {
+		uint64_t     seq = LatestSeq();
+		FrameShmView view;
+		if (!Begin(seq, view))
+			return 0;
+		int width  = view.Slot->Width;
+		int height = view.Slot->Height;
+		if (img.Width != width || img.Height != height) {
+			img.Width  = width;
+			img.Height = height;
+			img.Buf.resize((size_t) width * height * 4);
+		}
+		memcpy(img.Buf.data(), view.Pixels, (size_t) width * height * 4);
+		if (dirty) {
+			uint32_t n = std::min<uint32_t>(view.Slot->NumDirty, FrameShmMaxDirty);
+			dirty->assign(view.Slot->Dirty, view.Slot->Dirty + n);
+		}
+		if (End(view))
+			return seq;
+	}
+	return 0;
+}
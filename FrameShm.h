@@ -0,0 +1,148 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// FrameShm publishes captured frames into a named shared memory ring, so that other
+// processes can read them without copying them through a pipe or socket.
+//
+// The shared memory called 'name' is only a FrameShmDirectory, which holds the generation of the
+// current ring. The ring itself is called 'name.<generation>'. When the desktop grows, the writer
+// creates a bigger ring under the next generation, and marks the old one as closed. Readers of
+// the old ring see that, and Open the name again.
+//
+// Memory layout of a ring:
+//   FrameShmHeader
+//   NumSlots x [FrameShmSlot header, padded to 64 bytes][pixels, MaxWidth * MaxHeight * 4]
+//
+// Every slot is protected by a seqlock. The writer makes Lock odd before it touches the slot,
+// and even again when it's done. A reader samples Lock before and after it reads the slot,
+// and if the two values differ (or the first was odd), the frame was torn and must be discarded.
+// Because the writer cycles through the slots, a reader has NumSlots-1 frame intervals in which
+// to consume a frame in place, before the writer comes back around to overwrite it.
+
+static const uint32_t FrameShmMagic    = 0x4d485346; // 'FSHM'
+static const uint32_t FrameShmDirMagic = 0x44485346; // 'FSHD'
+static const uint32_t FrameShmVersion  = 2;
+static const int      FrameShmMaxDirty = 64;
+
+struct FrameShmDirectory {
+	uint32_t              Magic;
+	uint32_t              Version;
+	std::atomic<uint32_t> Generation; // Of the current ring. Zero when there is no writer.
+	uint32_t              Reserved;
+};
+
+struct FrameShmHeader {
+	uint32_t              Magic;
+	uint32_t              Version;
+	uint32_t              NumSlots;
+	uint32_t              MaxWidth;
+	uint32_t              MaxHeight;
+	uint32_t              SlotSize;  // Bytes per slot, including the slot header
+	std::atomic<uint32_t> Closed;    // Set by the writer when it goes away. Readers should reopen.
+	uint32_t              Reserved;
+	std::atomic<uint64_t> LatestSeq; // Sequence number of the most recently published frame. Zero until the first frame.
+};
+
+struct FrameShmSlot {
+	std::atomic<uint32_t> Lock;
+	uint32_t              Width;
+	uint32_t              Height;
+	uint32_t              Stride;
+	uint64_t              Seq;             // Frame sequence number. Consecutive frames have consecutive numbers.
+	int64_t               TimestampMicros; // When the OS presented the frame, on the clock of FrameShmNowMicros()
+	uint32_t              NumDirty;        // Dirty rects are relative to frame Seq-1
+	uint32_t              Reserved;
+	Rect                  Dirty[FrameShmMaxDirty];
+};
+
+// A frame that is being read in place out of shared memory
+struct FrameShmView {
+	const FrameShmSlot* Slot    = nullptr;
+	const uint8_t*      Pixels  = nullptr;
+	uint32_t            LockSeq = 0;
+};
+
+// Platform-specific ownership of the shared memory mapping
+class FrameShmMapping {
+public:
+	FrameShmMapping() = default;
+	FrameShmMapping(const FrameShmMapping&) = delete;
+	~FrameShmMapping();
+	FrameShmMapping& operator=(const FrameShmMapping&) = delete;
+	FrameShmMapping& operator=(FrameShmMapping&& b); // Takes over b's mapping
+
+	Error    Create(const std::string& name, size_t size);
+	Error    Open(const std::string& name);
+	void     Close();
+	uint8_t* Data() const { return Base; }
+	size_t   Size() const { return MapSize; }
+
+private:
+	uint8_t*    Base    = nullptr;
+	size_t      MapSize = 0;
+	bool        Owner   = false;
+	std::string Name;
+#ifdef _WIN32
+	HANDLE Handle = nullptr;
+#endif
+};
+
+// FrameShmWriter is the producer side. There must be only one writer per ring.
+class FrameShmWriter {
+public:
+	~FrameShmWriter();
+
+	Error Create(const std::string& name, int numSlots, int maxWidth, int maxHeight);
+	void  Close();
+	bool  IsOpen() const { return Header != nullptr; }
+	bool  Fits(int width, int height) const;
+
+	// Publish a frame. Returns false if the frame is larger than the ring's capacity.
+	bool Publish(const Bitmap& img, const std::vector<Rect>& dirty, int64_t timestampMicros);
+
+private:
+	FrameShmMapping    DirMap;
+	FrameShmDirectory* Directory = nullptr;
+	FrameShmMapping    Map;
+	FrameShmHeader*    Header     = nullptr;
+	uint32_t           Generation = 0;
+	std::string        Name;
+
+	void CloseRing();
+};
+
+// FrameShmReader is the consumer side. Any number of readers may attach to a ring.
+class FrameShmReader {
+public:
+	Error Open(const std::string& name);
+	void  Close();
+
+	// Returns true if the writer has gone away, or recreated the ring. The reader must Open() again,
+	// which fails until a writer is back.
+	bool WriterClosed() const;
+
+	// Sequence number of the most recently published frame, or zero if there is none yet
+	uint64_t LatestSeq() const;
+
+	// Begin reading the frame with the given sequence number in place.
+	// Returns false if that frame has not been published, or has already been overwritten.
+	bool Begin(uint64_t seq, FrameShmView& view) const;
+
+	// Returns true if the frame was not modified while we were reading it. Any data read
+	// from the view must be discarded if this returns false.
+	bool End(const FrameShmView& view) const;
+
+	// Copy the most recent frame into 'img'. Returns the sequence number of the frame, or zero if
+	// no frame was available, or if we could not get a consistent copy.
+	uint64_t CopyLatest(Bitmap& img, std::vector<Rect>* dirty = nullptr) const;
+
+private:
+	FrameShmMapping Map;
+	FrameShmHeader* Header = nullptr;
+
+	const FrameShmSlot* SlotAt(uint64_t seq) const;
+};
+
+// Monotonic time in microseconds, suitable for FrameShmSlot::TimestampMicros
+int64_t FrameShmNowMicros();
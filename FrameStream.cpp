@@ -0,0 +1,712 @@
+#include "stdafx.h"
+#include "FrameStream.h"
+#include "FrameBlit.h"
+#include "FrameTrace.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef WSABUF iovec_t;
+typedef int    socklen_t;
+#define closesocket_ closesocket
+#define poll_ WSAPoll
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+typedef struct iovec iovec_t;
+#define INVALID_SOCKET -1
+#define closesocket_ close
+#define poll_ poll
+#endif
+
+static_assert(sizeof(StreamFrameBegin) == 32, "StreamFrameBegin must be 32 bytes");
+static_assert(sizeof(StreamTile) == 12, "StreamTile must be 12 bytes");
+static_assert(sizeof(StreamFrameEnd) == 8, "StreamFrameEnd must be 8 bytes");
+static_assert(sizeof(StreamMove) == 28, "StreamMove must be 28 bytes");
+
+// Maximum number of buffers that we hand to a single gather write
+static const int MaxIovecs = 64;
+
+// Smallest changed area, in pixels, that DetectMotion looks for moves in
+static const int64_t MinMotionArea = 4 * TileSize * TileSize;
+
+static void InitSockets() {
+#ifdef _WIN32
+	static std::once_flag once;
+	std::call_once(once, [] {
+		WSADATA wsa;
+		WSAStartup(MAKEWORD(2, 2), &wsa);
+	});
+#endif
+}
+
+static int LastSocketError() {
+#ifdef _WIN32
+	return WSAGetLastError();
+#else
+	return errno;
+#endif
+}
+
+static bool WouldBlock(int err) {
+#ifdef _WIN32
+	return err == WSAEWOULDBLOCK;
+#else
+	return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+#endif
+}
+
+static void SetNonBlocking(StreamSocket s) {
+#ifdef _WIN32
+	u_long on = 1;
+	ioctlsocket(s, FIONBIO, &on);
+#else
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+static void SetNoDelay(StreamSocket s) {
+	int on = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*) &on, sizeof(on));
+}
+
+// Create a connected pair of sockets, which the capture thread uses to wake up the network thread
+static Error MakeWakePair(StreamSocket& recvSock, StreamSocket& sendSock) {
+#ifdef _WIN32
+	// Windows has no socketpair, so connect to ourselves over loopback
+	SOCKET lis = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (lis == INVALID_SOCKET)
+		return tsf::fmt("socket failed: %v", LastSocketError());
+	sockaddr_in addr     = {};
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port        = 0;
+	int addrLen          = sizeof(addr);
+	if (bind(lis, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(lis, 1) != 0 || getsockname(lis, (sockaddr*) &addr, &addrLen) != 0) {
+		closesocket(lis);
+		return tsf::fmt("wake socket setup failed: %v", LastSocketError());
+	}
+	SOCKET a = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (a == INVALID_SOCKET || connect(a, (sockaddr*) &addr, sizeof(addr)) != 0) {
+		if (a != INVALID_SOCKET)
+			closesocket(a);
+		closesocket(lis);
+		return tsf::fmt("wake socket connect failed: %v", LastSocketError());
+	}
+	SOCKET b = accept(lis, nullptr, nullptr);
+	closesocket(lis);
+	if (b == INVALID_SOCKET) {
+		closesocket(a);
+		return tsf::fmt("wake socket accept failed: %v", LastSocketError());
+	}
+	SetNoDelay(a);
+	recvSock = b;
+	sendSock = a;
+#else
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		return tsf::fmt("socketpair failed: %v", strerror(errno));
+	recvSock = fds[0];
+	sendSock = fds[1];
+#endif
+	SetNonBlocking(recvSock);
+	SetNonBlocking(sendSock);
+	return "";
+}
+
+// Send as many of the buffers as the socket will accept, without blocking.
+// Returns the number of bytes sent, 0 if the socket is full, or -1 on error.
+static int64_t GatherSend(StreamSocket s, iovec_t* iov, int n) {
+#ifdef _WIN32
+	DWORD sent = 0;
+	if (WSASend(s, iov, n, &sent, 0, nullptr, nullptr) != 0)
+		return WouldBlock(LastSocketError()) ? 0 : -1;
+	return sent;
+#else
+	msghdr msg     = {};
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = n;
+	ssize_t sent   = sendmsg(s, &msg, MSG_NOSIGNAL);
+	if (sent < 0)
+		return WouldBlock(errno) ? 0 : -1;
+	return sent;
+#endif
+}
+
+static void SetIovec(iovec_t& v, const uint8_t* p, size_t len) {
+#ifdef _WIN32
+	v.buf = (char*) p;
+	v.len = (ULONG) len;
+#else
+	v.iov_base = (void*) p;
+	v.iov_len  = len;
+#endif
+}
+
+// A piece of outgoing data. 'Owner' keeps the memory alive until it has been sent.
+struct FrameStreamServer::Segment {
+	Blob           Owner;
+	const uint8_t* P;
+	size_t         Len;
+};
+
+struct FrameStreamServer::Client {
+	StreamSocket          Sock;
+	uint64_t              SentSeq = 0;
+	std::vector<uint64_t> SentVersion; // TileVersion of each tile that we last sent
+	std::vector<Segment>  Out;
+	size_t                OutHead          = 0;
+	uint64_t              BatchFrameSeq    = 0; // FrameTiming::Seq of the frame in Out
+	int64_t               BatchStartMicros = 0; // When Out was built, for tracing
+};
+
+// A batch for one client, which is planned under Lock, and then compressed and queued outside of it
+struct FrameStreamServer::Batch {
+	Client*               C = nullptr;
+	StreamFrameBegin      Begin;
+	uint64_t              FrameSeq = 0; // FrameTiming::Seq of the frame
+	std::vector<int>      Tiles;
+	std::vector<uint64_t> Versions; // TileVersion of each tile, when the batch was planned
+	std::vector<Blob>     Payloads; // Compressed tiles. Null until EncodeTiles has compressed them.
+	std::vector<MoveOp>   Moves;
+};
+
+FrameStreamServer::FrameStreamServer() : StopFlag(false), ClientCount(0) {
+}
+
+FrameStreamServer::~FrameStreamServer() {
+	Close();
+}
+
+Error FrameStreamServer::Listen(int port, const std::string& bindAddress) {
+	Close();
+	InitSockets();
+
+	ListenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (ListenSock == INVALID_SOCKET)
+		return tsf::fmt("socket failed: %v", LastSocketError());
+	int on = 1;
+	setsockopt(ListenSock, SOL_SOCKET, SO_REUSEADDR, (const char*) &on, sizeof(on));
+
+	sockaddr_in addr = {};
+	addr.sin_family  = AF_INET;
+	addr.sin_port    = htons((uint16_t) port);
+	if (inet_pton(AF_INET, bindAddress.c_str(), &addr.sin_addr) != 1) {
+		closesocket_(ListenSock);
+		return tsf::fmt("Invalid bind address '%v'", bindAddress);
+	}
+	socklen_t addrLen = sizeof(addr);
+	if (bind(ListenSock, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(ListenSock, 16) != 0 || getsockname(ListenSock, (sockaddr*) &addr, &addrLen) != 0) {
+		auto err = tsf::fmt("Failed to listen on %v:%v: %v", bindAddress, port, LastSocketError());
+		closesocket_(ListenSock);
+		return err;
+	}
+	SetNonBlocking(ListenSock);
+	ListenPort = ntohs(addr.sin_port);
+
+	auto err = MakeWakePair(WakeRecv, WakeSend);
+	if (err != "") {
+		closesocket_(ListenSock);
+		return err;
+	}
+
+	IsOpen = true;
+	StopFlag.store(false);
+	ClientCount.store(0);
+	Thread = std::thread([this] { NetworkThread(); });
+	return "";
+}
+
+void FrameStreamServer::Close() {
+	if (!IsOpen)
+		return;
+	StopFlag.store(true);
+	uint8_t b = 0;
+	send(WakeSend, (const char*) &b, 1, 0);
+	Thread.join();
+	for (auto& c : Clients)
+		closesocket_(c->Sock);
+	Clients.clear();
+	closesocket_(ListenSock);
+	closesocket_(WakeRecv);
+	closesocket_(WakeSend);
+	ClientCount.store(0);
+	IsOpen = false;
+}
+
+void FrameStreamServer::Publish(const Bitmap& img, const std::vector<Rect>& dirty, int64_t timestampMicros, const std::vector<MoveOp>& moves) {
+	// Only Publish writes to Frame, so it may read it without holding Lock
+	const std::vector<Rect>*   redrawn = &dirty;
+	const std::vector<MoveOp>* moved   = &moves;
+	if (DetectMotion && moves.size() == 0 && Frame.Width == img.Width && Frame.Height == img.Height) {
+		int64_t area = 0;
+		for (const auto& r : dirty)
+			area += (int64_t) r.Width() * r.Height();
+		if (area >= MinMotionArea && Motion.Estimate(Frame, img, dirty)) {
+			redrawn = &Motion.Residual;
+			moved   = &Motion.Moves;
+		}
+	}
+	// Everything that changed: what was redrawn, and where the moved content landed
+	const std::vector<Rect>* changed = redrawn;
+	if (moved->size() != 0) {
+		ChangedRects = *redrawn;
+		for (const auto& m : *moved)
+			ChangedRects.push_back(m.Dst());
+		changed = &ChangedRects;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		uint64_t                    seq = Seq + 1;
+		Moves.clear();
+		if (Frame.Width != img.Width || Frame.Height != img.Height) {
+			Frame.Width  = img.Width;
+			Frame.Height = img.Height;
+			Frame.Buf.clear(); // All of it is rewritten, so don't copy it
+			Frame.Buf.resize((size_t) img.Stride() * img.Height);
+			BlitRects(Frame.Buf.data(), Frame.Stride(), img, {img.Bounds()});
+			Pool.Reset();
+			Pool.Commit({img.Bounds()});
+			Grid.Reset(img.Width, img.Height);
+			TileVersion.assign(Grid.Count(), seq);
+			TileCacheVersion.assign(Grid.Count(), 0);
+			TileCache.clear();
+			TileCache.resize(Grid.Count());
+		} else {
+			// The network thread may still be encoding tiles of the previous frame. Rather than
+			// copying all of it, switch to a buffer that it's done with. The regions that buffer
+			// missed are brought up to date, but they didn't change, so their tiles keep their versions.
+			const auto& stale = Pool.Acquire(Frame, *changed);
+			BlitRects(Frame.Buf.data(), Frame.Stride(), img, stale);
+			BlitRects(Frame.Buf.data(), Frame.Stride(), img, *changed);
+			Pool.Commit(*changed);
+			ChangedScratch.assign(Grid.Count(), 0);
+			Grid.MarkRects(*changed, ChangedScratch.data());
+			for (int i = 0; i < Grid.Count(); i++) {
+				if (ChangedScratch[i])
+					TileVersion[i] = seq;
+			}
+			if (moved->size() != 0) {
+				// A client that has the previous frame can skip the tiles that only changed because
+				// something moved into them, once it has replayed the moves. Anything redrawn was drawn
+				// after the moves, even inside a destination, such as the line that a scroll revealed,
+				// so those tiles must be sent.
+				MovedOnly.assign(Grid.Count(), 0);
+				ResidualScratch.assign(Grid.Count(), 0);
+				for (const auto& m : *moved)
+					Grid.MarkRect(m.Dst(), MovedOnly.data());
+				Grid.MarkRects(*redrawn, ResidualScratch.data());
+				for (int i = 0; i < Grid.Count(); i++)
+					MovedOnly[i] = MovedOnly[i] && !ResidualScratch[i];
+				Moves = *moved;
+			}
+		}
+		Seq          = seq;
+		Timestamp    = timestampMicros;
+		Frame.Timing = img.Timing;
+	}
+	if (ClientCount.load() != 0) {
+		uint8_t b = 0;
+		send(WakeSend, (const char*) &b, 1, 0);
+	}
+}
+
+// Work out which tiles the client hasn't seen yet, and take the ones that are already compressed
+// from TileCache. The rest are left for EncodeTiles. Caller must hold Lock.
+void FrameStreamServer::PlanBatch(Client& c) {
+	if (c.SentSeq == Seq || Grid.Count() == 0)
+		return;
+	if (c.SentVersion.size() != (size_t) Grid.Count())
+		c.SentVersion.assign(Grid.Count(), 0); // new client, or resolution change, so send a keyframe
+
+	Batch b;
+	bool  useMoves = Moves.size() != 0 && c.SentSeq + 1 == Seq;
+	if (useMoves)
+		b.Moves = Moves;
+	for (int i = 0; i < Grid.Count(); i++) {
+		if (TileVersion[i] == c.SentVersion[i])
+			continue;
+		if (useMoves && MovedOnly[i]) {
+			c.SentVersion[i] = TileVersion[i];
+			continue;
+		}
+		b.Tiles.push_back(i);
+		b.Versions.push_back(TileVersion[i]);
+		b.Payloads.push_back(TileCacheVersion[i] == TileVersion[i] ? TileCache[i] : nullptr);
+		c.SentVersion[i] = TileVersion[i];
+	}
+	c.SentSeq = Seq;
+	if (b.Tiles.size() == 0 && b.Moves.size() == 0)
+		return;
+
+	b.C                     = &c;
+	b.Begin                 = {};
+	b.Begin.Type            = StreamMsgFrameBegin;
+	b.Begin.Width           = Frame.Width;
+	b.Begin.Height          = Frame.Height;
+	b.Begin.NumTiles        = (uint32_t) b.Tiles.size();
+	b.Begin.Seq             = Seq;
+	b.Begin.TimestampMicros = Timestamp;
+	b.FrameSeq              = Frame.Timing.Seq;
+	Planned.push_back(std::move(b));
+}
+
+// Compress the tiles that the planned batches still lack, from 'frame', which is a snapshot of
+// Frame, taken when they were planned. Runs without holding Lock. Clients that lack the same
+// tile share one copy of it.
+void FrameStreamServer::EncodeTiles(const Bitmap& frame, const TileGrid& grid) {
+	Encoded.assign(grid.Count(), nullptr);
+	for (auto& b : Planned) {
+		for (size_t j = 0; j < b.Tiles.size(); j++) {
+			if (b.Payloads[j])
+				continue;
+			int tile = b.Tiles[j];
+			if (!Encoded[tile]) {
+				// Don't reuse the old buffer, because clients may still be sending it
+				Encoded[tile] = std::make_shared<std::vector<uint8_t>>();
+				TileEncode(frame, grid.TileRect(tile), *Encoded[tile]);
+			}
+			b.Payloads[j] = Encoded[tile];
+		}
+	}
+
+	// Keep them for the next client that needs them, unless the frame changed size meanwhile
+	std::lock_guard<std::mutex> lock(Lock);
+	if (Grid.Width != grid.Width || Grid.Height != grid.Height)
+		return;
+	for (const auto& b : Planned) {
+		for (size_t j = 0; j < b.Tiles.size(); j++) {
+			int tile = b.Tiles[j];
+			if (TileCacheVersion[tile] != b.Versions[j]) {
+				TileCache[tile]        = b.Payloads[j];
+				TileCacheVersion[tile] = b.Versions[j];
+			}
+		}
+	}
+}
+
+// Queue up a planned batch on its client
+void FrameStreamServer::QueueBatch(const Batch& b) {
+	Client& c = *b.C;
+
+	// All of the headers for the batch go into a single buffer. The tile payloads are not copied.
+	size_t headerBytes = sizeof(StreamFrameBegin) + b.Moves.size() * sizeof(StreamMove) + b.Tiles.size() * sizeof(StreamTile) + sizeof(StreamFrameEnd);
+	auto   headers     = std::make_shared<std::vector<uint8_t>>(headerBytes);
+	auto   h           = headers->data();
+	size_t pos         = 0;
+
+	memcpy(h + pos, &b.Begin, sizeof(b.Begin));
+	c.Out.push_back({headers, h + pos, sizeof(b.Begin)});
+	pos += sizeof(b.Begin);
+
+	if (b.Moves.size() != 0) {
+		size_t start = pos;
+		for (const auto& m : b.Moves) {
+			StreamMove sm = {};
+			sm.Type       = StreamMsgMove;
+			sm.SrcX1      = m.Src.X1;
+			sm.SrcY1      = m.Src.Y1;
+			sm.SrcX2      = m.Src.X2;
+			sm.SrcY2      = m.Src.Y2;
+			sm.DstX       = m.DstX;
+			sm.DstY       = m.DstY;
+			memcpy(h + pos, &sm, sizeof(sm));
+			pos += sizeof(sm);
+		}
+		c.Out.push_back({headers, h + start, pos - start});
+	}
+
+	for (size_t j = 0; j < b.Tiles.size(); j++) {
+		const Blob& payload = b.Payloads[j];
+		StreamTile  th      = {};
+		th.Type             = StreamMsgTile;
+		th.Tile             = b.Tiles[j];
+		th.Length           = (uint32_t) payload->size();
+		memcpy(h + pos, &th, sizeof(th));
+		c.Out.push_back({headers, h + pos, sizeof(th)});
+		c.Out.push_back({payload, payload->data(), payload->size()});
+		pos += sizeof(th);
+	}
+
+	StreamFrameEnd end = {};
+	end.Type           = StreamMsgFrameEnd;
+	memcpy(h + pos, &end, sizeof(end));
+	c.Out.push_back({headers, h + pos, sizeof(end)});
+	c.BatchFrameSeq    = b.FrameSeq;
+	c.BatchStartMicros = MonotonicMicros();
+}
+
+// Returns false if the client has disconnected
+bool FrameStreamServer::SendPending(Client& c) {
+	while (c.OutHead < c.Out.size()) {
+		iovec_t iov[MaxIovecs];
+		int     n = 0;
+		for (size_t i = c.OutHead; i < c.Out.size() && n < MaxIovecs; i++)
+			SetIovec(iov[n++], c.Out[i].P, c.Out[i].Len);
+		int64_t sent = GatherSend(c.Sock, iov, n);
+		if (sent < 0)
+			return false;
+		if (sent == 0)
+			return true; // socket buffer is full. Come back when it's writable.
+		while (sent > 0) {
+			Segment& s = c.Out[c.OutHead];
+			if ((size_t) sent >= s.Len) {
+				sent -= s.Len;
+				s.Owner.reset();
+				c.OutHead++;
+			} else {
+				s.P += sent;
+				s.Len -= sent;
+				sent = 0;
+			}
+		}
+	}
+	c.Out.clear();
+	c.OutHead = 0;
+	if (c.BatchStartMicros != 0) {
+		FrameTracer::Global().Record("stream-send", c.BatchFrameSeq, c.BatchStartMicros, MonotonicMicros());
+		c.BatchStartMicros = 0;
+	}
+	return true;
+}
+
+void FrameStreamServer::NetworkThread() {
+	std::vector<pollfd> fds;
+	while (!StopFlag.load()) {
+		// Give every idle client the latest changes. Only the planning happens under Lock. The
+		// snapshot shares Frame's pixels, so compressing a keyframe doesn't hold Publish up.
+		{
+			Planned.clear();
+			Bitmap   snapshot;
+			TileGrid grid;
+			{
+				std::lock_guard<std::mutex> lock(Lock);
+				for (auto& c : Clients) {
+					if (c->Out.size() == 0)
+						PlanBatch(*c);
+				}
+				if (Planned.size() != 0) {
+					snapshot = Frame;
+					grid     = Grid;
+				}
+			}
+			if (Planned.size() != 0) {
+				EncodeTiles(snapshot, grid);
+				for (const auto& b : Planned)
+					QueueBatch(b);
+				Planned.clear();
+			}
+		}
+		// Try to send immediately, which is usually enough to drain a batch without waiting for poll
+		for (size_t i = 0; i < Clients.size(); i++) {
+			if (!SendPending(*Clients[i])) {
+				closesocket_(Clients[i]->Sock);
+				Clients.erase(Clients.begin() + i);
+				ClientCount.store((int) Clients.size());
+				i--;
+			}
+		}
+
+		fds.clear();
+		fds.push_back({ListenSock, POLLIN, 0});
+		fds.push_back({WakeRecv, POLLIN, 0});
+		for (auto& c : Clients)
+			fds.push_back({c->Sock, (short) (POLLIN | (c->Out.size() != 0 ? POLLOUT : 0)), 0});
+
+		if (poll_(fds.data(), (unsigned) fds.size(), -1) < 0)
+			continue;
+
+		if (fds[1].revents & POLLIN) {
+			uint8_t buf[256];
+			while (recv(WakeRecv, (char*) buf, sizeof(buf), 0) > 0) {
+			}
+		}
+
+		// Clients don't send us anything, so readable means disconnected (or misbehaving)
+		for (size_t i = Clients.size(); i-- > 0;) {
+			short ev   = fds[i + 2].revents;
+			bool  dead = (ev & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+			if (!dead && (ev & POLLIN)) {
+				uint8_t buf[256];
+				int     r = (int) recv(Clients[i]->Sock, (char*) buf, sizeof(buf), 0);
+				dead      = r == 0 || (r < 0 && !WouldBlock(LastSocketError()));
+			}
+			if (dead) {
+				closesocket_(Clients[i]->Sock);
+				Clients.erase(Clients.begin() + i);
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			while (true) {
+				StreamSocket s = accept(ListenSock, nullptr, nullptr);
+				if (s == INVALID_SOCKET)
+					break;
+				SetNonBlocking(s);
+				SetNoDelay(s);
+				auto c  = std::unique_ptr<Client>(new Client());
+				c->Sock = s;
+				Clients.push_back(std::move(c));
+			}
+		}
+		ClientCount.store((int) Clients.size());
+	}
+}
+
+FrameStreamClient::~FrameStreamClient() {
+	Close();
+}
+
+Error FrameStreamClient::Connect(const std::string& host, int port) {
+	Close();
+	InitSockets();
+
+	addrinfo hints    = {};
+	hints.ai_family   = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* res     = nullptr;
+	if (getaddrinfo(host.c_str(), tsf::fmt("%v", port).c_str(), &hints, &res) != 0 || !res)
+		return tsf::fmt("Failed to resolve %v", host);
+
+	Sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (Sock == INVALID_SOCKET) {
+		freeaddrinfo(res);
+		return tsf::fmt("socket failed: %v", LastSocketError());
+	}
+	int r = connect(Sock, res->ai_addr, (socklen_t) res->ai_addrlen);
+	freeaddrinfo(res);
+	if (r != 0) {
+		auto err = tsf::fmt("Failed to connect to %v:%v: %v", host, port, LastSocketError());
+		closesocket_(Sock);
+		return err;
+	}
+	SetNonBlocking(Sock);
+	SetNoDelay(Sock);
+	Connected = true;
+	In.clear();
+	return "";
+}
+
+void FrameStreamClient::Close() {
+	if (Connected)
+		closesocket_(Sock);
+	Connected = false;
+}
+
+int FrameStreamClient::Poll(int timeoutMs) {
+	if (!Connected)
+		return -1;
+
+	pollfd pfd = {Sock, POLLIN, 0};
+	if (poll_(&pfd, 1, timeoutMs) <= 0)
+		return 0;
+
+	// Drain everything that is available
+	while (true) {
+		size_t at = In.size();
+		In.resize(at + 256 * 1024);
+		int r = (int) recv(Sock, (char*) In.data() + at, 256 * 1024, 0);
+		if (r > 0) {
+			In.resize(at + r);
+			BytesReceived += r;
+			continue;
+		}
+		In.resize(at);
+		if (r == 0 || !WouldBlock(LastSocketError())) {
+			Close();
+			return -1;
+		}
+		break;
+	}
+	return ParseMessages();
+}
+
+void FrameStreamClient::ApplyPendingMoves() {
+	if (PendingMoves.size() != 0) {
+		ApplyMoves(Frame, PendingMoves);
+		PendingMoves.clear();
+	}
+}
+
+bool FrameStreamClient::ProcessTile(const StreamTile& t, const uint8_t* payload) {
+	if (t.Tile >= (uint32_t) Grid.Count())
+		return false;
+	return TileDecode(payload, t.Length, Frame, Grid.TileRect(t.Tile));
+}
+
+int FrameStreamClient::ParseMessages() {
+	int    frames = 0;
+	size_t pos    = 0;
+	while (pos < In.size()) {
+		size_t avail = In.size() - pos;
+		switch (In[pos]) {
+		case StreamMsgFrameBegin: {
+			StreamFrameBegin m;
+			if (avail < sizeof(m))
+				goto more;
+			memcpy(&m, &In[pos], sizeof(m));
+			if (Frame.Width != (int) m.Width || Frame.Height != (int) m.Height) {
+				Frame.Width  = m.Width;
+				Frame.Height = m.Height;
+				Frame.Buf.resize((size_t) m.Width * m.Height * 4);
+				Grid.Reset(m.Width, m.Height);
+			}
+			PendingSeq       = m.Seq;
+			PendingTimestamp = m.TimestampMicros;
+			PendingMoves.clear();
+			pos += sizeof(m);
+			break;
+		}
+		case StreamMsgMove: {
+			StreamMove m;
+			if (avail < sizeof(m))
+				goto more;
+			memcpy(&m, &In[pos], sizeof(m));
+			PendingMoves.emplace_back(Rect(m.SrcX1, m.SrcY1, m.SrcX2, m.SrcY2), m.DstX, m.DstY);
+			pos += sizeof(m);
+			break;
+		}
+		case StreamMsgTile: {
+			StreamTile m;
+			if (avail < sizeof(m))
+				goto more;
+			memcpy(&m, &In[pos], sizeof(m));
+			if (avail < sizeof(m) + m.Length)
+				goto more;
+			ApplyPendingMoves();
+			if (!ProcessTile(m, &In[pos + sizeof(m)])) {
+				Close();
+				return -1;
+			}
+			pos += sizeof(m) + m.Length;
+			break;
+		}
+		case StreamMsgFrameEnd: {
+			if (avail < sizeof(StreamFrameEnd))
+				goto more;
+			ApplyPendingMoves();
+			FrameSeq             = PendingSeq;
+			FrameTimestampMicros = PendingTimestamp;
+			frames++;
+			pos += sizeof(StreamFrameEnd);
+			break;
+		}
+		default:
+			Close();
+			return -1;
+		}
+	}
+more:
+	In.erase(In.begin(), In.begin() + pos);
+	return frames;
+}
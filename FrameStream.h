@@ -0,0 +1,169 @@
+#pragma once
+
+#include "Tiles.h"
+#include "FramePool.h"
+#include "MotionDetect.h"
+
+// FrameStream sends captured frames over TCP, to viewers on this machine or the local network.
+// There is no authentication or encryption, so anybody who can connect sees the screen. That is
+// why the server only listens on loopback, unless it is given another address to bind to.
+//
+// A new client first receives every tile of the current frame (a keyframe). After that,
+// it only receives the tiles that changed since the last batch it was sent. Each client
+// has at most one batch in flight. While a slow client is still draining a batch, changes
+// accumulate as per-tile version numbers, so when it's ready for more, it gets the newest
+// content of every tile that changed, instead of a backlog of stale intermediate frames.
+//
+// A client that has the previous frame is sent its moves, such as a scroll, as copies that it
+// replays, and only then the tiles that the moves don't explain. Clients that are further behind
+// get whole tiles, as usual.
+//
+// Wire format (little endian). A batch is:
+//   StreamFrameBegin
+//   Any number of StreamMove, which must be applied together, as if simultaneously
+//   NumTiles x (StreamTile, followed by Length bytes of TileEncode output)
+//   StreamFrameEnd
+
+enum StreamMsgTypes {
+	StreamMsgFrameBegin = 1,
+	StreamMsgTile       = 2,
+	StreamMsgFrameEnd   = 3,
+	StreamMsgMove       = 4,
+};
+
+struct StreamFrameBegin {
+	uint8_t  Type;
+	uint8_t  Pad[3];
+	uint32_t Width;
+	uint32_t Height;
+	uint32_t NumTiles;
+	uint64_t Seq;
+	int64_t  TimestampMicros;
+};
+
+struct StreamTile {
+	uint8_t  Type;
+	uint8_t  Pad[3];
+	uint32_t Tile; // Index into the TileGrid of the frame
+	uint32_t Length;
+};
+
+// A region of the previous frame that reappears at (DstX, DstY). See MoveOp.
+struct StreamMove {
+	uint8_t Type;
+	uint8_t Pad[3];
+	int32_t SrcX1;
+	int32_t SrcY1;
+	int32_t SrcX2;
+	int32_t SrcY2;
+	int32_t DstX;
+	int32_t DstY;
+};
+
+struct StreamFrameEnd {
+	uint8_t  Type;
+	uint8_t  Pad[3];
+	uint32_t Reserved;
+};
+
+#ifdef _WIN32
+typedef uintptr_t StreamSocket;
+#else
+typedef int StreamSocket;
+#endif
+
+class FrameStreamServer {
+public:
+	// Look for scrolls and moves that Publish wasn't told about, with a MotionEstimator, in frames
+	// where a large area changed. That costs Publish about 3 ms per megapixel that changed.
+	bool DetectMotion = false;
+
+	FrameStreamServer();
+	~FrameStreamServer();
+
+	// Start listening, and start the network thread. Pass port = 0 to have the OS choose a port.
+	// Pass bindAddress = "0.0.0.0" to accept viewers from other machines.
+	Error Listen(int port, const std::string& bindAddress = "127.0.0.1");
+	void  Close();
+	int   Port() const { return ListenPort; }
+	int   NumClients() const { return ClientCount.load(); }
+
+	// Make a new frame available to clients. 'dirty' describes the regions that changed since
+	// the previous call. This is cheap: only the dirty regions are copied, and tiles are
+	// compressed lazily, at most once per change, by the network thread, which doesn't hold the
+	// lock that Publish takes while it compresses. 'moves' is the content that moved since the previous
+	// call, like WinDesktopDup::Moves. 'dirty' is then only what was redrawn after the moves were
+	// applied, like WinDesktopDup::RedrawnRects, and need not include their destinations.
+	void Publish(const Bitmap& img, const std::vector<Rect>& dirty, int64_t timestampMicros, const std::vector<MoveOp>& moves = {});
+
+private:
+	struct Segment;
+	struct Client;
+	struct Batch;
+	typedef std::shared_ptr<std::vector<uint8_t>> Blob;
+
+	std::mutex            Lock; // Guards everything from here down to TileCache
+	Bitmap                Frame;
+	FramePool             Pool; // Buffers for Frame, so that the network thread can compress a snapshot of it
+	TileGrid              Grid;
+	uint64_t              Seq       = 0;
+	int64_t               Timestamp = 0;
+	std::vector<uint64_t> TileVersion;      // Seq at which each tile last changed
+	std::vector<uint64_t> TileCacheVersion; // TileVersion at the time TileCache was encoded
+	std::vector<Blob>     TileCache;        // Compressed tiles, shared by all clients
+	std::vector<MoveOp>   Moves;            // Moves of frame Seq, from frame Seq - 1
+	std::vector<uint8_t>  MovedOnly;        // Tiles that only changed in frame Seq because of Moves
+
+	std::vector<std::unique_ptr<Client>> Clients; // Only touched by the network thread
+	std::vector<Batch>                   Planned; // Batches that PlanBatch made for idle clients
+	std::vector<Blob>                    Encoded; // Tiles that EncodeTiles compressed, for sharing between clients
+	std::vector<uint8_t>                 ChangedScratch;
+	std::vector<uint8_t>                 ResidualScratch;
+	MotionEstimator                      Motion;       // Only used by Publish
+	std::vector<Rect>                    ChangedRects; // Only used by Publish: what was redrawn, plus move destinations
+	StreamSocket                         ListenSock = 0;
+	StreamSocket                         WakeRecv   = 0;
+	StreamSocket                         WakeSend   = 0;
+	int                                  ListenPort = 0;
+	bool                                 IsOpen     = false;
+	std::atomic<bool>                    StopFlag;
+	std::atomic<int>                     ClientCount;
+	std::thread                          Thread;
+
+	void NetworkThread();
+	void PlanBatch(Client& c);
+	void EncodeTiles(const Bitmap& frame, const TileGrid& grid);
+	void QueueBatch(const Batch& b);
+	bool SendPending(Client& c);
+};
+
+// FrameStreamClient receives frames from a FrameStreamServer, and reassembles them.
+class FrameStreamClient {
+public:
+	Bitmap   Frame;                    // The most recent frame. Only consistent after Poll() reports a completed frame.
+	uint64_t FrameSeq             = 0; // Sequence number of the most recent completed frame
+	int64_t  FrameTimestampMicros = 0; // Capture timestamp of the most recent completed frame
+	uint64_t BytesReceived        = 0;
+
+	~FrameStreamClient();
+
+	Error Connect(const std::string& host, int port);
+	void  Close();
+
+	// Wait up to timeoutMs for data, and process everything that has arrived.
+	// Returns the number of frames that were completed, or -1 if the connection was lost.
+	int Poll(int timeoutMs);
+
+private:
+	StreamSocket         Sock      = 0;
+	bool                 Connected = false;
+	std::vector<uint8_t> In;
+	TileGrid             Grid;
+	uint64_t             PendingSeq       = 0;
+	int64_t              PendingTimestamp = 0;
+	std::vector<MoveOp>  PendingMoves; // Moves of the frame that is arriving, until its first tile
+
+	int  ParseMessages();
+	void ApplyPendingMoves();
+	bool ProcessTile(const StreamTile& t, const uint8_t* payload);
+};
@@ -0,0 +1,140 @@
+#include "stdafx.h"
+#include "FrameTrace.h"
+
+#ifdef _WIN32
+
+static int64_t QpcFrequency() {
+	static const int64_t freq = []() {
+		LARGE_INTEGER f;
+		QueryPerformanceFrequency(&f);
+		return (int64_t) f.QuadPart;
+	}();
+	return freq;
+}
+
+int64_t QpcToMicros(int64_t qpc) {
+	// Split the conversion, so that the multiplication can't overflow
+	int64_t freq = QpcFrequency();
+	return (qpc / freq) * 1000000 + (qpc % freq) * 1000000 / freq;
+}
+
+int64_t MonotonicMicros() {
+	LARGE_INTEGER c;
+	QueryPerformanceCounter(&c);
+	return QpcToMicros(c.QuadPart);
+}
+
+#else
+
+int64_t MonotonicMicros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
+
+static uint32_t TraceThreadId() {
+	static std::atomic<uint32_t> next(0);
+	thread_local uint32_t        id = ++next;
+	return id;
+}
+
+FrameTracer::FrameTracer(size_t capacity) : Slots(new Slot[capacity]), Capacity(capacity), Head(0), Enabled(false) {
+	for (size_t i = 0; i < capacity; i++)
+		Slots[i].Version.store(0, std::memory_order_relaxed);
+}
+
+FrameTracer& FrameTracer::Global() {
+	static FrameTracer global;
+	return global;
+}
+
+void FrameTracer::Record(const char* name, uint64_t frameSeq, int64_t startMicros, int64_t endMicros) {
+	if (!IsEnabled())
+		return;
+	uint64_t idx  = Head.fetch_add(1, std::memory_order_relaxed);
+	Slot&    slot = Slots[idx % Capacity];
+	// Writers that are a whole lap apart land on the same slot. Only one of them may write it at
+	// a time, or both could commit an event that mixes the two. If another writer has the slot,
+	// or a later one has already been through it, this event would be overwritten anyway, so drop it.
+	uint64_t version = slot.Version.load(std::memory_order_relaxed);
+	do {
+		if ((version & 1) != 0 || version > idx * 2)
+			return;
+	} while (!slot.Version.compare_exchange_weak(version, idx * 2 + 1, std::memory_order_acquire, std::memory_order_relaxed));
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.Name.store(name, std::memory_order_relaxed);
+	slot.FrameSeq.store(frameSeq, std::memory_order_relaxed);
+	slot.StartMicros.store(startMicros, std::memory_order_relaxed);
+	slot.EndMicros.store(endMicros, std::memory_order_relaxed);
+	slot.ThreadId.store(TraceThreadId(), std::memory_order_relaxed);
+	slot.Version.store(idx * 2 + 2, std::memory_order_release);
+}
+
+void FrameTracer::Snapshot(std::vector<TraceEvent>& events) const {
+	events.clear();
+	for (size_t i = 0; i < Capacity; i++) {
+		const Slot& slot = Slots[i];
+		uint64_t    v1   = slot.Version.load(std::memory_order_acquire);
+		if (v1 == 0 || (v1 & 1) != 0)
+			continue;
+		TraceEvent e;
+		e.Name        = slot.Name.load(std::memory_order_relaxed);
+		e.FrameSeq    = slot.FrameSeq.load(std::memory_order_relaxed);
+		e.StartMicros = slot.StartMicros.load(std::memory_order_relaxed);
+		e.EndMicros   = slot.EndMicros.load(std::memory_order_relaxed);
+		e.ThreadId    = slot.ThreadId.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		// If the slot was overwritten while we copied it, then the event is gone anyway
+		if (slot.Version.load(std::memory_order_relaxed) == v1)
+			events.push_back(e);
+	}
+	std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) { return a.StartMicros < b.StartMicros; });
+}
+
+Error FrameTracer::WriteChromeTrace(const std::string& filename) const {
+	std::vector<TraceEvent> events;
+	Snapshot(events);
+
+	// Events grouped by frame, so that we know where each flow starts and ends
+	std::vector<std::pair<uint64_t, size_t>> byFrame;
+	for (size_t i = 0; i < events.size(); i++) {
+		if (events[i].FrameSeq != 0)
+			byFrame.push_back({events[i].FrameSeq, i});
+	}
+	std::stable_sort(byFrame.begin(), byFrame.end(), [](const std::pair<uint64_t, size_t>& a, const std::pair<uint64_t, size_t>& b) { return a.first < b.first; });
+
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (!f)
+		return tsf::fmt("Failed to open %v for writing", filename);
+
+	fputs("{\"traceEvents\":[\n", f);
+	bool first = true;
+	for (size_t i = 0; i < events.size(); i++) {
+		const auto& e = events[i];
+		fputs(tsf::fmt("%v{\"name\":\"%v\",\"cat\":\"frame\",\"ph\":\"X\",\"ts\":%v,\"dur\":%v,\"pid\":1,\"tid\":%v,\"args\":{\"frame\":%v}}",
+		               first ? "" : ",\n", e.Name, e.StartMicros, e.EndMicros - e.StartMicros, e.ThreadId, e.FrameSeq)
+		          .c_str(),
+		      f);
+		first = false;
+		if (e.FrameSeq == 0)
+			continue;
+
+		// Flow arrows: 's' on the first event of the frame, 't' in the middle, and 'f' on the last
+		auto range = std::equal_range(byFrame.begin(), byFrame.end(), std::make_pair(e.FrameSeq, (size_t) 0), [](const std::pair<uint64_t, size_t>& a, const std::pair<uint64_t, size_t>& b) { return a.first < b.first; });
+		if (range.second - range.first < 2)
+			continue;
+		const char* ph = "t";
+		if (range.first->second == i)
+			ph = "s";
+		else if ((range.second - 1)->second == i)
+			ph = "f";
+		fputs(tsf::fmt(",\n{\"name\":\"frame\",\"cat\":\"frame\",\"ph\":\"%v\",\"bp\":\"e\",\"id\":%v,\"ts\":%v,\"pid\":1,\"tid\":%v}",
+		               ph, e.FrameSeq, e.StartMicros, e.ThreadId)
+		          .c_str(),
+		      f);
+	}
+	fputs("\n]}\n", f);
+	if (fclose(f) != 0)
+		return tsf::fmt("Failed to write %v", filename);
+	return "";
+}
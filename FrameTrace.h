@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// Monotonic clock, in microseconds, shared by every timestamp in the pipeline. On Windows this is
+// QueryPerformanceCounter, which is the clock of DXGI_OUTDUPL_FRAME_INFO::LastPresentTime, and
+// which is the same in every process, so timestamps can be compared across the shared memory ring.
+int64_t MonotonicMicros();
+
+#ifdef _WIN32
+int64_t QpcToMicros(int64_t qpc);
+#endif
+
+// A span of time that one stage of the pipeline spent on one frame
+struct TraceEvent {
+	const char* Name        = nullptr; // Must outlive the tracer, so in practice a string literal
+	uint64_t    FrameSeq    = 0;       // FrameTiming::Seq, or 0 if the event isn't about a frame
+	int64_t     StartMicros = 0;
+	int64_t     EndMicros   = 0;
+	uint32_t    ThreadId    = 0;
+};
+
+// FrameTracer records TraceEvents into a fixed size ring, overwriting the oldest events once
+// it's full. Recording is lock-free, so any thread may record at any time, and it's cheap
+// enough to leave on: one atomic increment, and a seqlock around the copy into the ring. When
+// writers are so far behind that the ring laps them, the event that loses the race for its slot is dropped.
+// The result can be exported as Chrome trace JSON, which chrome://tracing and Perfetto open.
+// Events that carry the same frame sequence number are connected by flow arrows, so you can
+// follow a frame through the pipeline.
+class FrameTracer {
+public:
+	static const size_t DefaultCapacity = 64 * 1024;
+
+	explicit FrameTracer(size_t capacity = DefaultCapacity);
+
+	static FrameTracer& Global();
+
+	void Enable(bool enable) { Enabled.store(enable, std::memory_order_relaxed); }
+	bool IsEnabled() const { return Enabled.load(std::memory_order_relaxed); }
+
+	void Record(const char* name, uint64_t frameSeq, int64_t startMicros, int64_t endMicros);
+
+	// Copy out the events that are currently in the ring, ordered by start time
+	void  Snapshot(std::vector<TraceEvent>& events) const;
+	Error WriteChromeTrace(const std::string& filename) const;
+
+private:
+	// The event's fields are relaxed atomics, which cost no more than plain loads and stores, so
+	// that Snapshot may copy them while a writer overwrites them. Version tells it if that happened.
+	struct Slot {
+		std::atomic<uint64_t>    Version; // 0 = empty, odd = being written, otherwise 2 * (index + 1)
+		std::atomic<const char*> Name;
+		std::atomic<uint64_t>    FrameSeq;
+		std::atomic<int64_t>     StartMicros;
+		std::atomic<int64_t>     EndMicros;
+		std::atomic<uint32_t>    ThreadId;
+	};
+
+	std::unique_ptr<Slot[]> Slots;
+	size_t                  Capacity;
+	std::atomic<uint64_t>   Head;
+	std::atomic<bool>       Enabled;
+};
+
+// Records the time between its construction and destruction into FrameTracer::Global()
+class TraceScope {
+public:
+	TraceScope(const char* name, uint64_t frameSeq) : Name(name), FrameSeq(frameSeq) {
+		if (FrameTracer::Global().IsEnabled())
+			Start = MonotonicMicros();
+	}
+	~TraceScope() {
+		if (Start != 0)
+			FrameTracer::Global().Record(Name, FrameSeq, Start, MonotonicMicros());
+	}
+
+private:
+	const char* Name;
+	uint64_t    FrameSeq;
+	int64_t     Start = 0;
+};
@@ -0,0 +1,611 @@
+#include "stdafx.h"
+#include "ImageEncode.h"
+#include "PixelKernels.h"
+#include "Simd.h"
+
+// Strips smaller than this aren't worth a thread of their own
+static const int PngMinStripRows = 16;
+
+// Longest hash chain that the deflate matcher follows. Desktop content is mostly long runs and
+// repeated rows, which are found on the first probe, so a short chain loses very little.
+static const int DeflateMaxChain  = 8;
+static const int DeflateHashBits  = 15;
+static const int DeflateWindow    = 32768;
+static const int DeflateMinMatch  = 4;
+static const int DeflateMaxMatch  = 258;
+
+static void PutBE32(uint8_t* p, uint32_t v) {
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t) v;
+}
+
+static void AppendBE32(std::vector<uint8_t>& out, uint32_t v) {
+	uint8_t b[4];
+	PutBE32(b, v);
+	out.insert(out.end(), b, b + 4);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Checksums
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint32_t Crc32(uint32_t crc, const uint8_t* p, size_t n) {
+	static const std::vector<uint32_t> table = []() {
+		std::vector<uint32_t> t(256);
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+	crc = ~crc;
+	for (size_t i = 0; i < n; i++)
+		crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+uint32_t Adler32(uint32_t adler, const uint8_t* p, size_t n) {
+	// 5552 is the most bytes that we can add up before the sums can overflow 32 bits
+	const uint32_t Base = 65521;
+	uint32_t       a    = adler & 0xffff;
+	uint32_t       b    = adler >> 16;
+	while (n != 0) {
+		size_t chunk = std::min(n, (size_t) 5552);
+		n -= chunk;
+		for (size_t i = 0; i < chunk; i++) {
+			a += p[i];
+			b += a;
+		}
+		p += chunk;
+		a %= Base;
+		b %= Base;
+	}
+	return a | (b << 16);
+}
+
+// Checksum of the concatenation of two buffers, given the checksum of each one (as in zlib)
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+	const uint32_t Base = 65521;
+	uint32_t       rem  = (uint32_t)(len2 % Base);
+	uint32_t       sum1 = adler1 & 0xffff;
+	uint32_t       sum2 = (uint32_t)(((uint64_t) rem * sum1) % Base);
+	sum1 += (adler2 & 0xffff) + Base - 1;
+	sum2 += (adler1 >> 16) + (adler2 >> 16) + Base - rem;
+	if (sum1 >= Base)
+		sum1 -= Base;
+	if (sum1 >= Base)
+		sum1 -= Base;
+	if (sum2 >= Base * 2)
+		sum2 -= Base * 2;
+	if (sum2 >= Base)
+		sum2 -= Base;
+	return sum1 | (sum2 << 16);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// QOI
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+void QoiEncode(const Bitmap& img, std::vector<uint8_t>& out) {
+	size_t start = out.size();
+	// Worst case is 4 bytes per pixel (QOI_OP_RGB), plus the header and end marker
+	out.resize(start + 14 + (size_t) img.Width * img.Height * 4 + 8);
+	uint8_t* o = out.data() + start;
+	memcpy(o, "qoif", 4);
+	PutBE32(o + 4, (uint32_t) img.Width);
+	PutBE32(o + 8, (uint32_t) img.Height);
+	o[12] = 3; // RGB
+	o[13] = 0; // sRGB
+	o += 14;
+
+	// The decoder starts with every slot at {0,0,0,0}, which no opaque pixel matches, not even black.
+	// Pixels only ever hold 24 bits here, so fill the empty slots with a value that none can equal.
+	uint32_t index[64];
+	uint32_t prev = 0; // BGR in the low 24 bits. Alpha is always 255.
+	int      run  = 0;
+	for (auto& slot : index)
+		slot = 0xffffffff;
+	for (int y = 0; y < img.Height; y++) {
+		const uint8_t* row = img.Row(y);
+		for (int x = 0; x < img.Width; x++) {
+			uint32_t px;
+			memcpy(&px, row + x * 4, 4);
+			px &= 0xffffff;
+			if (px == prev) {
+				run++;
+				if (run == 62) {
+					*o++ = (uint8_t)(0xc0 | (run - 1));
+					run  = 0;
+				}
+				continue;
+			}
+			if (run != 0) {
+				*o++ = (uint8_t)(0xc0 | (run - 1));
+				run  = 0;
+			}
+			int r = (px >> 16) & 0xff;
+			int g = (px >> 8) & 0xff;
+			int b = px & 0xff;
+			int h = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+			if (index[h] == px) {
+				*o++ = (uint8_t) h;
+				prev = px;
+				continue;
+			}
+			index[h] = px;
+			int8_t vr = (int8_t)(r - (int) ((prev >> 16) & 0xff));
+			int8_t vg = (int8_t)(g - (int) ((prev >> 8) & 0xff));
+			int8_t vb = (int8_t)(b - (int) (prev & 0xff));
+			int    rg = vr - vg;
+			int    bg = vb - vg;
+			if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+				*o++ = (uint8_t)(0x40 | ((vr + 2) << 4) | ((vg + 2) << 2) | (vb + 2));
+			} else if (vg >= -32 && vg <= 31 && rg >= -8 && rg <= 7 && bg >= -8 && bg <= 7) {
+				*o++ = (uint8_t)(0x80 | (vg + 32));
+				*o++ = (uint8_t)(((rg + 8) << 4) | (bg + 8));
+			} else {
+				*o++ = 0xfe;
+				*o++ = (uint8_t) r;
+				*o++ = (uint8_t) g;
+				*o++ = (uint8_t) b;
+			}
+			prev = px;
+		}
+	}
+	if (run != 0)
+		*o++ = (uint8_t)(0xc0 | (run - 1));
+
+	static const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+	memcpy(o, end, 8);
+	o += 8;
+	out.resize(o - out.data());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Deflate, with the fixed Huffman code
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+struct DeflateTables {
+	uint16_t LitCode[288]; // Bit-reversed, because deflate sends Huffman codes MSB first
+	uint8_t  LitBits[288];
+	uint16_t LenSym[DeflateMaxMatch + 1];
+	uint8_t  LenExtraBits[DeflateMaxMatch + 1];
+	uint16_t LenExtra[DeflateMaxMatch + 1];
+	uint8_t  DistSym[512]; // [d-1] for d <= 256, then [256 + ((d-1) >> 7)]
+	uint8_t  DistExtraBits[30];
+	uint16_t DistBase[30];
+	uint16_t DistCode[30];
+
+	DeflateTables() {
+		for (int s = 0; s < 288; s++) {
+			int code, bits;
+			if (s < 144) {
+				code = 0x30 + s;
+				bits = 8;
+			} else if (s < 256) {
+				code = 0x190 + s - 144;
+				bits = 9;
+			} else if (s < 280) {
+				code = s - 256;
+				bits = 7;
+			} else {
+				code = 0xc0 + s - 280;
+				bits = 8;
+			}
+			LitCode[s] = (uint16_t) Reverse(code, bits);
+			LitBits[s] = (uint8_t) bits;
+		}
+
+		static const uint16_t lenBase[29]  = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+		static const uint8_t  lenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+		for (int i = 0; i < 29; i++) {
+			int end = i == 28 ? 259 : lenBase[i + 1];
+			for (int len = lenBase[i]; len < end; len++) {
+				LenSym[len]       = (uint16_t)(257 + i);
+				LenExtraBits[len] = lenExtra[i];
+				LenExtra[len]     = (uint16_t)(len - lenBase[i]);
+			}
+		}
+
+		static const uint16_t distBase[30]  = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+		static const uint8_t  distExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+		for (int i = 0; i < 30; i++) {
+			DistBase[i]      = distBase[i];
+			DistExtraBits[i] = distExtra[i];
+			DistCode[i]      = (uint16_t) Reverse(i, 5);
+			int end          = i == 29 ? 32769 : distBase[i + 1];
+			for (int d = distBase[i]; d < end; d++) {
+				if (d <= 256)
+					DistSym[d - 1] = (uint8_t) i;
+				else
+					DistSym[256 + ((d - 1) >> 7)] = (uint8_t) i;
+			}
+		}
+	}
+
+	static int Reverse(int code, int bits) {
+		int r = 0;
+		for (int i = 0; i < bits; i++)
+			r |= ((code >> i) & 1) << (bits - 1 - i);
+		return r;
+	}
+
+	int Dist(int d) const { return d <= 256 ? DistSym[d - 1] : DistSym[256 + ((d - 1) >> 7)]; }
+};
+
+// Writes bits LSB first, as deflate requires
+struct BitWriter {
+	std::vector<uint8_t>& Out;
+	uint64_t              Bits  = 0;
+	int                   Count = 0;
+
+	BitWriter(std::vector<uint8_t>& out) : Out(out) {}
+
+	void Put(uint32_t v, int n) {
+		Bits |= (uint64_t) v << Count;
+		Count += n;
+		while (Count >= 8) {
+			Out.push_back((uint8_t) Bits);
+			Bits >>= 8;
+			Count -= 8;
+		}
+	}
+
+	void Align() {
+		if (Count != 0)
+			Put(0, 8 - Count);
+	}
+};
+
+} // namespace
+
+static uint32_t Load32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint64_t Load64(const uint8_t* p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+// Compress 'src' as a single fixed-Huffman block, and append it to 'out'. If 'final' is false,
+// the block is followed by an empty stored block (a sync flush), which leaves the stream byte
+// aligned, so that another independently compressed stream can be appended to it.
+static void DeflateFixed(const uint8_t* src, size_t n, bool final, std::vector<uint8_t>& out) {
+	static const DeflateTables t;
+
+	std::vector<int32_t> head(1 << DeflateHashBits, -1);
+	std::vector<int32_t> chain(DeflateWindow);
+	auto                 hash = [](uint32_t v) { return (v * 2654435761u) >> (32 - DeflateHashBits); };
+
+	BitWriter w(out);
+	w.Put(final ? 1 : 0, 1);
+	w.Put(1, 2); // Fixed Huffman
+
+	size_t i = 0;
+	while (i < n) {
+		int bestLen  = 0;
+		int bestDist = 0;
+		if (i + DeflateMinMatch <= n) {
+			uint32_t h       = hash(Load32(src + i));
+			int32_t  cand    = head[h];
+			int      maxLen  = (int) std::min((size_t) DeflateMaxMatch, n - i);
+			uint32_t first   = Load32(src + i);
+			for (int probe = 0; probe < DeflateMaxChain && cand >= 0 && (int) (i - cand) <= DeflateWindow; probe++) {
+				const uint8_t* a = src + cand;
+				const uint8_t* b = src + i;
+				if (Load32(a) == first) {
+					int len = DeflateMinMatch;
+					while (len + 8 <= maxLen && Load64(a + len) == Load64(b + len))
+						len += 8;
+					while (len < maxLen && a[len] == b[len])
+						len++;
+					if (len > bestLen) {
+						bestLen  = len;
+						bestDist = (int) (i - cand);
+						if (len == maxLen)
+							break;
+					}
+				}
+				cand = chain[cand & (DeflateWindow - 1)];
+			}
+			chain[i & (DeflateWindow - 1)] = head[h];
+			head[h]                        = (int32_t) i;
+		}
+
+		if (bestLen >= DeflateMinMatch) {
+			int ls = t.LenSym[bestLen];
+			w.Put(t.LitCode[ls], t.LitBits[ls]);
+			w.Put(t.LenExtra[bestLen], t.LenExtraBits[bestLen]);
+			int ds = t.Dist(bestDist);
+			w.Put(t.DistCode[ds], 5);
+			w.Put(bestDist - t.DistBase[ds], t.DistExtraBits[ds]);
+			// Make the positions inside the match findable too
+			size_t end = std::min(i + bestLen, n - DeflateMinMatch + 1);
+			for (size_t j = i + 1; j < end; j++) {
+				uint32_t h                     = hash(Load32(src + j));
+				chain[j & (DeflateWindow - 1)] = head[h];
+				head[h]                        = (int32_t) j;
+			}
+			i += bestLen;
+		} else {
+			w.Put(t.LitCode[src[i]], t.LitBits[src[i]]);
+			i++;
+		}
+	}
+	w.Put(t.LitCode[256], t.LitBits[256]); // End of block
+
+	if (!final) {
+		w.Put(0, 1);
+		w.Put(0, 2); // Stored
+		w.Align();
+		w.Put(0x0000, 16);
+		w.Put(0xffff, 16);
+	}
+	w.Align();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// PNG
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+static const int PngBpp     = 3; // RGB8
+static const int PngFilters = 5; // None, Sub, Up, Average, Paeth
+static const int RowPad     = 16;
+
+static uint8_t Paeth(int a, int b, int c) {
+	int p  = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return (uint8_t) a;
+	return (uint8_t)(pb <= pc ? b : c);
+}
+
+static int SignedAbs(uint8_t v) {
+	return v < 128 ? v : 256 - v;
+}
+
+// Apply all five filters to one row, and return the filter whose output has the smallest sum of
+// absolute values (when read as signed bytes), which is the heuristic that the PNG spec suggests.
+// cur and prev must be preceded by PngBpp zero bytes.
+static int FilterRow(const uint8_t* cur, const uint8_t* prev, int n, uint8_t* out[PngFilters]) {
+	uint64_t cost[PngFilters] = {};
+	int      i                = 0;
+#ifdef WINDUP_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one  = _mm_set1_epi8(1);
+	__m128i       acc[PngFilters];
+	for (int f = 0; f < PngFilters; f++)
+		acc[f] = zero;
+	auto abs16 = [&](__m128i v) { return _mm_max_epi16(v, _mm_sub_epi16(zero, v)); };
+	auto paeth = [&](__m128i a, __m128i b, __m128i c) {
+		__m128i pa   = abs16(_mm_sub_epi16(b, c));
+		__m128i pb   = abs16(_mm_sub_epi16(a, c));
+		__m128i pc   = abs16(_mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+		__m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+		__m128i notB = _mm_cmpgt_epi16(pb, pc);
+		__m128i bc   = _mm_or_si128(_mm_and_si128(notB, c), _mm_andnot_si128(notB, b));
+		return _mm_or_si128(_mm_and_si128(notA, bc), _mm_andnot_si128(notA, a));
+	};
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*) (cur + i));
+		__m128i a = _mm_loadu_si128((const __m128i*) (cur + i - PngBpp));
+		__m128i b = _mm_loadu_si128((const __m128i*) (prev + i));
+		__m128i c = _mm_loadu_si128((const __m128i*) (prev + i - PngBpp));
+		// _mm_avg_epu8 rounds up, but the Average filter rounds down
+		__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+		__m128i pth = _mm_packus_epi16(paeth(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+		                               paeth(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+		__m128i f[PngFilters] = {x, _mm_sub_epi8(x, a), _mm_sub_epi8(x, b), _mm_sub_epi8(x, avg), _mm_sub_epi8(x, pth)};
+		for (int k = 0; k < PngFilters; k++) {
+			_mm_storeu_si128((__m128i*) (out[k] + i), f[k]);
+			__m128i absv = _mm_min_epu8(f[k], _mm_sub_epi8(zero, f[k]));
+			acc[k]       = _mm_add_epi64(acc[k], _mm_sad_epu8(absv, zero));
+		}
+	}
+	for (int k = 0; k < PngFilters; k++) {
+		uint64_t s[2];
+		_mm_storeu_si128((__m128i*) s, acc[k]);
+		cost[k] = s[0] + s[1];
+	}
+#endif
+	for (; i < n; i++) {
+		int     a = cur[i - PngBpp];
+		int     b = prev[i];
+		int     c = prev[i - PngBpp];
+		uint8_t x = cur[i];
+		out[0][i] = x;
+		out[1][i] = (uint8_t)(x - a);
+		out[2][i] = (uint8_t)(x - b);
+		out[3][i] = (uint8_t)(x - ((a + b) >> 1));
+		out[4][i] = (uint8_t)(x - Paeth(a, b, c));
+		for (int k = 0; k < PngFilters; k++)
+			cost[k] += SignedAbs(out[k][i]);
+	}
+	int best = 0;
+	for (int k = 1; k < PngFilters; k++) {
+		if (cost[k] < cost[best])
+			best = k;
+	}
+	return best;
+}
+
+struct PngEncoder::Strip {
+	int                  Y1 = 0;
+	int                  Y2 = 0;
+	std::vector<uint8_t> Chunk; // IDAT chunk type and data
+	uint32_t             Crc         = 0;
+	uint32_t             Adler       = 1;
+	size_t               FilteredLen = 0;
+	std::vector<uint8_t> Rows;     // Scratch space for the raw and filtered versions of two rows
+	std::vector<uint8_t> Filtered; // Scratch space for the filtered strip, before it is compressed
+};
+
+void PngEncoder::EncodeStrip(const Bitmap& img, int i, int numStrips) {
+	auto   convert  = PixelKernels().ConvertRow[(int) PixelFormat::RGB8];
+	int    rowBytes = img.Width * PngBpp;
+	size_t padded   = RowPad + rowBytes + RowPad;
+	Strip& strip    = Strips[i];
+
+	// Raw rows are kept with zero padding on both sides, so that the filters can read the
+	// pixel to the left of the first pixel, and the vector loop can't read out of bounds.
+	strip.Rows.assign(padded * 2 + padded * PngFilters, 0);
+	uint8_t* prev = strip.Rows.data() + RowPad;
+	uint8_t* cur  = prev + padded;
+	uint8_t* out[PngFilters];
+	for (int k = 0; k < PngFilters; k++)
+		out[k] = strip.Rows.data() + padded * (2 + k) + RowPad;
+	if (strip.Y1 > 0)
+		convert(img.Row(strip.Y1 - 1), prev, img.Width);
+
+	strip.Filtered.resize((size_t)(rowBytes + 1) * (strip.Y2 - strip.Y1));
+	uint8_t* f = strip.Filtered.data();
+	for (int y = strip.Y1; y < strip.Y2; y++) {
+		convert(img.Row(y), cur, img.Width);
+		int best = FilterRow(cur, prev, rowBytes, out);
+		*f++     = (uint8_t) best;
+		memcpy(f, out[best], rowBytes);
+		f += rowBytes;
+		std::swap(prev, cur);
+	}
+
+	strip.Adler       = Adler32(1, strip.Filtered.data(), strip.Filtered.size());
+	strip.FilteredLen = strip.Filtered.size();
+	strip.Chunk.clear();
+	strip.Chunk.reserve(strip.Filtered.size() / 2 + 64);
+	strip.Chunk.insert(strip.Chunk.end(), {'I', 'D', 'A', 'T'});
+	if (i == 0) {
+		// zlib header: deflate with a 32K window, fastest compression, no dictionary
+		strip.Chunk.push_back(0x78);
+		strip.Chunk.push_back(0x01);
+	}
+	DeflateFixed(strip.Filtered.data(), strip.Filtered.size(), i == numStrips - 1, strip.Chunk);
+	strip.Crc = Crc32(0, strip.Chunk.data(), strip.Chunk.size());
+}
+
+static void PngAppendChunk(std::vector<uint8_t>& out, const uint8_t* typeAndData, size_t dataLen, uint32_t crc) {
+	AppendBE32(out, (uint32_t) dataLen);
+	out.insert(out.end(), typeAndData, typeAndData + 4 + dataLen);
+	AppendBE32(out, crc);
+}
+
+static void PngAppendChunk(std::vector<uint8_t>& out, const uint8_t* typeAndData, size_t dataLen) {
+	PngAppendChunk(out, typeAndData, dataLen, Crc32(0, typeAndData, 4 + dataLen));
+}
+
+PngEncoder::PngEncoder() {
+}
+
+PngEncoder::~PngEncoder() {
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Stopping = true;
+	}
+	Wake.notify_all();
+	for (auto& t : Workers)
+		t.join();
+}
+
+void PngEncoder::Encode(const Bitmap& img, std::vector<uint8_t>& out) {
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	out.insert(out.end(), signature, signature + 8);
+
+	uint8_t ihdr[4 + 13] = {'I', 'H', 'D', 'R'};
+	PutBE32(ihdr + 4, (uint32_t) img.Width);
+	PutBE32(ihdr + 8, (uint32_t) img.Height);
+	ihdr[12] = 8; // Bits per channel
+	ihdr[13] = 2; // RGB
+	ihdr[14] = 0; // Deflate
+	ihdr[15] = 0; // Adaptive filtering
+	ihdr[16] = 0; // Not interlaced
+	PngAppendChunk(out, ihdr, 13);
+
+	int numThreads = Threads;
+	if (numThreads <= 0)
+		numThreads = (int) std::max(1u, std::thread::hardware_concurrency());
+	int numStrips = std::max(1, std::min(numThreads, img.Height / PngMinStripRows));
+
+	if ((int) Strips.size() < numStrips)
+		Strips.resize(numStrips);
+	for (int i = 0; i < numStrips; i++) {
+		Strips[i].Y1 = (int) ((int64_t) img.Height * i / numStrips);
+		Strips[i].Y2 = (int) ((int64_t) img.Height * (i + 1) / numStrips);
+	}
+	if (numStrips > 1) {
+		{
+			std::lock_guard<std::mutex> lock(Lock);
+			while ((int) Workers.size() < numStrips - 1) {
+				int      index = (int) Workers.size() + 1;
+				uint64_t seen  = JobSeq;
+				Workers.emplace_back([this, index, seen] { WorkerThread(index, seen); });
+			}
+			Img       = &img;
+			NumStrips = numStrips;
+			Pending   = numStrips - 1;
+			JobSeq++;
+		}
+		Wake.notify_all();
+	}
+	EncodeStrip(img, 0, numStrips);
+	if (numStrips > 1) {
+		std::unique_lock<std::mutex> lock(Lock);
+		Done.wait(lock, [&] { return Pending == 0; });
+		Img = nullptr;
+	}
+
+	// The zlib stream ends with the Adler32 of all the uncompressed data
+	uint32_t adler = Strips[0].Adler;
+	for (int i = 1; i < numStrips; i++)
+		adler = Adler32Combine(adler, Strips[i].Adler, Strips[i].FilteredLen);
+	Strip&  lastStrip = Strips[numStrips - 1];
+	uint8_t trailer[4];
+	PutBE32(trailer, adler);
+	lastStrip.Chunk.insert(lastStrip.Chunk.end(), trailer, trailer + 4);
+	lastStrip.Crc = Crc32(lastStrip.Crc, trailer, 4);
+
+	for (int i = 0; i < numStrips; i++)
+		PngAppendChunk(out, Strips[i].Chunk.data(), Strips[i].Chunk.size() - 4, Strips[i].Crc);
+
+	static const uint8_t iend[4] = {'I', 'E', 'N', 'D'};
+	PngAppendChunk(out, iend, 0);
+}
+
+// Worker 'index' encodes strip 'index' of every image that has that many strips
+void PngEncoder::WorkerThread(int index, uint64_t seen) {
+	while (true) {
+		const Bitmap* img       = nullptr;
+		int           numStrips = 0;
+		{
+			std::unique_lock<std::mutex> lock(Lock);
+			Wake.wait(lock, [&] { return Stopping || JobSeq != seen; });
+			if (Stopping)
+				return;
+			seen      = JobSeq;
+			img       = Img;
+			numStrips = NumStrips;
+		}
+		if (index < numStrips) {
+			EncodeStrip(*img, index, numStrips);
+			std::lock_guard<std::mutex> lock(Lock);
+			if (--Pending == 0)
+				Done.notify_one();
+		}
+	}
+}
+
+void PngEncode(const Bitmap& img, std::vector<uint8_t>& out, int numThreads) {
+	PngEncoder encoder;
+	encoder.Threads = numThreads;
+	encoder.Encode(img, out);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// Still image encoders. Both produce opaque RGB images; the alpha channel of the capture is ignored.
+//
+// QOI (https://qoiformat.org) is a simple format that is several times faster to encode than PNG,
+// and is a good fit for bulk dumps that are post-processed by our own tools.
+//
+// PNG is encoded by our own deflate implementation, so that we can compress horizontal strips of
+// the image in parallel. Every strip is filtered and compressed independently, and ends with a
+// deflate sync flush, so that the strips can simply be concatenated into one zlib stream. Each
+// strip becomes its own IDAT chunk, which lets the workers compute the chunk CRCs too. The cost
+// is that matches can't reach back into the previous strip, and we only use the fixed Huffman
+// code, which is a few percent bigger than a tuned code, but needs no second pass over the data.
+
+// Encode img as QOI, and append it to 'out'
+void QoiEncode(const Bitmap& img, std::vector<uint8_t>& out);
+
+// Encodes PNGs on threads that it keeps from one image to the next, along with their buffers, so
+// that a stream of frames doesn't pay to start threads for every one. Only one thread at a time
+// may call Encode.
+class PngEncoder {
+public:
+	int Threads = 0; // Strips per image, each on its own thread. 0 = one per core.
+
+	PngEncoder();
+	~PngEncoder();
+
+	// Encode img as PNG, and append it to 'out'
+	void Encode(const Bitmap& img, std::vector<uint8_t>& out);
+
+private:
+	struct Strip;
+
+	std::vector<Strip>       Strips;
+	std::vector<std::thread> Workers;
+	std::mutex               Lock;
+	std::condition_variable  Wake;
+	std::condition_variable  Done;
+	const Bitmap*            Img       = nullptr; // The image that the workers are encoding
+	int                      NumStrips = 0;       // Strips of Img
+	uint64_t                 JobSeq    = 0;
+	int                      Pending   = 0; // Strips of Img that workers haven't finished
+	bool                     Stopping  = false;
+
+	void EncodeStrip(const Bitmap& img, int strip, int numStrips);
+	void WorkerThread(int index, uint64_t seen);
+};
+
+// Encode img as PNG, and append it to 'out'. If numThreads is 0, use one strip per core.
+// This starts threads for the one image. To encode many, keep a PngEncoder.
+void PngEncode(const Bitmap& img, std::vector<uint8_t>& out, int numThreads = 0);
+
+// zlib checksums, exposed for the benefit of other writers. Both are streaming: pass the
+// result of the previous call as the first argument.
+uint32_t Crc32(uint32_t crc, const uint8_t* p, size_t n);     // Start with crc = 0
+uint32_t Adler32(uint32_t adler, const uint8_t* p, size_t n); // Start with adler = 1
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t len2);
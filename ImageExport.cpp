@@ -0,0 +1,122 @@
+#include "stdafx.h"
+#include "ImageExport.h"
+#include "ImageEncode.h"
+#include "FrameTrace.h"
+
+ImageFormat ImageFormatFromFilename(const std::string& filename) {
+	size_t dot = filename.rfind('.');
+	if (dot != std::string::npos) {
+		std::string ext = filename.substr(dot + 1);
+		for (auto& c : ext)
+			c = (char) tolower((unsigned char) c);
+		if (ext == "qoi")
+			return ImageFormat::QOI;
+	}
+	return ImageFormat::PNG;
+}
+
+static Error EncodeAndSave(const Bitmap& img, const std::string& filename, ImageFormat format, PngEncoder& png) {
+	std::vector<uint8_t> buf;
+	if (format == ImageFormat::QOI)
+		QoiEncode(img, buf);
+	else
+		png.Encode(img, buf);
+
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (!f)
+		return tsf::fmt("Failed to open %v for writing", filename);
+	size_t n = fwrite(buf.data(), 1, buf.size(), f);
+	if (fclose(f) != 0 || n != buf.size())
+		return tsf::fmt("Failed to write %v", filename);
+	return "";
+}
+
+Error SaveImage(const Bitmap& img, const std::string& filename, ImageFormat format) {
+	PngEncoder png;
+	return EncodeAndSave(img, filename, format, png);
+}
+
+ImageExporter::ImageExporter() : Written(0), Failed(0) {
+}
+
+ImageExporter::~ImageExporter() {
+	Stop();
+}
+
+void ImageExporter::Start(int numWorkers) {
+	Stop();
+	Stopping = false;
+	for (int i = 0; i < std::max(numWorkers, 1); i++)
+		Workers.emplace_back([this] { WorkerThread(); });
+}
+
+void ImageExporter::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Stopping = true;
+	}
+	JobReady.notify_all();
+	for (auto& t : Workers)
+		t.join();
+	Workers.clear();
+}
+
+bool ImageExporter::Enqueue(const Bitmap& img, const std::string& filename) {
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		if (Workers.size() == 0 || Queue.size() >= MaxQueued)
+			return false;
+		Queue.push_back({img, filename});
+	}
+	JobReady.notify_one();
+	return true;
+}
+
+void ImageExporter::Wait() {
+	std::unique_lock<std::mutex> lock(Lock);
+	JobDone.wait(lock, [this] { return Queue.size() == 0 && Busy == 0; });
+}
+
+Error ImageExporter::LastError() {
+	std::lock_guard<std::mutex> lock(Lock);
+	return LastErr;
+}
+
+void ImageExporter::WorkerThread() {
+	// Every worker has its own encoder, which keeps its threads from frame to frame
+	PngEncoder png;
+	while (true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(Lock);
+			// When stopping, we still drain the queue
+			JobReady.wait(lock, [this] { return Queue.size() != 0 || Stopping; });
+			if (Queue.size() == 0)
+				return;
+			job = std::move(Queue.front());
+			Queue.pop_front();
+			Busy++;
+		}
+
+		Error err;
+		{
+			TraceScope trace("export", job.Img.Timing.Seq);
+			png.Threads = EncodeThreads;
+			err         = EncodeAndSave(job.Img, job.Filename, ImageFormatFromFilename(job.Filename), png);
+		}
+		if (err == "")
+			Written++;
+		else
+			Failed++;
+		// Release the frame before we signal, so that a waiter sees its buffer unshared
+		job.Img = Bitmap();
+
+		{
+			std::lock_guard<std::mutex> lock(Lock);
+			if (err != "")
+				LastErr = err;
+			Busy--;
+		}
+		JobDone.notify_all();
+	}
+}
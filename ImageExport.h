@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// ImageExporter saves frames to disk on background threads, so that the capture loop never waits
+// for an encoder or for the disk. Enqueueing a frame doesn't copy its pixels: the queue holds a
+// reference to the frame's buffer (see FrameBuf), and the capture loop only pays for a copy if it
+// writes to that buffer again before the frame has been encoded.
+
+enum class ImageFormat {
+	PNG,
+	QOI,
+};
+
+// Choose the format from the extension of the filename. Anything other than .qoi is PNG.
+ImageFormat ImageFormatFromFilename(const std::string& filename);
+
+// Encode img and write it to 'filename'
+Error SaveImage(const Bitmap& img, const std::string& filename, ImageFormat format);
+
+class ImageExporter {
+public:
+	size_t MaxQueued     = 8; // Enqueue fails when this many frames are waiting
+	int    EncodeThreads = 0; // Threads per PNG encode. 0 = one per core.
+
+	ImageExporter();
+	~ImageExporter(); // Finishes all queued frames before returning
+
+	void Start(int numWorkers = 1);
+	void Stop(); // Finishes all queued frames before returning
+
+	// Queue a frame to be saved. Returns false if the queue is full, in which case the frame is dropped.
+	bool Enqueue(const Bitmap& img, const std::string& filename);
+
+	// Block until every queued frame has been written
+	void Wait();
+
+	uint64_t NumWritten() const { return Written; }
+	uint64_t NumFailed() const { return Failed; }
+	Error    LastError();
+
+private:
+	struct Job {
+		Bitmap      Img;
+		std::string Filename;
+	};
+
+	std::mutex               Lock;
+	std::condition_variable  JobReady;
+	std::condition_variable  JobDone;
+	std::deque<Job>          Queue;
+	int                      Busy     = 0; // Number of jobs that workers are encoding right now
+	bool                     Stopping = false;
+	std::vector<std::thread> Workers;
+	std::atomic<uint64_t>    Written;
+	std::atomic<uint64_t>    Failed;
+	Error                    LastErr;
+
+	void WorkerThread();
+};
@@ -0,0 +1,311 @@
+#include "stdafx.h"
+#include "MotionDetect.h"
+#include "Tiles.h"
+#include "Simd.h"
+
+static const uint64_t HashMul = 0x9E3779B97F4A7C15ull;
+
+static inline uint64_t HashMix(uint64_t h, uint64_t v) {
+	h = (h ^ v) * HashMul;
+	return h ^ (h >> 29);
+}
+
+// Hash a run of pixels. 'n' is the number of pixels.
+static uint64_t HashPixels(const uint8_t* p, int n) {
+	uint64_t h = (uint64_t) n;
+	int      i = 0;
+	for (; i + 2 <= n; i += 2) {
+		uint64_t v;
+		memcpy(&v, p + i * 4, 8);
+		h = HashMix(h, v);
+	}
+	if (i < n) {
+		uint32_t v;
+		memcpy(&v, p + i * 4, 4);
+		h = HashMix(h, v);
+	}
+	return h;
+}
+
+bool BytesEqual(const uint8_t* a, const uint8_t* b, size_t len) {
+	size_t i = 0;
+#ifdef WINDUP_SSE2
+	for (; i + 64 <= len; i += 64) {
+		__m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i)), _mm_loadu_si128((const __m128i*) (b + i)));
+		__m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i + 16)), _mm_loadu_si128((const __m128i*) (b + i + 16)));
+		__m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i + 32)), _mm_loadu_si128((const __m128i*) (b + i + 32)));
+		__m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i + 48)), _mm_loadu_si128((const __m128i*) (b + i + 48)));
+		__m128i e  = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+		if (_mm_movemask_epi8(e) != 0xffff)
+			return false;
+	}
+	for (; i + 16 <= len; i += 16) {
+		__m128i e = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i)), _mm_loadu_si128((const __m128i*) (b + i)));
+		if (_mm_movemask_epi8(e) != 0xffff)
+			return false;
+	}
+#endif
+	return memcmp(a + i, b + i, len - i) == 0;
+}
+
+// A run of lines (rows or columns) of the current frame, which came from Start + Shift in the previous frame
+struct LineRun {
+	int Start;
+	int Len;
+	int Shift;
+};
+
+// Find the offset with the most votes. Returns 0 if no offset has enough votes.
+int MotionEstimator::BestOffset(int n) {
+	int best      = 0;
+	int bestVotes = Config.MinVotes - 1;
+	for (int i = 0; i < 2 * n + 1; i++) {
+		if (i != n && Votes[i] > bestVotes) {
+			bestVotes = Votes[i];
+			best      = i - n;
+		}
+	}
+	return best;
+}
+
+// Find moved and changed lines along one axis. 'hp' and 'hc' hold the n line hashes. Lines with
+// equal hashes are assumed to be unchanged, but moved runs are always verified with 'equal'.
+// 'equal(i, j)' must return true if line i of cur is identical to line j of prev.
+// Produces runs of moved lines, and runs of changed lines that are not explained by a move.
+template <typename TEqual>
+static void FindLineRuns(int n, const std::vector<uint64_t>& hp, const std::vector<uint64_t>& hc, int shift, int minRun, TEqual equal, std::vector<LineRun>& moved, std::vector<LineRun>& changed) {
+	std::vector<uint8_t> isChanged(n);
+	for (int i = 0; i < n; i++)
+		isChanged[i] = hc[i] != hp[i];
+
+	std::vector<uint8_t> isMoved(n, 0);
+	if (shift != 0) {
+		int i = 0;
+		while (i < n) {
+			int j            = i;
+			int changedCount = 0;
+			while (j < n && j + shift >= 0 && j + shift < n && hc[j] == hp[j + shift] && equal(j, j + shift)) {
+				changedCount += isChanged[j];
+				j++;
+			}
+			if (j - i >= minRun && changedCount != 0) {
+				moved.push_back({i, j - i, shift});
+				memset(&isMoved[i], 1, j - i);
+			}
+			i = std::max(j, i + 1);
+		}
+	}
+
+	for (int i = 0; i < n;) {
+		if (!isChanged[i] || isMoved[i]) {
+			i++;
+			continue;
+		}
+		int j = i;
+		while (j < n && isChanged[j] && !isMoved[j])
+			j++;
+		changed.push_back({i, j - i, 0});
+		i = j;
+	}
+}
+
+// Tally votes for the offset of each changed line whose hash appears exactly once in the previous frame
+static void VoteOffsets(int n, const std::vector<uint64_t>& hp, const std::vector<uint64_t>& hc, int maxShift, std::vector<int>& votes) {
+	std::vector<std::pair<uint64_t, int>> sorted(n);
+	for (int i = 0; i < n; i++)
+		sorted[i] = {hp[i], i};
+	std::sort(sorted.begin(), sorted.end());
+
+	votes.assign(2 * n + 1, 0);
+	for (int i = 0; i < n; i++) {
+		if (hc[i] == hp[i])
+			continue;
+		auto it = std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(hc[i], 0));
+		if (it == sorted.end() || it->first != hc[i])
+			continue;
+		if (it + 1 != sorted.end() && (it + 1)->first == hc[i])
+			continue; // not distinctive, such as a blank line
+		int shift = it->second - i;
+		if (maxShift == 0 || abs(shift) <= maxShift)
+			votes[shift + n]++;
+	}
+}
+
+void MotionEstimator::EstimateVertical(const Bitmap& prev, const Bitmap& cur, const Rect& area, std::vector<MoveOp>& moves, std::vector<Rect>& residual) {
+	int n = area.Height();
+	int w = area.Width();
+	HashPrev.resize(n);
+	HashCur.resize(n);
+	for (int i = 0; i < n; i++) {
+		HashPrev[i] = HashPixels(prev.Row(area.Y1 + i) + area.X1 * 4, w);
+		HashCur[i]  = HashPixels(cur.Row(area.Y1 + i) + area.X1 * 4, w);
+	}
+	VoteOffsets(n, HashPrev, HashCur, Config.MaxShift, Votes);
+	int shift = BestOffset(n);
+
+	auto equal = [&](int i, int j) {
+		return BytesEqual(cur.Row(area.Y1 + i) + area.X1 * 4, prev.Row(area.Y1 + j) + area.X1 * 4, w * 4);
+	};
+	std::vector<LineRun> moved, changed;
+	FindLineRuns(n, HashPrev, HashCur, shift, Config.MinRun, equal, moved, changed);
+
+	for (const auto& m : moved)
+		moves.emplace_back(Rect(area.X1, area.Y1 + m.Start + m.Shift, area.X2, area.Y1 + m.Start + m.Shift + m.Len), area.X1, area.Y1 + m.Start);
+	for (const auto& c : changed)
+		residual.emplace_back(area.X1, area.Y1 + c.Start, area.X2, area.Y1 + c.Start + c.Len);
+}
+
+void MotionEstimator::EstimateHorizontal(const Bitmap& prev, const Bitmap& cur, const Rect& area, std::vector<MoveOp>& moves, std::vector<Rect>& residual) {
+	int n = area.Width();
+	HashPrev.assign(n, 0);
+	HashCur.assign(n, 0);
+	for (int y = area.Y1; y < area.Y2; y++) {
+		const uint32_t* p = (const uint32_t*) prev.Row(y) + area.X1;
+		const uint32_t* c = (const uint32_t*) cur.Row(y) + area.X1;
+		for (int i = 0; i < n; i++) {
+			HashPrev[i] = HashMix(HashPrev[i], p[i]);
+			HashCur[i]  = HashMix(HashCur[i], c[i]);
+		}
+	}
+	VoteOffsets(n, HashPrev, HashCur, Config.MaxShift, Votes);
+	int shift = BestOffset(n);
+
+	auto equal = [&](int i, int j) {
+		for (int y = area.Y1; y < area.Y2; y++) {
+			if (((const uint32_t*) cur.Row(y))[area.X1 + i] != ((const uint32_t*) prev.Row(y))[area.X1 + j])
+				return false;
+		}
+		return true;
+	};
+	std::vector<LineRun> moved, changed;
+	FindLineRuns(n, HashPrev, HashCur, shift, Config.MinRun, equal, moved, changed);
+
+	for (const auto& m : moved)
+		moves.emplace_back(Rect(area.X1 + m.Start + m.Shift, area.Y1, area.X1 + m.Start + m.Shift + m.Len, area.Y2), area.X1 + m.Start, area.Y1);
+	for (const auto& c : changed)
+		residual.emplace_back(area.X1 + c.Start, area.Y1, area.X1 + c.Start + c.Len, area.Y2);
+}
+
+static int64_t TotalArea(const std::vector<Rect>& rects) {
+	int64_t a = 0;
+	for (const auto& r : rects)
+		a += (int64_t) r.Width() * r.Height();
+	return a;
+}
+
+// Merge neighbouring moves that have the same offset and line up exactly, such as the same
+// scroll detected in adjacent bands
+static void MergeMoves(std::vector<MoveOp>& moves) {
+	for (size_t i = 0; i < moves.size(); i++) {
+		for (size_t j = i + 1; j < moves.size(); j++) {
+			MoveOp& a    = moves[i];
+			MoveOp& b    = moves[j];
+			bool    same = a.Src.X1 - a.DstX == b.Src.X1 - b.DstX && a.Src.Y1 - a.DstY == b.Src.Y1 - b.DstY;
+			if (!same)
+				continue;
+			bool horz = a.Src.Y1 == b.Src.Y1 && a.Src.Y2 == b.Src.Y2 && (a.Src.X2 == b.Src.X1 || b.Src.X2 == a.Src.X1);
+			bool vert = a.Src.X1 == b.Src.X1 && a.Src.X2 == b.Src.X2 && (a.Src.Y2 == b.Src.Y1 || b.Src.Y2 == a.Src.Y1);
+			if (horz || vert) {
+				a.Src  = a.Src.Union(b.Src);
+				a.DstX = std::min(a.DstX, b.DstX);
+				a.DstY = std::min(a.DstY, b.DstY);
+				moves.erase(moves.begin() + j);
+				j = i;
+			}
+		}
+	}
+}
+
+static void MergeRects(std::vector<Rect>& rects) {
+	for (size_t i = 0; i < rects.size(); i++) {
+		for (size_t j = i + 1; j < rects.size(); j++) {
+			Rect& a    = rects[i];
+			Rect& b    = rects[j];
+			bool  horz = a.Y1 == b.Y1 && a.Y2 == b.Y2 && (a.X2 == b.X1 || b.X2 == a.X1);
+			bool  vert = a.X1 == b.X1 && a.X2 == b.X2 && (a.Y2 == b.Y1 || b.Y2 == a.Y1);
+			if (horz || vert) {
+				a = a.Union(b);
+				rects.erase(rects.begin() + j);
+				j = i;
+			}
+		}
+	}
+}
+
+bool MotionEstimator::Estimate(const Bitmap& prev, const Bitmap& cur, const std::vector<Rect>& dirty) {
+	Moves.clear();
+	Residual.clear();
+	if (prev.Width != cur.Width || prev.Height != cur.Height)
+		return false;
+
+	Rect area;
+	for (const auto& d : dirty)
+		area = area.Union(d.Intersection(cur.Bounds()));
+	if (area.IsEmpty())
+		return false;
+
+	std::vector<MoveOp> vMoves;
+	std::vector<Rect>   vResidual;
+	for (int x = area.X1; x < area.X2; x += TileSize)
+		EstimateVertical(prev, cur, Rect(x, area.Y1, std::min(x + TileSize, area.X2), area.Y2), vMoves, vResidual);
+
+	int64_t vArea     = TotalArea(vResidual);
+	int64_t movedArea = 0;
+	for (const auto& m : vMoves)
+		movedArea += (int64_t) m.Src.Width() * m.Src.Height();
+	if (vArea > movedArea) {
+		// Vertical motion doesn't explain most of the change, so see if horizontal motion does better
+		std::vector<MoveOp> hMoves;
+		std::vector<Rect>   hResidual;
+		for (int y = area.Y1; y < area.Y2; y += TileSize)
+			EstimateHorizontal(prev, cur, Rect(area.X1, y, area.X2, std::min(y + TileSize, area.Y2)), hMoves, hResidual);
+		if (hMoves.size() != 0 && TotalArea(hResidual) < vArea) {
+			vMoves.swap(hMoves);
+			vResidual.swap(hResidual);
+		}
+	}
+
+	MergeMoves(vMoves);
+	MergeRects(vResidual);
+	Moves.swap(vMoves);
+	Residual.swap(vResidual);
+	return Moves.size() != 0;
+}
+
+void ApplyMoves(Bitmap& frame, const std::vector<MoveOp>& moves) {
+	if (moves.size() == 1) {
+		// A single move only overlaps itself, so we can do it in place, by copying in the right order
+		const MoveOp& m   = moves[0];
+		Rect          src = m.Src.Intersection(frame.Bounds());
+		Rect          dst = m.Dst().Intersection(frame.Bounds());
+		if (src != m.Src || dst != m.Dst())
+			return;
+		size_t rowBytes = src.Width() * 4;
+		if (m.DstY > src.Y1) {
+			for (int y = src.Height() - 1; y >= 0; y--)
+				memmove(frame.Row(m.DstY + y) + m.DstX * 4, frame.Row(src.Y1 + y) + src.X1 * 4, rowBytes);
+		} else {
+			for (int y = 0; y < src.Height(); y++)
+				memmove(frame.Row(m.DstY + y) + m.DstX * 4, frame.Row(src.Y1 + y) + src.X1 * 4, rowBytes);
+		}
+		return;
+	}
+
+	// Moves may read from each other's destinations, so snapshot all of the sources first
+	std::vector<std::vector<uint8_t>> saved(moves.size());
+	for (size_t i = 0; i < moves.size(); i++) {
+		const MoveOp& m = moves[i];
+		if (m.Src.Intersection(frame.Bounds()) != m.Src || m.Dst().Intersection(frame.Bounds()) != m.Dst())
+			continue;
+		saved[i].resize((size_t) m.Src.Width() * m.Src.Height() * 4);
+		for (int y = 0; y < m.Src.Height(); y++)
+			memcpy(&saved[i][(size_t) y * m.Src.Width() * 4], frame.Row(m.Src.Y1 + y) + m.Src.X1 * 4, m.Src.Width() * 4);
+	}
+	for (size_t i = 0; i < moves.size(); i++) {
+		const MoveOp& m = moves[i];
+		if (saved[i].size() == 0)
+			continue;
+		for (int y = 0; y < m.Src.Height(); y++)
+			memcpy(frame.Row(m.DstY + y) + m.DstX * 4, &saved[i][(size_t) y * m.Src.Width() * 4], m.Src.Width() * 4);
+	}
+}
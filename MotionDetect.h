@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// MotionEstimator finds scrolled and moved content between two consecutive frames, so that
+// recorders and streamers can replay a cheap copy instead of sending the pixels again.
+//
+// The changed area is split into bands one tile wide (for vertical motion) or one tile high
+// (for horizontal motion). Inside each band, we hash every row (or column) of both frames,
+// vote on the offset that explains the most changed rows, and then verify runs of rows at that
+// offset with an exact compare. Adjacent bands that moved by the same amount are merged.
+// Pure vertical and pure horizontal motion are detected. Diagonal window drags are left to
+// the OS move rectangles, when they're available.
+
+struct MotionConfig {
+	int MinRun   = 8;  // Minimum number of rows (or columns) in a move
+	int MinVotes = 8;  // Minimum number of distinctive rows (or columns) that must agree on an offset
+	int MaxShift = 0;  // Largest offset that we search for. Zero means unlimited.
+};
+
+class MotionEstimator {
+public:
+	MotionConfig        Config;
+	std::vector<MoveOp> Moves;    // Output: content that moved
+	std::vector<Rect>   Residual; // Output: regions that changed, and are not explained by Moves
+
+	// Compare 'prev' and 'cur', which must be the same size. 'dirty' limits the search to the
+	// regions that changed. Pass cur.Bounds() when there's no better information.
+	// Returns true if any moves were found.
+	bool Estimate(const Bitmap& prev, const Bitmap& cur, const std::vector<Rect>& dirty);
+
+private:
+	std::vector<uint64_t> HashPrev;
+	std::vector<uint64_t> HashCur;
+	std::vector<int>      Votes;
+
+	void EstimateVertical(const Bitmap& prev, const Bitmap& cur, const Rect& area, std::vector<MoveOp>& moves, std::vector<Rect>& residual);
+	void EstimateHorizontal(const Bitmap& prev, const Bitmap& cur, const Rect& area, std::vector<MoveOp>& moves, std::vector<Rect>& residual);
+	int  BestOffset(int n);
+};
+
+// Returns true if the 'len' bytes at a and b are identical
+bool BytesEqual(const uint8_t* a, const uint8_t* b, size_t len);
+
+// Apply moves to 'frame', which holds the previous frame. Moves may overlap their own source.
+void ApplyMoves(Bitmap& frame, const std::vector<MoveOp>& moves);
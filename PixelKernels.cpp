@@ -0,0 +1,217 @@
+#include "stdafx.h"
+#include "PixelKernelsImpl.h"
+#include <random>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+// Defined in PixelKernelsAVX2.cpp, which is compiled with AVX2 enabled
+const PixelKernelTable* PixelKernelsAVX2();
+
+// Number of rows ahead of the current row that the row loop prefetches
+static const int PrefetchRows = 2;
+
+int PixelFormatBytes(PixelFormat f) {
+	switch (f) {
+	case PixelFormat::RGB8: return 3;
+	case PixelFormat::Gray8: return 1;
+	default: return 4;
+	}
+}
+
+const char* KernelISAName(KernelISA isa) {
+	switch (isa) {
+	case KernelISA::Scalar: return "scalar";
+	case KernelISA::SSE2: return "sse2";
+	case KernelISA::AVX2: return "avx2";
+	}
+	return "?";
+}
+
+static bool CpuHasAVX2() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int r[4];
+	__cpuid(r, 0);
+	if (r[0] < 7)
+		return false;
+	// The OS must also save the YMM registers on context switches
+	__cpuid(r, 1);
+	bool osxsave = (r[2] & (1 << 27)) != 0;
+	bool avx     = (r[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(r, 7, 0);
+	return (r[1] & (1 << 5)) != 0;
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+const PixelKernelTable* PixelKernelsFor(KernelISA isa) {
+	static PixelKernelTable scalar = MakeKernelTable<VecNone>(KernelISA::Scalar);
+#ifdef WINDUP_SSE2
+	static PixelKernelTable sse2 = MakeKernelTable<VecSSE2>(KernelISA::SSE2);
+#endif
+	switch (isa) {
+	case KernelISA::Scalar: return &scalar;
+#ifdef WINDUP_SSE2
+	case KernelISA::SSE2: return &sse2;
+#endif
+	case KernelISA::AVX2: return CpuHasAVX2() ? PixelKernelsAVX2() : nullptr;
+	default: return nullptr;
+	}
+}
+
+static std::atomic<const PixelKernelTable*> ForcedKernels;
+
+const PixelKernelTable& PixelKernels() {
+	static const PixelKernelTable* best = []() {
+		for (int isa = NumKernelISAs - 1; isa > 0; isa--) {
+			if (auto t = PixelKernelsFor((KernelISA) isa))
+				return t;
+		}
+		return PixelKernelsFor(KernelISA::Scalar);
+	}();
+	const PixelKernelTable* forced = ForcedKernels.load(std::memory_order_relaxed);
+	return forced ? *forced : *best;
+}
+
+bool ForcePixelKernels(KernelISA isa) {
+	const PixelKernelTable* t = PixelKernelsFor(isa);
+	if (t)
+		ForcedKernels = t;
+	return t != nullptr;
+}
+
+void UnforcePixelKernels() {
+	ForcedKernels = nullptr;
+}
+
+// The row loop that the whole-bitmap functions share. 'fn' is called with the row number,
+// while the hardware is told about the first cache lines of the rows that come after it.
+template <typename Fn>
+static void ForEachRow(const Bitmap& src, const Rect& r, Fn fn) {
+	for (int y = r.Y1; y < r.Y2; y++) {
+#ifdef WINDUP_SSE2
+		if (y + PrefetchRows < r.Y2) {
+			const uint8_t* ahead = src.Row(y + PrefetchRows) + r.X1 * 4;
+			_mm_prefetch((const char*) ahead, _MM_HINT_T0);
+			_mm_prefetch((const char*) ahead + 64, _MM_HINT_T0);
+		}
+#endif
+		fn(y);
+	}
+}
+
+void ConvertRect(const Bitmap& src, const Rect& r, PixelFormat format, uint8_t* dst, int dstStride) {
+	auto convert = PixelKernels().ConvertRow[(int) format];
+	ForEachRow(src, r, [&](int y) {
+		convert(src.Row(y) + r.X1 * 4, dst + (size_t)(y - r.Y1) * dstStride, r.Width());
+	});
+}
+
+void DitherRect(const Bitmap& src, const Rect& r, Pixel16Format format, uint16_t* dst, int dstStride) {
+	auto dither = PixelKernels().DitherRow16[(int) format];
+	ForEachRow(src, r, [&](int y) {
+		dither(src.Row(y) + r.X1 * 4, dst + (size_t)(y - r.Y1) * dstStride, r.Width(), r.X1, y);
+	});
+}
+
+void BlendBitmaps(const Bitmap& a, const Bitmap& b, int alpha, Bitmap& dst) {
+	dst.Width  = a.Width;
+	dst.Height = a.Height;
+	dst.Buf.resize((size_t) a.Stride() * a.Height);
+	auto blend = PixelKernels().BlendRow;
+	ForEachRow(a, a.Bounds(), [&](int y) {
+		blend(a.Row(y), b.Row(y), dst.Row(y), a.Width, alpha);
+	});
+}
+
+uint64_t SumAbsDiff(const Bitmap& a, const Bitmap& b, const Rect& r) {
+	auto     sad = PixelKernels().SumAbsDiffRow;
+	uint64_t sum = 0;
+	ForEachRow(a, r, [&](int y) {
+		sum += sad(a.Row(y) + r.X1 * 4, b.Row(y) + r.X1 * 4, r.Width());
+	});
+	return sum;
+}
+
+Error PixelKernelsSelfCheck() {
+	const PixelKernelTable* ref = PixelKernelsFor(KernelISA::Scalar);
+	std::mt19937            rng(1);
+	std::vector<uint8_t>    a, b, out, expect;
+	std::vector<uint16_t>   sums, sumsExpect, packed, packedExpect;
+	a.reserve(200 * 4); // So that even empty rows have a valid pointer, which memcpy insists on
+	b.reserve(200 * 4);
+	for (int isa = 1; isa < NumKernelISAs; isa++) {
+		const PixelKernelTable* k = PixelKernelsFor((KernelISA) isa);
+		if (!k)
+			continue;
+		const char* name = KernelISAName((KernelISA) isa);
+		// Every length up to a few vectors, to exercise the tails, and then some long rows
+		for (int n = 0; n < 200; n += n < 80 ? 1 : 37) {
+			a.resize(n * 4);
+			b.resize(n * 4);
+			for (size_t i = 0; i < a.size(); i++) {
+				a[i] = (uint8_t) rng();
+				b[i] = (uint8_t) rng();
+			}
+			for (int f = 0; f < NumPixelFormats; f++) {
+				size_t bytes = (size_t) n * PixelFormatBytes((PixelFormat) f);
+				out.assign(bytes + 1, 0xcc);
+				expect.assign(bytes + 1, 0xcc);
+				ref->ConvertRow[f](a.data(), expect.data(), n);
+				k->ConvertRow[f](a.data(), out.data(), n);
+				if (out != expect)
+					return tsf::fmt("%v ConvertRow[%v] differs from scalar at n = %v", name, f, n);
+			}
+			for (int f = 0; f < NumPixel16Formats; f++) {
+				// Every phase of the dither matrix
+				for (int x = 0; x < 4; x++) {
+					packed.assign(n + 1, 0xcccc);
+					packedExpect.assign(n + 1, 0xcccc);
+					ref->DitherRow16[f](a.data(), packedExpect.data(), n, x, n + x);
+					k->DitherRow16[f](a.data(), packed.data(), n, x, n + x);
+					if (packed != packedExpect)
+						return tsf::fmt("%v DitherRow16[%v] differs from scalar at n = %v, x = %v", name, f, n, x);
+				}
+			}
+			for (int alpha : {0, 1, 77, 128, 255, 256}) {
+				out.assign(n * 4 + 1, 0xcc);
+				expect.assign(n * 4 + 1, 0xcc);
+				ref->BlendRow(a.data(), b.data(), expect.data(), n, alpha);
+				k->BlendRow(a.data(), b.data(), out.data(), n, alpha);
+				if (out != expect)
+					return tsf::fmt("%v BlendRow differs from scalar at n = %v, alpha = %v", name, n, alpha);
+			}
+			if (k->SumAbsDiffRow(a.data(), b.data(), n) != ref->SumAbsDiffRow(a.data(), b.data(), n))
+				return tsf::fmt("%v SumAbsDiffRow differs from scalar at n = %v", name, n);
+
+			out.assign(n * 4 + 1, 0xcc);
+			expect.assign(n * 4 + 1, 0xcc);
+			ref->FillRow(expect.data(), n, 0x80402010);
+			k->FillRow(out.data(), n, 0x80402010);
+			if (out != expect)
+				return tsf::fmt("%v FillRow differs from scalar at n = %v", name, n);
+
+			sums.resize(n * 4);
+			sumsExpect.resize(n * 4);
+			for (size_t i = 0; i < sums.size(); i++)
+				sums[i] = sumsExpect[i] = (uint16_t) rng();
+			ref->AddRow16(sumsExpect.data(), a.data(), n);
+			k->AddRow16(sums.data(), a.data(), n);
+			ref->SubRow16(sumsExpect.data(), b.data(), n);
+			k->SubRow16(sums.data(), b.data(), n);
+			if (sums != sumsExpect)
+				return tsf::fmt("%v AddRow16 or SubRow16 differs from scalar at n = %v", name, n);
+			ref->ScaleRow16(sums.data(), expect.data(), n, 1234);
+			k->ScaleRow16(sums.data(), out.data(), n, 1234);
+			if (out != expect)
+				return tsf::fmt("%v ScaleRow16 differs from scalar at n = %v", name, n);
+		}
+	}
+	return "";
+}
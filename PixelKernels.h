@@ -0,0 +1,103 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// PixelKernels is a small framework for per-pixel operations over Bitmaps.
+//
+// Every kernel is written once, as a template over its pixel format and over a vector type
+// (see PixelKernelsImpl.h), and is instantiated for every instruction set that we build for.
+// The instantiations are collected into one PixelKernelTable per instruction set, and
+// PixelKernels() picks the best table for the CPU that we're running on, once, on first use.
+//
+// The row kernels only ever see one row at a time. The whole-bitmap functions at the bottom
+// share a single row loop, which handles clipping and prefetches the rows ahead.
+
+enum class PixelFormat {
+	BGRA8, // Native capture format, and the format of Bitmap
+	RGBA8, // Byte order of PNG and QOI
+	RGB8,  // Same, without alpha
+	Gray8, // Luma, BT.601 weights
+};
+
+static const int NumPixelFormats = 4;
+
+int PixelFormatBytes(PixelFormat f);
+
+// Packed 16-bit pixels, for previews that have to fit through a narrow link
+enum class Pixel16Format {
+	RGB565, // Red in the top 5 bits, then 6 bits of green, and 5 of blue
+	RGB555, // Same, with 5 bits of green, and the top bit clear
+};
+
+static const int NumPixel16Formats = 2;
+
+enum class KernelISA {
+	Scalar,
+	SSE2,
+	AVX2,
+};
+
+static const int NumKernelISAs = 3;
+
+const char* KernelISAName(KernelISA isa);
+
+struct PixelKernelTable {
+	KernelISA ISA;
+
+	// Convert n BGRA8 pixels to the format given by the array index
+	void (*ConvertRow[NumPixelFormats])(const uint8_t* src, uint8_t* dst, int n);
+
+	// Quantize n BGRA8 pixels to the format given by the array index, with 4x4 ordered dithering.
+	// (x, y) is the position of the first pixel in the image, which picks the dither threshold.
+	void (*DitherRow16[NumPixel16Formats])(const uint8_t* src, uint16_t* dst, int n, int x, int y);
+
+	// dst = (a * alpha + b * (256 - alpha)) / 256, per channel, for n BGRA8 pixels. alpha is [0..256].
+	void (*BlendRow)(const uint8_t* a, const uint8_t* b, uint8_t* dst, int n, int alpha);
+
+	// Sum of the absolute differences of every channel of n BGRA8 pixels
+	uint64_t (*SumAbsDiffRow)(const uint8_t* a, const uint8_t* b, int n);
+
+	// Set n BGRA8 pixels to color
+	void (*FillRow)(uint8_t* dst, int n, uint32_t color);
+
+	// Running column sums, for box filters. 'sums' holds a 16-bit total for every channel of n BGRA8 pixels,
+	// so it can sum up to 257 rows without overflowing.
+	void (*AddRow16)(uint16_t* sums, const uint8_t* src, int n);
+	void (*SubRow16)(uint16_t* sums, const uint8_t* src, int n);
+
+	// dst = (sums * scale) >> 16, saturated, per channel, for n BGRA8 pixels
+	void (*ScaleRow16)(const uint16_t* sums, uint8_t* dst, int n, uint16_t scale);
+};
+
+// The best kernels for this CPU
+const PixelKernelTable& PixelKernels();
+
+// The kernels for a specific instruction set, or null if that instruction set was not
+// compiled in, or is not supported by this CPU.
+const PixelKernelTable* PixelKernelsFor(KernelISA isa);
+
+// Make PixelKernels() return the kernels for 'isa', so that tests and benchmarks can compare
+// instruction sets through the whole-bitmap functions, and everything else that uses PixelKernels().
+// Returns false, and changes nothing, if that instruction set isn't available. Don't call this
+// while other threads are running kernels.
+bool ForcePixelKernels(KernelISA isa);
+
+// Go back to the best kernels for this CPU
+void UnforcePixelKernels();
+
+// Check every available instruction set against the scalar kernels, on random inputs of
+// many lengths. Returns an empty string if they all agree.
+Error PixelKernelsSelfCheck();
+
+// Crop r out of src, and convert it into dst, which must hold r.Height() rows of dstStride bytes
+void ConvertRect(const Bitmap& src, const Rect& r, PixelFormat format, uint8_t* dst, int dstStride);
+
+// Crop r out of src, and dither it into dst, which must hold r.Height() rows, dstStride pixels apart.
+// The dither pattern is anchored to the coordinates of src, so neighbouring rectangles line up.
+void DitherRect(const Bitmap& src, const Rect& r, Pixel16Format format, uint16_t* dst, int dstStride);
+
+// Blend a and b into dst, which is resized to match. a and b must have the same dimensions.
+void BlendBitmaps(const Bitmap& a, const Bitmap& b, int alpha, Bitmap& dst);
+
+// Sum of the absolute differences of every channel inside r. a and b must have the same dimensions.
+uint64_t SumAbsDiff(const Bitmap& a, const Bitmap& b, const Rect& r);
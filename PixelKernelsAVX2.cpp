@@ -0,0 +1,13 @@
+#include "stdafx.h"
+// This file must be compiled with AVX2 enabled (/arch:AVX2 or -mavx2). It's only ever
+// called into after PixelKernels.cpp has checked that the CPU supports AVX2.
+#include "PixelKernelsImpl.h"
+
+const PixelKernelTable* PixelKernelsAVX2() {
+#ifdef __AVX2__
+	static PixelKernelTable table = MakeKernelTable<VecAVX2>(KernelISA::AVX2);
+	return &table;
+#else
+	return nullptr;
+#endif
+}
@@ -0,0 +1,500 @@
+#pragma once
+
+// Kernel templates, shared by PixelKernels.cpp and PixelKernelsAVX2.cpp.
+//
+// Each of those translation units compiles these templates for a different instruction set, so
+// everything in here lives in an anonymous namespace. Otherwise the linker would be free to pick
+// the AVX2 instantiation of a shared inline function for use on a CPU that doesn't have AVX2.
+//
+// A kernel is written against a vector type V, which exposes the operations below on V::T.
+// V::Pixels is the number of BGRA pixels in one vector. The scalar reference kernels are
+// specializations for VecNone, and the vector kernels fall back to them for their tails.
+
+#include "PixelKernels.h"
+#include "Simd.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// BT.601 luma weights, scaled to sum to 256. Same as ChangeFilter.
+const int KernelLumaB = 29;
+const int KernelLumaG = 150;
+const int KernelLumaR = 77;
+
+struct VecNone {
+	static const int Pixels = 0;
+};
+
+#ifdef WINDUP_SSE2
+struct VecSSE2 {
+	typedef __m128i  T;
+	static const int Pixels = 4;
+
+	static T    Load(const uint8_t* p) { return _mm_loadu_si128((const __m128i*) p); }
+	static void Store(uint8_t* p, T v) { _mm_storeu_si128((__m128i*) p, v); }
+	static T    Zero() { return _mm_setzero_si128(); }
+	static T    Set32(uint32_t v) { return _mm_set1_epi32((int) v); }
+	static T    Set16(uint16_t v) { return _mm_set1_epi16((short) v); }
+	static T    And(T a, T b) { return _mm_and_si128(a, b); }
+	static T    Or(T a, T b) { return _mm_or_si128(a, b); }
+	template <int N>
+	static T Shl32(T a) { return _mm_slli_epi32(a, N); }
+	template <int N>
+	static T Shr32(T a) { return _mm_srli_epi32(a, N); }
+	template <int N>
+	static T    Shr16(T a) { return _mm_srli_epi16(a, N); }
+	static T    Add16(T a, T b) { return _mm_add_epi16(a, b); }
+	static T    Sub16(T a, T b) { return _mm_sub_epi16(a, b); }
+	static T    Add32(T a, T b) { return _mm_add_epi32(a, b); }
+	static T    Add64(T a, T b) { return _mm_add_epi64(a, b); }
+	static T    Mul16(T a, T b) { return _mm_mullo_epi16(a, b); }
+	static T    MulHi16(T a, T b) { return _mm_mulhi_epu16(a, b); }
+	static T    MulAdd16(T a, T b) { return _mm_madd_epi16(a, b); }
+	static T    UnpackLo8(T a) { return _mm_unpacklo_epi8(a, _mm_setzero_si128()); }
+	static T    UnpackHi8(T a) { return _mm_unpackhi_epi8(a, _mm_setzero_si128()); }
+	static T    Pack16(T lo, T hi) { return _mm_packus_epi16(lo, hi); }
+	static T    Sad8(T a, T b) { return _mm_sad_epu8(a, b); }
+
+	// Widen bytes to 16 bits, and back, keeping them in memory order
+	static void Widen8(T a, T& lo, T& hi) {
+		lo = UnpackLo8(a);
+		hi = UnpackHi8(a);
+	}
+	static T Narrow16(T lo, T hi) { return Pack16(lo, hi); }
+
+	static uint64_t Sum64(T a) {
+		uint64_t t[2];
+		_mm_storeu_si128((__m128i*) t, a);
+		return t[0] + t[1];
+	}
+
+	// Narrow the low byte of every 32-bit lane of a,b,c,d into one vector, in order
+	static T Narrow32To8(T a, T b, T c, T d) {
+		return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+	}
+
+	// Narrow the low 16 bits of every 32-bit lane of a,b into one vector, in order. There is no
+	// unsigned 32-bit pack in SSE2, so sign extend the low half first, to keep the signed one exact.
+	static T Narrow32To16(T a, T b) {
+		return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+	}
+};
+#endif
+
+#ifdef __AVX2__
+struct VecAVX2 {
+	typedef __m256i  T;
+	static const int Pixels = 8;
+
+	static T    Load(const uint8_t* p) { return _mm256_loadu_si256((const __m256i*) p); }
+	static void Store(uint8_t* p, T v) { _mm256_storeu_si256((__m256i*) p, v); }
+	static T    Zero() { return _mm256_setzero_si256(); }
+	static T    Set32(uint32_t v) { return _mm256_set1_epi32((int) v); }
+	static T    Set16(uint16_t v) { return _mm256_set1_epi16((short) v); }
+	static T    And(T a, T b) { return _mm256_and_si256(a, b); }
+	static T    Or(T a, T b) { return _mm256_or_si256(a, b); }
+	template <int N>
+	static T Shl32(T a) { return _mm256_slli_epi32(a, N); }
+	template <int N>
+	static T Shr32(T a) { return _mm256_srli_epi32(a, N); }
+	template <int N>
+	static T    Shr16(T a) { return _mm256_srli_epi16(a, N); }
+	static T    Add16(T a, T b) { return _mm256_add_epi16(a, b); }
+	static T    Sub16(T a, T b) { return _mm256_sub_epi16(a, b); }
+	static T    Add32(T a, T b) { return _mm256_add_epi32(a, b); }
+	static T    Add64(T a, T b) { return _mm256_add_epi64(a, b); }
+	static T    Mul16(T a, T b) { return _mm256_mullo_epi16(a, b); }
+	static T    MulHi16(T a, T b) { return _mm256_mulhi_epu16(a, b); }
+	static T    MulAdd16(T a, T b) { return _mm256_madd_epi16(a, b); }
+	static T    UnpackLo8(T a) { return _mm256_unpacklo_epi8(a, _mm256_setzero_si256()); }
+	static T    UnpackHi8(T a) { return _mm256_unpackhi_epi8(a, _mm256_setzero_si256()); }
+	static T    Pack16(T lo, T hi) { return _mm256_packus_epi16(lo, hi); }
+	static T    Sad8(T a, T b) { return _mm256_sad_epu8(a, b); }
+
+	// Unpack and pack work within each 128-bit half, so memory order needs a 64-bit permute
+	static void Widen8(T a, T& lo, T& hi) {
+		a  = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(3, 1, 2, 0));
+		lo = UnpackLo8(a);
+		hi = UnpackHi8(a);
+	}
+	static T Narrow16(T lo, T hi) { return _mm256_permute4x64_epi64(Pack16(lo, hi), _MM_SHUFFLE(3, 1, 2, 0)); }
+
+	static uint64_t Sum64(T a) {
+		uint64_t t[4];
+		_mm256_storeu_si256((__m256i*) t, a);
+		return t[0] + t[1] + t[2] + t[3];
+	}
+
+	// The packs work within each 128-bit half, so the result needs a cross-lane fixup
+	static T Narrow32To8(T a, T b, T c, T d) {
+		T p = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+		return _mm256_permutevar8x32_epi32(p, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+	}
+
+	static T Narrow32To16(T a, T b) {
+		T p = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16), _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16));
+		return _mm256_permute4x64_epi64(p, _MM_SHUFFLE(3, 1, 2, 0));
+	}
+};
+#endif
+
+// Per-format conversion from BGRA8. Pixel() is the scalar reference, and Vec() converts
+// V::Pixels * 4 pixels at a time (four vectors in, four vectors' worth of output bytes out).
+template <PixelFormat F>
+struct ConvertFormat;
+
+template <>
+struct ConvertFormat<PixelFormat::BGRA8> {
+	static void Pixel(const uint8_t* s, uint8_t* d) { memcpy(d, s, 4); }
+
+	template <typename V>
+	static void Vec(const uint8_t* s, uint8_t* d) {
+		for (int i = 0; i < 4; i++)
+			V::Store(d + i * V::Pixels * 4, V::Load(s + i * V::Pixels * 4));
+	}
+};
+
+template <>
+struct ConvertFormat<PixelFormat::RGBA8> {
+	static void Pixel(const uint8_t* s, uint8_t* d) {
+		d[0] = s[2];
+		d[1] = s[1];
+		d[2] = s[0];
+		d[3] = s[3];
+	}
+
+	// Swap B and R with masks and shifts, which every instruction set has
+	template <typename V>
+	static void Vec(const uint8_t* s, uint8_t* d) {
+		const typename V::T keep = V::Set32(0xff00ff00);
+		const typename V::T low  = V::Set32(0x000000ff);
+		for (int i = 0; i < 4; i++) {
+			typename V::T px = V::Load(s + i * V::Pixels * 4);
+			typename V::T br = V::Or(V::template Shl32<16>(V::And(px, low)), V::And(V::template Shr32<16>(px), low));
+			V::Store(d + i * V::Pixels * 4, V::Or(V::And(px, keep), br));
+		}
+	}
+};
+
+template <>
+struct ConvertFormat<PixelFormat::RGB8> {
+	static void Pixel(const uint8_t* s, uint8_t* d) {
+		d[0] = s[2];
+		d[1] = s[1];
+		d[2] = s[0];
+	}
+
+	// Without a byte shuffle (SSSE3), packing 4-byte pixels into 3 bytes is no faster in vector
+	// registers, so this is unrolled scalar code in every instantiation.
+	template <typename V>
+	static void Vec(const uint8_t* s, uint8_t* d) {
+		for (int i = 0; i < V::Pixels * 4; i++)
+			Pixel(s + i * 4, d + i * 3);
+	}
+};
+
+template <>
+struct ConvertFormat<PixelFormat::Gray8> {
+	static void Pixel(const uint8_t* s, uint8_t* d) {
+		d[0] = (uint8_t)((s[0] * KernelLumaB + s[1] * KernelLumaG + s[2] * KernelLumaR) >> 8);
+	}
+
+	// Produce the luma of every pixel in its own 32-bit lane. B and R are multiplied and added in
+	// one step by treating each pixel as two 16-bit lanes [B,R] after masking out G and A.
+	template <typename V>
+	static typename V::T Luma(typename V::T px) {
+		const typename V::T brMask = V::Set32(0x00ff00ff);
+		const typename V::T gMask  = V::Set32(0x000000ff);
+		const typename V::T brW    = V::Set32((KernelLumaR << 16) | KernelLumaB);
+		const typename V::T gW     = V::Set32(KernelLumaG);
+		typename V::T       br     = V::MulAdd16(V::And(px, brMask), brW);
+		typename V::T       g      = V::MulAdd16(V::And(V::template Shr32<8>(px), gMask), gW);
+		return V::template Shr32<8>(V::Add32(br, g));
+	}
+
+	template <typename V>
+	static void Vec(const uint8_t* s, uint8_t* d) {
+		const int n = V::Pixels * 4;
+		V::Store(d, V::Narrow32To8(Luma<V>(V::Load(s)), Luma<V>(V::Load(s + n)), Luma<V>(V::Load(s + 2 * n)), Luma<V>(V::Load(s + 3 * n))));
+	}
+};
+
+// 4x4 Bayer matrix. A channel with a quantization step of 8 gets threshold / 2 added before it is
+// truncated, and one with a step of 4 gets threshold / 4.
+const uint8_t KernelBayer[4][4] = {{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+
+// Per-format packing of a BGRA8 pixel into 16 bits, by truncation. Pack() is the scalar reference,
+// and Vec() packs every 32-bit lane of a vector. GreenDither is the shift that turns a Bayer
+// threshold into the dither offset for green.
+template <Pixel16Format F>
+struct Pack16Format;
+
+template <>
+struct Pack16Format<Pixel16Format::RGB565> {
+	static const int GreenDither = 2;
+
+	static uint32_t Pack(uint32_t v) { return ((v >> 3) & 0x1f) | ((v >> 5) & 0x7e0) | ((v >> 8) & 0xf800); }
+
+	template <typename V>
+	static typename V::T Vec(typename V::T v) {
+		typename V::T b = V::And(V::template Shr32<3>(v), V::Set32(0x1f));
+		typename V::T g = V::And(V::template Shr32<5>(v), V::Set32(0x7e0));
+		typename V::T r = V::And(V::template Shr32<8>(v), V::Set32(0xf800));
+		return V::Or(V::Or(b, g), r);
+	}
+};
+
+template <>
+struct Pack16Format<Pixel16Format::RGB555> {
+	static const int GreenDither = 1;
+
+	static uint32_t Pack(uint32_t v) { return ((v >> 3) & 0x1f) | ((v >> 6) & 0x3e0) | ((v >> 9) & 0x7c00); }
+
+	template <typename V>
+	static typename V::T Vec(typename V::T v) {
+		typename V::T b = V::And(V::template Shr32<3>(v), V::Set32(0x1f));
+		typename V::T g = V::And(V::template Shr32<6>(v), V::Set32(0x3e0));
+		typename V::T r = V::And(V::template Shr32<9>(v), V::Set32(0x7c00));
+		return V::Or(V::Or(b, g), r);
+	}
+};
+
+template <PixelFormat F, typename V>
+void ConvertRow(const uint8_t* src, uint8_t* dst, int n);
+template <Pixel16Format F, typename V>
+void DitherRow16(const uint8_t* src, uint16_t* dst, int n, int x, int y);
+template <typename V>
+void BlendRow(const uint8_t* a, const uint8_t* b, uint8_t* dst, int n, int alpha);
+template <typename V>
+uint64_t SumAbsDiffRow(const uint8_t* a, const uint8_t* b, int n);
+template <typename V>
+void FillRow(uint8_t* dst, int n, uint32_t color);
+template <typename V>
+void AddRow16(uint16_t* sums, const uint8_t* src, int n);
+template <typename V>
+void SubRow16(uint16_t* sums, const uint8_t* src, int n);
+template <typename V>
+void ScaleRow16(const uint16_t* sums, uint8_t* dst, int n, uint16_t scale);
+
+// Scalar reference kernels
+
+template <>
+inline void ConvertRow<PixelFormat::BGRA8, VecNone>(const uint8_t* src, uint8_t* dst, int n) {
+	memcpy(dst, src, (size_t) n * 4);
+}
+
+template <>
+inline void ConvertRow<PixelFormat::RGBA8, VecNone>(const uint8_t* src, uint8_t* dst, int n) {
+	for (int i = 0; i < n; i++)
+		ConvertFormat<PixelFormat::RGBA8>::Pixel(src + i * 4, dst + i * 4);
+}
+
+template <>
+inline void ConvertRow<PixelFormat::RGB8, VecNone>(const uint8_t* src, uint8_t* dst, int n) {
+	for (int i = 0; i < n; i++)
+		ConvertFormat<PixelFormat::RGB8>::Pixel(src + i * 4, dst + i * 3);
+}
+
+template <>
+inline void ConvertRow<PixelFormat::Gray8, VecNone>(const uint8_t* src, uint8_t* dst, int n) {
+	for (int i = 0; i < n; i++)
+		ConvertFormat<PixelFormat::Gray8>::Pixel(src + i * 4, dst + i);
+}
+
+template <Pixel16Format F>
+void DitherRow16Scalar(const uint8_t* src, uint16_t* dst, int n, int x, int y) {
+	const uint8_t* bayer = KernelBayer[y & 3];
+	for (int i = 0; i < n; i++, src += 4) {
+		int      t = bayer[(x + i) & 3];
+		uint32_t b = std::min(src[0] + (t >> 1), 255);
+		uint32_t g = std::min(src[1] + (t >> Pack16Format<F>::GreenDither), 255);
+		uint32_t r = std::min(src[2] + (t >> 1), 255);
+		dst[i]     = (uint16_t) Pack16Format<F>::Pack(b | (g << 8) | (r << 16));
+	}
+}
+
+template <>
+inline void DitherRow16<Pixel16Format::RGB565, VecNone>(const uint8_t* src, uint16_t* dst, int n, int x, int y) {
+	DitherRow16Scalar<Pixel16Format::RGB565>(src, dst, n, x, y);
+}
+
+template <>
+inline void DitherRow16<Pixel16Format::RGB555, VecNone>(const uint8_t* src, uint16_t* dst, int n, int x, int y) {
+	DitherRow16Scalar<Pixel16Format::RGB555>(src, dst, n, x, y);
+}
+
+template <>
+inline void BlendRow<VecNone>(const uint8_t* a, const uint8_t* b, uint8_t* dst, int n, int alpha) {
+	for (int j = 0; j < n * 4; j++)
+		dst[j] = (uint8_t)((a[j] * alpha + b[j] * (256 - alpha)) >> 8);
+}
+
+template <>
+inline uint64_t SumAbsDiffRow<VecNone>(const uint8_t* a, const uint8_t* b, int n) {
+	uint64_t sum = 0;
+	for (int j = 0; j < n * 4; j++)
+		sum += a[j] > b[j] ? a[j] - b[j] : b[j] - a[j];
+	return sum;
+}
+
+template <>
+inline void FillRow<VecNone>(uint8_t* dst, int n, uint32_t color) {
+	for (int i = 0; i < n; i++)
+		memcpy(dst + i * 4, &color, 4);
+}
+
+template <>
+inline void AddRow16<VecNone>(uint16_t* sums, const uint8_t* src, int n) {
+	for (int j = 0; j < n * 4; j++)
+		sums[j] += src[j];
+}
+
+template <>
+inline void SubRow16<VecNone>(uint16_t* sums, const uint8_t* src, int n) {
+	for (int j = 0; j < n * 4; j++)
+		sums[j] -= src[j];
+}
+
+template <>
+inline void ScaleRow16<VecNone>(const uint16_t* sums, uint8_t* dst, int n, uint16_t scale) {
+	for (int j = 0; j < n * 4; j++)
+		dst[j] = (uint8_t) std::min<uint32_t>(((uint32_t) sums[j] * scale) >> 16, 255);
+}
+
+// Vector kernels. Whatever is left over after the last whole vector goes to the scalar kernel.
+
+template <PixelFormat F, typename V>
+void ConvertRow(const uint8_t* src, uint8_t* dst, int n) {
+	const int dstBytes = F == PixelFormat::Gray8 ? 1 : (F == PixelFormat::RGB8 ? 3 : 4);
+	int       i        = 0;
+	for (; i + V::Pixels * 4 <= n; i += V::Pixels * 4)
+		ConvertFormat<F>::template Vec<V>(src + i * 4, dst + i * dstBytes);
+	ConvertRow<F, VecNone>(src + i * 4, dst + i * dstBytes, n - i);
+}
+
+// V::Pixels is a multiple of the width of the Bayer matrix, so every vector of a row adds the same
+// offsets. They are laid out as 16-bit lanes, to match the widened pixels.
+template <Pixel16Format F, typename V>
+void DitherRow16(const uint8_t* src, uint16_t* dst, int n, int x, int y) {
+	uint16_t offsets[V::Pixels * 4];
+	for (int i = 0; i < V::Pixels; i++) {
+		int t              = KernelBayer[y & 3][(x + i) & 3];
+		offsets[i * 4]     = (uint16_t)(t >> 1);
+		offsets[i * 4 + 1] = (uint16_t)(t >> Pack16Format<F>::GreenDither);
+		offsets[i * 4 + 2] = (uint16_t)(t >> 1);
+		offsets[i * 4 + 3] = 0;
+	}
+	const typename V::T dLo = V::Load((const uint8_t*) offsets);
+	const typename V::T dHi = V::Load((const uint8_t*) (offsets + V::Pixels * 2));
+	int                 i   = 0;
+	for (; i + V::Pixels * 2 <= n; i += V::Pixels * 2) {
+		typename V::T packed[2];
+		for (int k = 0; k < 2; k++) {
+			typename V::T lo, hi;
+			V::Widen8(V::Load(src + (i + k * V::Pixels) * 4), lo, hi);
+			// Narrow16 saturates, so bright pixels stay at 255
+			packed[k] = Pack16Format<F>::template Vec<V>(V::Narrow16(V::Add16(lo, dLo), V::Add16(hi, dHi)));
+		}
+		V::Store((uint8_t*) (dst + i), V::Narrow32To16(packed[0], packed[1]));
+	}
+	DitherRow16<F, VecNone>(src + i * 4, dst + i, n - i, x + i, y);
+}
+
+template <typename V>
+void BlendRow(const uint8_t* a, const uint8_t* b, uint8_t* dst, int n, int alpha) {
+	const typename V::T wa = V::Set16((uint16_t) alpha);
+	const typename V::T wb = V::Set16((uint16_t)(256 - alpha));
+	int                 i  = 0;
+	for (; i + V::Pixels <= n; i += V::Pixels) {
+		typename V::T va = V::Load(a + i * 4);
+		typename V::T vb = V::Load(b + i * 4);
+		typename V::T lo = V::template Shr16<8>(V::Add16(V::Mul16(V::UnpackLo8(va), wa), V::Mul16(V::UnpackLo8(vb), wb)));
+		typename V::T hi = V::template Shr16<8>(V::Add16(V::Mul16(V::UnpackHi8(va), wa), V::Mul16(V::UnpackHi8(vb), wb)));
+		V::Store(dst + i * 4, V::Pack16(lo, hi));
+	}
+	BlendRow<VecNone>(a + i * 4, b + i * 4, dst + i * 4, n - i, alpha);
+}
+
+template <typename V>
+uint64_t SumAbsDiffRow(const uint8_t* a, const uint8_t* b, int n) {
+	typename V::T acc = V::Zero();
+	int           i   = 0;
+	for (; i + V::Pixels <= n; i += V::Pixels)
+		acc = V::Add64(acc, V::Sad8(V::Load(a + i * 4), V::Load(b + i * 4)));
+	return V::Sum64(acc) + SumAbsDiffRow<VecNone>(a + i * 4, b + i * 4, n - i);
+}
+
+template <typename V>
+void FillRow(uint8_t* dst, int n, uint32_t color) {
+	const typename V::T c = V::Set32(color);
+	int                 i = 0;
+	for (; i + V::Pixels <= n; i += V::Pixels)
+		V::Store(dst + i * 4, c);
+	FillRow<VecNone>(dst + i * 4, n - i, color);
+}
+
+// The sums of V::Pixels pixels span two vectors
+template <typename V>
+void AddRow16(uint16_t* sums, const uint8_t* src, int n) {
+	const int half = V::Pixels * 2;
+	int       i    = 0;
+	for (; i + V::Pixels <= n; i += V::Pixels) {
+		typename V::T lo, hi;
+		V::Widen8(V::Load(src + i * 4), lo, hi);
+		uint8_t* s = (uint8_t*) (sums + i * 4);
+		V::Store(s, V::Add16(V::Load(s), lo));
+		V::Store(s + half * 2, V::Add16(V::Load(s + half * 2), hi));
+	}
+	AddRow16<VecNone>(sums + i * 4, src + i * 4, n - i);
+}
+
+template <typename V>
+void SubRow16(uint16_t* sums, const uint8_t* src, int n) {
+	const int half = V::Pixels * 2;
+	int       i    = 0;
+	for (; i + V::Pixels <= n; i += V::Pixels) {
+		typename V::T lo, hi;
+		V::Widen8(V::Load(src + i * 4), lo, hi);
+		uint8_t* s = (uint8_t*) (sums + i * 4);
+		V::Store(s, V::Sub16(V::Load(s), lo));
+		V::Store(s + half * 2, V::Sub16(V::Load(s + half * 2), hi));
+	}
+	SubRow16<VecNone>(sums + i * 4, src + i * 4, n - i);
+}
+
+template <typename V>
+void ScaleRow16(const uint16_t* sums, uint8_t* dst, int n, uint16_t scale) {
+	const typename V::T k    = V::Set16(scale);
+	const int           half = V::Pixels * 2;
+	int                 i    = 0;
+	for (; i + V::Pixels <= n; i += V::Pixels) {
+		const uint8_t* s  = (const uint8_t*) (sums + i * 4);
+		typename V::T  lo = V::MulHi16(V::Load(s), k);
+		typename V::T  hi = V::MulHi16(V::Load(s + half * 2), k);
+		V::Store(dst + i * 4, V::Narrow16(lo, hi));
+	}
+	ScaleRow16<VecNone>(sums + i * 4, dst + i * 4, n - i, scale);
+}
+
+template <typename V>
+PixelKernelTable MakeKernelTable(KernelISA isa) {
+	PixelKernelTable t;
+	t.ISA                                      = isa;
+	t.ConvertRow[(int) PixelFormat::BGRA8]     = ConvertRow<PixelFormat::BGRA8, V>;
+	t.ConvertRow[(int) PixelFormat::RGBA8]     = ConvertRow<PixelFormat::RGBA8, V>;
+	t.ConvertRow[(int) PixelFormat::RGB8]      = ConvertRow<PixelFormat::RGB8, V>;
+	t.ConvertRow[(int) PixelFormat::Gray8]     = ConvertRow<PixelFormat::Gray8, V>;
+	t.DitherRow16[(int) Pixel16Format::RGB565] = DitherRow16<Pixel16Format::RGB565, V>;
+	t.DitherRow16[(int) Pixel16Format::RGB555] = DitherRow16<Pixel16Format::RGB555, V>;
+	t.BlendRow                                 = BlendRow<V>;
+	t.SumAbsDiffRow                            = SumAbsDiffRow<V>;
+	t.FillRow                                  = FillRow<V>;
+	t.AddRow16                                 = AddRow16<V>;
+	t.SubRow16                                 = SubRow16<V>;
+	t.ScaleRow16                               = ScaleRow16<V>;
+	return t;
+}
+
+} // namespace
@@ -0,0 +1,338 @@
+#include "stdafx.h"
+#include "PrivacyMask.h"
+#include "PixelKernels.h"
+#include "FrameBlit.h"
+#include "MotionDetect.h"
+#include "Simd.h"
+
+static Rect Expand(const Rect& r, int by) {
+	return Rect(r.X1 - by, r.Y1 - by, r.X2 + by, r.Y2 + by);
+}
+
+// Grow r outwards to whole pixelation cells, which are aligned to the corner of 'area', and clipped to it
+static Rect SnapToCells(const Rect& r, const Rect& area, int size) {
+	int x1 = area.X1 + (r.X1 - area.X1) / size * size;
+	int y1 = area.Y1 + (r.Y1 - area.Y1) / size * size;
+	int x2 = std::min(area.X2, area.X1 + (r.X2 - area.X1 + size - 1) / size * size);
+	int y2 = std::min(area.Y2, area.Y1 + (r.Y2 - area.Y1 + size - 1) / size * size);
+	return Rect(x1, y1, x2, y2);
+}
+
+#ifdef WINDUP_SSE2
+// Widen the four bytes of one pixel into the low four 16-bit lanes
+static inline __m128i Widen4(const uint8_t* p) {
+	int32_t v;
+	memcpy(&v, p, 4);
+	return _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), _mm_setzero_si128());
+}
+#endif
+
+void PrivacyMasker::Reset() {
+	Output     = Bitmap();
+	HaveOutput = false;
+	Grid       = TileGrid();
+	Pool.Reset();
+	Active.clear();
+	Found.clear();
+}
+
+const Bitmap& PrivacyMasker::Apply(const Bitmap& img, const std::vector<Rect>& dirty) {
+	if (!IsActive()) {
+		if (HaveOutput)
+			Reset();
+		Dirty = dirty;
+		return img;
+	}
+
+	bool full = !HaveOutput || Output.Width != img.Width || Output.Height != img.Height;
+	if (full) {
+		Output.Width  = img.Width;
+		Output.Height = img.Height;
+		Output.Buf.clear(); // All of it is rewritten, so don't copy it
+		Output.Buf.resize((size_t) img.Stride() * img.Height);
+		BlitRects(Output.Buf.data(), Output.Stride(), img, {img.Bounds()});
+		Grid.Reset(img.Width, img.Height);
+		Refresh.assign(Grid.Count(), 1);
+		Active.clear();
+		HaveOutput = true;
+		Dirty.assign(1, img.Bounds());
+	} else {
+		// If Output switches to a buffer that missed some frames, the regions that it missed are
+		// brought up to date like changes, but they are not changes, so they don't go into Dirty
+		const auto& stale = Pool.Acquire(Output, dirty);
+		BlitRects(Output.Buf.data(), Output.Stride(), img, stale);
+		BlitRects(Output.Buf.data(), Output.Stride(), img, dirty);
+		Refresh.assign(Grid.Count(), 0);
+		Grid.MarkRects(stale, Refresh.data());
+		Grid.MarkRects(dirty, Refresh.data());
+		Dirty = dirty;
+	}
+	Output.Timing = img.Timing;
+
+	FindTemplates(img, dirty, full);
+
+	Next.clear();
+	for (const auto& m : Masks) {
+		MaskRegion c = m;
+		c.Area       = m.Area.Intersection(img.Bounds());
+		if (!c.Area.IsEmpty())
+			Next.push_back(c);
+	}
+	for (const auto& f : Found) {
+		MaskRegion c = Templates[f.Template].Mask;
+		c.Area       = f.Area;
+		Next.push_back(c);
+	}
+
+	// Masks that went away must be erased, and masks that arrived must be drawn
+	for (const auto& m : Active) {
+		if (std::find(Next.begin(), Next.end(), m) == Next.end()) {
+			BlitRects(Output.Buf.data(), Output.Stride(), img, {m.Area});
+			Grid.MarkRect(m.Area, Refresh.data());
+			Dirty.push_back(m.Area);
+		}
+	}
+	for (const auto& m : Next) {
+		if (std::find(Active.begin(), Active.end(), m) == Active.end()) {
+			Grid.MarkRect(m.Area, Refresh.data());
+			Dirty.push_back(m.Area);
+		}
+	}
+	Active.swap(Next);
+
+	Written.clear();
+	for (const auto& m : Active)
+		ApplyMask(img, m);
+	Dirty.insert(Dirty.end(), Written.begin(), Written.end());
+	Pool.Commit(Dirty);
+
+	return Output;
+}
+
+// Drop the matches that were touched by this frame's changes, and look for templates inside the changes
+void PrivacyMasker::FindTemplates(const Bitmap& img, const std::vector<Rect>& dirty, bool full) {
+	if (full) {
+		Found.clear();
+	} else {
+		size_t j = 0;
+		for (size_t i = 0; i < Found.size(); i++) {
+			bool touched = Found[i].Template >= (int) Templates.size();
+			for (const auto& d : dirty)
+				touched = touched || !d.Intersection(Found[i].Area).IsEmpty();
+			if (!touched)
+				Found[j++] = Found[i];
+		}
+		Found.resize(j);
+	}
+
+	for (int i = 0; i < (int) Templates.size(); i++) {
+		const Bitmap& t = Templates[i].Image;
+		if (t.Width == 0 || t.Height == 0 || t.Width > img.Width || t.Height > img.Height)
+			continue;
+		// Every position where the top-left corner of the template can go
+		Rect origins(0, 0, img.Width - t.Width + 1, img.Height - t.Height + 1);
+		if (full) {
+			FindTemplate(img, i, origins);
+		} else {
+			for (const auto& d : dirty)
+				FindTemplate(img, i, Rect(d.X1 - t.Width + 1, d.Y1 - t.Height + 1, d.X2, d.Y2).Intersection(origins));
+		}
+	}
+}
+
+// Find exact copies of a template, with their top-left corner inside 'origins'
+void PrivacyMasker::FindTemplate(const Bitmap& img, int index, const Rect& origins) {
+	const Bitmap& t      = Templates[index].Image;
+	uint32_t      anchor = 0;
+	memcpy(&anchor, t.Row(0), 4);
+
+	auto verify = [&](int x, int y) {
+		Rect area(x, y, x + t.Width, y + t.Height);
+		for (int ty = 0; ty < t.Height; ty++) {
+			if (!BytesEqual(img.Row(y + ty) + x * 4, t.Row(ty), t.Stride()))
+				return;
+		}
+		for (const auto& f : Found) {
+			if (f.Template == index && f.Area == area)
+				return;
+		}
+		Found.push_back({index, area});
+	};
+
+	for (int y = origins.Y1; y < origins.Y2; y++) {
+		const uint32_t* row = (const uint32_t*) img.Row(y);
+		int             x   = origins.X1;
+#ifdef WINDUP_SSE2
+		const __m128i a = _mm_set1_epi32((int) anchor);
+		for (; x + 4 <= origins.X2; x += 4) {
+			int hits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) (row + x)), a)));
+			for (int k = 0; hits != 0; k++, hits >>= 1) {
+				if (hits & 1)
+					verify(x + k, y);
+			}
+		}
+#endif
+		for (; x < origins.X2; x++) {
+			if (row[x] == anchor)
+				verify(x, y);
+		}
+	}
+}
+
+// Re-apply a mask to every run of tiles that needs a refresh. Pixelation and blur spread a
+// change beyond its own pixels, so the affected area is expanded accordingly. That in turn
+// can paint over earlier masks outside of the refreshed tiles, so wherever an earlier mask
+// painted, a later mask must paint again, to stay on top.
+void PrivacyMasker::ApplyMask(const Bitmap& img, const MaskRegion& m) {
+	int    size    = std::min(std::max(m.Size, 1), MaxMaskSize);
+	size_t earlier = Written.size();
+	for (size_t i = 0; i < earlier; i++) {
+		Rect r = Written[i].Intersection(m.Area);
+		if (!r.IsEmpty())
+			Paint(img, m, size, r);
+	}
+
+	int  spread = m.Mode == MaskMode::Blur ? size : (m.Mode == MaskMode::Pixelate ? size - 1 : 0);
+	Rect reach  = Expand(m.Area, spread).Intersection(img.Bounds());
+	if (reach.IsEmpty())
+		return;
+	int tx1 = reach.X1 / TileSize;
+	int ty1 = reach.Y1 / TileSize;
+	int tx2 = (reach.X2 - 1) / TileSize;
+	int ty2 = (reach.Y2 - 1) / TileSize;
+	for (int ty = ty1; ty <= ty2; ty++) {
+		for (int tx = tx1; tx <= tx2; tx++) {
+			if (!Refresh[ty * Grid.TilesX + tx])
+				continue;
+			int end = tx;
+			while (end + 1 <= tx2 && Refresh[ty * Grid.TilesX + end + 1])
+				end++;
+			Rect r = Grid.TileRect(ty * Grid.TilesX + tx).Union(Grid.TileRect(ty * Grid.TilesX + end));
+			tx     = end;
+			r      = Expand(r, spread).Intersection(m.Area);
+			if (!r.IsEmpty())
+				Paint(img, m, size, r);
+		}
+	}
+}
+
+// Paint the part r of a mask, and record where we painted
+void PrivacyMasker::Paint(const Bitmap& img, const MaskRegion& m, int size, Rect r) {
+	switch (m.Mode) {
+	case MaskMode::Fill:
+		Fill(m, r);
+		break;
+	case MaskMode::Pixelate:
+		r = SnapToCells(r, m.Area, size);
+		Pixelate(img, size, r);
+		break;
+	case MaskMode::Blur:
+		Blur(img, m.Area, size, r);
+		break;
+	}
+	Written.push_back(r);
+}
+
+void PrivacyMasker::Fill(const MaskRegion& m, const Rect& r) {
+	auto fill = PixelKernels().FillRow;
+	for (int y = r.Y1; y < r.Y2; y++)
+		fill(Output.Row(y) + r.X1 * 4, r.Width(), m.Color);
+}
+
+// Replace every cell of r with its average color. r must be aligned to cells.
+void PrivacyMasker::Pixelate(const Bitmap& img, int size, const Rect& r) {
+	const auto& k = PixelKernels();
+	int         w = r.Width();
+	Sums.resize((size_t) w * 4);
+	for (int cy = r.Y1; cy < r.Y2; cy += size) {
+		int ch = std::min(size, r.Y2 - cy);
+		std::fill(Sums.begin(), Sums.end(), 0);
+		for (int y = cy; y < cy + ch; y++)
+			k.AddRow16(Sums.data(), img.Row(y) + r.X1 * 4, w);
+		for (int cx = 0; cx < w; cx += size) {
+			int      cw       = std::min(size, w - cx);
+			uint32_t total[4] = {0, 0, 0, 0};
+			for (int i = cx; i < cx + cw; i++) {
+				for (int c = 0; c < 4; c++)
+					total[c] += Sums[i * 4 + c];
+			}
+			uint32_t n     = cw * ch;
+			uint8_t  px[4] = {};
+			for (int c = 0; c < 4; c++)
+				px[c] = (uint8_t)((total[c] + n / 2) / n);
+			uint32_t color;
+			memcpy(&color, px, 4);
+			for (int y = cy; y < cy + ch; y++)
+				k.FillRow(Output.Row(y) + (r.X1 + cx) * 4, cw, color);
+		}
+	}
+}
+
+// Box blur the pixels of r, reading only from inside 'area', and clamping at its edges.
+// The horizontal pass is a running sum along each row. The vertical pass keeps running
+// sums of whole rows, which is where the vector kernels do their work.
+void PrivacyMasker::Blur(const Bitmap& img, const Rect& area, int radius, const Rect& r) {
+	const auto&    k     = PixelKernels();
+	const int      n     = 2 * radius + 1;
+	const uint16_t scale = (uint16_t)((65536 + n - 1) / n);
+	int            w     = r.Width();
+	int            y1    = std::max(r.Y1 - radius, area.Y1);
+	int            y2    = std::min(r.Y2 + radius, area.Y2);
+	int            rows  = y2 - y1;
+	Rows.resize((size_t) rows * w * 4);
+
+	// Each row is first copied out with 'radius' pixels of padding on both sides, repeating the
+	// edge pixels of 'area' where it ends, so that the running sum needs no clamping.
+	int px1 = r.X1 - radius;
+	int cx1 = std::max(px1, area.X1);
+	int cx2 = std::min(r.X2 + radius, area.X2);
+	Padded.resize((size_t)(w + 2 * radius + 1) * 4);
+	for (int i = 0; i < rows; i++) {
+		const uint8_t* src = img.Row(y1 + i);
+		uint8_t*       pad = Padded.data();
+		memcpy(pad + (cx1 - px1) * 4, src + cx1 * 4, (cx2 - cx1) * 4);
+		for (int x = px1; x < cx1; x++)
+			memcpy(pad + (x - px1) * 4, src + cx1 * 4, 4);
+		for (int x = cx2; x < r.X2 + radius + 1; x++)
+			memcpy(pad + (x - px1) * 4, src + (cx2 - 1) * 4, 4);
+
+		uint8_t* dst = &Rows[(size_t) i * w * 4];
+#ifdef WINDUP_SSE2
+		// The four channel sums of one pixel live in the low 16-bit lanes of one register
+		const __m128i k16 = _mm_set1_epi16((short) scale);
+		__m128i       sum = _mm_setzero_si128();
+		for (int d = 0; d < n; d++)
+			sum = _mm_add_epi16(sum, Widen4(pad + d * 4));
+		for (int x = 0; x < w; x++) {
+			__m128i avg = _mm_mulhi_epu16(sum, k16);
+			int32_t px  = _mm_cvtsi128_si32(_mm_packus_epi16(avg, avg));
+			memcpy(dst + x * 4, &px, 4);
+			sum = _mm_sub_epi16(_mm_add_epi16(sum, Widen4(pad + (x + n) * 4)), Widen4(pad + x * 4));
+		}
+#else
+		uint32_t sum[4] = {0, 0, 0, 0};
+		for (int d = 0; d < n; d++) {
+			for (int c = 0; c < 4; c++)
+				sum[c] += pad[d * 4 + c];
+		}
+		for (int x = 0; x < w; x++) {
+			for (int c = 0; c < 4; c++) {
+				dst[x * 4 + c] = (uint8_t) std::min<uint32_t>((sum[c] * scale) >> 16, 255);
+				sum[c] += pad[(x + n) * 4 + c] - pad[x * 4 + c];
+			}
+		}
+#endif
+	}
+
+	auto row = [&](int i) { return &Rows[(size_t) std::min(std::max(i, 0), rows - 1) * w * 4]; };
+	Sums.assign((size_t) w * 4, 0);
+	int first = r.Y1 - y1;
+	for (int d = -radius; d <= radius; d++)
+		k.AddRow16(Sums.data(), row(first + d), w);
+	for (int y = r.Y1; y < r.Y2; y++) {
+		int i = y - y1;
+		k.ScaleRow16(Sums.data(), Output.Row(y) + r.X1 * 4, w, scale);
+		k.AddRow16(Sums.data(), row(i + radius + 1), w);
+		k.SubRow16(Sums.data(), row(i - radius), w);
+	}
+}
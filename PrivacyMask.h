@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Tiles.h"
+#include "FramePool.h"
+
+// PrivacyMasker redacts parts of every frame before it is recorded, streamed or saved.
+//
+// Masks are rectangles that are filled, pixelated or blurred. Templates are images that must
+// never be shown, such as a logo, and wherever an exact copy of one appears on screen, it is
+// masked too.
+//
+// The masked frame is a separate Bitmap that mirrors the captured frame. Only the regions that
+// changed are copied into it, and masks are only re-applied to the tiles that changed, so an idle
+// desktop costs nothing. Its buffers come from a FramePool, so consumers that still hold the
+// previous masked frame don't cost a copy of it. When there is nothing to mask, the captured frame
+// is passed through as is.
+// Every mask reads the original pixels, so where masks overlap, the last one wins.
+
+enum class MaskMode {
+	Fill,
+	Pixelate,
+	Blur,
+};
+
+// Largest pixelation cell, or blur radius
+static const int MaxMaskSize = 128;
+
+struct MaskRegion {
+	Rect     Area;
+	MaskMode Mode  = MaskMode::Fill;
+	int      Size  = 16;         // Pixelation cell size, or blur radius, in pixels
+	uint32_t Color = 0xff000000; // Fill color, as a little-endian BGRA pixel
+
+	bool operator==(const MaskRegion& b) const { return Area == b.Area && Mode == b.Mode && Size == b.Size && Color == b.Color; }
+	bool operator!=(const MaskRegion& b) const { return !(*this == b); }
+};
+
+struct MaskTemplate {
+	Bitmap     Image;
+	MaskRegion Mask; // How to mask the matches. Area is ignored.
+};
+
+class PrivacyMasker {
+public:
+	std::vector<MaskRegion>   Masks;     // May be changed between frames
+	std::vector<MaskTemplate> Templates; // Call Reset after changing these
+	std::vector<Rect>         Dirty;     // Output: regions of the masked frame that changed during the last Apply
+
+	bool IsActive() const { return Masks.size() != 0 || Templates.size() != 0; }
+
+	// Returns 'img' with the masks applied. 'dirty' is the list of regions of 'img' that changed since the
+	// previous call. The result is either 'img' itself, when there is nothing to mask, or a Bitmap
+	// owned by the masker, which stays valid until the next call. Copies of it are not changed by
+	// later calls, and are cheap to keep.
+	const Bitmap& Apply(const Bitmap& img, const std::vector<Rect>& dirty);
+
+	// Forget the masked frame, so that the next Apply starts from scratch
+	void Reset();
+
+private:
+	struct Match {
+		int  Template;
+		Rect Area;
+	};
+
+	Bitmap                  Output;
+	bool                    HaveOutput = false; // Output mirrors the previous frame
+	FramePool               Pool;               // Buffers for Output, which consumers may still hold
+	TileGrid                Grid;
+	std::vector<uint8_t>    Refresh; // Tiles whose masks must be applied again
+	std::vector<MaskRegion> Active;  // The masks that are applied to Output
+	std::vector<MaskRegion> Next;
+	std::vector<Match>      Found;   // Where templates appear in the frame
+	std::vector<Rect>       Written; // Where masks were painted during this Apply
+	std::vector<uint16_t>   Sums;
+	std::vector<uint8_t>    Rows;
+	std::vector<uint8_t>    Padded;
+
+	void FindTemplates(const Bitmap& img, const std::vector<Rect>& dirty, bool full);
+	void FindTemplate(const Bitmap& img, int index, const Rect& origins);
+	void ApplyMask(const Bitmap& img, const MaskRegion& m);
+	void Paint(const Bitmap& img, const MaskRegion& m, int size, Rect r);
+	void Fill(const MaskRegion& m, const Rect& r);
+	void Pixelate(const Bitmap& img, int size, const Rect& r);
+	void Blur(const Bitmap& img, const Rect& area, int radius, const Rect& r);
+};
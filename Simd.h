@@ -0,0 +1,8 @@
+#pragma once
+
+// WINDUP_SSE2 is defined when SSE2 intrinsics can be used unconditionally, which is the case
+// for every x64 CPU. Kernels that use it must keep a scalar path for other architectures.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WINDUP_SSE2 1
+#include <emmintrin.h>
+#endif
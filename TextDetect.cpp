@@ -0,0 +1,254 @@
+#include "stdafx.h"
+#include "TextDetect.h"
+#include "PixelKernels.h"
+#include "Simd.h"
+
+// Don't bother judging the stroke widths of a tile with fewer gaps than this
+static const int MinGaps = 8;
+
+// At least 1/MinRunColumnsDivisor of the columns of a text tile must have a stroke starting in them
+static const int MinRunColumnsDivisor = 8;
+
+static inline int PopCount64(uint64_t v) {
+#ifdef _MSC_VER
+#ifdef _M_X64
+	return (int) __popcnt64(v);
+#else
+	return (int) (__popcnt((uint32_t) v) + __popcnt((uint32_t)(v >> 32)));
+#endif
+#else
+	return __builtin_popcountll(v);
+#endif
+}
+
+// Bit i is set if |a[i] - b[i]| > threshold. n may not exceed 64.
+static uint64_t EdgeMask(const uint8_t* a, const uint8_t* b, int n, int threshold) {
+	uint64_t m = 0;
+	int      i = 0;
+#ifdef WINDUP_SSE2
+	const __m128i thr  = _mm_set1_epi8((char) threshold);
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		__m128i va   = _mm_loadu_si128((const __m128i*) (a + i));
+		__m128i vb   = _mm_loadu_si128((const __m128i*) (b + i));
+		__m128i d    = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+		__m128i flat = _mm_cmpeq_epi8(_mm_subs_epu8(d, thr), zero);
+		m |= (uint64_t)(~_mm_movemask_epi8(flat) & 0xffff) << i;
+	}
+#endif
+	for (; i < n; i++) {
+		if (abs(a[i] - b[i]) > threshold)
+			m |= (uint64_t) 1 << i;
+	}
+	return m;
+}
+
+// Darkest and brightest values of a w x h block of bytes
+static void MinMax(const uint8_t* p, int w, int h, int stride, int& lo, int& hi) {
+	uint8_t mn = 255;
+	uint8_t mx = 0;
+	int     x0 = 0;
+#ifdef WINDUP_SSE2
+	x0 = w & ~15;
+	if (x0 != 0) {
+		__m128i vmin = _mm_set1_epi8((char) 255);
+		__m128i vmax = _mm_setzero_si128();
+		for (int y = 0; y < h; y++) {
+			const uint8_t* row = p + y * stride;
+			for (int x = 0; x < x0; x += 16) {
+				__m128i v = _mm_loadu_si128((const __m128i*) (row + x));
+				vmin      = _mm_min_epu8(vmin, v);
+				vmax      = _mm_max_epu8(vmax, v);
+			}
+		}
+		uint8_t a[16], b[16];
+		_mm_storeu_si128((__m128i*) a, vmin);
+		_mm_storeu_si128((__m128i*) b, vmax);
+		for (int i = 0; i < 16; i++) {
+			mn = std::min(mn, a[i]);
+			mx = std::max(mx, b[i]);
+		}
+	}
+#endif
+	for (int y = 0; y < h; y++) {
+		const uint8_t* row = p + y * stride;
+		for (int x = x0; x < w; x++) {
+			mn = std::min(mn, row[x]);
+			mx = std::max(mx, row[x]);
+		}
+	}
+	lo = mn;
+	hi = mx;
+}
+
+bool TextDetector::AnalyzeTile(const Bitmap& img, const Rect& r, Rect& ink) {
+	int w = r.Width();
+	int h = r.Height();
+	if (w < 2 || h < 2)
+		return false;
+	Luma.resize(TileSize * TileSize);
+	ConvertRect(img, r, PixelFormat::Gray8, Luma.data(), TileSize);
+
+	int lo, hi;
+	MinMax(Luma.data(), w, h, TileSize, lo, hi);
+	if (hi - lo < Config.MinContrast)
+		return false;
+
+	uint64_t cols  = 0; // Columns that contain an edge
+	uint64_t runs  = 0; // Columns in which a run of horizontal steps starts
+	int      y0    = -1;
+	int      y1    = -1;
+	int      edges = 0;
+	int      gaps  = 0;
+	int      thin  = 0;
+	for (int y = 0; y < h; y++) {
+		const uint8_t* row  = &Luma[y * TileSize];
+		uint64_t       horz = EdgeMask(row, row + 1, w - 1, Config.EdgeThreshold);
+		uint64_t       vert = y + 1 < h ? EdgeMask(row, row + TileSize, w, Config.EdgeThreshold) : 0;
+		uint64_t       any  = horz | vert;
+		if (any != 0) {
+			if (y0 == -1)
+				y0 = y;
+			y1 = y;
+			cols |= any;
+			edges += PopCount64(any);
+		}
+
+		// An anti-aliased edge is a run of steps, so measure the gaps between the starts of runs.
+		// A start is thin if another start follows it within MaxStrokeWidth pixels.
+		uint64_t starts = horz & ~(horz << 1);
+		int      n      = PopCount64(starts);
+		runs |= starts;
+		if (n >= 2) {
+			uint64_t near = 0;
+			for (int k = 1; k <= Config.MaxStrokeWidth; k++)
+				near |= starts >> k;
+			gaps += n - 1;
+			thin += PopCount64(starts & near);
+		}
+	}
+
+	float density = (float) edges / (float) (w * h);
+	if (density < Config.MinEdgeDensity || density > Config.MaxEdgeDensity)
+		return false;
+	if (gaps < MinGaps || (float) thin < Config.MinThinFraction * (float) gaps)
+		return false;
+	// Glyphs put their strokes all over the place. A vertical rule has thin gaps too, but always in the same columns.
+	if (PopCount64(runs) * MinRunColumnsDivisor < w)
+		return false;
+
+	// An edge at x or y separates it from x + 1 or y + 1, so the ink extends one pixel beyond
+	int x0 = 0;
+	int x1 = w - 1;
+	while (!(cols & ((uint64_t) 1 << x0)))
+		x0++;
+	while (!(cols & ((uint64_t) 1 << x1)))
+		x1--;
+	ink = Rect(r.X1 + x0, r.Y1 + y0, std::min(r.X1 + x1 + 2, r.X2), std::min(r.Y1 + y1 + 2, r.Y2));
+	return true;
+}
+
+void TextDetector::Reset() {
+	Grid = TileGrid();
+	Tiles.clear();
+	Regions.clear();
+	// NextID keeps counting, so that IDs are never reused
+}
+
+int TextDetector::Update(const Bitmap& img, const std::vector<Rect>& dirty) {
+	if (Grid.Width != img.Width || Grid.Height != img.Height) {
+		Grid.Reset(img.Width, img.Height);
+		Tiles.assign(Grid.Count(), TileState());
+		Touched.assign(Grid.Count(), 1);
+		Regions.clear();
+	} else {
+		Touched.assign(Grid.Count(), 0);
+		Grid.MarkRects(dirty, Touched.data());
+	}
+
+	for (int t = 0; t < Grid.Count(); t++) {
+		if (Touched[t])
+			Tiles[t].IsText = AnalyzeTile(img, Grid.TileRect(t), Tiles[t].Ink);
+	}
+
+	PrevRegions.swap(Regions);
+	BuildRegions();
+	AssignIDs();
+
+	int changed = 0;
+	for (const auto& r : Regions)
+		changed += r.Changed ? 1 : 0;
+	return changed;
+}
+
+// Join text tiles that share an edge into regions
+void TextDetector::BuildRegions() {
+	Regions.clear();
+	RegionTouched.clear();
+	Component.assign(Grid.Count(), -1);
+	for (int seed = 0; seed < Grid.Count(); seed++) {
+		if (!Tiles[seed].IsText || Component[seed] != -1)
+			continue;
+		int  region     = (int) Regions.size();
+		Rect bounds     = Tiles[seed].Ink;
+		bool touched    = false;
+		Component[seed] = region;
+		Stack.clear();
+		Stack.push_back(seed);
+		while (Stack.size() != 0) {
+			int t = Stack.back();
+			Stack.pop_back();
+			bounds      = bounds.Union(Tiles[t].Ink);
+			touched     = touched || Touched[t];
+			int tx      = t % Grid.TilesX;
+			int ty      = t / Grid.TilesX;
+			int next[4] = {tx > 0 ? t - 1 : -1, tx + 1 < Grid.TilesX ? t + 1 : -1, ty > 0 ? t - Grid.TilesX : -1, ty + 1 < Grid.TilesY ? t + Grid.TilesX : -1};
+			for (int n : next) {
+				if (n != -1 && Tiles[n].IsText && Component[n] == -1) {
+					Component[n] = region;
+					Stack.push_back(n);
+				}
+			}
+		}
+		TextRegion r;
+		r.Bounds = bounds;
+		Regions.push_back(r);
+		RegionTouched.push_back(touched);
+	}
+}
+
+// Give every region the ID of a previous region that it overlaps, provided that they cover mostly
+// the same area. The largest overlaps are matched first, so that a small region inside the bounds
+// of a large one can't take its ID. Everything else gets a new ID.
+void TextDetector::AssignIDs() {
+	Matches.clear();
+	for (size_t i = 0; i < Regions.size(); i++) {
+		const Rect& r    = Regions[i].Bounds;
+		int64_t     area = (int64_t) r.Width() * r.Height();
+		for (size_t j = 0; j < PrevRegions.size(); j++) {
+			const Rect& p       = PrevRegions[j].Bounds;
+			Rect        overlap = r.Intersection(p);
+			int64_t     acc     = (int64_t) overlap.Width() * overlap.Height();
+			int64_t     smaller = std::min(area, (int64_t) p.Width() * p.Height());
+			if (acc > 0 && acc * 2 >= smaller)
+				Matches.push_back({acc, (int) i, (int) j});
+		}
+	}
+	std::sort(Matches.begin(), Matches.end(), [](const Match& a, const Match& b) { return a.Overlap > b.Overlap; });
+
+	PrevTaken.assign(PrevRegions.size(), 0);
+	for (const auto& m : Matches) {
+		auto& r = Regions[m.Region];
+		if (r.ID != 0 || PrevTaken[m.Prev])
+			continue;
+		PrevTaken[m.Prev] = 1;
+		r.ID              = PrevRegions[m.Prev].ID;
+		r.Changed         = RegionTouched[m.Region] || r.Bounds != PrevRegions[m.Prev].Bounds;
+	}
+	for (auto& r : Regions) {
+		if (r.ID == 0) {
+			r.ID      = NextID++;
+			r.Changed = true;
+		}
+	}
+}
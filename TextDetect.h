@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Tiles.h"
+
+// TextDetector finds the parts of the screen that probably contain text, so that OCR can be
+// pointed at a few small rectangles instead of a whole frame.
+//
+// Every tile is classified on its own, and only when it changes. A tile looks like text when it
+// has strong contrast, a moderate density of sharp luma edges, and when most of the gaps between
+// neighbouring edges along a row are short, which is what thin strokes and narrow letter spacing
+// look like. Photos fail the edge threshold, and flat UI chrome fails the stroke test.
+//
+// Text tiles are joined into connected regions, which are shrunk to the extent of their edges.
+// A region keeps the ID of a region in the previous frame when their overlap covers at least half
+// of the smaller of the two, so a consumer can cache OCR results by ID, and only reprocess regions
+// that are Changed. Text that scrolls by more than half its height in one frame gets a new ID.
+
+struct TextDetectConfig {
+	int   EdgeThreshold   = 40;    // Luma step (0..255) between neighbouring pixels that counts as an edge
+	int   MinContrast     = 96;    // Minimum difference between the darkest and brightest luma in a tile
+	float MinEdgeDensity  = 0.02f; // Fraction of pixels in a tile that sit on an edge
+	float MaxEdgeDensity  = 0.50f;
+	int   MaxStrokeWidth  = 6;     // Longest gap between two edges on a row that counts as a stroke or a letter gap
+	float MinThinFraction = 0.6f;  // Fraction of the gaps between edges that must be thin
+};
+
+struct TextRegion {
+	uint64_t ID      = 0;
+	Rect     Bounds;
+	bool     Changed = false; // The region is new, or it moved, or some of its pixels changed in the last Update
+};
+
+class TextDetector {
+public:
+	TextDetectConfig        Config; // Call Reset after changing this
+	std::vector<TextRegion> Regions;
+
+	// Bring Regions up to date with 'img'. 'dirty' is the list of regions that changed since the
+	// previous call. Returns the number of regions that are Changed.
+	int Update(const Bitmap& img, const std::vector<Rect>& dirty);
+
+	// Forget everything, so that the next Update analyzes the whole frame, and assigns new IDs
+	void Reset();
+
+	// Returns true if the pixels of r look like text. If so, 'ink' is set to the bounds of the edges inside r.
+	// r may not be larger than a tile.
+	bool AnalyzeTile(const Bitmap& img, const Rect& r, Rect& ink);
+
+private:
+	struct TileState {
+		bool IsText = false;
+		Rect Ink;
+	};
+
+	// A candidate for keeping the ID of a previous region
+	struct Match {
+		int64_t Overlap;
+		int     Region;
+		int     Prev;
+	};
+
+	TileGrid                Grid;
+	std::vector<TileState>  Tiles;
+	std::vector<uint8_t>    Touched;       // Tiles that changed in this Update
+	std::vector<int>        Component;     // Region index of every text tile, or -1
+	std::vector<uint8_t>    RegionTouched; // Regions that contain a tile that changed in this Update
+	std::vector<int>        Stack;
+	std::vector<uint8_t>    Luma;
+	std::vector<TextRegion> PrevRegions;
+	std::vector<uint8_t>    PrevTaken;
+	std::vector<Match>      Matches;
+	uint64_t                NextID = 1;
+
+	void BuildRegions();
+	void AssignIDs();
+};
@@ -0,0 +1,558 @@
+#include "stdafx.h"
+#include "TileStore.h"
+#include "Simd.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// The pack grows in steps of at least this many bytes, or by half of its size, whichever is more
+static const size_t MinGrowBytes = 16 * 1024 * 1024;
+
+// HashTile consumes 64 byte stripes into eight 64-bit accumulators, in the style of XXH3. Every
+// ScrambleStripes stripes, the accumulators are scrambled, so that their high bits feed back down.
+static const int ScrambleStripes = 16;
+
+static const uint64_t HashKeys[8] = {0x6aedcf4a4599a084ull, 0x41f60be07cef6aa3ull, 0x4d9dff9714f60b7aull, 0x0587212a56b73cfeull, 0x7bf8322a12847494ull, 0x1d6608f702d34789ull, 0xcec2d5ef48aa69a3ull, 0xf4d26f481e22010bull};
+
+static const uint64_t ScrambleKeys[8] = {0xdafccd9f4fa0336cull, 0xa638caa5be541a11ull, 0xe62d3f4c09274947ull, 0x110edc179ffbe863ull, 0x45869e992290176eull, 0xe565da21cb89c9f7ull, 0x27749d9fbca9e904ull, 0xfe19dbb53604c542ull};
+
+static const uint32_t ScramblePrime = 0x9e3779b1;
+static const uint64_t MixPrime      = 0x9e3779b97f4a7c15ull;
+
+static size_t Align8(size_t n) {
+	return (n + 7) & ~(size_t) 7;
+}
+
+// Murmur3 finalizer
+static uint64_t Mix64(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+// Hash 'stripes' stripes of 64 bytes at p into acc. Every lane adds the product of the two
+// halves of its keyed input, and the unkeyed input of its neighbour, so no input bits are lost.
+static void HashStripes(uint64_t* acc, const uint8_t* p, size_t stripes) {
+#ifdef WINDUP_SSE2
+	__m128i a[4];
+	for (int i = 0; i < 4; i++)
+		a[i] = _mm_loadu_si128((const __m128i*) (acc + i * 2));
+	for (size_t s = 0; s < stripes; s++, p += 64) {
+		for (int i = 0; i < 4; i++) {
+			__m128i d = _mm_loadu_si128((const __m128i*) (p + i * 16));
+			__m128i k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i*) (HashKeys + i * 2)));
+			a[i]      = _mm_add_epi64(a[i], _mm_mul_epu32(k, _mm_srli_epi64(k, 32)));
+			a[i]      = _mm_add_epi64(a[i], _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+		}
+		if (s % ScrambleStripes == ScrambleStripes - 1) {
+			const __m128i prime = _mm_set1_epi32((int) ScramblePrime);
+			for (int i = 0; i < 4; i++) {
+				__m128i x = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+				x         = _mm_xor_si128(x, _mm_loadu_si128((const __m128i*) (ScrambleKeys + i * 2)));
+				// 64 x 32 bit multiply, from two 32 x 32 bit multiplies
+				__m128i lo = _mm_mul_epu32(x, prime);
+				__m128i hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+				a[i]       = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+			}
+		}
+	}
+	for (int i = 0; i < 4; i++)
+		_mm_storeu_si128((__m128i*) (acc + i * 2), a[i]);
+#else
+	for (size_t s = 0; s < stripes; s++, p += 64) {
+		for (int i = 0; i < 8; i++) {
+			uint64_t d;
+			memcpy(&d, p + i * 8, 8);
+			uint64_t k = d ^ HashKeys[i];
+			acc[i] += (k & 0xffffffff) * (k >> 32);
+			acc[i ^ 1] += d;
+		}
+		if (s % ScrambleStripes == ScrambleStripes - 1) {
+			for (int i = 0; i < 8; i++) {
+				uint64_t x = acc[i] ^ (acc[i] >> 47) ^ ScrambleKeys[i];
+				acc[i]     = x * ScramblePrime;
+			}
+		}
+	}
+#endif
+}
+
+TileHash HashTile(const Bitmap& img, const Rect& r) {
+	// Gather the tile into a linear buffer, padded with zeros to a whole number of stripes
+	alignas(16) uint32_t px[TileSize * TileSize + 16];
+	int                  w = r.Width();
+	int                  h = r.Height();
+	size_t               n = (size_t) w * h;
+	for (int y = 0; y < h; y++)
+		memcpy(px + y * w, img.Row(r.Y1 + y) + r.X1 * 4, w * 4);
+	memset(px + n, 0, 64);
+
+	uint64_t acc[8];
+	memcpy(acc, HashKeys, sizeof(acc));
+	HashStripes(acc, (const uint8_t*) px, (n * 4 + 63) / 64);
+
+	// The size goes into both halves, so that a 32x64 tile can't collide with a 64x32 one
+	TileHash hash;
+	hash.Lo = Mix64(((uint64_t) w << 32 | h) * MixPrime);
+	hash.Hi = Mix64(hash.Lo ^ ~MixPrime);
+	for (int i = 0; i < 8; i++) {
+		hash.Lo = Mix64(hash.Lo ^ acc[i]);
+		hash.Hi = Mix64(hash.Hi + acc[7 - i]);
+	}
+	return hash;
+}
+
+TileStore::~TileStore() {
+	Close();
+}
+
+Error TileStore::Open(const std::string& filename) {
+	Close();
+	size_t size = 0;
+	auto   err  = OpenFile(filename, size);
+	if (err != "")
+		return err;
+	bool created = size == 0;
+	if (created)
+		size = sizeof(TilePackHeader) + MinGrowBytes;
+	else if (size < sizeof(TilePackHeader))
+		err = tsf::fmt("%v is not a tile pack", filename);
+	if (err == "")
+		err = Map(size);
+	if (err != "") {
+		Close();
+		return err;
+	}
+
+	if (created) {
+		Header->Magic      = TilePackMagic;
+		Header->Version    = TilePackVersion;
+		Header->Bytes      = 0;
+		Header->FrameBase  = 0;
+		Header->FirstFrame = 0;
+	} else if (Header->Magic != TilePackMagic || Header->Version != TilePackVersion || Header->Bytes > MapSize - sizeof(TilePackHeader) || Load() != "") {
+		// Unmap first, so that Close doesn't truncate somebody else's file
+		Unmap();
+		Close();
+		return tsf::fmt("%v is not a tile pack, or it is damaged", filename);
+	}
+	Filename = filename;
+	return "";
+}
+
+void TileStore::Close() {
+	// Drop the unused tail that we reserved for growth
+	size_t used = Header ? sizeof(TilePackHeader) + (size_t) Header->Bytes : 0;
+	Unmap();
+	CloseFile(used);
+	Filename = "";
+	Tiles.clear();
+	TileRefs.clear();
+	Frames.clear();
+	ByHash.clear();
+	LastTiles.clear();
+	LastWidth  = 0;
+	LastHeight = 0;
+	NumHashed  = 0;
+	NumStored  = 0;
+}
+
+// Rebuild the tables from the records in the file
+Error TileStore::Load() {
+	uint64_t offset = sizeof(TilePackHeader);
+	uint64_t end    = offset + Header->Bytes;
+	while (offset < end) {
+		if (end - offset < sizeof(TilePackRecord))
+			return "Truncated record";
+		const TilePackRecord* rec  = Record(offset);
+		uint64_t              next = offset + sizeof(TilePackRecord) + Align8(rec->Size);
+		if (next > end)
+			return "Truncated record";
+		if (rec->Kind == TilePackKindTile) {
+			if (rec->Size < sizeof(TilePackTile))
+				return "Truncated tile";
+			auto     tile = (const TilePackTile*) (rec + 1);
+			TileHash h;
+			h.Lo = tile->Hash[0];
+			h.Hi = tile->Hash[1];
+			ByHash.insert({h, (uint32_t) Tiles.size()});
+			Tiles.push_back(offset);
+		} else if (rec->Kind == TilePackKindFrame) {
+			if (rec->Size < sizeof(TilePackFrame))
+				return "Truncated frame";
+			auto     frame = (const TilePackFrame*) (rec + 1);
+			TileGrid grid(frame->Width, frame->Height);
+			if (rec->Size != sizeof(TilePackFrame) + (size_t) grid.Count() * sizeof(uint32_t))
+				return "Frame has the wrong number of tiles";
+			auto ids = (const uint32_t*) (frame + 1);
+			for (int i = 0; i < grid.Count(); i++) {
+				if (ids[i] >= Tiles.size())
+					return "Frame refers to a tile that comes after it";
+			}
+			Frames.push_back(offset);
+		} else {
+			return tsf::fmt("Unknown record kind %v", rec->Kind);
+		}
+		offset = next;
+	}
+	if (Header->FirstFrame < Header->FrameBase || Header->FirstFrame > EndFrame())
+		return "First frame is out of range";
+
+	TileRefs.assign(Tiles.size(), 0);
+	for (uint64_t f = FirstFrame(); f < EndFrame(); f++)
+		Reference(f, 1);
+	return "";
+}
+
+const uint32_t* TileStore::FrameTiles(uint64_t frame) const {
+	auto f = (const TilePackFrame*) (Record(Frames[frame - Header->FrameBase]) + 1);
+	return (const uint32_t*) (f + 1);
+}
+
+size_t TileStore::FrameTileCount(uint64_t frame) const {
+	return (Record(Frames[frame - Header->FrameBase])->Size - sizeof(TilePackFrame)) / sizeof(uint32_t);
+}
+
+void TileStore::Reference(uint64_t frame, int delta) {
+	const uint32_t* ids = FrameTiles(frame);
+	size_t          n   = FrameTileCount(frame);
+	for (size_t i = 0; i < n; i++)
+		TileRefs[ids[i]] += delta;
+}
+
+// Append a record, whose payload is 'head' followed by 'body', and return its offset
+Error TileStore::Append(uint32_t kind, const void* head, size_t headSize, const void* body, size_t bodySize, uint64_t& offset) {
+	size_t size = headSize + bodySize;
+	offset      = sizeof(TilePackHeader) + Header->Bytes;
+	size_t need = (size_t) offset + sizeof(TilePackRecord) + Align8(size);
+	if (need > MapSize) {
+		auto err = Map(std::max(need, MapSize + std::max(MapSize / 2, MinGrowBytes)));
+		if (err != "")
+			return err;
+	}
+	TilePackRecord rec;
+	rec.Kind   = kind;
+	rec.Size   = (uint32_t) size;
+	uint8_t* p = At(offset);
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), head, headSize);
+	memcpy(p + sizeof(rec) + headSize, body, bodySize);
+	memset(p + sizeof(rec) + size, 0, Align8(size) - size);
+	Header->Bytes += sizeof(TilePackRecord) + Align8(size);
+	return "";
+}
+
+Error TileStore::AddFrame(const Bitmap& img, const std::vector<Rect>& dirty, int64_t timestampMicros, uint64_t* frame) {
+	if (!Header)
+		return "Tile store is not open";
+
+	TileGrid grid(img.Width, img.Height);
+	if (img.Width != LastWidth || img.Height != LastHeight) {
+		LastWidth  = img.Width;
+		LastHeight = img.Height;
+		LastTiles.assign(grid.Count(), 0);
+		TileFlags.assign(grid.Count(), 1);
+	} else {
+		TileFlags.assign(grid.Count(), 0);
+		grid.MarkRects(dirty, TileFlags.data());
+	}
+
+	for (int i = 0; i < grid.Count(); i++) {
+		if (!TileFlags[i])
+			continue;
+		Rect     r = grid.TileRect(i);
+		TileHash h = HashTile(img, r);
+		NumHashed++;
+		auto existing = ByHash.find(h);
+		if (existing != ByHash.end()) {
+			LastTiles[i] = existing->second;
+			continue;
+		}
+		TilePackTile t;
+		t.Hash[0]  = h.Lo;
+		t.Hash[1]  = h.Hi;
+		t.Width    = (uint16_t) r.Width();
+		t.Height   = (uint16_t) r.Height();
+		t.Reserved = 0;
+		Encoded.clear();
+		TileEncode(img, r, Encoded);
+		uint64_t offset = 0;
+		auto     err    = Append(TilePackKindTile, &t, sizeof(t), Encoded.data(), Encoded.size(), offset);
+		if (err != "") {
+			// The tiles that we did store are fine, but the ones after this one would be stale
+			LastWidth = 0;
+			return err;
+		}
+		LastTiles[i] = (uint32_t) Tiles.size();
+		ByHash.insert({h, (uint32_t) Tiles.size()});
+		Tiles.push_back(offset);
+		TileRefs.push_back(0);
+		NumStored++;
+	}
+
+	TilePackFrame f;
+	f.TimestampMicros = timestampMicros;
+	f.Width           = img.Width;
+	f.Height          = img.Height;
+	uint64_t offset   = 0;
+	auto     err      = Append(TilePackKindFrame, &f, sizeof(f), LastTiles.data(), LastTiles.size() * sizeof(uint32_t), offset);
+	if (err != "")
+		return err;
+	Frames.push_back(offset);
+	for (auto id : LastTiles)
+		TileRefs[id]++;
+	if (frame)
+		*frame = EndFrame() - 1;
+	return "";
+}
+
+Error TileStore::ReadFrame(uint64_t frame, Bitmap& img, int64_t* timestampMicros) const {
+	if (!Header || frame < FirstFrame() || frame >= EndFrame())
+		return tsf::fmt("Frame %v is not in the tile store", frame);
+	auto f = (const TilePackFrame*) (Record(Frames[frame - Header->FrameBase]) + 1);
+	if (img.Width != f->Width || img.Height != f->Height) {
+		img.Width  = f->Width;
+		img.Height = f->Height;
+		img.Buf.resize((size_t) img.Stride() * img.Height);
+	}
+	if (timestampMicros)
+		*timestampMicros = f->TimestampMicros;
+
+	TileGrid        grid(f->Width, f->Height);
+	const uint32_t* ids = (const uint32_t*) (f + 1);
+	for (int i = 0; i < grid.Count(); i++) {
+		Rect                  r    = grid.TileRect(i);
+		const TilePackRecord* rec  = Record(Tiles[ids[i]]);
+		auto                  tile = (const TilePackTile*) (rec + 1);
+		if (tile->Width != r.Width() || tile->Height != r.Height() || !TileDecode((const uint8_t*) (tile + 1), rec->Size - sizeof(TilePackTile), img, r))
+			return tsf::fmt("Tile %v of frame %v is damaged", i, frame);
+	}
+	return "";
+}
+
+void TileStore::DropFrames(uint64_t frame) {
+	if (!Header)
+		return;
+	frame = std::min(frame, EndFrame());
+	for (uint64_t f = FirstFrame(); f < frame; f++)
+		Reference(f, -1);
+	if (frame > Header->FirstFrame)
+		Header->FirstFrame = frame;
+}
+
+Error TileStore::Compact() {
+	if (!Header)
+		return "Tile store is not open";
+
+	// Number the live tiles in the order that they appear, so that they still come before their frames
+	std::vector<uint32_t> renumber(Tiles.size(), UINT32_MAX);
+	uint32_t              live = 0;
+	for (size_t i = 0; i < Tiles.size(); i++) {
+		if (TileRefs[i] != 0)
+			renumber[i] = live++;
+	}
+
+	std::string tmp = Filename + ".compact";
+	FILE*       out = fopen(tmp.c_str(), "wb");
+	if (!out)
+		return tsf::fmt("Failed to open %v", tmp);
+	TilePackHeader h;
+	h.Magic      = TilePackMagic;
+	h.Version    = TilePackVersion;
+	h.Bytes      = 0;
+	h.FrameBase  = FirstFrame();
+	h.FirstFrame = FirstFrame();
+	fwrite(&h, sizeof(h), 1, out);
+	for (size_t i = 0; i < Tiles.size(); i++) {
+		if (TileRefs[i] == 0)
+			continue;
+		size_t size = sizeof(TilePackRecord) + Align8(Record(Tiles[i])->Size);
+		fwrite(At(Tiles[i]), size, 1, out);
+		h.Bytes += size;
+	}
+	std::vector<uint32_t> ids;
+	for (uint64_t f = FirstFrame(); f < EndFrame(); f++) {
+		const TilePackRecord* rec = Record(Frames[f - Header->FrameBase]);
+		const uint32_t*       old = FrameTiles(f);
+		ids.resize(FrameTileCount(f) + 1); // +1 for the padding
+		for (size_t i = 0; i + 1 < ids.size(); i++)
+			ids[i] = renumber[old[i]];
+		ids.back() = 0;
+		fwrite(rec, sizeof(TilePackRecord) + sizeof(TilePackFrame), 1, out);
+		fwrite(ids.data(), Align8(rec->Size) - sizeof(TilePackFrame), 1, out);
+		h.Bytes += sizeof(TilePackRecord) + Align8(rec->Size);
+	}
+	fseek(out, 0, SEEK_SET);
+	fwrite(&h, sizeof(h), 1, out);
+	bool ok = fflush(out) == 0 && !ferror(out);
+	fclose(out);
+	if (!ok) {
+		remove(tmp.c_str());
+		return tsf::fmt("Failed to write %v", tmp);
+	}
+
+	// Swap the new pack in. The counters and the tiles of the last frame carry over.
+	std::string           filename  = Filename;
+	std::vector<uint32_t> lastTiles = LastTiles;
+	int                   width     = LastWidth;
+	int                   height    = LastHeight;
+	uint64_t              hashed    = NumHashed;
+	uint64_t              stored    = NumStored;
+	Close();
+#ifdef _WIN32
+	bool moved = MoveFileExA(tmp.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	bool moved = rename(tmp.c_str(), filename.c_str()) == 0;
+#endif
+	auto err = Open(filename);
+	if (err != "")
+		return err;
+	if (!moved)
+		return tsf::fmt("Failed to replace %v with %v", filename, tmp);
+	NumHashed = hashed;
+	NumStored = stored;
+	// If every frame was dropped, the last frame's tiles may be gone too
+	if (FirstFrame() != EndFrame()) {
+		LastTiles  = lastTiles;
+		LastWidth  = width;
+		LastHeight = height;
+		for (auto& id : LastTiles)
+			id = renumber[id];
+	}
+	return "";
+}
+
+TileStoreStats TileStore::Stats() const {
+	TileStoreStats s;
+	if (!Header)
+		return s;
+	s.Frames      = EndFrame() - FirstFrame();
+	s.Tiles       = Tiles.size();
+	s.HashedTiles = NumHashed;
+	s.StoredTiles = NumStored;
+	s.PackBytes   = sizeof(TilePackHeader) + Header->Bytes;
+	for (uint64_t f = FirstFrame(); f < EndFrame(); f++) {
+		auto frame = (const TilePackFrame*) (Record(Frames[f - Header->FrameBase]) + 1);
+		s.TileRefs += FrameTileCount(f);
+		s.PixelBytes += (uint64_t) frame->Width * frame->Height * 4;
+	}
+	for (size_t i = 0; i < Tiles.size(); i++) {
+		if (TileRefs[i] != 0) {
+			s.LiveTiles++;
+			s.TileBytes += sizeof(TilePackRecord) + Align8(Record(Tiles[i])->Size);
+		}
+	}
+	if (s.LiveTiles != 0)
+		s.DedupRatio = (double) s.TileRefs / s.LiveTiles;
+	if (s.PackBytes != 0)
+		s.SpaceSavings = (double) s.PixelBytes / s.PackBytes;
+	return s;
+}
+
+#ifdef _WIN32
+
+Error TileStore::OpenFile(const std::string& filename, size_t& size) {
+	File = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (File == INVALID_HANDLE_VALUE)
+		return tsf::fmt("Failed to open %v: %v", filename, GetLastError());
+	LARGE_INTEGER li;
+	GetFileSizeEx(File, &li);
+	size = (size_t) li.QuadPart;
+	return "";
+}
+
+void TileStore::CloseFile(size_t finalSize) {
+	if (File == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER li;
+	li.QuadPart = (LONGLONG) finalSize;
+	if (finalSize != 0 && SetFilePointerEx(File, li, nullptr, FILE_BEGIN))
+		SetEndOfFile(File);
+	CloseHandle(File);
+	File = INVALID_HANDLE_VALUE;
+}
+
+// Map the first 'size' bytes of the file, growing the file if necessary
+Error TileStore::Map(size_t size) {
+	Unmap();
+	Mapping = CreateFileMappingW(File, nullptr, PAGE_READWRITE, (DWORD)((uint64_t) size >> 32), (DWORD) size, nullptr);
+	if (!Mapping)
+		return tsf::fmt("CreateFileMapping failed: %v", GetLastError());
+	Header = (TilePackHeader*) MapViewOfFile(Mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!Header) {
+		auto err = tsf::fmt("MapViewOfFile failed: %v", GetLastError());
+		Unmap();
+		return err;
+	}
+	MapSize = size;
+	return "";
+}
+
+void TileStore::Unmap() {
+	if (Header)
+		UnmapViewOfFile(Header);
+	if (Mapping)
+		CloseHandle(Mapping);
+	Header  = nullptr;
+	Mapping = nullptr;
+	MapSize = 0;
+}
+
+#else
+
+Error TileStore::OpenFile(const std::string& filename, size_t& size) {
+	File = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+	if (File == -1)
+		return tsf::fmt("Failed to open %v: %v", filename, strerror(errno));
+	struct stat st;
+	if (fstat(File, &st) != 0) {
+		auto err = tsf::fmt("fstat failed: %v", strerror(errno));
+		CloseFile(0);
+		return err;
+	}
+	size = (size_t) st.st_size;
+	return "";
+}
+
+void TileStore::CloseFile(size_t finalSize) {
+	if (File == -1)
+		return;
+	// If this fails, the unused tail is simply ignored when the pack is reopened
+	if (finalSize != 0)
+		(void) !ftruncate(File, (off_t) finalSize);
+	close(File);
+	File = -1;
+}
+
+// Map the first 'size' bytes of the file, growing the file if necessary
+Error TileStore::Map(size_t size) {
+	Unmap();
+	struct stat st;
+	if (fstat(File, &st) != 0)
+		return tsf::fmt("fstat failed: %v", strerror(errno));
+	if ((size_t) st.st_size < size && ftruncate(File, (off_t) size) != 0)
+		return tsf::fmt("ftruncate failed: %v", strerror(errno));
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, File, 0);
+	if (p == MAP_FAILED)
+		return tsf::fmt("mmap failed: %v", strerror(errno));
+	Header  = (TilePackHeader*) p;
+	MapSize = size;
+	return "";
+}
+
+void TileStore::Unmap() {
+	if (Header)
+		munmap(Header, MapSize);
+	Header  = nullptr;
+	MapSize = 0;
+}
+
+#endif
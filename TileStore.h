@@ -0,0 +1,157 @@
+#pragma once
+
+#include "Tiles.h"
+
+// TileStore records frames into a content-addressed tile pack, so that content which reappears,
+// such as a window that is switched back to, a blinking cursor or an idle desktop, is stored once.
+//
+// Every 64x64 tile (see Tiles.h) is hashed with a 128-bit non-cryptographic hash of its pixels.
+// A tile whose hash is already in the pack is not stored again. Otherwise it is compressed with
+// TileEncode and appended. A frame is stored as the grid of tile numbers that make it up. Tiles
+// that are not touched by the dirty rects of a frame keep the numbers that they had in the previous
+// frame, so only the tiles that changed are hashed.
+//
+// File layout (append only):
+//   TilePackHeader
+//   Records, each of which is a TilePackRecord, followed by its payload, padded to 8 bytes:
+//     TilePackTile,  followed by the TileEncode bytes of the tile
+//     TilePackFrame, followed by TilesX * TilesY uint32 tile numbers, in row major order
+//
+// Tiles are numbered in the order that they appear in the file, and a frame only refers to tiles
+// that come before it. Frames are numbered from the header's FrameBase.
+//
+// The file is memory mapped, and grown in large steps. Bytes is only advanced after a record has
+// been written, so a crash leaves a valid pack behind.
+//
+// A recorder that only keeps the last N minutes drops older frames with DropFrames. That only
+// advances FirstFrame; Compact then rewrites the pack without the dropped frames, and without the
+// tiles that no remaining frame refers to.
+
+static const uint32_t TilePackMagic   = 0x4b415054; // 'TPAK'
+static const uint32_t TilePackVersion = 1;
+
+struct TilePackHeader {
+	uint32_t Magic;
+	uint32_t Version;
+	uint64_t Bytes;      // Bytes of valid records after the header
+	uint64_t FrameBase;  // Number of the first frame record in the file
+	uint64_t FirstFrame; // Frames before this were dropped
+};
+
+enum TilePackKind {
+	TilePackKindTile  = 1,
+	TilePackKindFrame = 2,
+};
+
+struct TilePackRecord {
+	uint32_t Kind; // TilePackKind
+	uint32_t Size; // Bytes of payload that follow, not counting the padding
+};
+
+struct TilePackTile {
+	uint64_t Hash[2];
+	uint16_t Width;
+	uint16_t Height;
+	uint32_t Reserved;
+};
+
+struct TilePackFrame {
+	int64_t TimestampMicros;
+	int32_t Width;
+	int32_t Height;
+};
+
+struct TileHash {
+	uint64_t Lo = 0;
+	uint64_t Hi = 0;
+
+	bool operator==(const TileHash& b) const { return Lo == b.Lo && Hi == b.Hi; }
+	bool operator!=(const TileHash& b) const { return !(*this == b); }
+};
+
+// 128-bit hash of the pixels of r, which must lie inside img and be at most TileSize on each side.
+// Equal pixels hash equal, no matter where they are, but tiles of different sizes never do.
+TileHash HashTile(const Bitmap& img, const Rect& r);
+
+struct TileStoreStats {
+	uint64_t Frames       = 0; // Frames that have not been dropped
+	uint64_t TileRefs     = 0; // Tile numbers in those frames
+	uint64_t Tiles        = 0; // Tiles in the pack
+	uint64_t LiveTiles    = 0; // Tiles that at least one of those frames refers to
+	uint64_t HashedTiles  = 0; // Tiles that were hashed since the pack was opened, because they changed
+	uint64_t StoredTiles  = 0; // Tiles that were appended since the pack was opened, because their hash was new
+	uint64_t PixelBytes   = 0; // Uncompressed size of the frames that have not been dropped
+	uint64_t PackBytes    = 0; // Size of the pack, including dropped frames and dead tiles
+	uint64_t TileBytes    = 0; // Bytes of the live tiles in the pack
+	double   DedupRatio   = 0; // TileRefs / LiveTiles
+	double   SpaceSavings = 0; // PixelBytes / PackBytes
+};
+
+class TileStore {
+public:
+	~TileStore();
+
+	Error Open(const std::string& filename); // Opens an existing pack, or creates a new one
+	void  Close();
+	bool  IsOpen() const { return Header != nullptr; }
+
+	// Frames that can be read are numbered [FirstFrame, EndFrame)
+	uint64_t FirstFrame() const { return Header ? Header->FirstFrame : 0; }
+	uint64_t EndFrame() const { return Header ? Header->FrameBase + Frames.size() : 0; }
+
+	// Store a frame. Tiles outside of 'dirty' are taken to be the same as in the previous frame, if
+	// it had the same size. If 'frame' is not null, it receives the number of the new frame.
+	Error AddFrame(const Bitmap& img, const std::vector<Rect>& dirty, int64_t timestampMicros, uint64_t* frame = nullptr);
+
+	// Decode a frame into img, which is resized if necessary
+	Error ReadFrame(uint64_t frame, Bitmap& img, int64_t* timestampMicros = nullptr) const;
+
+	// Drop every frame before 'frame'. The tiles that only they refer to stay in the pack until Compact.
+	void DropFrames(uint64_t frame);
+
+	// Rewrite the pack without the dropped frames, and without the tiles that no other frame refers to.
+	// Frame numbers stay the same, but tile numbers change.
+	Error Compact();
+
+	TileStoreStats Stats() const;
+
+private:
+	struct HashOf {
+		size_t operator()(const TileHash& h) const { return (size_t) h.Lo; }
+	};
+
+	std::string                                    Filename;
+	TilePackHeader*                                Header  = nullptr;
+	size_t                                         MapSize = 0;
+	std::vector<uint64_t>                          Tiles;     // Offset of every tile record, from the start of the file
+	std::vector<uint32_t>                          TileRefs;  // Number of live frames that refer to every tile
+	std::vector<uint64_t>                          Frames;    // Offset of every frame record, including dropped ones
+	std::unordered_map<TileHash, uint32_t, HashOf> ByHash;    // Tile number of every hash
+	std::vector<uint32_t>                          LastTiles; // Tile numbers of the last frame
+	int                                            LastWidth  = 0;
+	int                                            LastHeight = 0;
+	std::vector<uint8_t>                           TileFlags;
+	std::vector<uint8_t>                           Encoded;
+	uint64_t                                       NumHashed = 0;
+	uint64_t                                       NumStored = 0;
+#ifdef _WIN32
+	HANDLE File    = INVALID_HANDLE_VALUE;
+	HANDLE Mapping = nullptr;
+#else
+	int File = -1;
+#endif
+
+	uint8_t*              At(uint64_t offset) const { return (uint8_t*) Header + offset; }
+	const TilePackRecord* Record(uint64_t offset) const { return (const TilePackRecord*) At(offset); }
+	const uint32_t*       FrameTiles(uint64_t frame) const;
+	size_t                FrameTileCount(uint64_t frame) const;
+
+	Error Load();
+	Error Append(uint32_t kind, const void* head, size_t headSize, const void* body, size_t bodySize, uint64_t& offset);
+	void  Reference(uint64_t frame, int delta);
+
+	Error OpenFile(const std::string& filename, size_t& size);
+	void  CloseFile(size_t finalSize); // If finalSize is not zero, truncate the file to that size
+	Error Map(size_t size);
+	void  Unmap();
+};
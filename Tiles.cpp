@@ -0,0 +1,170 @@
+#include "stdafx.h"
+#include "Tiles.h"
+
+void TileGrid::Reset(int width, int height) {
+	Width  = width;
+	Height = height;
+	TilesX = (width + TileSize - 1) / TileSize;
+	TilesY = (height + TileSize - 1) / TileSize;
+}
+
+Rect TileGrid::TileRect(int tile) const {
+	int tx = tile % TilesX;
+	int ty = tile / TilesX;
+	return Rect(tx * TileSize, ty * TileSize, std::min((tx + 1) * TileSize, Width), std::min((ty + 1) * TileSize, Height));
+}
+
+void TileGrid::MarkRect(const Rect& r, uint8_t* flags) const {
+	Rect c = r.Intersection(Rect(0, 0, Width, Height));
+	if (c.IsEmpty())
+		return;
+	int tx1 = c.X1 / TileSize;
+	int ty1 = c.Y1 / TileSize;
+	int tx2 = (c.X2 - 1) / TileSize;
+	int ty2 = (c.Y2 - 1) / TileSize;
+	for (int ty = ty1; ty <= ty2; ty++)
+		memset(flags + ty * TilesX + tx1, 1, tx2 - tx1 + 1);
+}
+
+void TileGrid::MarkRects(const std::vector<Rect>& rects, uint8_t* flags) const {
+	for (const auto& r : rects)
+		MarkRect(r, flags);
+}
+
+// Op codes. The low 6 bits hold (count - 1).
+enum TileOps {
+	TileOpRun     = 0x00, // Repeat the previous pixel
+	TileOpAbove   = 0x40, // Copy pixels from the row above
+	TileOpLiteral = 0x80, // Literal pixels follow
+	TileOpMask    = 0xc0,
+};
+
+enum TileFlags {
+	TileFlagAlpha = 1, // Literals are BGRA. Without this flag they are BGR, and alpha is 255.
+};
+
+static const int TileMaxCount = 64;
+
+size_t TileEncode(const Bitmap& img, const Rect& r, std::vector<uint8_t>& out) {
+	const int w = r.Width();
+	const int h = r.Height();
+	const int n = w * h;
+
+	// Gather the tile into a linear buffer, so that "previous" and "above" are just offsets,
+	// and runs can continue from the end of one row onto the next.
+	uint32_t px[TileSize * TileSize];
+	uint32_t alphaAnd = 0xff000000;
+	for (int y = 0; y < h; y++) {
+		memcpy(px + y * w, img.Row(r.Y1 + y) + r.X1 * 4, w * 4);
+		for (int x = 0; x < w; x++)
+			alphaAnd &= px[y * w + x];
+	}
+	bool alpha = alphaAnd != 0xff000000;
+
+	size_t start = out.size();
+	// Worst case is all literals. The +1 is because we always copy 4 bytes per literal, even when we only keep 3.
+	out.resize(start + 1 + n * (alpha ? 4 : 3) + (n + TileMaxCount - 1) / TileMaxCount + 1);
+	uint8_t* o = out.data() + start;
+	*o++       = alpha ? TileFlagAlpha : 0;
+
+	int i = 0;
+	while (i < n) {
+		// measure the runs available at i
+		int run = 0;
+		if (i > 0) {
+			uint32_t prev = px[i - 1];
+			while (run < TileMaxCount && i + run < n && px[i + run] == prev)
+				run++;
+		}
+		int above = 0;
+		if (i >= w) {
+			while (above < TileMaxCount && i + above < n && px[i + above] == px[i + above - w])
+				above++;
+		}
+
+		if (run >= 2 || above >= 2 || (run == 1 && i + 1 == n) || (above == 1 && i + 1 == n)) {
+			if (above > run) {
+				*o++ = (uint8_t)(TileOpAbove | (above - 1));
+				i += above;
+			} else {
+				*o++ = (uint8_t)(TileOpRun | (run - 1));
+				i += run;
+			}
+			continue;
+		}
+
+		// Emit literals until we reach something that is worth encoding as a run
+		int j = i + 1;
+		for (; j < n && j - i < TileMaxCount; j++) {
+			if (j + 1 < n) {
+				if (px[j] == px[j - 1] && px[j + 1] == px[j])
+					break;
+				if (j >= w && px[j] == px[j - w] && px[j + 1] == px[j + 1 - w])
+					break;
+			}
+		}
+		int count = j - i;
+		*o++      = (uint8_t)(TileOpLiteral | (count - 1));
+		for (; i < j; i++) {
+			memcpy(o, &px[i], 4);
+			o += alpha ? 4 : 3;
+		}
+	}
+
+	size_t len = o - (out.data() + start);
+	out.resize(start + len);
+	return len;
+}
+
+bool TileDecode(const uint8_t* src, size_t len, Bitmap& img, const Rect& r) {
+	const int w = r.Width();
+	const int h = r.Height();
+	const int n = w * h;
+	if (len < 1 || r.Intersection(img.Bounds()).Width() != w || r.Intersection(img.Bounds()).Height() != h)
+		return false;
+
+	const uint8_t* end   = src + len;
+	bool           alpha = (*src++ & TileFlagAlpha) != 0;
+	int            bpp   = alpha ? 4 : 3;
+
+	uint32_t px[TileSize * TileSize];
+	int      i = 0;
+	while (i < n) {
+		if (src >= end)
+			return false;
+		uint8_t op    = *src++;
+		int     count = (op & ~TileOpMask) + 1;
+		if (i + count > n)
+			return false;
+		switch (op & TileOpMask) {
+		case TileOpRun:
+			if (i == 0)
+				return false;
+			for (int k = 0; k < count; k++, i++)
+				px[i] = px[i - 1];
+			break;
+		case TileOpAbove:
+			if (i < w)
+				return false;
+			for (int k = 0; k < count; k++, i++)
+				px[i] = px[i - w];
+			break;
+		case TileOpLiteral:
+			if (end - src < count * bpp)
+				return false;
+			for (int k = 0; k < count; k++, i++) {
+				uint32_t p = 0xff000000;
+				memcpy(&p, src, bpp);
+				src += bpp;
+				px[i] = p;
+			}
+			break;
+		default:
+			return false;
+		}
+	}
+
+	for (int y = 0; y < h; y++)
+		memcpy(img.Row(r.Y1 + y) + r.X1 * 4, px + y * w, w * 4);
+	return true;
+}
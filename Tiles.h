@@ -0,0 +1,37 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// Many consumers of captured frames work on a fixed grid of square tiles, so that they only
+// need to touch the parts of the screen that changed. This is that grid, and a fast lossless
+// codec for individual tiles.
+
+static const int TileSize = 64;
+
+struct TileGrid {
+	int Width  = 0; // Size of the image, in pixels
+	int Height = 0;
+	int TilesX = 0; // Number of tiles across
+	int TilesY = 0; // Number of tiles down
+
+	TileGrid() {}
+	TileGrid(int width, int height) { Reset(width, height); }
+
+	void Reset(int width, int height);
+	int  Count() const { return TilesX * TilesY; }
+	Rect TileRect(int tile) const;
+
+	// Set flags[i] = 1 for every tile that overlaps r. 'flags' must hold Count() elements.
+	void MarkRect(const Rect& r, uint8_t* flags) const;
+	void MarkRects(const std::vector<Rect>& rects, uint8_t* flags) const;
+};
+
+// Append the losslessly compressed pixels of 'r' (which must lie inside 'img') to 'out'.
+// The codec is built for desktop content: it run-length encodes repeated pixels and pixels
+// that are identical to the one above, and stores everything else as literals.
+// Returns the number of bytes appended.
+size_t TileEncode(const Bitmap& img, const Rect& r, std::vector<uint8_t>& out);
+
+// Decode a tile that was produced by TileEncode into the rectangle 'r' of 'img'.
+// Returns false if the encoded data is corrupt.
+bool TileDecode(const uint8_t* src, size_t len, Bitmap& img, const Rect& r);
@@ -1,11 +1,14 @@
 #include "stdafx.h"
 #include "WinDesktopDup.h"
+#include "FrameTrace.h"
 
 WinDesktopDup::~WinDesktopDup() {
 	Close();
 }
 
 Error WinDesktopDup::Initialize() {
+	Close();
+
 	// Get desktop
 	HDESK hDesk = OpenInputDesktop(0, FALSE, GENERIC_ALL);
 	if (!hDesk)
@@ -105,6 +108,9 @@ Error WinDesktopDup::Initialize() {
 }
 
 void WinDesktopDup::Close() {
+	if (StagingTex)
+		StagingTex->Release();
+
 	if (DeskDupl)
 		DeskDupl->Release();
 
@@ -114,13 +120,19 @@ void WinDesktopDup::Close() {
 	if (D3DDevice)
 		D3DDevice->Release();
 
+	StagingTex       = nullptr;
 	DeskDupl         = nullptr;
 	D3DDeviceContext = nullptr;
 	D3DDevice        = nullptr;
 	HaveFrameLock    = false;
 }
 
-bool WinDesktopDup::CaptureNext() {
+Rect WinDesktopDup::DesktopRect() const {
+	const RECT& r = OutputDesc.DesktopCoordinates;
+	return Rect(r.left, r.top, r.right, r.bottom);
+}
+
+bool WinDesktopDup::CaptureNext(int timeoutMs) {
 	if (!DeskDupl)
 		return false;
 
@@ -137,20 +149,29 @@ bool WinDesktopDup::CaptureNext() {
 
 	IDXGIResource*          deskRes = nullptr;
 	DXGI_OUTDUPL_FRAME_INFO frameInfo;
-	hr = DeskDupl->AcquireNextFrame(0, &frameInfo, &deskRes);
+	hr = DeskDupl->AcquireNextFrame(timeoutMs, &frameInfo, &deskRes);
+	int64_t acquireMicros = MonotonicMicros();
 	if (hr == DXGI_ERROR_WAIT_TIMEOUT) {
 		// nothing to see here
 		return false;
 	}
 	if (FAILED(hr)) {
-		// perhaps shutdown and reinitialize
+		// Usually DXGI_ERROR_ACCESS_LOST. Whatever it is, this duplication is done for, and the caller
+		// must Initialize again. The new staging texture makes the next frame a full one.
 		auto msg = tsf::fmt("Acquire failed: %x\n", hr);
 		OutputDebugStringA(msg.c_str());
+		Close();
 		return false;
 	}
 
 	HaveFrameLock = true;
 
+	if (frameInfo.LastPresentTime.QuadPart == 0) {
+		// Only the mouse moved. The desktop image is unchanged.
+		deskRes->Release();
+		return false;
+	}
+
 	ID3D11Texture2D* gpuTex = nullptr;
 	hr                      = deskRes->QueryInterface(__uuidof(ID3D11Texture2D), (void**) &gpuTex);
 	deskRes->Release();
@@ -160,41 +181,166 @@ bool WinDesktopDup::CaptureNext() {
 		return false;
 	}
 
-	bool ok = true;
-
 	D3D11_TEXTURE2D_DESC desc;
 	gpuTex->GetDesc(&desc);
-	desc.CPUAccessFlags     = D3D11_CPU_ACCESS_WRITE | D3D11_CPU_ACCESS_READ;
-	desc.Usage              = D3D11_USAGE_STAGING;
-	desc.BindFlags          = 0;
-	desc.MiscFlags          = 0; // D3D11_RESOURCE_MISC_GDI_COMPATIBLE ?
-	ID3D11Texture2D* cpuTex = nullptr;
-	hr                      = D3DDevice->CreateTexture2D(&desc, nullptr, &cpuTex);
-	if (SUCCEEDED(hr)) {
-		D3DDeviceContext->CopyResource(cpuTex, gpuTex);
+
+	// Hang onto the staging texture between frames. Creating it is expensive, and because it retains
+	// the previous frame, we only need to bring the dirty regions across. If a readback failed,
+	// then Latest is missing changes that only the staging texture has, so read all of it.
+	bool fullFrame = ReadbackFailed;
+	if (StagingTex) {
+		D3D11_TEXTURE2D_DESC stageDesc;
+		StagingTex->GetDesc(&stageDesc);
+		if (stageDesc.Width != desc.Width || stageDesc.Height != desc.Height || stageDesc.Format != desc.Format) {
+			StagingTex->Release();
+			StagingTex = nullptr;
+		}
+	}
+	if (!StagingTex) {
+		desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE | D3D11_CPU_ACCESS_READ;
+		desc.Usage          = D3D11_USAGE_STAGING;
+		desc.BindFlags      = 0;
+		desc.MiscFlags      = 0; // D3D11_RESOURCE_MISC_GDI_COMPATIBLE ?
+		hr                  = D3DDevice->CreateTexture2D(&desc, nullptr, &StagingTex);
+		if (FAILED(hr)) {
+			// not expected
+			gpuTex->Release();
+			return false;
+		}
+		fullFrame = true;
+	}
+
+	if (Latest.Width != desc.Width || Latest.Height != desc.Height) {
+		Latest.Width  = desc.Width;
+		Latest.Height = desc.Height;
+		// All of it is about to be rewritten, so don't copy the old contents
+		Latest.Buf.clear();
+		Latest.Buf.resize(desc.Width * desc.Height * 4);
+		Pool.Reset();
+		fullFrame = true;
+	}
+
+	if (fullFrame || !ReadFrameRects(frameInfo)) {
+		DirtyRects.clear();
+		Moves.clear();
+		DirtyRects.push_back(Latest.Bounds());
+		RedrawnRects = DirtyRects;
+	}
+
+	// Consumers may still hold the previous frame. Rather than copying all of it on write, switch
+	// to a buffer that they are done with, and also bring across the regions that buffer missed.
+	// StagingTex holds the whole desktop, so any region can be read from it.
+	const auto& stale = Pool.Acquire(Latest, DirtyRects);
+
+	if (DirtyRects.size() == 1 && DirtyRects[0].Width() == Latest.Width && DirtyRects[0].Height() == Latest.Height) {
+		D3DDeviceContext->CopyResource(StagingTex, gpuTex);
 	} else {
-		// not expected
-		ok = false;
+		for (const auto& r : DirtyRects) {
+			D3D11_BOX box = {(UINT) r.X1, (UINT) r.Y1, 0, (UINT) r.X2, (UINT) r.Y2, 1};
+			D3DDeviceContext->CopySubresourceRegion(StagingTex, 0, r.X1, r.Y1, 0, gpuTex, 0, &box);
+		}
 	}
+	gpuTex->Release();
+
+	bool ok = true;
 
-	//UINT                     subresource = D3D11CalcSubresource(0, 0, 0);
 	D3D11_MAPPED_SUBRESOURCE sr;
-	hr = D3DDeviceContext->Map(cpuTex, 0, D3D11_MAP_READ, 0, &sr);
+	hr = D3DDeviceContext->Map(StagingTex, 0, D3D11_MAP_READ, 0, &sr);
 	if (SUCCEEDED(hr)) {
-		if (Latest.Width != desc.Width || Latest.Height != desc.Height) {
-			Latest.Width  = desc.Width;
-			Latest.Height = desc.Height;
-			Latest.Buf.resize(desc.Width * desc.Height * 4);
+		uint8_t*       dst = Latest.Buf.data();
+		const uint8_t* src = (const uint8_t*) sr.pData;
+		if (fullFrame && Copier.Recall(Latest.Stride(), (int) sr.RowPitch, Latest.Bounds())) {
+			Copier.Copy(dst, Latest.Stride(), src, (int) sr.RowPitch, Latest.Bounds());
+		} else if (fullFrame) {
+			// Calibrating copies the whole frame, many times over, so it only happens once per size
+			auto timings = Copier.Calibrate(dst, Latest.Stride(), src, (int) sr.RowPitch, Latest.Bounds());
+			auto msg     = tsf::fmt("Readback copy strategy: %v\n", CopyStrategyName(Copier.Strategy));
+			for (const auto& t : timings)
+				msg += tsf::fmt("  %-10v %8.0f us  %5.1f GB/s\n", CopyStrategyName(t.Strategy), t.Micros, t.GBPerSec);
+			OutputDebugStringA(msg.c_str());
+		} else {
+			for (const auto& r : stale)
+				Copier.Copy(dst, Latest.Stride(), src, (int) sr.RowPitch, r);
+			for (const auto& r : DirtyRects)
+				Copier.Copy(dst, Latest.Stride(), src, (int) sr.RowPitch, r);
 		}
-		for (int y = 0; y < (int) desc.Height; y++)
-			memcpy(Latest.Buf.data() + y * desc.Width * 4, (uint8_t*) sr.pData + sr.RowPitch * y, desc.Width * 4);
-		D3DDeviceContext->Unmap(cpuTex, 0);
+		D3DDeviceContext->Unmap(StagingTex, 0);
+		Pool.Commit(DirtyRects);
 	} else {
+		// Nothing was written to Latest. If the pool switched it to a spare, that spare is missing
+		// updates, so go back to the buffer that holds the previous frame.
+		Pool.Revert(Latest);
 		ok = false;
 	}
+	ReadbackFailed = !ok;
 
-	cpuTex->Release();
-	gpuTex->Release();
+	if (ok) {
+		auto& t         = Latest.Timing;
+		t.Seq           = ++FrameSeq;
+		t.PresentMicros = QpcToMicros(frameInfo.LastPresentTime.QuadPart);
+		t.MouseMicros   = frameInfo.LastMouseUpdateTime.QuadPart != 0 ? QpcToMicros(frameInfo.LastMouseUpdateTime.QuadPart) : 0;
+		t.AcquireMicros = acquireMicros;
+		t.ReadyMicros   = MonotonicMicros();
+		auto& tracer    = FrameTracer::Global();
+		tracer.Record("compose", t.Seq, t.PresentMicros, t.AcquireMicros);
+		tracer.Record("capture", t.Seq, t.AcquireMicros, t.ReadyMicros);
+	}
 
 	return ok;
 }
+
+// Populate DirtyRects, Moves and RedrawnRects from the frame's metadata. Moved regions are reported separately
+// by the OS, and their destinations are not included in the dirty rectangles, so we add them here. The OS applies
+// the dirty rectangles after the moves, so those are kept apart too, as RedrawnRects.
+// Returns false if the metadata is unavailable, in which case the caller must treat the whole frame as dirty.
+bool WinDesktopDup::ReadFrameRects(const DXGI_OUTDUPL_FRAME_INFO& frameInfo) {
+	DirtyRects.clear();
+	Moves.clear();
+	RedrawnRects.clear();
+	if (frameInfo.TotalMetadataBufferSize == 0)
+		return false;
+
+	if (MetaBuf.size() < frameInfo.TotalMetadataBufferSize)
+		MetaBuf.resize(frameInfo.TotalMetadataBufferSize);
+
+	UINT    bufSize = (UINT) MetaBuf.size();
+	HRESULT hr      = DeskDupl->GetFrameMoveRects(bufSize, (DXGI_OUTDUPL_MOVE_RECT*) MetaBuf.data(), &bufSize);
+	if (FAILED(hr))
+		return false;
+	auto   moves  = (const DXGI_OUTDUPL_MOVE_RECT*) MetaBuf.data();
+	size_t nMoves = bufSize / sizeof(DXGI_OUTDUPL_MOVE_RECT);
+	for (size_t i = 0; i < nMoves; i++) {
+		const auto& m = moves[i];
+		Rect        dst(m.DestinationRect.left, m.DestinationRect.top, m.DestinationRect.right, m.DestinationRect.bottom);
+		Moves.emplace_back(Rect(m.SourcePoint.x, m.SourcePoint.y, m.SourcePoint.x + dst.Width(), m.SourcePoint.y + dst.Height()), dst.X1, dst.Y1);
+		DirtyRects.push_back(dst);
+	}
+
+	bufSize = (UINT) MetaBuf.size();
+	hr      = DeskDupl->GetFrameDirtyRects(bufSize, (RECT*) MetaBuf.data(), &bufSize);
+	if (FAILED(hr))
+		return false;
+	auto   dirty  = (const RECT*) MetaBuf.data();
+	size_t nDirty = bufSize / sizeof(RECT);
+	for (size_t i = 0; i < nDirty; i++)
+		RedrawnRects.emplace_back(dirty[i].left, dirty[i].top, dirty[i].right, dirty[i].bottom);
+
+	// Clip, in case the OS hands us anything outside of the desktop
+	Rect   bounds = Latest.Bounds();
+	size_t j      = 0;
+	for (size_t i = 0; i < RedrawnRects.size(); i++) {
+		Rect r = RedrawnRects[i].Intersection(bounds);
+		if (!r.IsEmpty())
+			RedrawnRects[j++] = r;
+	}
+	RedrawnRects.resize(j);
+	j = 0;
+	for (size_t i = 0; i < DirtyRects.size(); i++) {
+		Rect r = DirtyRects[i].Intersection(bounds);
+		if (!r.IsEmpty())
+			DirtyRects[j++] = r;
+	}
+	DirtyRects.resize(j);
+	DirtyRects.insert(DirtyRects.end(), RedrawnRects.begin(), RedrawnRects.end());
+	return true;
+}
@@ -1,31 +1,43 @@
 #pragma once
 
-typedef std::string Error;
-
-// BGRA U8 Bitmap
-struct Bitmap {
-	int                  Width  = 0;
-	int                  Height = 0;
-	std::vector<uint8_t> Buf;
-};
+#include "FrameCopy.h"
+#include "FramePool.h"
 
 // WinDesktopDup hides the gory details of capturing the screen using the
 // Windows Desktop Duplication API
 class WinDesktopDup {
 public:
-	Bitmap Latest;
-	int    OutputNumber = 0;
+	Bitmap              Latest;
+	std::vector<Rect>   DirtyRects;   // Regions of Latest that changed during the most recent successful CaptureNext
+	std::vector<MoveOp> Moves;        // Regions that the OS reports as moved. Their destinations are also in DirtyRects.
+	std::vector<Rect>   RedrawnRects; // The part of DirtyRects that the OS drew after applying Moves. It may overlap their destinations.
+	int                 OutputNumber = 0;
 
 	~WinDesktopDup();
 
-	Error Initialize();
+	Error Initialize(); // May be called again, to recover once IsOpen() is false
 	void  Close();
-	bool  CaptureNext();
+	bool  CaptureNext(int timeoutMs = 0);
+
+	// False before Initialize, and after CaptureNext has lost access to the desktop, for example to a
+	// desktop switch, a UAC prompt or a mode change. Nothing can be captured until Initialize succeeds.
+	bool IsOpen() const { return DeskDupl != nullptr; }
+
+	// Where this output sits on the virtual desktop, in the coordinates of GetWindowRect
+	Rect DesktopRect() const;
 
 private:
 	ID3D11Device*           D3DDevice        = nullptr;
 	ID3D11DeviceContext*    D3DDeviceContext = nullptr;
 	IDXGIOutputDuplication* DeskDupl         = nullptr;
+	ID3D11Texture2D*        StagingTex       = nullptr; // Persistent CPU readable copy of the desktop
 	DXGI_OUTPUT_DESC        OutputDesc;
-	bool                    HaveFrameLock = false;
+	bool                    ReadbackFailed = false; // Latest lacks the changes of a frame that we couldn't map
+	bool                    HaveFrameLock  = false;
+	uint64_t                FrameSeq       = 0;
+	std::vector<uint8_t>    MetaBuf; // Scratch space for move and dirty rectangles
+	FrameCopier             Copier;  // Reads StagingTex into Latest. Calibrated the first time StagingTex has a new size.
+	FramePool               Pool;    // Buffers for Latest, so that consumers of the previous frame don't force a copy of it
+
+	bool ReadFrameRects(const DXGI_OUTDUPL_FRAME_INFO& frameInfo);
 };
\ No newline at end of file
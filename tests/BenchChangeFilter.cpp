@@ -0,0 +1,60 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "ChangeFilter.h"
+
+struct ChangeFilterCase {
+	const char* Name;
+	int         Width;
+	int         Height;
+	Rect        Change; // Alternates between two versions every frame
+	bool        Caret;  // The change is a caret blinking, instead of new text
+};
+
+static const ChangeFilterCase ChangeFilterCases[] = {
+    {"1080p caret", 1920, 1080, Rect(500, 300, 502, 318), true},
+    {"1080p typing", 1920, 1080, Rect(200, 300, 500, 318), false},
+    {"1080p full", 1920, 1080, Rect(0, 0, 1920, 1080), false},
+    {"4K caret", 3840, 2160, Rect(500, 300, 502, 318), true},
+    {"4K typing", 3840, 2160, Rect(200, 300, 500, 318), false},
+    {"4K full", 3840, 2160, Rect(0, 0, 3840, 2160), false},
+};
+
+// The cost of Consider on the capture thread, for frames that it drops and frames that it passes
+BENCH(ChangeFilter, Consider) {
+	for (const auto& c : ChangeFilterCases) {
+		const int frames = 60;
+		Bitmap    img[2];
+		DrawDesktop(img[0], c.Width, c.Height, 1);
+		img[1] = img[0];
+		img[1].Buf.MakeUnique();
+		if (c.Caret) {
+			for (int y = c.Change.Y1; y < c.Change.Y2; y++)
+				std::fill((uint32_t*) img[1].Row(y) + c.Change.X1, (uint32_t*) img[1].Row(y) + c.Change.X2, 0xff000000);
+		} else {
+			DrawText(img[1], c.Change, c.Change.Y1, 18, 7);
+		}
+
+		// The first frame shares its buffer with the reference, and the second one pays for unsharing it
+		ChangeFilter f;
+		f.Consider(img[0], {img[0].Bounds()});
+		f.Consider(img[1], {c.Change});
+		f.Consider(img[0], {c.Change});
+		uint64_t passed     = f.Passed;
+		uint64_t suppressed = f.Suppressed;
+		double   start      = BenchSeconds();
+		for (int i = 1; i <= frames; i++)
+			f.Consider(img[i & 1], {c.Change});
+		double seconds = BenchSeconds() - start;
+		tsf::print("  %-26s Consider %8.1f us/frame  passed %3v  suppressed %3v\n", c.Name, seconds * 1e6 / frames, f.Passed - passed, f.Suppressed - suppressed);
+	}
+}
+
+BENCH(ChangeFilter, LumaDiff) {
+	Bitmap a, b;
+	DrawDesktop(a, 1920, 1080, 1);
+	DrawDesktop(b, 1920, 1080, 2);
+	int           n = a.Width * a.Height;
+	LumaDiffStats s;
+	double        seconds = BenchBest(10, [&] { s = LumaDiff(a.Buf.data(), b.Buf.data(), n, 12); });
+	tsf::print("  %-26s %6.0f MB/s  (%v changed)\n", "1080p", n * 4.0 / seconds / 1e6, s.Changed);
+}
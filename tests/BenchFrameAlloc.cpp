@@ -0,0 +1,100 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FramePool.h"
+#include "FrameBlit.h"
+
+static const int FrameSizes[][2] = {{1920, 1080}, {3840, 2160}};
+
+static volatile uint64_t Sink; // Keeps the reads from being optimized away
+
+// Allocating a frame, writing all of it, and freeing it. Straight from the OS, every page faults
+// in on first write, and is zeroed by the kernel. From the pool, it's a lock and a vector scan.
+BENCH(FrameAlloc, AllocLatency) {
+	for (const auto& size : FrameSizes) {
+		size_t bytes = (size_t) size[0] * size[1] * 4;
+		for (int pooled = 0; pooled < 2; pooled++) {
+			FrameAllocator alloc;
+			alloc.MaxCachedBytes = pooled ? bytes * 4 : 0;
+			double allocOnly = BenchBest(20, [&]() {
+				size_t cap;
+				void*  p = alloc.Alloc(bytes, cap);
+				alloc.Free(p, cap);
+			});
+			double withWrite = BenchBest(20, [&]() {
+				size_t cap;
+				void*  p = alloc.Alloc(bytes, cap);
+				memset(p, 1, bytes);
+				alloc.Free(p, cap);
+			});
+			tsf::print("  %vx%v %-6s alloc + free %8.1f us, alloc + write + free %8.1f us\n", size[0], size[1], pooled ? "pool" : "OS", allocOnly * 1e6, withWrite * 1e6);
+		}
+	}
+}
+
+// Reading a 4K frame one 64x64 tile at a time, as the tile encoders do. Each tile touches 64 rows
+// that are 15 KB apart, so with 4 KB pages every row is a different page, and the TLB thrashes.
+BENCH(FrameAlloc, TLB) {
+	const int w     = 3840;
+	const int h     = 2160;
+	size_t    bytes = (size_t) w * h * 4;
+	for (int huge = 0; huge < 2; huge++) {
+		FrameAllocator alloc;
+		alloc.UseHugePages = huge != 0;
+		size_t   cap;
+		uint8_t* p = (uint8_t*) alloc.Alloc(bytes, cap);
+		memset(p, 1, bytes);
+		uint64_t sum  = 0;
+		double   tile = BenchBest(10, [&]() {
+			for (int ty = 0; ty < h; ty += 64) {
+				for (int tx = 0; tx < w; tx += 64) {
+					for (int y = ty; y < std::min(h, ty + 64); y++) {
+						const uint64_t* row = (const uint64_t*) (p + (size_t) y * w * 4 + tx * 4);
+						for (int i = 0; i < 32; i += 8)
+							sum += row[i];
+					}
+				}
+			}
+		});
+		double column = BenchBest(10, [&]() {
+			for (int x = 0; x < w; x += 16) {
+				for (int y = 0; y < h; y++)
+					sum += p[(size_t) y * w * 4 + x * 4];
+			}
+		});
+		Sink = sum;
+		tsf::print("  4K %-10s tile walk %6.2f ms, column walk %6.2f ms (%v huge page allocs)\n", huge ? "huge pages" : "4K pages", tile * 1000, column * 1000, alloc.Stats().HugeAllocs);
+		alloc.Free(p, cap);
+	}
+}
+
+// A writer that changes one line of text per frame, while a consumer holds the previous frame
+// for a few frames, as the frame graph does. Copy on write copies the whole frame every time.
+BENCH(FrameAlloc, SharedWrites) {
+	for (const auto& size : FrameSizes) {
+		Bitmap src;
+		MakeBitmap(src, size[0], size[1], 0xffffffff);
+		Rect line(100, 100, 400, 140);
+		for (int usePool = 0; usePool < 2; usePool++) {
+			Bitmap frame;
+			MakeBitmap(frame, size[0], size[1], 0xffffffff);
+			FramePool          pool;
+			std::deque<Bitmap> held;
+			const int          frames = 200;
+			double             start  = BenchSeconds();
+			for (int i = 0; i < frames; i++) {
+				std::vector<Rect> write;
+				if (usePool)
+					write = pool.Acquire(frame);
+				write.push_back(line);
+				BlitRects(frame.Buf.data(), frame.Stride(), src, write);
+				if (usePool)
+					pool.Commit({line});
+				held.push_back(frame);
+				if (held.size() > 2)
+					held.pop_front();
+			}
+			double t = (BenchSeconds() - start) / frames;
+			tsf::print("  %vx%v %-14s %8.1f us per frame\n", size[0], size[1], usePool ? "FramePool" : "copy on write", t * 1e6);
+		}
+	}
+}
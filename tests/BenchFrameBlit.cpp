@@ -0,0 +1,45 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameBlit.h"
+#include <random>
+
+// The work that the window does for every captured frame, before GDI gets involved: copying the
+// dirty rectangles into the DIB, and turning them into invalidation rectangles for a window that
+// shows the desktop shrunk to 1280x720
+BENCH(FrameBlit, Present) {
+	struct Case {
+		const char* Name;
+		int         Width;
+		int         Height;
+		int         NumRects; // Scattered rectangles, of up to MaxSize x MaxSize
+		int         MaxSize;
+	};
+	const Case cases[] = {
+	    {"1080p typing", 1920, 1080, 2, 40},
+	    {"1080p 800x600 window", 1920, 1080, 1, 0},
+	    {"1080p 200 small rects", 1920, 1080, 200, 60},
+	    {"1080p full", 1920, 1080, 0, 0},
+	    {"4K typing", 3840, 2160, 2, 40},
+	    {"4K 200 small rects", 3840, 2160, 200, 60},
+	    {"4K full", 3840, 2160, 0, 0},
+	};
+	for (const auto& c : cases) {
+		Bitmap src;
+		DrawDesktop(src, c.Width, c.Height, 1);
+		std::vector<uint8_t> dib((size_t) src.Stride() * src.Height);
+		std::vector<Rect>    dirty, invalid;
+		std::mt19937         rng(1);
+		if (c.NumRects == 0)
+			dirty.push_back(src.Bounds());
+		else if (c.MaxSize == 0)
+			dirty.push_back(Rect(200, 200, 1000, 800));
+		for (int i = 0; i < c.NumRects && c.MaxSize != 0; i++) {
+			int x = rng() % (c.Width - c.MaxSize);
+			int y = rng() % (c.Height - c.MaxSize);
+			dirty.push_back(Rect(x, y, x + 1 + rng() % c.MaxSize, y + 1 + rng() % c.MaxSize));
+		}
+		double blit = BenchBest(20, [&] { BlitRects(dib.data(), src.Stride(), src, dirty); });
+		double inv  = BenchBest(20, [&] { InvalidationRects(dirty, c.Width, c.Height, 1280, 720, 32, invalid); });
+		tsf::print("  %-26s BlitRects %8.1f us  InvalidationRects %6.1f us  %2v rects\n", c.Name, blit * 1e6, inv * 1e6, invalid.size());
+	}
+}
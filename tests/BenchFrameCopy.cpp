@@ -0,0 +1,29 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameCopy.h"
+
+// The readback of every capture, for full frames with and without padded rows, a window, and a
+// line of text, which is the common case when typing
+BENCH(FrameCopy, Strategies) {
+	struct Case {
+		const char* Name;
+		int         Width;
+		int         Height;
+		int         SrcPitch;
+		Rect        R;
+	};
+	Case cases[] = {
+	    {"1080p full", 1920, 1080, 1920 * 4, Rect(0, 0, 1920, 1080)},
+	    {"1080p full, pitch + 256", 1920, 1080, 1920 * 4 + 256, Rect(0, 0, 1920, 1080)},
+	    {"4K full", 3840, 2160, 3840 * 4, Rect(0, 0, 3840, 2160)},
+	    {"4K full, pitch + 256", 3840, 2160, 3840 * 4 + 256, Rect(0, 0, 3840, 2160)},
+	    {"4K 800x600 window", 3840, 2160, 3840 * 4 + 256, Rect(100, 100, 900, 700)},
+	    {"4K 300x40 text line", 3840, 2160, 3840 * 4 + 256, Rect(100, 100, 400, 140)},
+	};
+	for (const auto& c : cases) {
+		tsf::print("  %-26s", c.Name);
+		for (const auto& t : BenchmarkFrameCopy(c.Width, c.Height, c.SrcPitch, c.R))
+			tsf::print(" %10s %8.1f us %5.1f GB/s", CopyStrategyName(t.Strategy), t.Micros, t.GBPerSec);
+		tsf::print("\n");
+	}
+}
@@ -0,0 +1,113 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameCoro.h"
+#include "FrameTrace.h"
+
+#ifdef WINDUP_COROUTINES
+
+static const int     CoroFrames        = 5000;
+static const int64_t CoroFrameMicros   = 200; // A 5 kHz source
+static const int     CoroStageMicros[] = {5, 10, 5};
+
+static void Spin(int micros) {
+	double end = BenchSeconds() + micros * 1e-6;
+	while (BenchSeconds() < end) {
+	}
+}
+
+static int64_t Percentile(std::vector<int64_t> v, double p) {
+	if (v.size() == 0)
+		return 0;
+	std::sort(v.begin(), v.end());
+	return v[std::min(v.size() - 1, (size_t) (p * v.size()))];
+}
+
+// A frame every CoroFrameMicros, give or take the resolution of sleep, stamped with the time it was made, or false once there have been enough
+static bool MakeFrame(int64_t& next, int& n, FrameRef& frame) {
+	if (n == CoroFrames)
+		return false;
+	int64_t now = MonotonicMicros();
+	if (now < next)
+		std::this_thread::sleep_for(std::chrono::microseconds(next - now));
+	next += CoroFrameMicros;
+	auto f                    = std::make_shared<GraphFrame>();
+	f->Img.Timing.Seq         = ++n;
+	f->Img.Timing.ReadyMicros = MonotonicMicros();
+	frame                     = f;
+	return true;
+}
+
+struct CoroPipeline {
+	std::atomic<bool>    Done;
+	std::vector<int64_t> Latency;
+
+	CoroPipeline() : Done(false) {}
+};
+
+static CoTask RunStages(CoExecutor& exec, AsyncFrameSource& source, CoroPipeline& p) {
+	co_await exec.Schedule();
+	auto frames = source.Frames(200000);
+	while (co_await frames.Next()) {
+		for (int micros : CoroStageMicros)
+			Spin(micros);
+		p.Latency.push_back(MonotonicMicros() - frames.Value()->Img.Timing.ReadyMicros);
+	}
+	p.Done = true;
+}
+
+// Three short stages after a 5 kHz source. As coroutines on one executor thread, every frame has one
+// thread switch, from the capture thread. As a FrameGraph, every stage is a hop through a queue.
+BENCH(FrameCoro, Pipeline) {
+	{
+		CoExecutor       exec(1);
+		AsyncFrameSource source(exec);
+		CoroPipeline     p;
+		RunStages(exec, source, p);
+		int64_t next = MonotonicMicros();
+		int     n    = 0;
+		source.Start([&](FrameRef& frame) {
+			if (!MakeFrame(next, n, frame)) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				return false;
+			}
+			return true;
+		});
+		while (!p.Done)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		source.Stop();
+		tsf::print("  %-26s %5v of %v frames  latency median %4v us  p99 %5v us  replaced %v\n", "coroutines, 1 thread", p.Latency.size(), CoroFrames,
+		           Percentile(p.Latency, 0.5), Percentile(p.Latency, 0.99), source.Replaced());
+	}
+
+	for (int threads : {1, 3}) {
+		FrameGraph           g;
+		std::vector<int64_t> latency;
+		g.Threads = threads;
+		int src   = g.AddSource("source");
+		int prev  = src;
+		for (size_t i = 0; i < 3; i++) {
+			int stage = g.AddStage(tsf::fmt("stage %v", i), [&latency, i](const FrameRef& f) -> FrameRef {
+				Spin(CoroStageMicros[i]);
+				if (i != 2)
+					return f;
+				latency.push_back(MonotonicMicros() - f->Img.Timing.ReadyMicros);
+				return nullptr;
+			});
+			g.Connect(prev, stage, EdgePolicy::DropOldest, 2);
+			prev = stage;
+		}
+		if (g.Start() != "")
+			return;
+		int64_t  next = MonotonicMicros();
+		int      n    = 0;
+		FrameRef frame;
+		while (MakeFrame(next, n, frame))
+			g.Push(src, frame);
+		g.Drain();
+		g.Stop();
+		tsf::print("  %-26s %5v of %v frames  latency median %4v us  p99 %5v us\n", tsf::fmt("FrameGraph, %v %v", threads, threads == 1 ? "thread" : "threads"), latency.size(), CoroFrames,
+		           Percentile(latency, 0.5), Percentile(latency, 0.99));
+	}
+}
+
+#endif
@@ -0,0 +1,92 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameHistory.h"
+
+enum class HistoryWorkload {
+	Idle,   // A caret blinks and the clock ticks
+	Typing, // A character every 5 frames, and the caret
+	Video,  // A 640x360 video at 30 fps, and the clock
+};
+
+struct HistoryCase {
+	const char*     Name;
+	int             Width;
+	int             Height;
+	HistoryWorkload Workload;
+};
+
+static const HistoryCase HistoryCases[] = {
+    {"1080p idle", 1920, 1080, HistoryWorkload::Idle},
+    {"1080p typing", 1920, 1080, HistoryWorkload::Typing},
+    {"1080p video", 1920, 1080, HistoryWorkload::Video},
+    {"4K idle", 3840, 2160, HistoryWorkload::Idle},
+    {"4K typing", 3840, 2160, HistoryWorkload::Typing},
+    {"4K video", 3840, 2160, HistoryWorkload::Video},
+};
+
+// Change img the way workload w would on frame i, and return what changed
+static std::vector<Rect> HistoryFrame(HistoryWorkload w, Bitmap& img, int i) {
+	std::vector<Rect> dirty;
+	Rect              caret(600, 300, 602, 318);
+	Rect              clock(img.Width - 80, img.Height - 30, img.Width - 10, img.Height - 12);
+	if (i % 15 == 0 && w != HistoryWorkload::Video) {
+		uint32_t color = i % 30 == 0 ? 0xff000000 : 0xffffffff;
+		for (int y = caret.Y1; y < caret.Y2; y++)
+			std::fill((uint32_t*) img.Row(y) + caret.X1, (uint32_t*) img.Row(y) + caret.X2, color);
+		dirty.push_back(caret);
+	}
+	if (i % 30 == 0) {
+		DrawText(img, clock, clock.Y1, 18, i / 30);
+		dirty.push_back(clock);
+	}
+	if (w == HistoryWorkload::Typing && i % 5 == 0) {
+		// The line wraps every 100 characters
+		int  c = (i / 5) % 100;
+		Rect ch(200 + c * 9, 300 + (i / 500) % 20 * 18, 209 + c * 9, 318 + (i / 500) % 20 * 18);
+		DrawText(img, ch, ch.Y1, 18, i);
+		dirty.push_back(ch);
+	}
+	if (w == HistoryWorkload::Video) {
+		Rect video(400, 200, 1040, 560);
+		DrawPhoto(img, video, i);
+		dirty.push_back(video);
+	}
+	return dirty;
+}
+
+// Two minutes of 30 fps capture. The memory per second of history is measured before thinning,
+// which is what the last ThinAfterMicros cost, and after thinning, which is what everything older costs.
+BENCH(FrameHistory, Workloads) {
+	for (const auto& c : HistoryCases) {
+		const int    frames = 120 * 30;
+		Bitmap       img;
+		FrameHistory h;
+		h.ThinAfterMicros = INT64_MAX / 2;
+		DrawDesktop(img, c.Width, c.Height, 1);
+		h.Add(img, {img.Bounds()}, 0);
+		double add = 0;
+		for (int i = 1; i < frames; i++) {
+			auto   dirty = HistoryFrame(c.Workload, img, i);
+			double start = BenchSeconds();
+			h.Add(img, dirty, (int64_t) i * 1000000 / 30);
+			add += BenchSeconds() - start;
+		}
+		auto   raw     = h.Stats();
+		double seconds = (raw.NewestMicros - raw.OldestMicros) / 1e6;
+
+		h.ThinAfterMicros = 0;
+		double start      = BenchSeconds();
+		h.Thin();
+		double thin    = BenchSeconds() - start;
+		auto   thinned = h.Stats();
+
+		double start2 = BenchSeconds();
+		for (int i = 0; i < 10; i++)
+			h.FrameAt(thinned.OldestMicros + (thinned.NewestMicros - thinned.OldestMicros) * i / 10, img);
+		double frameAt = (BenchSeconds() - start2) / 10;
+
+		tsf::print("  %-26s %8.1f KB/s  thinned %8.1f KB/s  (%4.0f s kept)  Add %6.0f us  Thin %5.0f ms  FrameAt %5.1f ms\n", c.Name,
+		           raw.Bytes / seconds / 1024, thinned.Bytes / ((thinned.NewestMicros - thinned.OldestMicros) / 1e6) / 1024, seconds,
+		           add * 1e6 / frames, thin * 1000, frameAt * 1000);
+	}
+}
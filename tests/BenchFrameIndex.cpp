@@ -0,0 +1,64 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameIndex.h"
+#include "FrameTrace.h"
+
+// 4K capture at 30 fps, which leaves AddFrame 33 ms per frame at most. Every workload adds ten
+// seconds of frames to the same index, and the queries run against all of it at the end.
+BENCH(FrameIndex, Capture4K) {
+	struct Workload {
+		const char* Name;
+		Rect        Change; // What changes in every frame
+		bool        Text;   // Scrolling text, instead of noise
+	};
+	const Workload workloads[] = {
+	    {"typing", Rect(400, 600, 1000, 618), true},
+	    {"scrolling browser", Rect(400, 240, 3440, 2080), true},
+	    {"video 1280x720", Rect(1000, 500, 2280, 1220), false},
+	    {"idle, clock", Rect(3700, 2120, 3800, 2150), true},
+	};
+	std::string file = tsf::fmt("windup_bench_%v.idx", MonotonicMicros());
+	FrameIndex  idx;
+	if (idx.Open(file) != "")
+		return;
+
+	Bitmap img;
+	DrawDesktop(img, 3840, 2160, 1);
+	uint32_t seq = 0;
+	idx.AddFrame(img, {img.Bounds()}, seq++, 0);
+	for (const auto& w : workloads) {
+		const int frames     = 300;
+		size_t    startCount = idx.Size();
+		double    total      = 0;
+		double    slowest    = 0;
+		for (int i = 0; i < frames; i++) {
+			if (w.Text)
+				DrawText(img, w.Change, w.Change.Y1 - i * 18, 18, seq);
+			else
+				DrawNoise(img, w.Change, seq);
+			double start = BenchSeconds();
+			idx.AddFrame(img, {w.Change}, seq, (int64_t) seq * 33333);
+			double t = BenchSeconds() - start;
+			total += t;
+			slowest = std::max(slowest, t);
+			seq++;
+		}
+		tsf::print("  %-26s AddFrame %7.1f us  slowest %7.1f us  %6.1f entries/frame  largest bucket %6v\n", w.Name, total * 1e6 / frames, slowest * 1e6, (double) (idx.Size() - startCount) / frames, idx.LargestBucket());
+	}
+
+	std::vector<size_t> results;
+	for (int distance : {0, 4, 8, 12}) {
+		size_t found = 0;
+		auto   run   = [&] {
+			found = 0;
+			for (size_t i = 0; i < idx.Size(); i += idx.Size() / 100) {
+				idx.Query(idx.At(i).Hash, distance, results);
+				found += results.size();
+			}
+		};
+		double t = BenchBest(5, run);
+		tsf::print("  %-26s %7.1f us per query  %8.1f results  (%v entries)\n", tsf::fmt("Query distance %v", distance).c_str(), t * 1e6 / 100, found / 100.0, idx.Size());
+	}
+	idx.Close();
+	remove(file.c_str());
+}
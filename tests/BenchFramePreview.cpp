@@ -0,0 +1,95 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FramePreview.h"
+
+static const char* PreviewFormatName(PreviewFormat f) {
+	switch (f) {
+	case PreviewFormat::RGB565: return "565";
+	case PreviewFormat::RGB555: return "555";
+	default: return "palette8";
+	}
+}
+
+// Decode a preview frame into dec, and return its PSNR against the downscaled source
+static double DecodePSNR(PreviewEncoder& enc, PreviewDecoder& dec, const std::vector<uint8_t>& out) {
+	size_t used = 0;
+	if (out.size() != 0 && dec.Decode(out.data(), out.size(), used) != "")
+		return 0;
+	return PSNR(dec.Frame, enc.Scaled);
+}
+
+// A whole 1080p desktop of text, photos and window frames
+BENCH(FramePreview, Keyframe) {
+	Bitmap img;
+	DrawDesktop(img, 1920, 1080, 1);
+	for (int scale : {1, 2, 4}) {
+		for (auto format : {PreviewFormat::RGB565, PreviewFormat::Palette8}) {
+			PreviewEncoder       enc;
+			PreviewDecoder       dec;
+			std::vector<uint8_t> out;
+			enc.Format = format;
+			enc.Scale  = scale;
+
+			double start = BenchSeconds();
+			enc.Encode(img, {img.Bounds()}, out);
+			double seconds = BenchSeconds() - start;
+			tsf::print("  %-26s %8.1f KB  %5.1f dB  %6.1f ms\n", tsf::fmt("scale %v %v", scale, PreviewFormatName(format)), out.size() / 1024.0,
+			           DecodePSNR(enc, dec, out), seconds * 1000);
+		}
+	}
+}
+
+// 300 frames at 10 fps: typing, a scrolling page, and a slideshow that changes every 50 frames.
+// The budget is 12.5 KB per frame, which is 1 Mbit/s.
+BENCH(FramePreview, Session) {
+	for (int scale : {2, 4}) {
+		for (auto format : {PreviewFormat::RGB565, PreviewFormat::Palette8}) {
+			for (size_t budget : {(size_t) 0, (size_t) 12500}) {
+				PreviewEncoder       enc;
+				PreviewDecoder       dec;
+				std::vector<uint8_t> out;
+				enc.Format   = format;
+				enc.Scale    = scale;
+				enc.MaxBytes = budget;
+				Bitmap img;
+				DrawDesktop(img, 1920, 1080, 1);
+				Rect   page(100, 100, 900, 1000);
+				Rect   slide(1000, 150, 1800, 750);
+				size_t total   = 0;
+				size_t largest = 0;
+				int    over    = 0;
+				double seconds = 0;
+				for (int i = 0; i < 300; i++) {
+					std::vector<Rect> dirty;
+					if (i % 3 == 0) {
+						int  c = (i / 3) % 80;
+						Rect ch(120 + c * 9, 980, 129 + c * 9, 998);
+						DrawText(img, ch, ch.Y1, 18, i);
+						dirty.push_back(ch);
+					}
+					if (i % 20 < 5) {
+						DrawText(img, Rect(page.X1, page.Y1, page.X2, 960), page.Y1 - i * 18, 18, 4);
+						dirty.push_back(page);
+					}
+					if (i % 50 == 0) {
+						DrawPhoto(img, slide, i);
+						dirty.push_back(slide);
+					}
+					out.clear();
+					double start = BenchSeconds();
+					enc.Encode(img, dirty, out);
+					seconds += BenchSeconds() - start;
+					total += out.size();
+					largest = std::max(largest, out.size());
+					over += out.size() > 12500 ? 1 : 0;
+					size_t used = 0;
+					if (out.size() != 0)
+						dec.Decode(out.data(), out.size(), used);
+				}
+				tsf::print("  %-26s %6.1f KB/frame  %5.2f Mbit/s  largest %6.1f KB  %3v over 12.5 KB  %4.0f us/frame  final %4.1f dB\n",
+				           tsf::fmt("scale %v %v%v", scale, PreviewFormatName(format), budget ? " budget" : ""), total / 300.0 / 1024, total * 8 * 10 / 300.0 / 1e6,
+				           largest / 1024.0, over, seconds * 1e6 / 300, PSNR(dec.Frame, enc.Scaled));
+			}
+		}
+	}
+}
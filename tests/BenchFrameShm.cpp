@@ -0,0 +1,84 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameShm.h"
+#include "FrameTrace.h"
+
+static int64_t Percentile(std::vector<int64_t> v, double p) {
+	if (v.size() == 0)
+		return 0;
+	std::sort(v.begin(), v.end());
+	return v[std::min(v.size() - 1, (size_t) (p * v.size()))];
+}
+
+// Whole 1080p frames, published and copied out on one thread, so that neither side waits for the other
+BENCH(FrameShm, Throughput) {
+	std::string    name = tsf::fmt("windup_bench_%v", MonotonicMicros());
+	FrameShmWriter w;
+	FrameShmReader r;
+	if (w.Create(name, 3, 1920, 1080) != "" || r.Open(name) != "")
+		return;
+	Bitmap img, out;
+	DrawDesktop(img, 1920, 1080, 1);
+	double gb = (double) img.Buf.size() / (1024 * 1024 * 1024);
+
+	bool   same    = true;
+	double publish = BenchBest(20, [&]() { w.Publish(img, {img.Bounds()}, FrameShmNowMicros()); });
+	double copy    = BenchBest(20, [&]() { r.CopyLatest(out); });
+	double view    = BenchBest(20, [&]() {
+		FrameShmView v;
+		if (r.Begin(r.LatestSeq(), v))
+			same = memcmp(v.Pixels, img.Buf.data(), img.Buf.size()) == 0 && r.End(v);
+	});
+	CHECK(same);
+	tsf::print("  %-26s %6.0f us  %5.1f GB/s\n", "1080p publish", publish * 1e6, gb / publish);
+	tsf::print("  %-26s %6.0f us  %5.1f GB/s\n", "1080p CopyLatest", copy * 1e6, gb / copy);
+	tsf::print("  %-26s %6.0f us  %5.1f GB/s\n", "1080p compare in place", view * 1e6, gb / view);
+}
+
+// A producer thread publishes 1080p frames at 60 fps, and the reader polls for them and copies
+// each one out. Latency is from just before Publish until the reader has a consistent copy.
+BENCH(FrameShm, Latency) {
+	const int      frames = 120;
+	std::string    name   = tsf::fmt("windup_bench_%v", MonotonicMicros());
+	FrameShmWriter w;
+	FrameShmReader r;
+	if (w.Create(name, 3, 1920, 1080) != "" || r.Open(name) != "")
+		return;
+	Bitmap img, out;
+	DrawDesktop(img, 1920, 1080, 1);
+	MakeBitmap(out, 1920, 1080, 0);
+
+	std::atomic<bool> done(false);
+	std::thread       producer([&] {
+		int64_t next = MonotonicMicros();
+		for (int i = 0; i < frames; i++) {
+			int64_t now = MonotonicMicros();
+			if (now < next)
+				std::this_thread::sleep_for(std::chrono::microseconds(next - now));
+			next += 1000000 / 60;
+			w.Publish(img, {img.Bounds()}, FrameShmNowMicros());
+		}
+		done = true;
+	});
+
+	std::vector<int64_t> latency;
+	int                  torn = 0;
+	for (uint64_t last = 0; !done || r.LatestSeq() != last;) {
+		uint64_t     seq = r.LatestSeq();
+		FrameShmView v;
+		if (seq == last || !r.Begin(seq, v)) {
+			std::this_thread::yield();
+			continue;
+		}
+		int64_t ts = v.Slot->TimestampMicros;
+		memcpy(out.Buf.data(), v.Pixels, out.Buf.size());
+		if (r.End(v))
+			latency.push_back(FrameShmNowMicros() - ts);
+		else
+			torn++;
+		last = seq;
+	}
+	producer.join();
+	tsf::print("  %-26s received %3v of %v  torn %v  latency median %5v us  p99 %5v us\n", "1080p at 60 fps", latency.size(), frames, torn,
+	           Percentile(latency, 0.5), Percentile(latency, 0.99));
+}
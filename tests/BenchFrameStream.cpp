@@ -0,0 +1,133 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameStream.h"
+#include "FrameTrace.h"
+
+// Receives frames on a thread of its own, and measures glass to glass latency, from the timestamp
+// that the frame was published with, to the moment the client has all of it
+struct BenchViewer {
+	FrameStreamClient     Client;
+	std::atomic<bool>     Stop;
+	std::atomic<bool>     Measure; // Record latency. Off during the first keyframe.
+	std::atomic<int64_t>  Frames;
+	std::atomic<uint64_t> LastSeq;
+	std::vector<int64_t>  Latency; // Microseconds, of every completed frame. Only read it after Finish.
+	std::thread           Thread;
+
+	BenchViewer() : Stop(false), Measure(false), Frames(0), LastSeq(0) {}
+
+	bool Start(int port) {
+		if (Client.Connect("127.0.0.1", port) != "")
+			return false;
+		Thread = std::thread([this] {
+			while (!Stop) {
+				int n = Client.Poll(5);
+				if (n < 0)
+					break;
+				if (n > 0) {
+					if (Measure)
+						Latency.push_back(MonotonicMicros() - Client.FrameTimestampMicros);
+					LastSeq = Client.FrameSeq;
+					Frames += n;
+				}
+			}
+		});
+		return true;
+	}
+
+	void Finish() {
+		Stop = true;
+		Thread.join();
+	}
+};
+
+struct StreamCase {
+	const char* Name;
+	int         Width;
+	int         Height;
+	Rect        Change; // Redrawn every frame. The whole frame means a keyframe's worth of tiles.
+};
+
+static const StreamCase StreamCases[] = {
+    {"1080p text line", 1920, 1080, Rect(200, 300, 500, 318)},
+    {"1080p 800x600 window", 1920, 1080, Rect(200, 200, 1000, 800)},
+    {"1080p full", 1920, 1080, Rect(0, 0, 1920, 1080)},
+    {"4K text line", 3840, 2160, Rect(200, 300, 500, 318)},
+    {"4K full", 3840, 2160, Rect(0, 0, 3840, 2160)},
+};
+
+// Publish 'frames' frames of case c, 'intervalMicros' apart, or as fast as possible if it's zero,
+// to one viewer, and wait for the viewer to catch up. Also measures how long that took, without
+// the wait, and the slowest Publish.
+static void RunStream(const StreamCase& c, int frames, int64_t intervalMicros, BenchViewer& viewer, double& seconds, int64_t& maxPublishMicros) {
+	FrameStreamServer srv;
+	if (srv.Listen(0) != "" || !viewer.Start(srv.Port()))
+		return;
+	while (srv.NumClients() == 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	// Two versions of the changing region, to alternate between
+	Bitmap img[2];
+	DrawDesktop(img[0], c.Width, c.Height, 1);
+	img[1] = img[0];
+	DrawDesktop(img[1], c.Width, c.Height, 2);
+	for (int y = c.Change.Y1; y < c.Change.Y2; y++)
+		memcpy(img[0].Row(y) + c.Change.X1 * 4, img[1].Row(y) + c.Change.X1 * 4, c.Change.Width() * 4);
+	DrawText(img[1], c.Change, c.Change.Y1, 18, 7);
+
+	srv.Publish(img[0], {img[0].Bounds()}, MonotonicMicros());
+	while (viewer.Frames == 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	viewer.Frames  = 0;
+	viewer.Measure = true;
+
+	maxPublishMicros = 0;
+	double  start    = BenchSeconds();
+	int64_t next     = MonotonicMicros();
+	for (int i = 1; i <= frames; i++) {
+		int64_t now = MonotonicMicros();
+		srv.Publish(img[i & 1], {c.Change}, now);
+		maxPublishMicros = std::max(maxPublishMicros, MonotonicMicros() - now);
+		next += intervalMicros;
+		while (intervalMicros != 0 && MonotonicMicros() < next)
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	seconds = BenchSeconds() - start;
+	// The last frame always arrives, however many were skipped before it
+	double end = BenchSeconds() + 2;
+	while (BenchSeconds() < end && viewer.LastSeq != (uint64_t) frames + 1)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	viewer.Finish();
+	srv.Close();
+}
+
+static int64_t Percentile(std::vector<int64_t> v, double p) {
+	if (v.size() == 0)
+		return 0;
+	std::sort(v.begin(), v.end());
+	return v[std::min(v.size() - 1, (size_t) (p * v.size()))];
+}
+
+// Frames published as fast as possible. A viewer that can't keep up skips to the newest tiles,
+// so the interesting numbers are how many frames it still sees, and how long Publish takes.
+BENCH(FrameStream, Throughput) {
+	for (const auto& c : StreamCases) {
+		BenchViewer v;
+		double      seconds    = 0;
+		int64_t     maxPublish = 0;
+		int         frames     = c.Change.Width() * c.Change.Height() > 1000000 ? 60 : 600;
+		RunStream(c, frames, 0, v, seconds, maxPublish);
+		tsf::print("  %-26s published %6.0f fps  received %6.0f fps  slowest Publish %6v us\n", c.Name, frames / seconds, v.Frames / seconds, maxPublish);
+	}
+}
+
+// Frames published at 60 fps, with the latency from Publish until the viewer has the whole frame
+BENCH(FrameStream, Latency) {
+	for (const auto& c : StreamCases) {
+		BenchViewer v;
+		double      seconds    = 0;
+		int64_t     maxPublish = 0;
+		RunStream(c, 120, 1000000 / 60, v, seconds, maxPublish);
+		tsf::print("  %-26s received %3v of 120  latency median %6v us  p99 %6v us  slowest Publish %6v us\n", c.Name, v.Latency.size(), Percentile(v.Latency, 0.5), Percentile(v.Latency, 0.99), maxPublish);
+	}
+}
@@ -0,0 +1,87 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "MotionDetect.h"
+#include "FrameStream.h"
+#include "FrameTrace.h"
+
+struct ScrollCase {
+	const char* Name;
+	int         Width;
+	int         Height;
+	Rect        Pane; // The text that scrolls
+	int         Step; // Pixels per frame
+};
+
+static const ScrollCase ScrollCases[] = {
+    {"1080p browser, 3 lines", 1920, 1080, Rect(200, 120, 1720, 1040), 54},
+    {"1080p editor, 1 line", 1920, 1080, Rect(60, 40, 1400, 1040), 18},
+    {"4K browser, 3 lines", 3840, 2160, Rect(400, 240, 3440, 2080), 54},
+    {"4K editor, 1 line", 3840, 2160, Rect(120, 80, 2800, 2080), 18},
+};
+
+// Draw frame i of case c into img, which holds the desktop
+static void DrawScroll(Bitmap& img, const ScrollCase& c, int i) {
+	DrawText(img, c.Pane, c.Pane.Y1 - i * c.Step, 18, 5);
+}
+
+// How long the estimator takes per frame, and how much of the pane it can't explain
+BENCH(MotionDetect, Estimate) {
+	for (const auto& c : ScrollCases) {
+		const int       frames = 30;
+		Bitmap          img[2];
+		MotionEstimator m;
+		DrawDesktop(img[0], c.Width, c.Height, 1);
+		img[1] = img[0];
+		img[1].Buf.MakeUnique();
+		DrawScroll(img[0], c, 0);
+		double  seconds  = 0;
+		int64_t residual = 0;
+		for (int i = 1; i <= frames; i++) {
+			Bitmap& prev = img[(i - 1) & 1];
+			Bitmap& cur  = img[i & 1];
+			DrawScroll(cur, c, i);
+			double start = BenchSeconds();
+			m.Estimate(prev, cur, {c.Pane});
+			seconds += BenchSeconds() - start;
+			for (const auto& r : m.Residual)
+				residual += (int64_t) r.Width() * r.Height();
+		}
+		double paneArea = (double) c.Pane.Width() * c.Pane.Height() * frames;
+		tsf::print("  %-26s Estimate %6.0f us/frame  residual %5.1f%% of the pane\n", c.Name, seconds * 1e6 / frames, residual * 100.0 / paneArea);
+	}
+}
+
+// What a viewer receives per frame of scrolling, with and without DetectMotion
+BENCH(MotionDetect, Stream) {
+	for (const auto& c : ScrollCases) {
+		const int frames = 30;
+		double    kb[2]  = {0, 0};
+		double    us[2]  = {0, 0};
+		for (int detect = 0; detect < 2; detect++) {
+			FrameStreamServer srv;
+			FrameStreamClient cl;
+			srv.DetectMotion = detect != 0;
+			if (srv.Listen(0) != "" || cl.Connect("127.0.0.1", srv.Port()) != "")
+				return;
+			Bitmap img;
+			DrawDesktop(img, c.Width, c.Height, 1);
+			DrawScroll(img, c, 0);
+			srv.Publish(img, {img.Bounds()}, MonotonicMicros());
+			while (cl.FrameSeq != 1 && cl.Poll(100) >= 0) {
+			}
+			uint64_t start = cl.BytesReceived;
+			for (int i = 1; i <= frames; i++) {
+				DrawScroll(img, c, i);
+				double t = BenchSeconds();
+				srv.Publish(img, {c.Pane}, MonotonicMicros());
+				us[detect] += BenchSeconds() - t;
+				// Wait for each frame, so that every client batch is a scroll of one step
+				while (cl.FrameSeq != (uint64_t) i + 1 && cl.Poll(100) >= 0) {
+				}
+			}
+			kb[detect] = (cl.BytesReceived - start) / 1024.0 / frames;
+			us[detect] = us[detect] * 1e6 / frames;
+		}
+		tsf::print("  %-26s tiles %7.1f KB/frame  moves %7.1f KB/frame  Publish %5.0f us -> %5.0f us\n", c.Name, kb[0], kb[1], us[0], us[1]);
+	}
+}
@@ -0,0 +1,53 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "PixelKernels.h"
+
+// Every whole-bitmap function on a full frame, with each instruction set, in megapixels per second
+BENCH(PixelKernels, Matrix) {
+	struct Size {
+		const char* Name;
+		int         Width;
+		int         Height;
+	};
+	const Size sizes[] = {{"1080p", 1920, 1080}, {"4K", 3840, 2160}};
+
+	for (const auto& sz : sizes) {
+		Bitmap a, b, blend;
+		DrawDesktop(a, sz.Width, sz.Height, 1);
+		DrawDesktop(b, sz.Width, sz.Height, 2);
+		std::vector<uint8_t>  bytes((size_t) sz.Width * sz.Height * 4);
+		std::vector<uint16_t> packed((size_t) sz.Width * sz.Height);
+		volatile uint64_t     sad  = 0; // So that SumAbsDiff isn't optimized away
+
+		struct Op {
+			const char*           Name;
+			std::function<void()> Run;
+		};
+		const Op ops[] = {
+		    {"ConvertRect RGBA8", [&] { ConvertRect(a, a.Bounds(), PixelFormat::RGBA8, bytes.data(), a.Width * 4); }},
+		    {"ConvertRect RGB8", [&] { ConvertRect(a, a.Bounds(), PixelFormat::RGB8, bytes.data(), a.Width * 3); }},
+		    {"ConvertRect Gray8", [&] { ConvertRect(a, a.Bounds(), PixelFormat::Gray8, bytes.data(), a.Width); }},
+		    {"DitherRect RGB565", [&] { DitherRect(a, a.Bounds(), Pixel16Format::RGB565, packed.data(), a.Width); }},
+		    {"BlendBitmaps", [&] { BlendBitmaps(a, b, 77, blend); }},
+		    {"SumAbsDiff", [&] { sad = SumAbsDiff(a, b, a.Bounds()); }},
+		};
+
+		tsf::print("  %-26s", sz.Name);
+		for (int isa = 0; isa < NumKernelISAs; isa++)
+			tsf::print(" %10s", KernelISAName((KernelISA) isa));
+		tsf::print("  Mpx/s\n");
+		for (const auto& op : ops) {
+			tsf::print("  %-26s", op.Name);
+			for (int isa = 0; isa < NumKernelISAs; isa++) {
+				if (!ForcePixelKernels((KernelISA) isa)) {
+					tsf::print(" %10s", "-");
+					continue;
+				}
+				double seconds = BenchBest(10, op.Run);
+				tsf::print(" %10.0f", sz.Width * sz.Height / seconds / 1e6);
+			}
+			tsf::print("\n");
+		}
+		UnforcePixelKernels();
+	}
+}
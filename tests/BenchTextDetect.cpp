@@ -0,0 +1,50 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "TextDetect.h"
+
+struct TextScrollCase {
+	const char* Name;
+	int         Width;
+	int         Height;
+	Rect        Pane; // The text that scrolls
+	int         Step; // Pixels per frame
+};
+
+static const TextScrollCase TextScrollCases[] = {
+    {"1080p editor, 1 line", 1920, 1080, Rect(60, 40, 1400, 1040), 18},
+    {"1080p browser, 3 lines", 1920, 1080, Rect(200, 120, 1720, 1040), 54},
+    {"1080p page down", 1920, 1080, Rect(200, 120, 1720, 1040), 900},
+    {"4K editor, 1 line", 3840, 2160, Rect(120, 80, 2800, 2080), 18},
+    {"4K browser, 3 lines", 3840, 2160, Rect(400, 240, 3440, 2080), 54},
+};
+
+// Text scrolling in a pane. Every frame reanalyzes the pane, so this is the worst case for
+// Update. New IDs are what a consumer that caches OCR results by ID would have to redo from scratch.
+BENCH(TextDetect, Scroll) {
+	for (const auto& c : TextScrollCases) {
+		const int    frames = 60;
+		Bitmap       img;
+		TextDetector td;
+		DrawDesktop(img, c.Width, c.Height, 1);
+		DrawText(img, c.Pane, c.Pane.Y1, 18, 5);
+		td.Update(img, {img.Bounds()});
+
+		double  seconds = 0;
+		int64_t regions = 0;
+		int64_t changed = 0;
+		int64_t newIDs  = 0;
+		for (int i = 1; i <= frames; i++) {
+			DrawText(img, c.Pane, c.Pane.Y1 - i * c.Step, 18, 5);
+			uint64_t nextID = 0; // IDs are handed out in order, so anything above the largest one so far is new
+			for (const auto& r : td.Regions)
+				nextID = std::max(nextID, r.ID + 1);
+			double start = BenchSeconds();
+			changed += td.Update(img, {c.Pane});
+			seconds += BenchSeconds() - start;
+			regions += td.Regions.size();
+			for (const auto& r : td.Regions)
+				newIDs += r.ID >= nextID ? 1 : 0;
+		}
+		tsf::print("  %-26s Update %6.0f us/frame  regions %5.1f  changed %5.1f  new IDs %5.1f per frame\n", c.Name, seconds * 1e6 / frames, (double) regions / frames, (double) changed / frames, (double) newIDs / frames);
+	}
+}
@@ -0,0 +1,65 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "TileStore.h"
+#include "FrameTrace.h"
+
+// A session of 6000 frames at 1080p: alt-tab between 6 windows every 100 frames, a caret that
+// blinks, typing, and a 600x400 region that an application repaints with the same pixels
+BENCH(TileStore, Session) {
+	std::string file = tsf::fmt("windup_bench_%v.tiles", MonotonicMicros());
+	Bitmap      windows[6];
+	for (int i = 0; i < 6; i++)
+		DrawDesktop(windows[i], 1920, 1080, i + 1);
+
+	TileStore store;
+	if (store.Open(file) != "")
+		return;
+	const int frames = 6000;
+	Bitmap    img    = windows[0];
+	Rect      caret(900, 500, 902, 518);
+	Rect      repaint(1100, 300, 1700, 700);
+	double    add = 0;
+	for (int i = 0; i < frames; i++) {
+		std::vector<Rect> dirty;
+		if (i % 100 == 0) {
+			img = windows[(i / 100) % 6];
+			dirty.push_back(img.Bounds());
+		}
+		if (i % 15 == 0) {
+			for (int y = caret.Y1; y < caret.Y2; y++)
+				std::fill((uint32_t*) img.Row(y) + caret.X1, (uint32_t*) img.Row(y) + caret.X2, i % 30 == 0 ? 0xff000000 : 0xffffffff);
+			dirty.push_back(caret);
+		}
+		if (i % 5 == 0) {
+			int  c = (i / 5) % 80;
+			Rect ch(200 + c * 9, 800, 209 + c * 9, 818);
+			DrawText(img, ch, ch.Y1, 18, i);
+			dirty.push_back(ch);
+		}
+		if (i % 10 == 0)
+			dirty.push_back(repaint);
+		double start = BenchSeconds();
+		store.AddFrame(img, dirty, (int64_t) i * 1000000 / 60);
+		add += BenchSeconds() - start;
+	}
+	TileStoreStats s = store.Stats();
+	tsf::print("  %-26s %6.0f frames/s  (%4.0f us/frame)  %v tiles hashed, %v stored\n", "ingest", frames / add, add * 1e6 / frames, s.HashedTiles, s.StoredTiles);
+	tsf::print("  %-26s %6.0fx  (%v tile refs, %v live tiles)\n", "dedup", s.DedupRatio, s.TileRefs, s.LiveTiles);
+	tsf::print("  %-26s %6.1f MB for %.1f GB of pixels  (%.0fx)\n", "pack", s.PackBytes / 1e6, s.PixelBytes / 1e9, s.SpaceSavings);
+
+	double start = BenchSeconds();
+	store.DropFrames(frames / 2);
+	store.Compact();
+	double         compact = BenchSeconds() - start;
+	TileStoreStats c       = store.Stats();
+	tsf::print("  %-26s %6.1f ms  %.1f -> %.1f MB  %v tiles kept\n", "drop half + compact", compact * 1000, s.PackBytes / 1e6, c.PackBytes / 1e6, c.Tiles);
+	store.Close();
+	remove(file.c_str());
+
+	double hash = BenchBest(5, [&] {
+		TileGrid grid(1920, 1080);
+		for (int t = 0; t < grid.Count(); t++)
+			HashTile(windows[0], grid.TileRect(t));
+	});
+	tsf::print("  %-26s %6.1f GB/s\n", "HashTile", 1920 * 1080 * 4 / hash / 1e9);
+}
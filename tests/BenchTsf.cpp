@@ -0,0 +1,90 @@
+#include "stdafx.h"
+#include "Test.h"
+#include <clocale>
+
+struct WideCase {
+	const char* Name;
+	uint32_t    First; // Characters are First, First + 1, ...
+	int         Len;
+};
+
+static const WideCase WideCases[] = {
+    {"ASCII, 30 chars", 'a', 30},
+    {"ASCII, 260 chars", 'a', 260},
+    {"CJK, 30 chars", 0x4e00, 30},
+    {"CJK, 260 chars", 0x4e00, 260},
+};
+
+template <typename F>
+static double NanosPerCall(F f) {
+	const int reps = 10000;
+	double    best = BenchBest(5, [&] {
+		for (int i = 0; i < reps; i++)
+			f();
+	});
+	return best * 1e9 / reps;
+}
+
+// A wide string argument, against snprintf's %ls, and against the same string in UTF-8
+BENCH(Tsf, Wide) {
+	// %ls needs a UTF-8 locale to produce anything but ASCII
+	std::string old = setlocale(LC_ALL, nullptr);
+	setlocale(LC_ALL, "C.UTF-8");
+	for (const auto& c : WideCases) {
+		std::wstring s;
+		for (int i = 0; i < c.Len; i++)
+			s += (wchar_t) (c.First + i % 26);
+		std::string utf8 = tsf::fmt("%v", s);
+
+		char   buf[1024];
+		double wide   = NanosPerCall([&] { tsf::fmt_buf(buf, sizeof(buf), "%v", s); });
+		double ls     = NanosPerCall([&] { snprintf(buf, sizeof(buf), "%ls", s.c_str()); });
+		double narrow = NanosPerCall([&] { tsf::fmt_buf(buf, sizeof(buf), "%v", utf8); });
+		tsf::print("  %-26s fmt_buf %6.0f ns  snprintf %%ls %6.0f ns  fmt_buf of UTF-8 %6.0f ns\n", c.Name, wide, ls, narrow);
+	}
+	setlocale(LC_ALL, old.c_str());
+}
+
+// A frame record, formatted to text, written to a binary log, and decoded from the log
+BENCH(Tsf, Binlog) {
+	static const char*    fs  = "frame %v captured %v presented %v dirty %v took %.3f ms in %v";
+	static const uint32_t fid = tsf::binlog_format_id(fs);
+	uint64_t              seq = 123456;
+	int64_t               t1  = 1700000000123456;
+	int64_t               t2  = t1 + 16667;
+	int                   n   = 7;
+	double                ms  = 3.25;
+	std::string           who = "WinDesktopDup";
+
+	char   buf[256];
+	size_t textBytes = tsf::fmt_buf(buf, sizeof(buf), fs, seq, t1, t2, n, ms, who).Len;
+	double text      = NanosPerCall([&] { tsf::fmt_buf(buf, sizeof(buf), fs, seq, t1, t2, n, ms, who); });
+
+	tsf::binlog_writer w;
+	w.write(fid, seq, t1, t2, n, ms, who);
+	size_t first = w.size();
+	w.write(fid, seq, t1, t2, n, ms, who);
+	size_t recordBytes = w.size() - first;
+	double write       = NanosPerCall([&] {
+		w.write(fid, seq, t1, t2, n, ms, who);
+		if (w.size() > 1 << 20)
+			w.clear();
+	});
+
+	// A log of records to decode, which starts with the definition of the format
+	w.reset();
+	for (int i = 0; i < 10000; i++)
+		w.write(fid, seq + i, t1, t2, n, ms, who);
+	std::string log(w.data(), w.size());
+	std::string out;
+	double      read = BenchBest(5, [&] {
+		tsf::binlog_reader r;
+		const uint8_t*     p = (const uint8_t*) log.data();
+		while (r.next(p, (const uint8_t*) log.data() + log.size(), out) == 1) {
+		}
+	}) * 1e9 / 10000;
+
+	tsf::print("  %-26s %6.0f ns/record  %3v bytes\n", "tsf::fmt_buf to text", text, textBytes);
+	tsf::print("  %-26s %6.0f ns/record  %3v bytes\n", "binlog_writer::write", write, recordBytes);
+	tsf::print("  %-26s %6.0f ns/record\n", "binlog_reader::next", read);
+}
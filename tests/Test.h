@@ -0,0 +1,100 @@
+#pragma once
+
+#include "Bitmap.h"
+
+// A minimal registry of tests and benchmarks, shared by windup_tests and windup_bench.
+//
+// TEST(Group, Name) { ... } defines and registers a test. Every group is a separate CTest test
+// (see CMakeLists.txt), so a group should run in a few seconds at most. CHECK records a failure
+// and carries on, and REQUIRE also returns from the test, for when the rest of it can't run.
+//
+// BENCH(Group, Name) { ... } registers a benchmark the same way, for windup_bench. Benchmarks
+// print their own results, one line per case, so that two runs can be diffed.
+//
+// Both executables take a list of filters on the command line, and only run the cases whose
+// group, or Group.Name, matches one of them exactly. With no filters, everything runs.
+
+struct TestCase {
+	const char* Group;
+	const char* Name;
+	void (*Run)();
+};
+
+std::vector<TestCase>& TestRegistry();
+
+struct TestRegistrar {
+	TestRegistrar(const char* group, const char* name, void (*run)()) { TestRegistry().push_back({group, name, run}); }
+};
+
+#define TEST(group, name)                                                           \
+	static void          group##_##name();                                          \
+	static TestRegistrar group##_##name##_registrar(#group, #name, group##_##name); \
+	static void          group##_##name()
+
+#define BENCH(group, name) TEST(group, name)
+
+void TestFail(const char* file, int line, const std::string& msg);
+
+#define CHECK(cond)                              \
+	do {                                         \
+		if (!(cond))                             \
+			TestFail(__FILE__, __LINE__, #cond); \
+	} while (0)
+
+#define REQUIRE(cond)                            \
+	do {                                         \
+		if (!(cond)) {                           \
+			TestFail(__FILE__, __LINE__, #cond); \
+			return;                              \
+		}                                        \
+	} while (0)
+
+// err is an Error, which should be empty
+#define CHECK_OK(err)                                                   \
+	do {                                                                \
+		Error e_ = (err);                                               \
+		if (e_ != "")                                                   \
+			TestFail(__FILE__, __LINE__, tsf::fmt("%v: %v", #err, e_)); \
+	} while (0)
+
+#define REQUIRE_OK(err)                                                 \
+	do {                                                                \
+		Error e_ = (err);                                               \
+		if (e_ != "") {                                                 \
+			TestFail(__FILE__, __LINE__, tsf::fmt("%v: %v", #err, e_)); \
+			return;                                                     \
+		}                                                               \
+	} while (0)
+
+// Seconds since an arbitrary point, for timing benchmarks
+double BenchSeconds();
+
+// Best time of 'reps' runs of f, in seconds, after one warm up run
+template <typename F>
+double BenchBest(int reps, F f) {
+	f();
+	double best = 1e30;
+	for (int i = 0; i < reps; i++) {
+		double start = BenchSeconds();
+		f();
+		best = std::min(best, BenchSeconds() - start);
+	}
+	return best;
+}
+
+// Synthetic screen content, with the mix of flat backgrounds, window frames, text and photos
+// that a desktop has. The same seed always draws the same image.
+void DrawDesktop(Bitmap& img, int width, int height, uint32_t seed);
+
+// Lines of dark, text-like glyphs on white inside r, lineHeight rows apart, with the first line
+// at row y0, which may be above r, as if r were a scrolled view of a longer page
+void DrawText(Bitmap& img, const Rect& r, int y0, int lineHeight, uint32_t seed);
+
+// Random pixels, with alpha 255
+void DrawNoise(Bitmap& img, const Rect& r, uint32_t seed);
+
+// A smooth image with a little noise, like a photo, or a frame of a video
+void DrawPhoto(Bitmap& img, const Rect& r, uint32_t seed);
+
+// Allocate img at width x height, and fill it with one color
+void MakeBitmap(Bitmap& img, int width, int height, uint32_t color);
@@ -0,0 +1,107 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "ChangeFilter.h"
+#include <random>
+
+// The statistics of LumaDiff, one pixel at a time, from the definition of luma
+static LumaDiffStats RefLumaDiff(const uint8_t* a, const uint8_t* b, int n, int threshold) {
+	LumaDiffStats s;
+	for (int i = 0; i < n; i++) {
+		int ya = (a[i * 4] * 29 + a[i * 4 + 1] * 150 + a[i * 4 + 2] * 77) >> 8;
+		int yb = (b[i * 4] * 29 + b[i * 4 + 1] * 150 + b[i * 4 + 2] * 77) >> 8;
+		s.SumA += ya;
+		s.SumB += yb;
+		s.SumAA += ya * ya;
+		s.SumBB += yb * yb;
+		s.SumAB += ya * yb;
+		s.Changed += std::abs(ya - yb) > threshold ? 1 : 0;
+	}
+	return s;
+}
+
+// Every length up to a few vectors, and past the 8192 pixel batches of the vector code
+TEST(ChangeFilter, LumaDiff) {
+	std::mt19937         rng(1);
+	std::vector<uint8_t> a(20000 * 4), b(a.size());
+	for (size_t i = 0; i < a.size(); i++) {
+		a[i] = (uint8_t) rng();
+		b[i] = i % 3 == 0 ? (uint8_t) rng() : a[i];
+	}
+	for (int n = 0; n <= 20000; n += n < 40 ? 1 : 4093) {
+		LumaDiffStats s = LumaDiff(a.data(), b.data(), n, 12);
+		LumaDiffStats r = RefLumaDiff(a.data(), b.data(), n, 12);
+		CHECK(s.Changed == r.Changed && s.SumA == r.SumA && s.SumB == r.SumB && s.SumAA == r.SumAA && s.SumBB == r.SumBB && s.SumAB == r.SumAB);
+	}
+
+	// Identical content is perfectly similar, and unrelated noise isn't similar at all
+	LumaDiffStats same = LumaDiff(a.data(), a.data(), 4096, 12);
+	CHECK(same.Changed == 0 && same.SSIM(4096) > 0.9999f);
+	LumaDiffStats noise = LumaDiff(a.data(), a.data() + 4096 * 4, 4096, 12);
+	CHECK(noise.SSIM(4096) < 0.1f);
+}
+
+// Add 'delta' to the channels of every dark pixel in r, which is what font smoothing jitter looks like
+static void Jitter(Bitmap& img, const Rect& r, int delta) {
+	for (int y = r.Y1; y < r.Y2; y++) {
+		uint8_t* p = img.Row(y) + r.X1 * 4;
+		for (int x = 0; x < r.Width() * 4; x++) {
+			if ((x & 3) != 3 && p[x] < 128)
+				p[x] = (uint8_t) (p[x] + delta);
+		}
+	}
+}
+
+// True if every pixel of r is inside one of 'rects'
+static bool Covers(const std::vector<Rect>& rects, const Rect& r) {
+	for (int y = r.Y1; y < r.Y2; y++) {
+		for (int x = r.X1; x < r.X2; x++) {
+			bool in = false;
+			for (const auto& d : rects)
+				in = in || (x >= d.X1 && x < d.X2 && y >= d.Y1 && y < d.Y2);
+			if (!in)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Noise that nobody cares about is suppressed, and the next frame that passes covers it anyway
+TEST(ChangeFilter, Significance) {
+	Bitmap img;
+	DrawDesktop(img, 1280, 720, 1);
+	Rect pane(100, 100, 900, 600);
+	DrawText(img, pane, pane.Y1, 18, 2);
+
+	ChangeFilter f;
+	CHECK(f.Consider(img, {img.Bounds()}));
+	CHECK(f.Dirty.size() == 1 && f.Dirty[0] == img.Bounds());
+
+	// A caret blinks
+	Rect caret(500, 300, 502, 318);
+	for (int y = caret.Y1; y < caret.Y2; y++)
+		std::fill((uint32_t*) img.Row(y) + caret.X1, (uint32_t*) img.Row(y) + caret.X2, 0xff000000);
+	CHECK(!f.Consider(img, {caret}));
+
+	// Font smoothing wobbles on a line of text
+	Rect line(100, 190, 900, 208);
+	Jitter(img, line, 6);
+	CHECK(!f.Consider(img, {line}));
+
+	// A change under an ignore mask, such as a clock
+	Rect clock(1180, 690, 1270, 710);
+	f.Config.IgnoreMasks = {clock};
+	DrawNoise(img, clock, 3);
+	CHECK(!f.Consider(img, {clock}));
+	CHECK(f.Suppressed == 3);
+
+	// A line of new text is a real change, and Dirty also covers the suppressed changes outside the mask
+	Rect typed(100, 400, 600, 418);
+	DrawText(img, typed, typed.Y1, 18, 9);
+	CHECK(f.Consider(img, {typed}));
+	CHECK(f.Passed == 2);
+	for (const Rect& r : {caret, line, typed})
+		CHECK(Covers(f.Dirty, r));
+
+	// The reference caught up with everything, so the same frame again is not a change
+	CHECK(!f.Consider(img, {img.Bounds()}));
+}
@@ -0,0 +1,48 @@
+#include "stdafx.h"
+#include "Test.h"
+
+// Like the frames that windup.cpp keeps in globals, this is destroyed during static destruction,
+// and frees its buffer into FrameAllocator::Global() when it is.
+static Bitmap GlobalFrame;
+
+TEST(FrameAlloc, GlobalFrame) {
+	MakeBitmap(GlobalFrame, 1920, 1080, 0xff000000);
+	CHECK(GlobalFrame.Buf.capacity() >= GlobalFrame.Buf.size());
+}
+
+TEST(FrameAlloc, CopyOnWrite) {
+	Bitmap a;
+	MakeBitmap(a, 640, 480, 0xff102030);
+	Bitmap b = a;
+	CHECK(a.Buf.IsShared() && b.Buf.IsShared());
+	const Bitmap& ca = a;
+	CHECK(ca.Buf.data() == ((const Bitmap&) b).Buf.data());
+
+	// Writing to one copy leaves the other alone
+	b.Row(10)[0] = 0xff;
+	CHECK(!a.Buf.IsShared() && !b.Buf.IsShared());
+	CHECK(ca.Row(10)[0] == 0x30);
+	CHECK(b.Row(11)[0] == 0x30);
+
+	// resize keeps the contents, and so does a move
+	b.Buf.resize(b.Buf.size() / 2);
+	CHECK(b.Row(10)[0] == 0xff);
+	Bitmap c = std::move(b);
+	CHECK(b.Buf.size() == 0);
+	CHECK(c.Row(10)[0] == 0xff);
+}
+
+TEST(FrameAlloc, Pool) {
+	auto&  alloc = FrameAllocator::Global();
+	size_t cap   = 0;
+	void*  p     = alloc.Alloc(3840 * 2160 * 4, cap);
+	CHECK(cap >= 3840 * 2160 * 4 && (uintptr_t) p % FrameAlign == 0);
+	alloc.Free(p, cap);
+	auto   before = alloc.Stats();
+	size_t cap2   = 0;
+	void*  q      = alloc.Alloc(3840 * 2160 * 4 - 100, cap2);
+	auto   after  = alloc.Stats();
+	CHECK(cap2 == cap);
+	CHECK(after.PoolHits == before.PoolHits + 1);
+	alloc.Free(q, cap2);
+}
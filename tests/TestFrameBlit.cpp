@@ -0,0 +1,113 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameBlit.h"
+#include <random>
+
+// Random rectangles, some of them hanging off the edges, and some whole rows, which take the single copy path
+TEST(FrameBlit, BlitRects) {
+	std::mt19937 rng(1);
+	Bitmap       src;
+	MakeBitmap(src, 301, 157, 0);
+	for (int stride : {301 * 4, 301 * 4 + 64}) {
+		std::vector<uint8_t> dst((size_t) stride * src.Height, 0), expect(dst.size(), 0);
+		for (int i = 0; i < 50; i++) {
+			DrawNoise(src, src.Bounds(), rng());
+			std::vector<Rect> rects;
+			for (int j = 0; j < 4; j++) {
+				int x = (int) (rng() % 340) - 20;
+				int y = (int) (rng() % 180) - 10;
+				rects.push_back(Rect(x, y, x + 1 + rng() % 100, y + 1 + rng() % 60));
+			}
+			int y = rng() % 150;
+			rects.push_back(Rect(0, y, src.Width, y + 1 + rng() % 7));
+			BlitRects(dst.data(), stride, src, rects);
+			for (const auto& r : rects) {
+				Rect c = r.Intersection(src.Bounds());
+				for (int y = c.Y1; y < c.Y2; y++)
+					memcpy(&expect[(size_t) y * stride + c.X1 * 4], src.Row(y) + c.X1 * 4, c.Width() * 4);
+			}
+			CHECK(dst == expect);
+		}
+	}
+}
+
+TEST(FrameBlit, PresentSize) {
+	int w, h;
+	PresentSize(1920, 1080, 2000, 1200, w, h);
+	CHECK(w == 1920 && h == 1080);
+	PresentSize(1920, 1080, 960, 1000, w, h);
+	CHECK(w == 960 && h == 540);
+	PresentSize(1920, 1080, 3000, 540, w, h);
+	CHECK(w == 960 && h == 540);
+	PresentSize(3840, 10, 100, 100, w, h);
+	CHECK(w == 100 && h == 1);
+}
+
+// Every destination pixel that samples the source rectangle must be covered, so that scaling
+// never leaves stale pixels in the window
+TEST(FrameBlit, ScaleRect) {
+	std::mt19937 rng(2);
+	const int    sw = 1920, sh = 1080;
+	for (int i = 0; i < 200; i++) {
+		int  dw = 100 + rng() % 1900;
+		int  dh = 60 + rng() % 1100;
+		int  x  = rng() % (sw - 1);
+		int  y  = rng() % (sh - 1);
+		Rect r(x, y, x + 1 + rng() % (sw - x), y + 1 + rng() % std::min(sh - y, 40));
+		Rect s = ScaleRect(r, sw, sh, dw, dh);
+		CHECK(Rect(0, 0, dw, dh).Contains(s));
+		// The source span of destination pixel d is [d * sw / dw, (d + 1) * sw / dw)
+		for (int d = 0; d < dw; d++) {
+			bool samples = (int64_t) d * sw / dw < r.X2 && (int64_t) (d + 1) * sw > (int64_t) r.X1 * dw;
+			if (samples && (d < s.X1 || d >= s.X2)) {
+				TestFail(__FILE__, __LINE__, tsf::fmt("column %v of %v is not covered by %v..%v, for %v..%v", d, dw, s.X1, s.X2, r.X1, r.X2));
+				return;
+			}
+		}
+		for (int d = 0; d < dh; d++) {
+			bool samples = (int64_t) d * sh / dh < r.Y2 && (int64_t) (d + 1) * sh > (int64_t) r.Y1 * dh;
+			if (samples && (d < s.Y1 || d >= s.Y2)) {
+				TestFail(__FILE__, __LINE__, tsf::fmt("row %v of %v is not covered by %v..%v, for %v..%v", d, dh, s.Y1, s.Y2, r.Y1, r.Y2));
+				return;
+			}
+		}
+	}
+	CHECK(ScaleRect(Rect(3, 4, 5, 6), 100, 100, 100, 100) == Rect(3, 4, 5, 6));
+}
+
+TEST(FrameBlit, InvalidationRects) {
+	std::mt19937      rng(3);
+	std::vector<Rect> out;
+	for (int i = 0; i < 100; i++) {
+		std::vector<Rect> dirty;
+		int               n = 1 + rng() % 40;
+		for (int j = 0; j < n; j++) {
+			int x = rng() % 1900;
+			int y = rng() % 1060;
+			dirty.push_back(Rect(x, y, x + 1 + rng() % 200, y + 1 + rng() % 100));
+		}
+		InvalidationRects(dirty, 1920, 1080, 1280, 720, 32, out);
+		REQUIRE(out.size() != 0 && out.size() <= 32);
+		for (const auto& d : dirty) {
+			Rect s       = ScaleRect(d.Intersection(Rect(0, 0, 1920, 1080)), 1920, 1080, 1280, 720);
+			bool covered = false;
+			for (const auto& o : out)
+				covered = covered || o.Contains(s);
+			CHECK(covered);
+		}
+		// Whatever touched was merged
+		for (size_t a = 0; a < out.size(); a++) {
+			for (size_t b = a + 1; b < out.size(); b++)
+				CHECK(!out[a].Touches(out[b]));
+		}
+	}
+
+	// Too many rectangles become their bounding box
+	std::vector<Rect> dirty;
+	for (int i = 0; i < 10; i++)
+		dirty.push_back(Rect(i * 100, i * 50, i * 100 + 10, i * 50 + 10));
+	InvalidationRects(dirty, 1920, 1080, 1920, 1080, 4, out);
+	CHECK(out.size() == 1 && out[0] == Rect(0, 0, 910, 460));
+	InvalidationRects({Rect(-50, -50, -10, -10)}, 1920, 1080, 1920, 1080, 4, out);
+	CHECK(out.size() == 0);
+}
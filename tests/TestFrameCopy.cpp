@@ -0,0 +1,40 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameCopy.h"
+
+// Every strategy copies exactly the rectangle, out of a source with padded rows
+TEST(FrameCopy, Strategies) {
+	const int            w = 517, h = 203, srcPitch = w * 4 + 192;
+	std::vector<uint8_t> src((size_t) srcPitch * h);
+	for (size_t i = 0; i < src.size(); i++)
+		src[i] = (uint8_t) (i * 7 + i / 4099);
+	const Rect rects[] = {Rect(0, 0, w, h), Rect(3, 5, 500, 200), Rect(100, 100, 140, 118), Rect(0, 10, w, 11)};
+	for (int s = 0; s < NumCopyStrategies; s++) {
+		FrameCopier c;
+		c.Strategy      = (CopyStrategy) s;
+		c.StripStrategy = CopyStrategy::Streaming;
+		for (const auto& r : rects) {
+			std::vector<uint8_t> dst((size_t) w * 4 * h, 0), expect(dst.size(), 0);
+			for (int y = r.Y1; y < r.Y2; y++)
+				memcpy(&expect[(size_t) y * w * 4 + r.X1 * 4], &src[(size_t) y * srcPitch + r.X1 * 4], r.Width() * 4);
+			c.Copy(dst.data(), w * 4, src.data(), srcPitch, r);
+			if (dst != expect)
+				TestFail(__FILE__, __LINE__, tsf::fmt("%v copy of %v,%v,%v,%v", CopyStrategyName((CopyStrategy) s), r.X1, r.Y1, r.X2, r.Y2));
+		}
+	}
+}
+
+// A size that was calibrated before is recalled, instead of timed again
+TEST(FrameCopy, Recall) {
+	const int            w = 640, h = 360, srcPitch = w * 4 + 64;
+	std::vector<uint8_t> src((size_t) srcPitch * h, 1), dst((size_t) w * 4 * h, 0);
+	FrameCopier          c;
+	CHECK(!c.Recall(w * 4, srcPitch, Rect(0, 0, w, h)));
+	CHECK(c.Calibrate(dst.data(), w * 4, src.data(), srcPitch, Rect(0, 0, w, h)).size() == NumCopyStrategies);
+	CopyStrategy picked = c.Strategy;
+	c.Strategy          = picked == CopyStrategy::Rows ? CopyStrategy::Prefetch : CopyStrategy::Rows;
+	CHECK(c.Recall(w * 4, srcPitch, Rect(0, 0, w, h)));
+	CHECK(c.Strategy == picked);
+	CHECK(!c.Recall(w * 4, srcPitch + 64, Rect(0, 0, w, h)));
+	CHECK(!c.Recall(w * 4, srcPitch, Rect(0, 0, w, h - 1)));
+}
@@ -0,0 +1,184 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameCoro.h"
+#include "FrameBlit.h"
+#include <random>
+
+#ifdef WINDUP_COROUTINES
+
+// Wait up to a few seconds for 'done', which a coroutine sets when it finishes
+static bool WaitDone(const std::atomic<bool>& done) {
+	double end = BenchSeconds() + 5;
+	while (!done && BenchSeconds() < end)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return done;
+}
+
+struct NextFrameResult {
+	std::atomic<bool> Done;
+	bool              Null    = false;
+	double            Seconds = 0; // How long NextFrame took
+
+	NextFrameResult() : Done(false) {}
+};
+
+static CoTask AwaitFrame(CoExecutor& exec, AsyncFrameSource& source, int64_t timeoutMicros, CancelToken* cancel, NextFrameResult& res) {
+	co_await exec.Schedule();
+	double   start = BenchSeconds();
+	FrameRef f     = co_await source.NextFrame(timeoutMicros, cancel);
+	res.Seconds    = BenchSeconds() - start;
+	res.Null       = f == nullptr;
+	res.Done       = true;
+}
+
+TEST(FrameCoro, Timeout) {
+	CoExecutor       exec(2);
+	AsyncFrameSource source(exec);
+	NextFrameResult  res;
+	AwaitFrame(exec, source, 20000, nullptr, res);
+	REQUIRE(WaitDone(res.Done));
+	CHECK(res.Null);
+	CHECK(res.Seconds >= 0.02 && res.Seconds < 1);
+
+	// A frame that arrives first wins, and the timeout that fires later does nothing
+	NextFrameResult got;
+	AwaitFrame(exec, source, 50000, nullptr, got);
+	source.Publish(std::make_shared<GraphFrame>());
+	REQUIRE(WaitDone(got.Done));
+	CHECK(!got.Null && got.Seconds < 0.05);
+	std::this_thread::sleep_for(std::chrono::milliseconds(80));
+}
+
+TEST(FrameCoro, Cancel) {
+	CoExecutor       exec(2);
+	AsyncFrameSource source(exec);
+	CancelToken      token;
+	NextFrameResult  a, b;
+	AwaitFrame(exec, source, -1, &token, a);
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	CHECK(!a.Done);
+	token.Cancel();
+	REQUIRE(WaitDone(a.Done));
+	CHECK(a.Null);
+
+	// A token that is already cancelled doesn't wait at all
+	AwaitFrame(exec, source, -1, &token, b);
+	REQUIRE(WaitDone(b.Done));
+	CHECK(b.Null);
+
+	// Close resumes the waiter, and every NextFrame after it returns null
+	NextFrameResult c, d;
+	AwaitFrame(exec, source, -1, nullptr, c);
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	source.Close();
+	REQUIRE(WaitDone(c.Done));
+	CHECK(c.Null);
+	source.Publish(std::make_shared<GraphFrame>());
+	AwaitFrame(exec, source, -1, nullptr, d);
+	REQUIRE(WaitDone(d.Done));
+	CHECK(d.Null);
+}
+
+// Sleeps resume in the order in which they are due
+static CoTask SleepThenRecord(CoExecutor& exec, int64_t micros, std::mutex& lock, std::vector<int64_t>& order) {
+	co_await exec.Sleep(micros);
+	std::lock_guard<std::mutex> l(lock);
+	order.push_back(micros);
+}
+
+TEST(FrameCoro, Sleep) {
+	CoExecutor           exec(1);
+	std::mutex           lock;
+	std::vector<int64_t> order;
+	for (int64_t m : {30000, 10000, 40000, 20000})
+		SleepThenRecord(exec, m, lock, order);
+	double end = BenchSeconds() + 5;
+	while (BenchSeconds() < end) {
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (order.size() == 4)
+				break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	std::lock_guard<std::mutex> l(lock);
+	CHECK(order == std::vector<int64_t>({10000, 20000, 30000, 40000}));
+}
+
+struct ConsumerState {
+	std::atomic<bool>     Done;
+	std::atomic<uint64_t> LastSeq;
+	Bitmap                Mirror;
+	int                   Frames  = 0;
+	int                   Bad     = 0; // Frames that the mirror didn't match
+	bool                  Ordered = true;
+
+	ConsumerState() : Done(false), LastSeq(0) {}
+};
+
+// A slow consumer, which keeps a mirror up to date by copying only the dirty rects of the frames it sees
+static CoTask Consume(CoExecutor& exec, AsyncFrameSource& source, ConsumerState& s) {
+	co_await exec.Schedule();
+	auto frames = source.Frames(1000000);
+	while (co_await frames.Next()) {
+		const FrameRef& f = frames.Value();
+		s.Ordered         = s.Ordered && f->Img.Timing.Seq > s.LastSeq;
+		s.LastSeq         = f->Img.Timing.Seq;
+		BlitRects(s.Mirror.Buf.data(), s.Mirror.Stride(), f->Img, f->Dirty);
+		const Bitmap& m = s.Mirror;
+		s.Bad += memcmp(m.Buf.data(), f->Img.Buf.data(), m.Buf.size()) != 0;
+		s.Frames++;
+		if (s.Frames % 3 == 0)
+			co_await exec.Sleep(200);
+	}
+	s.Done = true;
+}
+
+// Frames arrive in order, and the dirty rects of the frames that were replaced reach the consumer
+TEST(FrameCoro, Order) {
+	CoExecutor       exec(2);
+	AsyncFrameSource source(exec);
+	ConsumerState    s;
+	Bitmap           cur;
+	MakeBitmap(cur, 320, 240, 0);
+	MakeBitmap(s.Mirror, 320, 240, 0);
+	Consume(exec, source, s);
+
+	std::mt19937 rng(13);
+	const int    total = 3000;
+	int          n     = 0;
+	source.Start([&](FrameRef& frame) {
+		if (n == total) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			return false;
+		}
+		auto f = std::make_shared<GraphFrame>();
+		int  x = rng() % 300;
+		int  y = rng() % 220;
+		Rect r(x, y, x + 1 + rng() % 20, y + 1 + rng() % 20);
+		DrawNoise(cur, r, rng());
+		f->Dirty.push_back(r);
+		cur.Timing.Seq = ++n;
+		f->Img         = cur;
+		f->Img.Buf.MakeUnique();
+		frame = f;
+		if (n % 50 == 0)
+			std::this_thread::sleep_for(std::chrono::microseconds(500));
+		return true;
+	});
+	double end = BenchSeconds() + 10;
+	while (s.LastSeq != total && BenchSeconds() < end)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	source.Stop();
+	source.Close();
+	REQUIRE(WaitDone(s.Done));
+
+	CHECK(s.Ordered);
+	CHECK(s.Bad == 0);
+	CHECK(s.LastSeq == total);
+	CHECK(source.Published() == total);
+	CHECK(s.Frames + source.Replaced() == total);
+	CHECK(source.Replaced() != 0);
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameGraph.h"
+#include "FrameBlit.h"
+#include <random>
+
+static void Spin(int micros) {
+	double end = BenchSeconds() + micros * 1e-6;
+	while (BenchSeconds() < end) {
+	}
+}
+
+// Push n frames of w x h, each with a few random dirty rects, into 'source'
+static void PushFrames(FrameGraph& g, int source, Bitmap& cur, int n, std::mt19937& rng) {
+	for (int i = 0; i < n; i++) {
+		auto f = std::make_shared<GraphFrame>();
+		int  k = 1 + rng() % 3;
+		for (int j = 0; j < k; j++) {
+			int  x = rng() % (cur.Width - 10);
+			int  y = rng() % (cur.Height - 10);
+			Rect r(x, y, x + 1 + rng() % (cur.Width - x), y + 1 + rng() % (cur.Height - y));
+			DrawNoise(cur, r, rng());
+			f->Dirty.push_back(r);
+		}
+		cur.Timing.Seq++;
+		f->Img = cur;
+		g.Push(source, f);
+	}
+}
+
+TEST(FrameGraph, Cycle) {
+	FrameGraph g;
+	auto       pass = [](const FrameRef& f) { return f; };
+	int        a    = g.AddSource("a");
+	int        b    = g.AddStage("b", pass);
+	int        c    = g.AddStage("c", pass);
+	g.Connect(a, b);
+	g.Connect(b, c);
+	g.Connect(c, b);
+	CHECK(g.Start() != "");
+}
+
+// A slow stage behind a DropOldest edge skips frames, but the dirty rects of the skipped frames
+// are passed on, so a mirror that only copies dirty rects still matches every frame it sees.
+// A Block edge sees every frame, and every stage sees its frames in order.
+TEST(FrameGraph, DropAndBlock) {
+	FrameGraph g;
+	g.Threads = 4;
+	int      src     = g.AddSource("capture");
+	uint64_t lastSeq = 0;
+	bool     ordered = true;
+	int      pass    = g.AddStage("pass", [&](const FrameRef& f) -> FrameRef {
+		ordered = ordered && f->Img.Timing.Seq > lastSeq;
+		lastSeq = f->Img.Timing.Seq;
+		return f;
+	});
+
+	Bitmap           mirror;
+	int              mirrorBad    = 0;
+	int              mirrorFrames = 0;
+	std::atomic<int> recorded(0);
+	MakeBitmap(mirror, 320, 240, 0);
+	int slow = g.AddStage("mirror", [&](const FrameRef& f) -> FrameRef {
+		BlitRects(mirror.Buf.data(), mirror.Stride(), f->Img, f->Dirty);
+		const Bitmap& m = mirror;
+		mirrorBad += memcmp(m.Buf.data(), f->Img.Buf.data(), m.Buf.size()) != 0;
+		mirrorFrames++;
+		Spin(1000);
+		return nullptr;
+	});
+	int record = g.AddStage("record", [&](const FrameRef& f) -> FrameRef {
+		recorded++;
+		Spin(100);
+		return nullptr;
+	});
+	g.Connect(src, pass, EdgePolicy::Block, 2);
+	g.Connect(pass, slow, EdgePolicy::DropOldest, 2);
+	g.Connect(pass, record, EdgePolicy::Block, 4);
+	REQUIRE_OK(g.Start());
+
+	std::mt19937 rng(3);
+	Bitmap       cur;
+	MakeBitmap(cur, 320, 240, 0);
+	PushFrames(g, src, cur, 300, rng);
+	g.Drain();
+	CHECK(ordered);
+	CHECK(mirrorBad == 0);
+	CHECK(mirrorFrames > 0 && mirrorFrames < 300);
+	CHECK(recorded == 300);
+	auto stats = g.Stats();
+	CHECK(stats[slow].Dropped + stats[slow].Frames == 300);
+	g.Stop();
+}
+
+// Stopping with frames still queued, and starting again, must leave every stage runnable
+TEST(FrameGraph, Restart) {
+	FrameGraph       g;
+	std::atomic<int> seen(0);
+	g.Threads = 2;
+	int src = g.AddSource("capture");
+	int a   = g.AddStage("a", [&](const FrameRef& f) -> FrameRef {
+		Spin(200);
+		return f;
+	});
+	int b   = g.AddStage("b", [&](const FrameRef& f) -> FrameRef {
+		seen++;
+		return nullptr;
+	});
+	g.Connect(src, a, EdgePolicy::Block, 4);
+	g.Connect(a, b, EdgePolicy::Block, 4);
+
+	std::mt19937 rng(5);
+	Bitmap       cur;
+	MakeBitmap(cur, 64, 64, 0);
+	for (int round = 0; round < 3; round++) {
+		REQUIRE_OK(g.Start());
+		CHECK(g.Start() != "");
+		PushFrames(g, src, cur, 20, rng);
+		g.Stop();
+	}
+	REQUIRE_OK(g.Start());
+	seen = 0;
+	PushFrames(g, src, cur, 20, rng);
+	g.Drain();
+	CHECK(seen == 20);
+	g.Stop();
+}
+
+// A merged frame covers the changes of both, and forgets moves, which were relative to the dropped frame
+TEST(FrameGraph, MergeDirty) {
+	auto a = std::make_shared<GraphFrame>();
+	auto b = std::make_shared<GraphFrame>();
+	a->Dirty  = {Rect(0, 0, 10, 10)};
+	b->Dirty  = {Rect(20, 20, 30, 30)};
+	b->Moves  = {MoveOp(Rect(0, 0, 10, 10), 20, 20)};
+	FrameRef m = MergeDirty(a, b);
+	CHECK(m->Dirty.size() == 2);
+	CHECK(m->Moves.size() == 0);
+	CHECK(b->Moves.size() == 1);
+}
@@ -0,0 +1,124 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameHistory.h"
+#include <map>
+#include <random>
+#include <set>
+
+static uint64_t HashBitmap(const Bitmap& img) {
+	uint64_t        h = 14695981039346656037ull;
+	const uint64_t* p = (const uint64_t*) img.Buf.data();
+	for (size_t i = 0; i < img.Buf.size() / 8; i++)
+		h = (h ^ p[i]) * 1099511628211ull;
+	return h ^ (uint64_t) img.Width << 32 ^ (uint64_t) img.Height;
+}
+
+// Record frames of random changes, 30 per second, and remember a hash of every one of them
+static void Record(FrameHistory& h, int seconds, std::map<int64_t, uint64_t>& hashes) {
+	std::mt19937 rng(7);
+	Bitmap       img;
+	DrawDesktop(img, 640, 360, 1);
+	h.Add(img, {img.Bounds()}, 0);
+	hashes[0] = HashBitmap(img);
+	for (int i = 1; i < seconds * 30; i++) {
+		std::vector<Rect> dirty;
+		int               n = rng() % 3;
+		for (int j = 0; j < n; j++) {
+			int  x = rng() % 620;
+			int  y = rng() % 340;
+			Rect r(x, y, std::min(640, x + 1 + (int) (rng() % 100)), std::min(360, y + 1 + (int) (rng() % 60)));
+			DrawNoise(img, r, rng());
+			dirty.push_back(r);
+		}
+		// Reported dirty, but nothing changed
+		if (i % 17 == 0)
+			dirty.push_back(Rect(0, 0, 64, 64));
+		int64_t t = (int64_t) i * 1000000 / 30;
+		h.Add(img, dirty, t);
+		hashes[t] = HashBitmap(img);
+	}
+}
+
+// Every frame can be rebuilt exactly. After thinning, the frames that were kept are still exact,
+// and a thinned segment keeps no more than one frame per ThinMicros.
+TEST(FrameHistory, Rebuild) {
+	FrameHistory h;
+	h.KeyframeMicros  = 2000000;
+	h.ThinAfterMicros = 5000000;
+	h.ThinMicros      = 500000;
+	std::map<int64_t, uint64_t> hashes;
+	Record(h, 20, hashes);
+
+	Bitmap  img;
+	int64_t ts = 0;
+	for (const auto& f : hashes) {
+		REQUIRE(h.FrameAt(f.first, img, &ts));
+		CHECK(ts <= f.first && HashBitmap(img) == f.second);
+	}
+	CHECK(!h.FrameAt(-1, img));
+
+	size_t before = h.Stats().Bytes;
+	h.Thin();
+	FrameHistoryStats s = h.Stats();
+	CHECK(s.ThinnedSegments != 0 && s.ThinnedSegments < s.Segments);
+	CHECK(s.Bytes < before);
+	CHECK(s.OldestMicros == 0);
+
+	std::set<int64_t> seen;
+	for (const auto& f : hashes) {
+		REQUIRE(h.FrameAt(f.first, img, &ts));
+		CHECK(ts <= f.first && HashBitmap(img) == hashes[ts]);
+		seen.insert(ts);
+		// Frames that are recent enough are not thinned
+		if (f.first >= s.NewestMicros - h.ThinAfterMicros + h.KeyframeMicros)
+			CHECK(HashBitmap(img) == f.second);
+	}
+	CHECK(seen.size() < hashes.size() / 2);
+}
+
+// The history stays within MaxBytes by dropping its oldest frames
+TEST(FrameHistory, Evict) {
+	FrameHistory h;
+	h.MaxBytes       = 4 * 1024 * 1024;
+	h.KeyframeMicros = 1000000;
+	std::map<int64_t, uint64_t> hashes;
+	Record(h, 20, hashes);
+
+	FrameHistoryStats s = h.Stats();
+	CHECK(s.Bytes <= h.MaxBytes);
+	CHECK(s.OldestMicros > 0 && s.NewestMicros == hashes.rbegin()->first);
+	Bitmap img;
+	CHECK(!h.FrameAt(s.OldestMicros - 1, img));
+	CHECK(h.FrameAt(s.OldestMicros, img) && HashBitmap(img) == hashes[s.OldestMicros]);
+
+	h.Clear();
+	CHECK(h.Stats().Bytes == 0);
+	CHECK(!h.FrameAt(s.NewestMicros, img));
+}
+
+// Thinning on another thread, while frames are added and rebuilt
+TEST(FrameHistory, Concurrent) {
+	FrameHistory h;
+	h.MaxBytes        = 8 * 1024 * 1024;
+	h.KeyframeMicros  = 500000;
+	h.ThinAfterMicros = 1000000;
+	h.ThinMicros      = 200000;
+	std::atomic<bool> stop(false);
+	std::thread       thinner([&] {
+		while (!stop)
+			h.Thin();
+	});
+	std::map<int64_t, uint64_t> hashes;
+	Record(h, 10, hashes);
+	stop = true;
+	thinner.join();
+
+	FrameHistoryStats s = h.Stats();
+	CHECK(s.ThinnedSegments != 0);
+	Bitmap  img;
+	int64_t ts = 0;
+	for (int64_t t = s.OldestMicros; t <= s.NewestMicros; t += 100000) {
+		REQUIRE(h.FrameAt(t, img, &ts));
+		CHECK(HashBitmap(img) == hashes[ts]);
+	}
+}
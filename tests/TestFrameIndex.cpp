@@ -0,0 +1,84 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameIndex.h"
+#include "FrameTrace.h"
+#include "Tiles.h"
+#include <random>
+
+// Unique to this run, and removed at the end of each test
+static std::string IndexFile() {
+	static std::string name = tsf::fmt("windup_test_%v.idx", MonotonicMicros());
+	return name;
+}
+
+// Only tiles with some detail are recorded, and they can be found again, also after reopening
+TEST(FrameIndex, Tiles) {
+	remove(IndexFile().c_str());
+	Bitmap img;
+	Rect   pane(128, 128, 448, 320); // Exactly 5 x 3 tiles
+	MakeBitmap(img, 1280, 720, 0xff285078);
+	DrawText(img, pane, pane.Y1, 18, 1);
+	{
+		FrameIndex idx;
+		REQUIRE_OK(idx.Open(IndexFile()));
+		CHECK_OK(idx.AddFrame(img, {img.Bounds()}, 1, 1000));
+		REQUIRE(idx.Size() >= 2);
+		CHECK(idx.At(0).IsFrame());
+		for (size_t i = 1; i < idx.Size(); i++) {
+			Rect tile(idx.At(i).TileX * TileSize, idx.At(i).TileY * TileSize, (idx.At(i).TileX + 1) * TileSize, (idx.At(i).TileY + 1) * TileSize);
+			CHECK(pane.Contains(tile));
+		}
+		// The background is all one color, so nothing changed that is worth recording
+		CHECK_OK(idx.AddFrame(img, {Rect(900, 500, 1000, 600)}, 2, 2000));
+		CHECK(idx.At(idx.Size() - 1).FrameSeq == 1);
+	}
+
+	FrameIndex idx;
+	REQUIRE_OK(idx.Open(IndexFile()));
+	CHECK(idx.Size() >= 2);
+	std::vector<size_t> results;
+	idx.Query(DHash(img, Rect(192, 192, 256, 256)), 0, results);
+	bool found = false;
+	for (auto i : results)
+		found = found || (idx.At(i).TileX == 3 && idx.At(i).TileY == 3);
+	CHECK(found);
+	idx.Close();
+	remove(IndexFile().c_str());
+}
+
+// Query agrees with a linear scan, whether it probes buckets or falls back to scanning
+TEST(FrameIndex, Query) {
+	remove(IndexFile().c_str());
+	FrameIndex idx;
+	REQUIRE_OK(idx.Open(IndexFile()));
+	std::mt19937_64              rng(1);
+	std::vector<FrameIndexEntry> entries(20000);
+	for (size_t i = 0; i < entries.size(); i++) {
+		entries[i]          = FrameIndexEntry();
+		entries[i].Hash     = rng();
+		entries[i].FrameSeq = (uint32_t) i;
+		// A crowded bucket, like the one that mostly blank tiles share
+		if (i % 3 == 0)
+			entries[i].Hash &= ~(uint64_t) 0xffff;
+		// Near duplicates
+		if (i % 7 == 0 && i != 0)
+			entries[i].Hash = entries[i - 1].Hash ^ ((uint64_t) 1 << (rng() % 64)) ^ ((uint64_t) 1 << (rng() % 64));
+	}
+	REQUIRE_OK(idx.Add(entries.data(), entries.size()));
+
+	std::vector<size_t> results, expect;
+	for (int q = 0; q < 50; q++) {
+		uint64_t hash = entries[rng() % entries.size()].Hash ^ (q % 2 ? (uint64_t) 1 << (q % 64) : 0);
+		for (int d : {0, 3, 4, 8, 11, 12, 20}) {
+			idx.Query(hash, d, results);
+			expect.clear();
+			for (size_t i = 0; i < entries.size(); i++) {
+				if (HammingDistance(entries[i].Hash, hash) <= d)
+					expect.push_back(i);
+			}
+			CHECK(results == expect);
+		}
+	}
+	idx.Close();
+	remove(IndexFile().c_str());
+}
@@ -0,0 +1,120 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FramePool.h"
+#include "FrameBlit.h"
+#include <random>
+
+// A writer updates a frame in place, with random dirty rects, while consumers hold on to random
+// earlier versions for a while. Every version must match the source, and no consumer may see the
+// frame that it holds change.
+TEST(FramePool, Versions) {
+	std::mt19937 rng(1);
+	const int    w = 300;
+	const int    h = 200;
+	Bitmap       src;
+	Bitmap       frame;
+	MakeBitmap(src, w, h, 0xff000000);
+	MakeBitmap(frame, w, h, 0xff000000);
+
+	struct Held {
+		Bitmap Frame;
+		Bitmap Copy; // A deep copy, taken when the frame was handed out
+		int    Until;
+	};
+	std::vector<Held> held;
+	FramePool         pool;
+	for (int v = 0; v < 2000; v++) {
+		std::vector<Rect> dirty;
+		int               n = rng() % 4;
+		for (int i = 0; i < n; i++) {
+			int x = rng() % w;
+			int y = rng() % h;
+			dirty.push_back(Rect(x, y, std::min(w, x + 1 + (int) (rng() % 80)), std::min(h, y + 1 + (int) (rng() % 60))));
+		}
+		for (const auto& r : dirty)
+			DrawNoise(src, r, v);
+
+		std::vector<Rect> write = pool.Acquire(frame);
+		write.insert(write.end(), dirty.begin(), dirty.end());
+		BlitRects(frame.Buf.data(), frame.Stride(), src, write);
+		pool.Commit(dirty);
+		REQUIRE(memcmp(((const Bitmap&) frame).Buf.data(), ((const Bitmap&) src).Buf.data(), src.Buf.size()) == 0);
+
+		for (size_t i = 0; i < held.size();) {
+			const Bitmap& a = held[i].Frame;
+			const Bitmap& b = held[i].Copy;
+			REQUIRE(memcmp(a.Buf.data(), b.Buf.data(), a.Buf.size()) == 0);
+			if (held[i].Until <= v) {
+				held[i] = std::move(held.back());
+				held.pop_back();
+			} else {
+				i++;
+			}
+		}
+		// Usually the previous frame is held for a frame or two, and now and then, for a long time
+		if (rng() % 3 != 0) {
+			Held x;
+			x.Frame = frame;
+			MakeBitmap(x.Copy, w, h, 0);
+			BlitRects(x.Copy.Buf.data(), x.Copy.Stride(), frame, {frame.Bounds()});
+			x.Until = v + (rng() % 10 == 0 ? 100 : 1 + rng() % 3);
+			held.push_back(std::move(x));
+		}
+	}
+	auto stats = pool.Stats();
+	CHECK(stats.Versions == 2000);
+	CHECK(stats.Switches > stats.Copies * 4);
+}
+
+// Without consumers, the frame is written in place, and nothing is ever stale
+TEST(FramePool, InPlace) {
+	Bitmap frame;
+	MakeBitmap(frame, 64, 64, 0);
+	FramePool      pool;
+	const uint8_t* before = ((const Bitmap&) frame).Buf.data();
+	for (int i = 0; i < 10; i++) {
+		CHECK(pool.Acquire(frame).size() == 0);
+		pool.Commit({Rect(0, 0, 8, 8)});
+	}
+	CHECK(((const Bitmap&) frame).Buf.data() == before);
+	CHECK(pool.Stats().Switches == 0 && pool.Stats().Copies == 0);
+}
+
+// A writer that acquired a spare, but then couldn't produce the frame, goes back to the buffer
+// that holds the previous frame, and the next Acquire catches the spare up as if nothing happened
+TEST(FramePool, Revert) {
+	Bitmap src, frame;
+	DrawDesktop(src, 200, 100, 1);
+	MakeBitmap(frame, 200, 100, 0);
+	FramePool pool;
+	pool.Acquire(frame);
+	BlitRects(frame.Buf.data(), frame.Stride(), src, {src.Bounds()});
+	pool.Commit({src.Bounds()});
+
+	// Version 2 is written while a consumer holds version 1, so version 1's buffer becomes a spare
+	Bitmap held = frame;
+	Rect   d2(10, 10, 50, 30);
+	DrawNoise(src, d2, 2);
+	pool.Acquire(frame);
+	BlitRects(frame.Buf.data(), frame.Stride(), src, {d2});
+	pool.Commit({d2});
+	held = frame;
+
+	// Switch to the spare, which missed d2, and give up
+	CHECK(pool.Acquire(frame) == std::vector<Rect>{d2});
+	CHECK(((const Bitmap&) frame).Buf.data() != ((const Bitmap&) held).Buf.data());
+	pool.Revert(frame);
+	CHECK(((const Bitmap&) frame).Buf.data() == ((const Bitmap&) held).Buf.data());
+	CHECK(memcmp(((const Bitmap&) frame).Buf.data(), ((const Bitmap&) src).Buf.data(), src.Buf.size()) == 0);
+
+	// The spare still knows that it missed d2
+	Rect d3(100, 50, 150, 90);
+	DrawNoise(src, d3, 3);
+	std::vector<Rect> write = pool.Acquire(frame);
+	CHECK(write == std::vector<Rect>{d2});
+	write.push_back(d3);
+	BlitRects(frame.Buf.data(), frame.Stride(), src, write);
+	pool.Commit({d3});
+	CHECK(memcmp(((const Bitmap&) frame).Buf.data(), ((const Bitmap&) src).Buf.data(), src.Buf.size()) == 0);
+	CHECK(pool.Stats().Switches == 2 && pool.Stats().Versions == 3);
+}
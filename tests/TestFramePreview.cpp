@@ -0,0 +1,124 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FramePreview.h"
+#include <random>
+
+static bool Same(const Bitmap& a, const Bitmap& b) {
+	return a.Width == b.Width && a.Height == b.Height && memcmp(a.Buf.data(), b.Buf.data(), a.Buf.size()) == 0;
+}
+
+// What a 16-bit preview of 'scaled' should decode to: dithered, and widened back to 8 bits per
+// channel by repeating the top bits
+static void Quantize(const Bitmap& scaled, Pixel16Format format, Bitmap& out) {
+	std::vector<uint16_t> px((size_t) scaled.Width * scaled.Height);
+	DitherRect(scaled, scaled.Bounds(), format, px.data(), scaled.Width);
+	MakeBitmap(out, scaled.Width, scaled.Height, 0);
+	int gbits = format == Pixel16Format::RGB565 ? 6 : 5;
+	for (size_t i = 0; i < px.size(); i++) {
+		uint32_t c = px[i];
+		uint32_t b = c & 31;
+		uint32_t g = (c >> 5) & ((1 << gbits) - 1);
+		uint32_t r = (c >> (5 + gbits)) & 31;
+		b          = b << 3 | b >> 2;
+		g          = g << (8 - gbits) | g >> (2 * gbits - 8);
+		r          = r << 3 | r >> 2;
+		((uint32_t*) out.Buf.data())[i] = 0xff000000 | r << 16 | g << 8 | b;
+	}
+}
+
+// Feed every frame that the encoder produces to the decoder
+static bool Send(PreviewEncoder& enc, PreviewDecoder& dec, const Bitmap& img, const std::vector<Rect>& dirty, size_t* bytes = nullptr, int* tiles = nullptr) {
+	std::vector<uint8_t> out;
+	size_t               n = enc.Encode(img, dirty, out);
+	if (bytes)
+		*bytes = n;
+	if (tiles && n != 0)
+		*tiles = ((const PreviewFrameHeader*) out.data())->NumTiles;
+	if (n == 0)
+		return true;
+	size_t used = 0;
+	return dec.Decode(out.data(), out.size(), used) == "" && used == out.size();
+}
+
+// Random changes to a desktop. With 16-bit pixels, the decoded preview is exactly the dithered
+// downscaled frame, after every frame. With a palette, it's within a few dB of that.
+TEST(FramePreview, Formats) {
+	for (auto format : {PreviewFormat::RGB565, PreviewFormat::RGB555, PreviewFormat::Palette8}) {
+		for (int scale : {1, 2, 4, 8}) {
+			std::mt19937   rng(19);
+			PreviewEncoder enc;
+			PreviewDecoder dec;
+			enc.Format = format;
+			enc.Scale  = scale;
+			Bitmap img, ref;
+			DrawDesktop(img, 700, 500, 1);
+			for (int i = 0; i < 20; i++) {
+				std::vector<Rect> dirty = {img.Bounds()};
+				if (i != 0) {
+					int  x = rng() % 650;
+					int  y = rng() % 450;
+					Rect r(x, y, x + 1 + rng() % 200, y + 1 + rng() % 100);
+					if (i % 2)
+						DrawText(img, r, y, 18, rng());
+					else
+						DrawPhoto(img, r, rng());
+					dirty = {r};
+				}
+				REQUIRE(Send(enc, dec, img, dirty));
+				if (format == PreviewFormat::Palette8) {
+					CHECK(PSNR(dec.Frame, enc.Scaled) > 28);
+				} else {
+					Quantize(enc.Scaled, format == PreviewFormat::RGB565 ? Pixel16Format::RGB565 : Pixel16Format::RGB555, ref);
+					CHECK(Same(dec.Frame, ref));
+				}
+			}
+		}
+	}
+}
+
+// With a budget, no frame is bigger than it, unless it holds a single tile. Tiles that wait catch
+// up with their newest content, and the preview ends up where it would have been without a budget.
+TEST(FramePreview, Budget) {
+	PreviewEncoder enc, free;
+	PreviewDecoder dec, freeDec;
+	enc.Format   = PreviewFormat::RGB565;
+	free.Format  = PreviewFormat::RGB565;
+	enc.MaxBytes = 12500;
+	Bitmap img;
+	DrawDesktop(img, 1280, 720, 2);
+	size_t bytes    = 0;
+	int    tiles    = 0;
+	size_t deferred = 0;
+	for (int i = 0; i < 30; i++) {
+		Rect r(i * 30, i * 20, i * 30 + 300, i * 20 + 200);
+		if (i % 10 == 0)
+			r = img.Bounds();
+		DrawPhoto(img, r, i);
+		REQUIRE(Send(enc, dec, img, {r}, &bytes, &tiles));
+		REQUIRE(Send(free, freeDec, img, {r}));
+		CHECK(bytes <= enc.MaxBytes || tiles == 1);
+		deferred = std::max(deferred, enc.PendingTiles());
+	}
+	CHECK(deferred != 0);
+	for (int i = 0; i < 1000 && enc.PendingTiles() != 0; i++) {
+		REQUIRE(Send(enc, dec, img, {}, &bytes, &tiles));
+		CHECK(bytes <= enc.MaxBytes || tiles == 1);
+	}
+	CHECK(enc.PendingTiles() == 0);
+	CHECK(Same(dec.Frame, freeDec.Frame));
+}
+
+TEST(FramePreview, Damaged) {
+	PreviewEncoder       enc;
+	PreviewDecoder       dec;
+	std::vector<uint8_t> out;
+	Bitmap               img;
+	DrawDesktop(img, 300, 200, 3);
+	enc.Encode(img, {img.Bounds()}, out);
+	size_t used = 0;
+	for (size_t n : {(size_t) 0, (size_t) 5, sizeof(PreviewFrameHeader), out.size() / 2, out.size() - 1})
+		CHECK(dec.Decode(out.data(), n, used) != "");
+	out[0] = 7;
+	CHECK(dec.Decode(out.data(), out.size(), used) != "");
+	CHECK(PSNR(img, img) == 99);
+}
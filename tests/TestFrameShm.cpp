@@ -0,0 +1,224 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameShm.h"
+#include "FrameTrace.h"
+#include <set>
+
+// Unique to this run, so that concurrent runs don't share a ring
+static std::string RingName() {
+	static std::string name = tsf::fmt("windup_test_%v", MonotonicMicros());
+	return name;
+}
+
+TEST(FrameShm, Publish) {
+	FrameShmWriter w;
+	REQUIRE_OK(w.Create(RingName(), 3, 320, 200));
+	FrameShmReader r;
+	REQUIRE_OK(r.Open(RingName()));
+	CHECK(r.LatestSeq() == 0);
+
+	Bitmap img, out;
+	for (int i = 0; i < 5; i++) {
+		DrawDesktop(img, 320, 200, i);
+		CHECK(w.Publish(img, {Rect(1, 2, 3, 4)}, 1000 + i));
+		std::vector<Rect> dirty;
+		CHECK(r.CopyLatest(out, &dirty) == (uint64_t) i + 1);
+		CHECK(memcmp(out.Buf.data(), img.Buf.data(), img.Buf.size()) == 0);
+		CHECK(dirty.size() == 1 && dirty[0] == Rect(1, 2, 3, 4));
+	}
+	// Overwritten by the writer, which has lapped it
+	FrameShmView view;
+	CHECK(!r.Begin(1, view));
+	CHECK(!r.WriterClosed());
+
+	MakeBitmap(img, 321, 200, 0);
+	CHECK(!w.Publish(img, {}, 0));
+}
+
+// When the desktop grows, readers of the old ring are told to reopen, and the old ring stays
+// intact for as long as they hold it
+TEST(FrameShm, Grow) {
+	FrameShmWriter w;
+	REQUIRE_OK(w.Create(RingName(), 2, 64, 64));
+	FrameShmReader old;
+	REQUIRE_OK(old.Open(RingName()));
+	Bitmap small, big, out;
+	DrawDesktop(small, 64, 64, 1);
+	CHECK(w.Publish(small, {}, 0));
+
+	DrawDesktop(big, 200, 100, 2);
+	CHECK(!w.Fits(big.Width, big.Height));
+	REQUIRE_OK(w.Create(RingName(), 2, big.Width, big.Height));
+	CHECK(w.Publish(big, {}, 0));
+
+	CHECK(old.WriterClosed());
+	CHECK(old.CopyLatest(out) == 1);
+	CHECK(out.Width == 64 && memcmp(out.Buf.data(), small.Buf.data(), small.Buf.size()) == 0);
+
+	FrameShmReader r;
+	REQUIRE_OK(r.Open(RingName()));
+	CHECK(!r.WriterClosed());
+	CHECK(r.CopyLatest(out) == 1);
+	CHECK(out.Width == 200 && memcmp(out.Buf.data(), big.Buf.data(), big.Buf.size()) == 0);
+
+	w.Close();
+	CHECK(r.WriterClosed());
+	CHECK(r.Open(RingName()) != "");
+}
+
+// More dirty rects than a slot holds are collapsed into their bounding box
+TEST(FrameShm, ManyDirty) {
+	FrameShmWriter w;
+	REQUIRE_OK(w.Create(RingName(), 2, 320, 200));
+	FrameShmReader r;
+	REQUIRE_OK(r.Open(RingName()));
+	Bitmap            img, out;
+	std::vector<Rect> dirty, got;
+	DrawDesktop(img, 320, 200, 1);
+	for (int i = 0; i < FrameShmMaxDirty; i++)
+		dirty.push_back(Rect(i * 4, i, i * 4 + 2, i + 3));
+	CHECK(w.Publish(img, dirty, 0));
+	CHECK(r.CopyLatest(out, &got) == 1);
+	CHECK(got == dirty);
+
+	dirty.push_back(Rect(300, 150, 310, 160));
+	CHECK(w.Publish(img, dirty, 0));
+	CHECK(r.CopyLatest(out, &got) == 2);
+	CHECK(got.size() == 1 && got[0] == Rect(0, 0, 310, 160));
+}
+
+// A reader that is still looking at a slot when the writer comes back around to it must find out
+TEST(FrameShm, Torn) {
+	FrameShmWriter w;
+	REQUIRE_OK(w.Create(RingName(), 2, 64, 64));
+	FrameShmReader r;
+	REQUIRE_OK(r.Open(RingName()));
+	Bitmap img;
+	DrawDesktop(img, 64, 64, 1);
+	CHECK(w.Publish(img, {}, 0));
+	FrameShmView view;
+	REQUIRE(r.Begin(1, view));
+	CHECK(r.End(view));
+	CHECK(w.Publish(img, {}, 0));
+	CHECK(r.End(view));
+	CHECK(w.Publish(img, {}, 0));
+	CHECK(!r.End(view));
+	CHECK(!r.Begin(1, view));
+	CHECK(r.Begin(3, view) && r.End(view));
+}
+
+// Every pixel of frame 'seq' of a ring of the given width. A frame that mixes two frames, or two
+// rows, or that was read from the wrong ring, doesn't match.
+static uint32_t ShmPattern(uint64_t seq, int width, int x, int y) {
+	return ((uint32_t) seq * 2654435761u) ^ (uint32_t) width << 20 ^ (uint32_t) (y * 1021 + x);
+}
+
+static void DrawShmPattern(Bitmap& img, uint64_t seq) {
+	for (int y = 0; y < img.Height; y++) {
+		uint32_t* row = (uint32_t*) img.Row(y);
+		for (int x = 0; x < img.Width; x++)
+			row[x] = ShmPattern(seq, img.Width, x, y);
+	}
+}
+
+// Checks rows y1 to y2 of the frame
+static bool IsShmPattern(const uint8_t* pixels, int width, int y1, int y2, uint64_t seq) {
+	for (int y = y1; y < y2; y++) {
+		const uint32_t* row = (const uint32_t*) (pixels + (size_t) y * width * 4);
+		for (int x = 0; x < width; x++) {
+			if (row[x] != ShmPattern(seq, width, x, y))
+				return false;
+		}
+	}
+	return true;
+}
+
+// A producer thread publishes frames into a ring of only two slots, so that it keeps lapping the
+// reader, and grows the ring halfway through. The reader reads some frames in place and copies
+// others, and every frame that the seqlock lets through must be exactly what was published.
+// Some of the reads in place stall halfway, for long enough that the producer overwrites the slot.
+TEST(FrameShm, Concurrent) {
+	const int         frames = 4000;
+	std::atomic<bool> done(false);
+	FrameShmWriter    w;
+	FrameShmReader    r;
+	REQUIRE_OK(w.Create(RingName(), 2, 160, 120));
+	REQUIRE_OK(r.Open(RingName()));
+
+	std::thread producer([&] {
+		Bitmap img;
+		MakeBitmap(img, 160, 120, 0);
+		for (int i = 1; i <= frames; i++) {
+			if (i == frames / 2) {
+				w.Create(RingName(), 2, 200, 150);
+				MakeBitmap(img, 200, 150, 0);
+			}
+			uint64_t seq = i < frames / 2 ? i : i - frames / 2 + 1;
+			DrawShmPattern(img, seq);
+			w.Publish(img, {Rect(0, 0, img.Width, (int) (seq % img.Height) + 1)}, (int64_t) seq);
+			std::this_thread::yield();
+		}
+		done = true;
+		w.Close();
+	});
+
+	Bitmap            out;
+	std::vector<Rect> dirty;
+	int64_t           good    = 0;
+	int64_t           wrong   = 0;
+	int64_t           torn    = 0;
+	int               reopens = 0;
+	std::set<int>     widths;
+	for (uint64_t last = 0, n = 0;; n++) {
+		if (r.WriterClosed()) {
+			// Grown, or finished
+			if (r.Open(RingName()) == "") {
+				reopens++;
+				last = 0;
+				continue;
+			}
+			if (done)
+				break;
+			std::this_thread::yield();
+			continue;
+		}
+		uint64_t seq = r.LatestSeq();
+		if (seq == last) {
+			std::this_thread::yield();
+			continue;
+		}
+		if (n % 2 == 0) {
+			FrameShmView view;
+			if (!r.Begin(seq, view))
+				continue;
+			int  width  = view.Slot->Width;
+			int  height = view.Slot->Height;
+			bool same   = IsShmPattern(view.Pixels, width, 0, height / 2, seq);
+			for (uint64_t i = 0; i < n % 6; i++)
+				std::this_thread::yield();
+			same = same && IsShmPattern(view.Pixels, width, height / 2, height, seq) && view.Slot->TimestampMicros == (int64_t) seq;
+			if (!r.End(view)) {
+				torn++;
+				continue;
+			}
+			good++;
+			wrong += !same;
+			widths.insert(width);
+		} else {
+			seq = r.CopyLatest(out, &dirty);
+			if (seq == 0)
+				continue;
+			good++;
+			wrong += !IsShmPattern(out.Buf.data(), out.Width, 0, out.Height, seq);
+			wrong += dirty.size() != 1 || dirty[0] != Rect(0, 0, out.Width, (int) (seq % out.Height) + 1);
+			widths.insert(out.Width);
+		}
+		last = seq;
+	}
+	producer.join();
+	CHECK(good > 0);
+	CHECK(wrong == 0);
+	CHECK(torn > 0);
+	CHECK(reopens >= 1);
+	CHECK(widths.count(200) == 1);
+}
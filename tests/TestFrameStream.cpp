@@ -0,0 +1,148 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameStream.h"
+#include "FrameTrace.h"
+#include <random>
+
+static bool Same(const Bitmap& a, const Bitmap& b) {
+	return a.Width == b.Width && a.Height == b.Height && memcmp(a.Buf.data(), b.Buf.data(), a.Buf.size()) == 0;
+}
+
+// Poll until the client has frame 'seq', or a second has passed
+static bool WaitFor(FrameStreamClient& c, uint64_t seq) {
+	double end = BenchSeconds() + 1;
+	while (c.FrameSeq < seq && BenchSeconds() < end) {
+		if (c.Poll(10) < 0)
+			return false;
+	}
+	return c.FrameSeq == seq;
+}
+
+// A fast client and a slow one both end up with the latest frame, whatever they skipped
+TEST(FrameStream, Clients) {
+	FrameStreamServer srv;
+	REQUIRE_OK(srv.Listen(0));
+	FrameStreamClient fast, slow;
+	REQUIRE_OK(fast.Connect("127.0.0.1", srv.Port()));
+	REQUIRE_OK(slow.Connect("127.0.0.1", srv.Port()));
+	double end = BenchSeconds() + 1;
+	while (srv.NumClients() < 2 && BenchSeconds() < end)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	REQUIRE(srv.NumClients() == 2);
+
+	std::mt19937 rng(3);
+	Bitmap       img;
+	DrawDesktop(img, 1000, 600, 1);
+	srv.Publish(img, {img.Bounds()}, MonotonicMicros());
+	CHECK(WaitFor(fast, 1));
+	CHECK(Same(fast.Frame, img));
+
+	for (uint64_t seq = 2; seq < 200; seq++) {
+		std::vector<Rect> dirty;
+		for (int i = 0; i < 3; i++) {
+			int  x = rng() % 950;
+			int  y = rng() % 560;
+			Rect r(x, y, x + 1 + rng() % 50, y + 1 + rng() % 40);
+			DrawNoise(img, r, rng());
+			dirty.push_back(r);
+		}
+		srv.Publish(img, dirty, MonotonicMicros());
+		if (seq % 20 == 0) {
+			CHECK(WaitFor(fast, seq));
+			CHECK(Same(fast.Frame, img));
+		}
+		if (seq % 70 == 0)
+			slow.Poll(0);
+	}
+	CHECK(WaitFor(fast, 199));
+	CHECK(WaitFor(slow, 199));
+	CHECK(Same(fast.Frame, img));
+	CHECK(Same(slow.Frame, img));
+
+	// A new resolution is a new keyframe
+	DrawDesktop(img, 640, 480, 2);
+	srv.Publish(img, {img.Bounds()}, MonotonicMicros());
+	CHECK(WaitFor(fast, 200));
+	CHECK(Same(fast.Frame, img));
+
+	srv.Close();
+	CHECK(fast.Poll(100) == -1);
+}
+
+// Scroll a text pane, and let the server find the moves. The client must still end up with every
+// frame exactly, and receive far less than it would without the moves.
+TEST(FrameStream, Scroll) {
+	uint64_t bytes[2] = {0, 0};
+	for (int detect = 0; detect < 2; detect++) {
+		FrameStreamServer srv;
+		srv.DetectMotion = detect != 0;
+		REQUIRE_OK(srv.Listen(0));
+		FrameStreamClient c;
+		REQUIRE_OK(c.Connect("127.0.0.1", srv.Port()));
+
+		Rect   pane(100, 80, 1100, 700);
+		Bitmap img;
+		DrawDesktop(img, 1280, 720, 1);
+		DrawText(img, pane, pane.Y1, 18, 3);
+		srv.Publish(img, {img.Bounds()}, MonotonicMicros());
+		REQUIRE(WaitFor(c, 1));
+		uint64_t start = c.BytesReceived;
+		for (uint64_t seq = 2; seq < 40; seq++) {
+			DrawText(img, pane, pane.Y1 - (int) seq * 23, 18, 3);
+			srv.Publish(img, {pane}, MonotonicMicros());
+			CHECK(WaitFor(c, seq));
+			CHECK(Same(c.Frame, img));
+		}
+		bytes[detect] = c.BytesReceived - start;
+	}
+	CHECK(bytes[1] * 4 < bytes[0]);
+}
+
+// Moves given to Publish are only sent to clients that have the previous frame. A client that
+// fell behind gets tiles instead, and ends up with the same frame.
+TEST(FrameStream, Moves) {
+	FrameStreamServer srv;
+	REQUIRE_OK(srv.Listen(0));
+	FrameStreamClient fast, slow;
+	REQUIRE_OK(fast.Connect("127.0.0.1", srv.Port()));
+	REQUIRE_OK(slow.Connect("127.0.0.1", srv.Port()));
+
+	Bitmap img;
+	DrawDesktop(img, 800, 600, 1);
+	srv.Publish(img, {img.Bounds()}, MonotonicMicros());
+	REQUIRE(WaitFor(fast, 1));
+	REQUIRE(WaitFor(slow, 1));
+
+	// A window of noise, dragged across the desktop in steps
+	Rect   win(50, 50, 250, 200);
+	Bitmap bg;
+	DrawDesktop(bg, 800, 600, 1);
+	DrawNoise(img, win, 7);
+	srv.Publish(img, {win}, MonotonicMicros());
+	REQUIRE(WaitFor(fast, 2));
+	for (uint64_t seq = 3; seq < 20; seq++) {
+		Rect   to(win.X1 + 17, win.Y1 + 9, win.X2 + 17, win.Y2 + 9);
+		Bitmap prev = img;
+		prev.Buf.MakeUnique();
+		for (int y = win.Y1; y < win.Y2; y++)
+			memcpy(img.Row(y) + win.X1 * 4, bg.Row(y) + win.X1 * 4, win.Width() * 4);
+		for (int y = to.Y1; y < to.Y2; y++)
+			memcpy(img.Row(y) + to.X1 * 4, prev.Row(y - 9) + (to.X1 - 17) * 4, to.Width() * 4);
+		// Sometimes the window also redraws part of itself after the move, like a caret blinking
+		Rect inner(to.X1 + 40, to.Y1 + 30, to.X1 + 90, to.Y1 + 45);
+		if (seq % 3 == 0) {
+			srv.Publish(img, {win}, MonotonicMicros(), {MoveOp(win, to.X1, to.Y1)});
+		} else {
+			DrawNoise(img, inner, (uint32_t) seq);
+			if (seq % 3 == 1)
+				srv.Publish(img, {win, inner}, MonotonicMicros(), {MoveOp(win, to.X1, to.Y1)});
+			else
+				srv.Publish(img, {win, to, inner}, MonotonicMicros(), {MoveOp(win, to.X1, to.Y1)});
+		}
+		win = to;
+		CHECK(WaitFor(fast, seq));
+		CHECK(Same(fast.Frame, img));
+	}
+	CHECK(WaitFor(slow, 19));
+	CHECK(Same(slow.Frame, img));
+}
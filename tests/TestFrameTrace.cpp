@@ -0,0 +1,232 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "FrameTrace.h"
+#include <map>
+
+// Just enough of a JSON parser to tell whether a document is valid
+struct JsonChecker {
+	const char* P;
+
+	void Space() {
+		while (*P == ' ' || *P == '\t' || *P == '\r' || *P == '\n')
+			P++;
+	}
+
+	bool Digits() {
+		if (!isdigit((unsigned char) *P))
+			return false;
+		while (isdigit((unsigned char) *P))
+			P++;
+		return true;
+	}
+
+	bool String() {
+		if (*P++ != '"')
+			return false;
+		for (; *P != '"'; P++) {
+			if ((unsigned char) *P < 0x20)
+				return false;
+			if (*P == '\\' && *++P == 0)
+				return false;
+		}
+		P++;
+		return true;
+	}
+
+	bool Number() {
+		if (*P == '-')
+			P++;
+		if (!Digits())
+			return false;
+		if (*P == '.') {
+			P++;
+			if (!Digits())
+				return false;
+		}
+		if (*P == 'e' || *P == 'E') {
+			P++;
+			if (*P == '+' || *P == '-')
+				P++;
+			if (!Digits())
+				return false;
+		}
+		return true;
+	}
+
+	// An object if close is '}', otherwise an array
+	bool Container(char close) {
+		P++;
+		Space();
+		if (*P == close) {
+			P++;
+			return true;
+		}
+		while (true) {
+			if (close == '}') {
+				Space();
+				if (!String())
+					return false;
+				Space();
+				if (*P++ != ':')
+					return false;
+			}
+			if (!Value())
+				return false;
+			Space();
+			if (*P == close) {
+				P++;
+				return true;
+			}
+			if (*P++ != ',')
+				return false;
+		}
+	}
+
+	bool Value() {
+		Space();
+		switch (*P) {
+		case '{': return Container('}');
+		case '[': return Container(']');
+		case '"': return String();
+		case 't': return strncmp(P, "true", 4) == 0 && (P += 4);
+		case 'f': return strncmp(P, "false", 5) == 0 && (P += 5);
+		case 'n': return strncmp(P, "null", 4) == 0 && (P += 4);
+		default: return Number();
+		}
+	}
+
+	bool Document() {
+		if (!Value())
+			return false;
+		Space();
+		return *P == 0;
+	}
+};
+
+static bool IsJson(const std::string& s) {
+	JsonChecker c = {s.c_str()};
+	return c.Document();
+}
+
+static std::string ReadFile(const std::string& filename) {
+	std::string s;
+	FILE*       f = fopen(filename.c_str(), "rb");
+	if (!f)
+		return s;
+	char buf[4096];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) != 0;)
+		s.append(buf, n);
+	fclose(f);
+	return s;
+}
+
+TEST(FrameTrace, Snapshot) {
+	FrameTracer t(16);
+	t.Record("off", 1, 0, 1);
+	std::vector<TraceEvent> ev;
+	t.Snapshot(ev);
+	CHECK(ev.size() == 0);
+
+	// Snapshot orders by start time, not by when the events were recorded
+	t.Enable(true);
+	t.Record("c", 3, 30, 35);
+	t.Record("a", 1, 10, 40);
+	t.Record("b", 2, 20, 21);
+	t.Snapshot(ev);
+	REQUIRE(ev.size() == 3);
+	CHECK(strcmp(ev[0].Name, "a") == 0 && ev[0].FrameSeq == 1 && ev[0].StartMicros == 10 && ev[0].EndMicros == 40);
+	CHECK(strcmp(ev[1].Name, "b") == 0 && ev[1].FrameSeq == 2);
+	CHECK(strcmp(ev[2].Name, "c") == 0 && ev[2].FrameSeq == 3);
+	CHECK(ev[0].ThreadId != 0 && ev[0].ThreadId == ev[2].ThreadId);
+}
+
+// Once the ring is full, the oldest events make way for new ones
+TEST(FrameTrace, Wrap) {
+	FrameTracer t(8);
+	t.Enable(true);
+	for (int i = 0; i < 21; i++)
+		t.Record("e", i, 100 - i, 100);
+	std::vector<TraceEvent> ev;
+	t.Snapshot(ev);
+	REQUIRE(ev.size() == 8);
+	for (int i = 0; i < 8; i++)
+		CHECK(ev[i].FrameSeq == (uint64_t) (20 - i) && ev[i].StartMicros == 80 + i);
+}
+
+// Writers that share a small ring keep landing on each other's slots. Every event that comes out
+// must be one that a single writer recorded, and not a mix of two.
+TEST(FrameTrace, Concurrent) {
+	static const char* names[] = {"w0", "w1", "w2", "w3"};
+	FrameTracer        t(16);
+	t.Enable(true);
+	std::atomic<bool>        stop(false);
+	std::vector<std::thread> writers;
+	for (int w = 0; w < 4; w++) {
+		writers.emplace_back([&, w] {
+			for (int64_t i = 1; !stop; i++) {
+				int64_t seq = w * 1000000000ll + i;
+				t.Record(names[w], (uint64_t) seq, seq, seq * 3);
+			}
+		});
+	}
+	std::vector<TraceEvent> ev;
+	int64_t                 bad  = 0;
+	int64_t                 seen = 0;
+	for (int i = 0; i < 2000; i++) {
+		t.Snapshot(ev);
+		for (const auto& e : ev) {
+			int w = (int) (e.FrameSeq / 1000000000ll);
+			bad += w >= 4 || e.Name != names[w] || e.StartMicros != (int64_t) e.FrameSeq || e.EndMicros != e.StartMicros * 3;
+		}
+		seen += ev.size();
+		std::this_thread::yield();
+	}
+	stop = true;
+	for (auto& th : writers)
+		th.join();
+	t.Snapshot(ev);
+	CHECK(bad == 0);
+	CHECK(seen > 0);
+	CHECK(ev.size() == 16);
+}
+
+// The trace must load in chrome://tracing, and every frame with more than one event gets one flow
+// that starts at its first event and finishes at its last
+TEST(FrameTrace, ChromeTrace) {
+	FrameTracer t(64);
+	t.Enable(true);
+	t.Record("capture", 1, 100, 110);
+	t.Record("filter", 1, 110, 120);
+	t.Record("capture", 2, 200, 210);
+	t.Record("publish", 1, 120, 130);
+	t.Record("stream-send", 0, 50, 60);
+	t.Record("filter", 2, 210, 220);
+	t.Record("lonely", 3, 300, 310);
+
+	std::string filename = tsf::fmt("windup_test_%v.json", MonotonicMicros());
+	REQUIRE_OK(t.WriteChromeTrace(filename));
+	std::string json = ReadFile(filename);
+	remove(filename.c_str());
+	CHECK(IsJson(json));
+	CHECK(!IsJson(json.substr(0, json.size() - 4)));
+
+	// One event per line. Collect the flow phases of every frame, in order.
+	std::map<uint64_t, std::string> flows;
+	int                             spans = 0;
+	for (size_t p = 0, eol; p < json.size(); p = eol + 1) {
+		eol              = json.find('\n', p);
+		std::string line = json.substr(p, eol - p);
+		if (line.find("\"ph\":\"X\"") != std::string::npos)
+			spans++;
+		size_t ph = line.find("\"bp\":\"e\"");
+		if (ph == std::string::npos)
+			continue;
+		size_t id = line.find("\"id\":");
+		REQUIRE(id != std::string::npos);
+		flows[strtoull(line.c_str() + id + 5, nullptr, 10)] += line[line.find("\"ph\":\"") + 6];
+	}
+	CHECK(spans == 7);
+	CHECK(flows.size() == 2);
+	CHECK(flows[1] == "stf");
+	CHECK(flows[2] == "sf");
+}
@@ -0,0 +1,450 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "ImageEncode.h"
+
+// A straight transcription of the reference QOI decoder, which keeps alpha in its index, and
+// starts with every slot at {0,0,0,0}. Returns BGRA pixels, or nothing if the stream is invalid.
+static std::vector<uint32_t> QoiDecode(const std::vector<uint8_t>& in, int& width, int& height) {
+	if (in.size() < 22 || memcmp(in.data(), "qoif", 4) != 0)
+		return {};
+	auto be32 = [&](size_t i) { return (uint32_t) in[i] << 24 | (uint32_t) in[i + 1] << 16 | (uint32_t) in[i + 2] << 8 | in[i + 3]; };
+	width     = (int) be32(4);
+	height    = (int) be32(8);
+	struct RGBA {
+		uint8_t R, G, B, A;
+	};
+	RGBA   index[64] = {};
+	RGBA   px        = {0, 0, 0, 255};
+	int    run       = 0;
+	size_t p         = 14;
+	size_t end       = in.size() - 8;
+
+	std::vector<uint32_t> out;
+	for (size_t i = 0; i < (size_t) width * height; i++) {
+		if (run > 0) {
+			run--;
+		} else if (p < end) {
+			uint8_t b = in[p++];
+			if (b == 0xfe) {
+				px.R = in[p++];
+				px.G = in[p++];
+				px.B = in[p++];
+			} else if (b == 0xff) {
+				px.R = in[p++];
+				px.G = in[p++];
+				px.B = in[p++];
+				px.A = in[p++];
+			} else if ((b & 0xc0) == 0x00) {
+				px = index[b];
+			} else if ((b & 0xc0) == 0x40) {
+				px.R += ((b >> 4) & 3) - 2;
+				px.G += ((b >> 2) & 3) - 2;
+				px.B += (b & 3) - 2;
+			} else if ((b & 0xc0) == 0x80) {
+				uint8_t b2 = in[p++];
+				int     vg = (b & 0x3f) - 32;
+				px.R += vg - 8 + ((b2 >> 4) & 0x0f);
+				px.G += vg;
+				px.B += vg - 8 + (b2 & 0x0f);
+			} else {
+				run = b & 0x3f;
+			}
+			index[(px.R * 3 + px.G * 5 + px.B * 7 + px.A * 11) % 64] = px;
+		}
+		out.push_back((uint32_t) px.A << 24 | (uint32_t) px.R << 16 | (uint32_t) px.G << 8 | px.B);
+	}
+	return out;
+}
+
+static void CheckQoiRoundTrip(const Bitmap& img) {
+	std::vector<uint8_t> enc;
+	QoiEncode(img, enc);
+	int  width   = 0;
+	int  height  = 0;
+	auto decoded = QoiDecode(enc, width, height);
+	REQUIRE(width == img.Width && height == img.Height);
+	REQUIRE(decoded.size() == (size_t) width * height);
+	size_t wrong = 0;
+	for (int y = 0; y < height; y++) {
+		const uint32_t* row = (const uint32_t*) img.Row(y);
+		for (int x = 0; x < width; x++)
+			wrong += decoded[(size_t) y * width + x] != (row[x] | 0xff000000);
+	}
+	CHECK(wrong == 0);
+}
+
+TEST(ImageEncode, QoiDesktop) {
+	Bitmap img;
+	DrawDesktop(img, 1280, 720, 1);
+	CheckQoiRoundTrip(img);
+}
+
+// Opaque black hashes to the same slot as an empty one, so a black pixel that doesn't follow
+// another black pixel must not be sent as an index into a slot that was never written.
+TEST(ImageEncode, QoiBlack) {
+	Bitmap img;
+	MakeBitmap(img, 200, 300, 0xff000000);
+	DrawNoise(img, Rect(0, 0, 1, 1), 1);
+	DrawNoise(img, Rect(50, 50, 150, 100), 2);
+	DrawText(img, Rect(0, 200, 200, 300), 200, 18, 3);
+	CheckQoiRoundTrip(img);
+
+	// Black right after a single other colour, at the very start
+	MakeBitmap(img, 3, 1, 0xff000000);
+	((uint32_t*) img.Row(0))[0] = 0xff102030;
+	CheckQoiRoundTrip(img);
+}
+
+// Canonical Huffman decoding table, from code lengths, as in zlib's puff
+struct Huffman {
+	uint16_t Count[16]   = {}; // Number of symbols of each length
+	uint16_t Symbol[320] = {}; // Symbols ordered by code
+
+	void Build(const uint8_t* lengths, int n) {
+		memset(Count, 0, sizeof(Count));
+		for (int i = 0; i < n; i++)
+			Count[lengths[i]]++;
+		Count[0]          = 0;
+		uint16_t offs[16] = {};
+		for (int len = 1; len < 15; len++)
+			offs[len + 1] = offs[len] + Count[len];
+		for (int i = 0; i < n; i++) {
+			if (lengths[i] != 0)
+				Symbol[offs[lengths[i]]++] = (uint16_t) i;
+		}
+	}
+};
+
+// A small inflater that handles every block type, so that the PNG tests don't need zlib
+struct Inflater {
+	const std::vector<uint8_t>& In;
+	size_t                      BitPos  = 0;
+	bool                        Overrun = false;
+
+	Inflater(const std::vector<uint8_t>& in, size_t start) : In(in), BitPos(start * 8) {}
+
+	int Bits(int n) {
+		int v = 0;
+		for (int i = 0; i < n; i++, BitPos++) {
+			if (BitPos >= In.size() * 8) {
+				Overrun = true;
+				return 0;
+			}
+			v |= ((In[BitPos >> 3] >> (BitPos & 7)) & 1) << i;
+		}
+		return v;
+	}
+
+	int Decode(const Huffman& h) {
+		int code  = 0;
+		int first = 0;
+		int index = 0;
+		for (int len = 1; len < 16; len++) {
+			code |= Bits(1);
+			int count = h.Count[len];
+			if (code - count < first)
+				return h.Symbol[index + (code - first)];
+			index += count;
+			first += count;
+			first <<= 1;
+			code <<= 1;
+		}
+		return -1;
+	}
+
+	bool Codes(const Huffman& lit, const Huffman& dist, std::vector<uint8_t>& out) {
+		static const uint16_t lenBase[29]  = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+		static const uint8_t  lenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+		static const uint16_t distBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+		static const uint8_t  distExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+		while (!Overrun) {
+			int sym = Decode(lit);
+			if (sym < 0 || sym > 285)
+				return false;
+			if (sym < 256) {
+				out.push_back((uint8_t) sym);
+			} else if (sym == 256) {
+				return true;
+			} else {
+				int len = lenBase[sym - 257] + Bits(lenExtra[sym - 257]);
+				int d   = Decode(dist);
+				if (d < 0 || d > 29)
+					return false;
+				size_t back = distBase[d] + Bits(distExtra[d]);
+				if (back > out.size())
+					return false;
+				for (int i = 0; i < len; i++)
+					out.push_back(out[out.size() - back]);
+			}
+		}
+		return false;
+	}
+
+	// Inflate a raw deflate stream. On success, BitPos is at the end of the final block.
+	bool Inflate(std::vector<uint8_t>& out) {
+		uint8_t lengths[320];
+		Huffman lit, dist;
+		bool    last = false;
+		while (!last) {
+			last     = Bits(1) != 0;
+			int type = Bits(2);
+			if (type == 0) {
+				BitPos   = (BitPos + 7) & ~(size_t) 7;
+				size_t p = BitPos / 8;
+				if (p + 4 > In.size())
+					return false;
+				int len  = In[p] | In[p + 1] << 8;
+				int nlen = In[p + 2] | In[p + 3] << 8;
+				if ((len ^ 0xffff) != nlen || p + 4 + len > In.size())
+					return false;
+				out.insert(out.end(), In.begin() + p + 4, In.begin() + p + 4 + len);
+				BitPos = (p + 4 + len) * 8;
+			} else if (type == 1) {
+				for (int i = 0; i < 288; i++)
+					lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+				lit.Build(lengths, 288);
+				for (int i = 0; i < 30; i++)
+					lengths[i] = 5;
+				dist.Build(lengths, 30);
+				if (!Codes(lit, dist, out))
+					return false;
+			} else if (type == 2) {
+				static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+				int                  nLit      = Bits(5) + 257;
+				int                  nDist     = Bits(5) + 1;
+				int                  nCode     = Bits(4) + 4;
+				memset(lengths, 0, sizeof(lengths));
+				for (int i = 0; i < nCode; i++)
+					lengths[order[i]] = (uint8_t) Bits(3);
+				Huffman code;
+				code.Build(lengths, 19);
+				for (int i = 0; i < nLit + nDist;) {
+					int sym = Decode(code);
+					if (sym < 0)
+						return false;
+					if (sym < 16) {
+						lengths[i++] = (uint8_t) sym;
+						continue;
+					}
+					int     rep = sym == 16 ? 3 + Bits(2) : sym == 17 ? 3 + Bits(3) : 11 + Bits(7);
+					uint8_t v   = 0;
+					if (sym == 16) {
+						if (i == 0)
+							return false;
+						v = lengths[i - 1];
+					}
+					if (i + rep > nLit + nDist)
+						return false;
+					while (rep--)
+						lengths[i++] = v;
+				}
+				lit.Build(lengths, nLit);
+				dist.Build(lengths + nLit, nDist);
+				if (!Codes(lit, dist, out))
+					return false;
+			} else {
+				return false;
+			}
+			if (Overrun)
+				return false;
+		}
+		return true;
+	}
+};
+
+// Bit at a time, so that it shares nothing with Crc32
+static uint32_t RefCrc32(const uint8_t* p, size_t n) {
+	uint32_t crc = 0xffffffff;
+	for (size_t i = 0; i < n; i++) {
+		crc ^= p[i];
+		for (int k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+	}
+	return ~crc;
+}
+
+static uint32_t RefAdler32(const uint8_t* p, size_t n) {
+	uint32_t a = 1;
+	uint32_t b = 0;
+	for (size_t i = 0; i < n; i++) {
+		a = (a + p[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	return b << 16 | a;
+}
+
+static uint8_t RefPaeth(int a, int b, int c) {
+	int p  = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	return (uint8_t) (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Check every chunk's CRC, inflate the IDATs, check the zlib header and Adler32, and undo the
+// filters. Returns RGB pixels, or nothing if anything is wrong. 'filters' receives the filter of every row.
+static std::vector<uint8_t> PngDecode(const std::vector<uint8_t>& in, int& width, int& height, std::vector<uint8_t>& filters) {
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	if (in.size() < 8 || memcmp(in.data(), signature, 8) != 0)
+		return {};
+	auto be32 = [&](size_t i) { return (uint32_t) in[i] << 24 | (uint32_t) in[i + 1] << 16 | (uint32_t) in[i + 2] << 8 | in[i + 3]; };
+
+	std::vector<uint8_t> zlib;
+	bool                 haveHeader = false;
+	bool                 haveEnd    = false;
+	for (size_t p = 8; p < in.size() && !haveEnd;) {
+		if (p + 12 > in.size())
+			return {};
+		size_t len = be32(p);
+		if (p + 12 + len > in.size() || RefCrc32(&in[p + 4], 4 + len) != be32(p + 8 + len))
+			return {};
+		const uint8_t* type = &in[p + 4];
+		const uint8_t* data = &in[p + 8];
+		if (memcmp(type, "IHDR", 4) == 0) {
+			if (len != 13 || data[8] != 8 || data[9] != 2 || data[10] != 0 || data[11] != 0 || data[12] != 0)
+				return {};
+			width      = (int) be32(p + 8);
+			height     = (int) be32(p + 12);
+			haveHeader = true;
+		} else if (memcmp(type, "IDAT", 4) == 0) {
+			zlib.insert(zlib.end(), data, data + len);
+		} else if (memcmp(type, "IEND", 4) == 0) {
+			haveEnd = true;
+		}
+		p += 12 + len;
+	}
+	if (!haveHeader || !haveEnd || zlib.size() < 6)
+		return {};
+	if ((zlib[0] & 0x0f) != 8 || (zlib[0] * 256 + zlib[1]) % 31 != 0 || (zlib[1] & 0x20) != 0)
+		return {};
+
+	std::vector<uint8_t> raw;
+	Inflater             inf(zlib, 2);
+	if (!inf.Inflate(raw))
+		return {};
+	size_t trailer = (inf.BitPos + 7) / 8;
+	if (trailer + 4 != zlib.size())
+		return {};
+	uint32_t adler = (uint32_t) zlib[trailer] << 24 | (uint32_t) zlib[trailer + 1] << 16 | (uint32_t) zlib[trailer + 2] << 8 | zlib[trailer + 3];
+	if (adler != RefAdler32(raw.data(), raw.size()))
+		return {};
+
+	size_t rowBytes = (size_t) width * 3;
+	if (raw.size() != (rowBytes + 1) * height)
+		return {};
+	std::vector<uint8_t> out(rowBytes * height);
+	filters.clear();
+	for (int y = 0; y < height; y++) {
+		const uint8_t* src  = &raw[(rowBytes + 1) * y];
+		uint8_t*       cur  = &out[rowBytes * y];
+		const uint8_t* prev = y == 0 ? nullptr : cur - rowBytes;
+		filters.push_back(src[0]);
+		for (size_t i = 0; i < rowBytes; i++) {
+			int a = i >= 3 ? cur[i - 3] : 0;
+			int b = prev ? prev[i] : 0;
+			int c = prev && i >= 3 ? prev[i - 3] : 0;
+			int v = src[1 + i];
+			switch (src[0]) {
+			case 0: break;
+			case 1: v += a; break;
+			case 2: v += b; break;
+			case 3: v += (a + b) / 2; break;
+			case 4: v += RefPaeth(a, b, c); break;
+			default: return {};
+			}
+			cur[i] = (uint8_t) v;
+		}
+	}
+	return out;
+}
+
+// 'filters' receives the filters that the rows used
+static void CheckPngRoundTrip(const Bitmap& img, int numThreads, std::vector<uint8_t>& filters) {
+	std::vector<uint8_t> enc;
+	PngEncode(img, enc, numThreads);
+	int  width   = 0;
+	int  height  = 0;
+	auto decoded = PngDecode(enc, width, height, filters);
+	REQUIRE(decoded.size() != 0);
+	REQUIRE(width == img.Width && height == img.Height);
+	size_t wrong = 0;
+	for (int y = 0; y < height; y++) {
+		const uint32_t* row = (const uint32_t*) img.Row(y);
+		const uint8_t*  rgb = &decoded[(size_t) y * width * 3];
+		for (int x = 0; x < width; x++)
+			wrong += rgb[x * 3] != (uint8_t) (row[x] >> 16) || rgb[x * 3 + 1] != (uint8_t) (row[x] >> 8) || rgb[x * 3 + 2] != (uint8_t) row[x];
+	}
+	CHECK(wrong == 0);
+}
+
+TEST(ImageEncode, Checksums) {
+	const char* check = "123456789";
+	CHECK(Crc32(0, (const uint8_t*) check, 9) == 0xcbf43926);
+	CHECK(Adler32(1, (const uint8_t*) check, 9) == 0x091e01de);
+
+	// Long enough that the sums wrap many times over, with splits on both sides of 65521
+	std::vector<uint8_t> buf(300000);
+	uint32_t             s = 1;
+	for (auto& b : buf) {
+		s = s * 1103515245 + 12345;
+		b = (uint8_t) (s >> 16);
+	}
+	CHECK(Crc32(Crc32(0, buf.data(), 1000), buf.data() + 1000, buf.size() - 1000) == RefCrc32(buf.data(), buf.size()));
+	uint32_t whole = RefAdler32(buf.data(), buf.size());
+	CHECK(Adler32(1, buf.data(), buf.size()) == whole);
+	for (size_t split : {(size_t) 0, (size_t) 1, (size_t) 5552, (size_t) 65520, (size_t) 65521, (size_t) 100000, buf.size()}) {
+		uint32_t a = Adler32(1, buf.data(), split);
+		uint32_t b = Adler32(1, buf.data() + split, buf.size() - split);
+		CHECK(Adler32Combine(a, b, buf.size() - split) == whole);
+	}
+}
+
+TEST(ImageEncode, PngDesktop) {
+	Bitmap               img;
+	std::vector<uint8_t> filters;
+	DrawDesktop(img, 1280, 720, 1);
+	for (int threads : {0, 1, 4, 7}) {
+		CheckPngRoundTrip(img, threads, filters);
+		// Text, photos and flat areas should each have found a different filter
+		int used[5] = {};
+		for (auto f : filters)
+			used[f % 5]++;
+		int distinct = 0;
+		for (int n : used)
+			distinct += n != 0;
+		CHECK(distinct >= 3);
+	}
+}
+
+// Widths that aren't a multiple of the filters' vector width, and strips that don't divide the height
+TEST(ImageEncode, PngShapes) {
+	Bitmap               img;
+	std::vector<uint8_t> filters;
+	for (int w : {1, 2, 5, 17, 333}) {
+		for (int h : {1, 3, 97}) {
+			MakeBitmap(img, w, h, 0xff204060);
+			DrawNoise(img, Rect(0, 0, (w + 1) / 2, h), (uint32_t) (w * h));
+			DrawPhoto(img, Rect(w / 2, 0, w, h), (uint32_t) (w + h));
+			for (int threads : {0, 1, 5})
+				CheckPngRoundTrip(img, threads, filters);
+		}
+	}
+}
+
+// An encoder keeps its workers and buffers between images, which may change size and strip count
+TEST(ImageEncode, PngEncoder) {
+	PngEncoder           enc;
+	Bitmap               img;
+	std::vector<uint8_t> filters;
+	enc.Threads = 4;
+	for (int i = 0; i < 6; i++) {
+		int w = i % 2 ? 640 : 97;
+		int h = i % 3 ? 480 : 40;
+		DrawDesktop(img, w, h, i);
+		std::vector<uint8_t> out, ref;
+		enc.Encode(img, out);
+		PngEncode(img, ref, 4);
+		CHECK(out == ref);
+		CheckPngRoundTrip(img, 4, filters);
+	}
+}
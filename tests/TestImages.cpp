@@ -0,0 +1,91 @@
+#include "stdafx.h"
+#include "Test.h"
+
+// Integer hash, so that every pixel of the synthetic images depends only on where it is on the
+// page, and scrolling or redrawing a region reproduces exactly the same pixels
+static uint32_t Hash(uint32_t a, uint32_t b, uint32_t c = 0) {
+	uint32_t h = a * 0x9e3779b1 ^ (b + 0x7f4a7c15) * 0x85ebca77 ^ (c + 0x165667b1) * 0xc2b2ae3d;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6d;
+	h ^= h >> 12;
+	h *= 0x297a2d39;
+	h ^= h >> 15;
+	return h;
+}
+
+static void Fill(Bitmap& img, const Rect& r, uint32_t color) {
+	Rect c = r.Intersection(img.Bounds());
+	for (int y = c.Y1; y < c.Y2; y++) {
+		uint32_t* row = (uint32_t*) img.Row(y);
+		std::fill(row + c.X1, row + c.X2, color);
+	}
+}
+
+void MakeBitmap(Bitmap& img, int width, int height, uint32_t color) {
+	img.Width  = width;
+	img.Height = height;
+	img.Buf.resize((size_t) width * height * 4);
+	Fill(img, img.Bounds(), color);
+}
+
+void DrawText(Bitmap& img, const Rect& r, int y0, int lineHeight, uint32_t seed) {
+	const int cell = 8; // Glyphs are 8 pixels wide, with a 1 pixel gap
+	Rect      c    = r.Intersection(img.Bounds());
+	for (int y = c.Y1; y < c.Y2; y++) {
+		uint32_t* row   = (uint32_t*) img.Row(y);
+		int       pageY = y - y0;
+		int       line  = pageY >= 0 ? pageY / lineHeight : -1;
+		int       gy    = pageY - line * lineHeight - 3; // Glyph row, with 3 rows of leading
+		int       cells = 10 + (int) (Hash(seed, line) % std::max(r.Width() / cell, 1));
+		for (int x = c.X1; x < c.X2; x++) {
+			int      cx  = (x - r.X1) / cell;
+			int      gx  = (x - r.X1) % cell;
+			uint32_t ch  = Hash(seed, line, cx);
+			bool     ink = line >= 0 && cx < cells && gy >= 0 && gy < lineHeight - 6 && gx != cell - 1 && ch % 6 != 0 && (Hash(ch % 64, gy, gx) & 3) == 0;
+			row[x]       = ink ? 0xff202020 : 0xffffffff;
+		}
+	}
+}
+
+void DrawNoise(Bitmap& img, const Rect& r, uint32_t seed) {
+	Rect c = r.Intersection(img.Bounds());
+	for (int y = c.Y1; y < c.Y2; y++) {
+		uint32_t* row = (uint32_t*) img.Row(y);
+		for (int x = c.X1; x < c.X2; x++)
+			row[x] = 0xff000000 | Hash(seed, x, y);
+	}
+}
+
+void DrawPhoto(Bitmap& img, const Rect& r, uint32_t seed) {
+	Rect c = r.Intersection(img.Bounds());
+	for (int y = c.Y1; y < c.Y2; y++) {
+		uint32_t* row = (uint32_t*) img.Row(y);
+		for (int x = c.X1; x < c.X2; x++) {
+			uint32_t n = Hash(seed, x, y);
+			int      b = (x * 255 / std::max(r.Width(), 1) + (n & 7)) & 255;
+			int      g = (y * 255 / std::max(r.Height(), 1) + ((n >> 3) & 7)) & 255;
+			int      v = ((x + y) / 2 + ((n >> 6) & 15)) & 255;
+			row[x]     = 0xff000000 | (uint32_t) v << 16 | (uint32_t) g << 8 | (uint32_t) b;
+		}
+	}
+}
+
+void DrawDesktop(Bitmap& img, int width, int height, uint32_t seed) {
+	MakeBitmap(img, width, height, 0xff285078);
+	for (int i = 0; i < 6; i++) {
+		uint32_t h  = Hash(seed, i, 1);
+		int      w  = width / 4 + (int) (h % (width / 3));
+		int      ht = height / 4 + (int) ((h >> 12) % (height / 3));
+		int      x  = (int) (Hash(seed, i, 2) % (width - w / 2));
+		int      y  = (int) (Hash(seed, i, 3) % (height - ht / 2));
+		Rect     win(x, y, x + w, y + ht);
+		Fill(img, win, 0xff606060);
+		Fill(img, Rect(x + 1, y + 1, x + w - 1, y + 24), 0xff1e3c5a);
+		Rect client(x + 1, y + 24, x + w - 1, y + ht - 1);
+		if (i % 3 == 2)
+			DrawPhoto(img, client, seed + i);
+		else
+			DrawText(img, client, client.Y1, 18, seed + i);
+	}
+	Fill(img, Rect(0, height - 40, width, height), 0xff303030);
+}
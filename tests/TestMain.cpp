@@ -0,0 +1,57 @@
+#include "stdafx.h"
+#include "Test.h"
+
+// main() of both windup_tests and windup_bench. Which one it is depends on the cases linked in.
+
+static int Failures = 0;
+
+std::vector<TestCase>& TestRegistry() {
+	static std::vector<TestCase> cases;
+	return cases;
+}
+
+void TestFail(const char* file, int line, const std::string& msg) {
+	Failures++;
+	tsf::print("  %v:%v: %v\n", file, line, msg);
+	fflush(stdout);
+}
+
+double BenchSeconds() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool Matches(const TestCase& c, int argc, char** argv) {
+	if (argc <= 1)
+		return true;
+	std::string full = tsf::fmt("%v.%v", c.Group, c.Name);
+	for (int i = 1; i < argc; i++) {
+		if (argv[i] == full || strcmp(argv[i], c.Group) == 0)
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char** argv) {
+	int ran    = 0;
+	int failed = 0;
+	for (const auto& c : TestRegistry()) {
+		if (!Matches(c, argc, argv))
+			continue;
+		tsf::print("%v.%v\n", c.Group, c.Name);
+		fflush(stdout);
+		int    before = Failures;
+		double start  = BenchSeconds();
+		c.Run();
+		ran++;
+		if (Failures != before) {
+			failed++;
+			tsf::print("  FAILED (%.0f ms)\n", (BenchSeconds() - start) * 1000);
+		}
+	}
+	if (ran == 0) {
+		tsf::print("Nothing matches the filters\n");
+		return 1;
+	}
+	tsf::print("%v of %v passed\n", ran - failed, ran);
+	return failed == 0 ? 0 : 1;
+}
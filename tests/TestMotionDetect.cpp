@@ -0,0 +1,66 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "MotionDetect.h"
+
+static bool Same(const Bitmap& a, const Bitmap& b) {
+	return a.Width == b.Width && a.Height == b.Height && memcmp(a.Buf.data(), b.Buf.data(), a.Buf.size()) == 0;
+}
+
+// Rebuild 'cur' from 'prev' and what the estimator found, the way a viewer would
+static bool Rebuilds(const MotionEstimator& m, const Bitmap& prev, const Bitmap& cur) {
+	Bitmap out = prev;
+	ApplyMoves(out, m.Moves);
+	for (const auto& r : m.Residual) {
+		for (int y = r.Y1; y < r.Y2; y++)
+			memcpy(out.Row(y) + r.X1 * 4, cur.Row(y) + r.X1 * 4, r.Width() * 4);
+	}
+	return Same(out, cur);
+}
+
+static int64_t Area(const std::vector<Rect>& rects) {
+	int64_t a = 0;
+	for (const auto& r : rects)
+		a += (int64_t) r.Width() * r.Height();
+	return a;
+}
+
+TEST(MotionDetect, VerticalScroll) {
+	Rect            pane(300, 100, 1600, 1000);
+	MotionEstimator m;
+	Bitmap          prev, cur;
+	DrawDesktop(prev, 1920, 1080, 1);
+	for (int step : {37, -18, 1, 200}) {
+		cur = prev;
+		DrawText(cur, pane, pane.Y1 - 400 - step, 18, 5);
+		DrawText(prev, pane, pane.Y1 - 400, 18, 5);
+		CHECK(m.Estimate(prev, cur, {pane}));
+		CHECK(Rebuilds(m, prev, cur));
+		// Only the lines that scrolled into view are left over
+		CHECK(Area(m.Residual) <= (int64_t) pane.Width() * (std::abs(step) + 36));
+	}
+}
+
+TEST(MotionDetect, HorizontalScroll) {
+	Bitmap prev, cur;
+	DrawDesktop(prev, 1920, 1080, 2);
+	cur = prev;
+	for (int y = 0; y < 1080; y++)
+		memmove(cur.Row(y) + 400 * 4, cur.Row(y) + 430 * 4, (1500 - 430) * 4);
+	MotionEstimator m;
+	CHECK(m.Estimate(prev, cur, {cur.Bounds()}));
+	CHECK(Rebuilds(m, prev, cur));
+}
+
+// Content that changed without moving must not be explained as a move
+TEST(MotionDetect, NoMotion) {
+	Bitmap prev, cur;
+	DrawDesktop(prev, 800, 600, 3);
+	cur = prev;
+	Rect r(100, 100, 500, 400);
+	DrawNoise(cur, r, 4);
+	MotionEstimator m;
+	CHECK(!m.Estimate(prev, cur, {r}));
+	CHECK(Rebuilds(m, prev, cur));
+	CHECK(!m.Estimate(prev, prev, {prev.Bounds()}));
+	CHECK(m.Residual.size() == 0);
+}
@@ -0,0 +1,94 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "PixelKernels.h"
+
+TEST(PixelKernels, SelfCheck) {
+	CHECK_OK(PixelKernelsSelfCheck());
+}
+
+// Per-pixel definitions of the whole-bitmap functions, written from their documentation rather
+// than from the kernels
+static void RefConvert(const uint8_t* s, PixelFormat f, uint8_t* d) {
+	switch (f) {
+	case PixelFormat::BGRA8: memcpy(d, s, 4); break;
+	case PixelFormat::RGBA8: d[0] = s[2], d[1] = s[1], d[2] = s[0], d[3] = s[3]; break;
+	case PixelFormat::RGB8: d[0] = s[2], d[1] = s[1], d[2] = s[0]; break;
+	case PixelFormat::Gray8: d[0] = (uint8_t) ((s[0] * 29 + s[1] * 150 + s[2] * 77) >> 8); break;
+	}
+}
+
+static uint16_t RefDither(const uint8_t* s, Pixel16Format f, int x, int y) {
+	static const int bayer[4][4] = {{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+	int              t           = bayer[y & 3][x & 3];
+	int              b           = std::min(s[0] + t / 2, 255) >> 3;
+	int              r           = std::min(s[2] + t / 2, 255) >> 3;
+	if (f == Pixel16Format::RGB565)
+		return (uint16_t) (r << 11 | (std::min(s[1] + t / 4, 255) >> 2) << 5 | b);
+	return (uint16_t) (r << 10 | (std::min(s[1] + t / 2, 255) >> 3) << 5 | b);
+}
+
+// Every instruction set, through the whole-bitmap functions, on a rectangle with ragged edges
+TEST(PixelKernels, WholeBitmap) {
+	Bitmap a, b, blend;
+	DrawDesktop(a, 333, 97, 1);
+	DrawNoise(a, Rect(0, 0, 333, 40), 2);
+	MakeBitmap(b, 333, 97, 0);
+	DrawNoise(b, b.Bounds(), 3);
+	Rect                    r(5, 3, 302, 96);
+	const PixelKernelTable* best = &PixelKernels();
+
+	for (int isa = 0; isa < NumKernelISAs; isa++) {
+		if (!ForcePixelKernels((KernelISA) isa))
+			continue;
+		const char* name = KernelISAName((KernelISA) isa);
+
+		for (int f = 0; f < NumPixelFormats; f++) {
+			int                  bpp    = PixelFormatBytes((PixelFormat) f);
+			int                  stride = r.Width() * bpp + 7;
+			std::vector<uint8_t> out((size_t) stride * r.Height(), 0xcc), expect(out.size(), 0xcc);
+			for (int y = r.Y1; y < r.Y2; y++) {
+				for (int x = r.X1; x < r.X2; x++)
+					RefConvert(a.Row(y) + x * 4, (PixelFormat) f, &expect[(y - r.Y1) * stride + (x - r.X1) * bpp]);
+			}
+			ConvertRect(a, r, (PixelFormat) f, out.data(), stride);
+			if (out != expect)
+				TestFail(__FILE__, __LINE__, tsf::fmt("%v ConvertRect to format %v", name, f));
+		}
+
+		for (int f = 0; f < NumPixel16Formats; f++) {
+			int                   stride = r.Width() + 3;
+			std::vector<uint16_t> out((size_t) stride * r.Height(), 0xcccc), expect(out.size(), 0xcccc);
+			for (int y = r.Y1; y < r.Y2; y++) {
+				for (int x = r.X1; x < r.X2; x++)
+					expect[(y - r.Y1) * stride + x - r.X1] = RefDither(a.Row(y) + x * 4, (Pixel16Format) f, x, y);
+			}
+			DitherRect(a, r, (Pixel16Format) f, out.data(), stride);
+			if (out != expect)
+				TestFail(__FILE__, __LINE__, tsf::fmt("%v DitherRect to format %v", name, f));
+		}
+
+		for (int alpha : {0, 99, 256}) {
+			BlendBitmaps(a, b, alpha, blend);
+			REQUIRE(blend.Width == a.Width && blend.Height == a.Height);
+			const uint8_t* pa = a.Buf.data();
+			const uint8_t* pb = b.Buf.data();
+			const uint8_t* pd = blend.Buf.data();
+			bool           ok = true;
+			for (size_t i = 0; i < a.Buf.size(); i++)
+				ok = ok && pd[i] == (uint8_t) ((pa[i] * alpha + pb[i] * (256 - alpha)) >> 8);
+			if (!ok)
+				TestFail(__FILE__, __LINE__, tsf::fmt("%v BlendBitmaps with alpha %v", name, alpha));
+		}
+
+		uint64_t sad = 0;
+		for (int y = r.Y1; y < r.Y2; y++) {
+			for (int x = r.X1 * 4; x < r.X2 * 4; x++)
+				sad += std::abs(a.Row(y)[x] - b.Row(y)[x]);
+		}
+		if (SumAbsDiff(a, b, r) != sad)
+			TestFail(__FILE__, __LINE__, tsf::fmt("%v SumAbsDiff", name));
+		CHECK(SumAbsDiff(a, a, a.Bounds()) == 0);
+	}
+	UnforcePixelKernels();
+	CHECK(&PixelKernels() == best);
+}
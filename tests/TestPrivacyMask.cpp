@@ -0,0 +1,194 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "PrivacyMask.h"
+#include <random>
+
+static bool Same(const Bitmap& a, const Bitmap& b) {
+	return a.Width == b.Width && a.Height == b.Height && memcmp(a.Buf.data(), b.Buf.data(), a.Buf.size()) == 0;
+}
+
+// Copy the template into img at (x, y), and return where it went
+static Rect Place(Bitmap& img, const Bitmap& tpl, int x, int y) {
+	for (int r = 0; r < tpl.Height; r++)
+		memcpy(img.Row(y + r) + x * 4, tpl.Row(r), tpl.Width * 4);
+	return Rect(x, y, x + tpl.Width, y + tpl.Height);
+}
+
+// Random changes under masks that move and come and go. Every frame must match a masker that
+// starts from scratch, Dirty must cover every change, and frames that were held on to must not change.
+TEST(PrivacyMask, Incremental) {
+	std::mt19937 rng(5);
+	Bitmap       img, tpl;
+	MakeBitmap(img, 1000, 700, 0);
+	DrawNoise(img, img.Bounds(), 1);
+	MakeBitmap(tpl, 20, 10, 0);
+	DrawNoise(tpl, tpl.Bounds(), 2);
+	Place(img, tpl, 500, 500);
+
+	MaskRegion blur, pixelate, fill;
+	blur.Area     = Rect(10, 10, 300, 200);
+	blur.Mode     = MaskMode::Blur;
+	blur.Size     = 9;
+	pixelate.Area = Rect(250, 150, 630, 433);
+	pixelate.Mode = MaskMode::Pixelate;
+	pixelate.Size = 13;
+	fill.Area     = Rect(700, 100, 900, 120);
+	fill.Color    = 0xff112233;
+	MaskTemplate t;
+	t.Image      = tpl;
+	t.Mask.Color = 0xff00ff00;
+
+	PrivacyMasker inc;
+	inc.Masks     = {blur, pixelate, fill};
+	inc.Templates = {t};
+	Bitmap mirror = inc.Apply(img, {img.Bounds()});
+	mirror.Buf.MakeUnique();
+
+	// Frames that a slow consumer still holds, with a copy of what they held when they were made
+	std::deque<std::pair<Bitmap, Bitmap>> held;
+
+	for (int f = 0; f < 200; f++) {
+		std::vector<Rect> dirty;
+		int               n = rng() % 4;
+		for (int i = 0; i < n; i++) {
+			int  x = rng() % 990;
+			int  y = rng() % 690;
+			Rect r(x, y, std::min(1000, x + 1 + (int) (rng() % 80)), std::min(700, y + 1 + (int) (rng() % 60)));
+			DrawNoise(img, r, rng());
+			dirty.push_back(r);
+		}
+		if (f % 7 == 0)
+			dirty.push_back(Place(img, tpl, rng() % 980, rng() % 690));
+		if (f % 50 == 25)
+			inc.Masks[1].Area.X1 += 5;
+		if (f % 50 == 40)
+			inc.Masks.pop_back();
+		if (f % 50 == 45)
+			inc.Masks.push_back(fill);
+
+		const Bitmap& out = inc.Apply(img, dirty);
+		for (const auto& d : inc.Dirty) {
+			for (int y = d.Y1; y < d.Y2; y++)
+				memcpy(mirror.Row(y) + d.X1 * 4, out.Row(y) + d.X1 * 4, d.Width() * 4);
+		}
+		CHECK(Same(mirror, out));
+
+		PrivacyMasker ref;
+		ref.Masks     = inc.Masks;
+		ref.Templates = inc.Templates;
+		CHECK(Same(out, ref.Apply(img, {img.Bounds()})));
+
+		// Hold on to some frames for a while, like a consumer that falls behind
+		if (f % 3 == 0) {
+			Bitmap copy = out;
+			copy.Buf.MakeUnique();
+			held.emplace_back(out, copy);
+		}
+		while (held.size() > (size_t) (f % 11 == 0 ? 0 : 4)) {
+			CHECK(Same(held.front().first, held.front().second));
+			held.pop_front();
+		}
+	}
+}
+
+// A gray image, opaque, with one value per pixel, row by row
+static void MakeGray(Bitmap& img, int width, int height, const std::vector<int>& values) {
+	MakeBitmap(img, width, height, 0);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++)
+			((uint32_t*) img.Row(y))[x] = 0xff000000 | (uint32_t) values[y * width + x] * 0x010101;
+	}
+}
+
+// Apply one mask to a fresh masker, and compare with the gray values we worked out by hand
+static void CheckMask(const Bitmap& img, const MaskRegion& m, const std::vector<int>& expect) {
+	PrivacyMasker masker;
+	masker.Masks      = {m};
+	const Bitmap& out = masker.Apply(img, {img.Bounds()});
+	Bitmap        want;
+	MakeGray(want, img.Width, img.Height, expect);
+	CHECK(Same(out, want));
+}
+
+// Masks that hang over the edge of the frame are clipped to it
+TEST(PrivacyMask, GoldenFill) {
+	Bitmap img;
+	MakeGray(img, 6, 4, std::vector<int>(24, 50));
+	MaskRegion m;
+	m.Area  = Rect(4, 2, 10, 10);
+	m.Color = 0xff141414;
+	CheckMask(img, m,
+	          {50, 50, 50, 50, 50, 50,
+	           50, 50, 50, 50, 50, 50,
+	           50, 50, 50, 50, 20, 20,
+	           50, 50, 50, 50, 20, 20});
+}
+
+// Cells are the average of their pixels, rounded, and the last cell of a row or column is cut short
+TEST(PrivacyMask, GoldenPixelate) {
+	Bitmap img;
+	MakeGray(img, 6, 4,
+	         {160, 0, 0, 0, 12, 0,
+	          0, 0, 0, 0, 0, 0,
+	          0, 0, 0, 0, 0, 0,
+	          0, 0, 0, 0, 0, 0});
+	MaskRegion m;
+	m.Area = img.Bounds();
+	m.Mode = MaskMode::Pixelate;
+	m.Size = 4;
+	// 160 / 16 = 10, and 12 / 8 = 1.5, which rounds up
+	CheckMask(img, m,
+	          {10, 10, 10, 10, 2, 2,
+	           10, 10, 10, 10, 2, 2,
+	           10, 10, 10, 10, 2, 2,
+	           10, 10, 10, 10, 2, 2});
+
+	// Clipped to the top left corner of the frame, in 2x2 cells, which both corners of the mask agree on
+	MakeGray(img, 6, 4,
+	         {4, 8, 1, 9, 9, 9,
+	          0, 0, 2, 9, 9, 9,
+	          3, 5, 7, 9, 9, 9,
+	          6, 0, 7, 9, 9, 9});
+	m.Area = Rect(-4, -4, 3, 4);
+	m.Size = 2;
+	CheckMask(img, m,
+	          {3, 3, 2, 9, 9, 9,
+	           3, 3, 2, 9, 9, 9,
+	           4, 4, 7, 9, 9, 9,
+	           4, 4, 7, 9, 9, 9});
+}
+
+// A box blur that repeats the edge pixels of the mask, rather than reading beyond it
+TEST(PrivacyMask, GoldenBlur) {
+	// Every pixel's 3x3 window, with the edges repeated, holds the center exactly once: 90 / 9 = 10
+	Bitmap img;
+	MakeGray(img, 3, 3,
+	         {0, 0, 0,
+	          0, 90, 0,
+	          0, 0, 0});
+	MaskRegion m;
+	m.Area = img.Bounds();
+	m.Mode = MaskMode::Blur;
+	m.Size = 1;
+	CheckMask(img, m,
+	          {10, 10, 10,
+	           10, 10, 10,
+	           10, 10, 10});
+
+	// One row, so only the horizontal pass does anything: (0 + 0 + 30) / 3 = 10, and (90 + 120 + 120) / 3 = 110
+	MakeGray(img, 5, 1, {0, 30, 60, 90, 120});
+	m.Area = img.Bounds();
+	CheckMask(img, m, {10, 30, 60, 90, 110});
+
+	// Clipped to the top left 2x2 of the frame. The 200s around it must not leak in.
+	// (0,0) = (4*0 + 2*30 + 2*60 + 90) / 9 = 30, and (1,1) = (0 + 2*30 + 2*60 + 4*90) / 9 = 60
+	MakeGray(img, 4, 3,
+	         {0, 30, 200, 200,
+	          60, 90, 200, 200,
+	          200, 200, 200, 200});
+	m.Area = Rect(-5, -5, 2, 2);
+	CheckMask(img, m,
+	          {30, 40, 200, 200,
+	           50, 60, 200, 200,
+	           200, 200, 200, 200});
+}
@@ -0,0 +1,66 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "TextDetect.h"
+
+// The largest region, which is the body of a text pane. Short lines may leave a few stragglers.
+static const TextRegion* Largest(const TextDetector& td) {
+	const TextRegion* best = nullptr;
+	for (const auto& r : td.Regions) {
+		if (!best || (int64_t) r.Bounds.Width() * r.Bounds.Height() > (int64_t) best->Bounds.Width() * best->Bounds.Height())
+			best = &r;
+	}
+	return best;
+}
+
+// Text is found, and photos and flat areas are not. A region keeps its ID while it scrolls by a
+// line at a time, and text that shows up somewhere else is a new region.
+TEST(TextDetect, Regions) {
+	Bitmap img;
+	Rect   pane(128, 128, 640, 512);
+	Rect   noise(768, 128, 1088, 384); // Tile aligned, because noise next to a flat area has text-like edges
+	MakeBitmap(img, 1280, 720, 0xff606060);
+	DrawText(img, pane, pane.Y1, 18, 1);
+	DrawNoise(img, noise, 2);
+
+	TextDetector td;
+	CHECK(td.Update(img, {img.Bounds()}) == (int) td.Regions.size());
+	const TextRegion* first = Largest(td);
+	REQUIRE(first != nullptr);
+	uint64_t id = first->ID;
+	CHECK(first->Changed);
+	CHECK(first->Bounds.Width() * 2 > pane.Width() && first->Bounds.Height() * 2 > pane.Height());
+	for (const auto& r : td.Regions)
+		CHECK(pane.Contains(r.Bounds));
+
+	// Scrolling by a line keeps the ID, but the region needs another look
+	DrawText(img, pane, pane.Y1 - 18, 18, 1);
+	td.Update(img, {pane});
+	REQUIRE(Largest(td) != nullptr);
+	CHECK(Largest(td)->ID == id);
+	CHECK(Largest(td)->Changed);
+
+	// Changes elsewhere leave it alone
+	DrawNoise(img, noise, 3);
+	CHECK(td.Update(img, {noise}) == 0);
+	REQUIRE(Largest(td) != nullptr);
+	CHECK(Largest(td)->ID == id);
+
+	// Text that appears somewhere else is a new region
+	Rect other(704, 448, 1216, 704);
+	MakeBitmap(img, 1280, 720, 0xff606060);
+	DrawText(img, other, other.Y1, 18, 4);
+	td.Update(img, {img.Bounds()});
+	REQUIRE(Largest(td) != nullptr);
+	CHECK(Largest(td)->ID > id);
+	for (const auto& r : td.Regions)
+		CHECK(other.Contains(r.Bounds));
+
+	// IDs are never reused, even after Reset
+	uint64_t last = 0;
+	for (const auto& r : td.Regions)
+		last = std::max(last, r.ID);
+	td.Reset();
+	td.Update(img, {});
+	for (const auto& r : td.Regions)
+		CHECK(r.ID > last && r.Changed);
+}
@@ -0,0 +1,137 @@
+#include "stdafx.h"
+#include "Test.h"
+#include "TileStore.h"
+#include "FrameTrace.h"
+#include <random>
+
+// Unique to this run, and removed at the end of each test
+static std::string PackFile() {
+	static std::string name = tsf::fmt("windup_test_%v.tiles", MonotonicMicros());
+	return name;
+}
+
+static bool Same(const Bitmap& a, const Bitmap& b) {
+	return a.Width == b.Width && a.Height == b.Height && memcmp(a.Buf.data(), b.Buf.data(), a.Buf.size()) == 0;
+}
+
+// Equal pixels hash equal wherever they are, and the hash doesn't depend on the instruction set.
+// The pinned values are what the scalar and the SSE2 code both produce.
+TEST(TileStore, Hash) {
+	Bitmap img;
+	MakeBitmap(img, 200, 150, 0);
+	DrawNoise(img, Rect(0, 0, 64, 64), 1);
+	for (int y = 0; y < 64; y++)
+		memcpy(img.Row(70 + y) + 100 * 4, img.Row(y), 64 * 4);
+	TileHash a = HashTile(img, Rect(0, 0, 64, 64));
+	TileHash b = HashTile(img, Rect(100, 70, 164, 134));
+	CHECK(a == b);
+	CHECK(a.Lo == 0x9b0a0919218ff3a0ull && a.Hi == 0x6fc3c5c8bc325021ull);
+
+	// Tiles of the same pixels, but different shapes, are different tiles
+	CHECK(HashTile(img, Rect(150, 0, 182, 64)) != HashTile(img, Rect(150, 0, 214, 32)));
+	TileHash edge = HashTile(img, Rect(3, 5, 20, 38));
+	CHECK(edge.Lo == 0xa29b20e8cc3b47d6ull && edge.Hi == 0xc89359fe2af9f047ull);
+
+	// Every pixel counts
+	img.Row(133)[163 * 4 + 2] ^= 1;
+	CHECK(HashTile(img, Rect(100, 70, 164, 134)) != a);
+}
+
+// Alt-tab between a few windows, with a caret that blinks, and now and then something new.
+// Every frame reads back exactly, also after reopening, and after dropping half and compacting.
+TEST(TileStore, Session) {
+	remove(PackFile().c_str());
+	std::mt19937 rng(17);
+	Bitmap       windows[3];
+	for (int i = 0; i < 3; i++)
+		DrawDesktop(windows[i], 640, 360, i + 1);
+
+	TileStore store;
+	REQUIRE_OK(store.Open(PackFile()));
+	std::vector<Bitmap> frames; // Every frame that was stored, unshared
+	Bitmap              img = windows[0];
+	Rect                caret(300, 100, 302, 118);
+	for (int i = 0; i < 300; i++) {
+		std::vector<Rect> dirty;
+		if (i % 40 == 0) {
+			img = windows[rng() % 3];
+			dirty.push_back(img.Bounds());
+		}
+		if (i % 8 == 0) {
+			for (int y = caret.Y1; y < caret.Y2; y++)
+				std::fill((uint32_t*) img.Row(y) + caret.X1, (uint32_t*) img.Row(y) + caret.X2, i % 16 == 0 ? 0xff000000 : 0xffffffff);
+			dirty.push_back(caret);
+		}
+		if (i % 25 == 0) {
+			Rect r(rng() % 500, rng() % 300, 0, 0);
+			r.X2 = r.X1 + 1 + rng() % 100;
+			r.Y2 = r.Y1 + 1 + rng() % 50;
+			DrawNoise(img, r, rng());
+			dirty.push_back(r);
+		}
+		uint64_t n = 0;
+		REQUIRE_OK(store.AddFrame(img, dirty, i * 1000, &n));
+		CHECK(n == (uint64_t) i);
+		frames.push_back(img);
+		frames.back().Buf.MakeUnique();
+	}
+
+	// Everything that recurs was stored once
+	TileStoreStats s = store.Stats();
+	CHECK(s.Frames == 300 && s.TileRefs == 300 * 60);
+	CHECK(s.StoredTiles == s.Tiles && s.StoredTiles * 3 < s.HashedTiles);
+	CHECK(s.DedupRatio > 40);
+
+	auto checkFrames = [&](uint64_t first) {
+		Bitmap  out;
+		int64_t ts = 0;
+		for (uint64_t f = first; f < frames.size(); f++) {
+			CHECK_OK(store.ReadFrame(f, out, &ts));
+			CHECK(Same(out, frames[f]) && ts == (int64_t) f * 1000);
+		}
+		CHECK(store.ReadFrame(frames.size(), out) != "");
+	};
+	checkFrames(0);
+	store.Close();
+	REQUIRE_OK(store.Open(PackFile()));
+	checkFrames(0);
+
+	// Drop the first half, and compact away the tiles that only it used
+	store.DropFrames(150);
+	CHECK(store.FirstFrame() == 150 && store.EndFrame() == 300);
+	uint64_t before = store.Stats().PackBytes;
+	REQUIRE_OK(store.Compact());
+	s = store.Stats();
+	CHECK(s.PackBytes < before && s.Tiles == s.LiveTiles && s.Frames == 150);
+	Bitmap out;
+	CHECK(store.ReadFrame(149, out) != "");
+	checkFrames(150);
+	store.Close();
+	REQUIRE_OK(store.Open(PackFile()));
+	CHECK(store.FirstFrame() == 150);
+	checkFrames(150);
+
+	// A window that was seen before costs no new tiles, after compaction and reopening too
+	for (int i = 0; i < 3; i++) {
+		REQUIRE_OK(store.AddFrame(windows[i], {windows[i].Bounds()}, (300 + i) * 1000));
+		frames.push_back(windows[i]);
+	}
+	CHECK(store.Stats().StoredTiles <= 60 * 3);
+	checkFrames(150);
+	store.Close();
+	remove(PackFile().c_str());
+}
+
+TEST(TileStore, NotAPack) {
+	remove(PackFile().c_str());
+	FILE* f = fopen(PackFile().c_str(), "wb");
+	REQUIRE(f != nullptr);
+	fputs("this is not a tile pack, but it is longer than the header of one", f);
+	fclose(f);
+	TileStore store;
+	CHECK(store.Open(PackFile()) != "");
+	CHECK(!store.IsOpen());
+	Bitmap img;
+	CHECK(store.ReadFrame(0, img) != "");
+	remove(PackFile().c_str());
+}
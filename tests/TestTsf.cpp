@@ -0,0 +1,177 @@
+#include "stdafx.h"
+#include "Test.h"
+#include <random>
+
+// UTF-8 of a wide string, written the long way. Wide strings are UTF-16 on Windows, and UTF-32 elsewhere.
+static std::string RefUTF8(const std::wstring& s) {
+	std::vector<uint32_t> cps;
+	for (size_t i = 0; i < s.size(); i++) {
+		uint32_t c = sizeof(wchar_t) == 2 ? (uint16_t) s[i] : (uint32_t) s[i];
+		bool     hi = c >= 0xd800 && c < 0xdc00;
+		bool     lo = c >= 0xdc00 && c < 0xe000;
+		if (sizeof(wchar_t) == 2 && hi && i + 1 < s.size() && (uint16_t) s[i + 1] >= 0xdc00 && (uint16_t) s[i + 1] < 0xe000) {
+			cps.push_back(0x10000 + ((c - 0xd800) << 10) + ((uint16_t) s[i + 1] - 0xdc00));
+			i++;
+		} else if (hi || lo || c > 0x10ffff) {
+			cps.push_back(0xfffd);
+		} else {
+			cps.push_back(c);
+		}
+	}
+	std::string out;
+	for (uint32_t c : cps) {
+		int n = c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+		if (n == 1) {
+			out += (char) c;
+			continue;
+		}
+		static const uint8_t lead[5] = {0, 0, 0xc0, 0xe0, 0xf0};
+		out += (char) (lead[n] | (c >> (6 * (n - 1))));
+		for (int k = n - 2; k >= 0; k--)
+			out += (char) (0x80 | ((c >> (6 * k)) & 0x3f));
+	}
+	return out;
+}
+
+// Append one code point, as a surrogate pair if it needs one
+static void PutWide(std::wstring& s, uint32_t c) {
+	if (sizeof(wchar_t) == 2 && c >= 0x10000) {
+		s += (wchar_t) (0xd800 + ((c - 0x10000) >> 10));
+		s += (wchar_t) (0xdc00 + ((c - 0x10000) & 0x3ff));
+	} else {
+		s += (wchar_t) c;
+	}
+}
+
+// Runs of ASCII, CJK and everything else, so that the vector path sees whole blocks of each,
+// blocks that mix them, surrogate pairs split across blocks, and invalid values
+static std::wstring RandomWide(std::mt19937& rng) {
+	std::wstring s;
+	int          runs = rng() % 6;
+	for (int r = 0; r < runs; r++) {
+		int kind = rng() % 7;
+		int len  = rng() % 40;
+		for (int i = 0; i < len; i++) {
+			switch (kind) {
+			case 0: PutWide(s, 0x20 + rng() % 0x5f); break;
+			case 1: PutWide(s, 0x4e00 + rng() % 0x5000); break;
+			case 2: PutWide(s, 0x80 + rng() % 0x780); break;
+			case 3: PutWide(s, 0x10000 + rng() % 0x100000); break;
+			case 4: s += (wchar_t) (0xd800 + rng() % 0x800); break; // Lone or misordered surrogates
+			case 5: s += (wchar_t) (sizeof(wchar_t) == 2 ? 0xffff : 0x110000 + rng() % 0x1000); break;
+			default: PutWide(s, 1 + rng() % 0x10000); break;
+			}
+		}
+	}
+	return s;
+}
+
+TEST(Tsf, Wide) {
+	std::mt19937 rng(9);
+	char         buf[64];
+	for (int i = 0; i < 20000; i++) {
+		std::wstring s   = RandomWide(rng);
+		std::string  ref = RefUTF8(s);
+		CHECK(tsf::fmt("%v", s) == ref);
+		CHECK(tsf::fmt("[%v]", s.c_str()) == "[" + ref + "]");
+
+		// Too long for the stack buffer, so the formatter has to ask for more
+		auto r = tsf::fmt_buf(buf, sizeof(buf), "%v", s);
+		CHECK(std::string(r.Str, r.Len) == ref);
+		if (r.Str != buf)
+			delete[] r.Str;
+
+		// Width and precision count bytes of UTF-8, like they do for narrow strings
+		if (i % 10 == 0)
+			CHECK(tsf::fmt("%-30s|%.7s|", s, s) == tsf::fmt("%-30s|%.7s|", ref, ref));
+	}
+	CHECK(tsf::fmt("%v", std::wstring()) == "");
+	CHECK(tsf::fmt("%v", L"\u00b5s") == "\xc2\xb5s");
+}
+
+// Decode 'log', 'step' bytes at a time, as if it were still being written, and return the text of every record
+static bool DecodeLog(const std::string& log, size_t step, std::vector<std::string>& records) {
+	tsf::binlog_reader r;
+	const uint8_t*     p     = (const uint8_t*) log.data();
+	const uint8_t*     start = p;
+	size_t             avail = 0;
+	std::string        text;
+	while (true) {
+		int res = r.next(p, start + avail, text);
+		if (res < 0)
+			return false;
+		if (res == 1) {
+			records.push_back(text);
+		} else if (avail == log.size()) {
+			return p == start + avail;
+		} else {
+			avail = std::min(log.size(), avail + step);
+		}
+	}
+}
+
+// Random records of every argument type, each of which must decode to what tsf::fmt produces
+TEST(Tsf, Binlog) {
+	static const uint32_t frameFmt = tsf::binlog_format_id("frame %v took %v us, %v rects, %v ms, %v");
+	static const uint32_t specFmt  = tsf::binlog_format_id("%d|%u|%x|%8.3f|%-6s|%c|%5v");
+	static const uint32_t wideFmt  = tsf::binlog_format_id("[%v] at %v");
+	static const uint32_t noneFmt  = tsf::binlog_format_id("no arguments, 100%%");
+	CHECK(tsf::binlog_format_id("[%v] at %v") == wideFmt);
+
+	std::mt19937             rng(11);
+	tsf::binlog_writer       w;
+	std::string              log;
+	std::vector<std::string> expect;
+	for (int i = 0; i < 30000; i++) {
+		uint64_t    u64 = (uint64_t) rng() << (rng() % 33) | rng();
+		int64_t     i64 = (int64_t) u64 * (rng() & 1 ? -1 : 1);
+		int         i32 = (int) rng();
+		double      dbl = (double) i32 / (1 + rng() % 1000);
+		std::string str(rng() % 20, 'a' + rng() % 26);
+		switch (rng() % 4) {
+		case 0:
+			w.write(frameFmt, u64, i64, i32, dbl, str);
+			expect.push_back(tsf::fmt("frame %v took %v us, %v rects, %v ms, %v", u64, i64, i32, dbl, str));
+			break;
+		case 1:
+			w.write(specFmt, i32, (unsigned) i32, u64, dbl, str.c_str(), 'a' + i32 % 26, (void*) (uintptr_t) u64);
+			expect.push_back(tsf::fmt("%d|%u|%x|%8.3f|%-6s|%c|%5v", i32, (unsigned) i32, u64, dbl, str.c_str(), 'a' + i32 % 26, (void*) (uintptr_t) u64));
+			break;
+		case 2: {
+			std::wstring ws = RandomWide(rng);
+			w.write(wideFmt, ws, i64);
+			expect.push_back(tsf::fmt("[%v] at %v", ws, i64));
+			break;
+		}
+		default:
+			w.write(noneFmt);
+			expect.push_back(tsf::fmt("no arguments, 100%%"));
+			break;
+		}
+		// Take the bytes out now and then, the way a log that is flushed to a file would
+		if (i % 1000 == 999) {
+			log.append(w.data(), w.size());
+			w.clear();
+		}
+	}
+	log.append(w.data(), w.size());
+
+	for (size_t step : {(size_t) 7, log.size()}) {
+		std::vector<std::string> records;
+		CHECK(DecodeLog(log, step, records));
+		CHECK(records == expect);
+	}
+
+	// After clear, the log continues, and refers to formats that were defined earlier
+	w.clear();
+	w.write(wideFmt, L"x", 1);
+	std::vector<std::string> records;
+	CHECK(!DecodeLog(std::string(w.data(), w.size()), 7, records));
+
+	// After reset, it starts again, with its own definitions
+	w.reset();
+	w.write(wideFmt, L"x", 1);
+	records.clear();
+	CHECK(DecodeLog(std::string(w.data(), w.size()), 7, records));
+	CHECK(records.size() == 1 && records[0] == "[x] at 1");
+}
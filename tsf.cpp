@@ -7,19 +7,22 @@
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
+#include <mutex>
+#include <unordered_map>
 
 namespace tsf {
 
 static const size_t argbuf_arraysize = 16;
 
 #ifdef _WIN32
-static const char* i64Prefix   = "I64";
-static const char* wcharPrefix = "";
-static const char  wcharType   = 'S';
+static const char* i64Prefix = "I64";
 #else
-static const char* i64Prefix   = "ll";
-static const char* wcharPrefix = "l";
-static const char  wcharType   = 's';
+static const char* i64Prefix = "ll";
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TSF_SSE2 1
+#include <emmintrin.h>
 #endif
 
 class StackBuffer {
@@ -84,6 +87,142 @@ static int format_string(char* destination, size_t count, const char* format_str
 	return fmt_snprintf(destination, count, format_str, s);
 }
 
+// Wide strings are UTF-16 on Windows, and UTF-32 everywhere else. We transcode them to UTF-8
+// ourselves, instead of handing them to snprintf as %ls, because that depends on the C locale
+// (in the default "C" locale, it fails on anything that isn't ASCII), and it's slow.
+// Unpaired surrogates, and anything else that isn't a valid code point, become U+FFFD.
+
+static const size_t   utf8_max_per_wchar = sizeof(wchar_t) == 2 ? 3 : 4;
+static const uint32_t utf8_replacement   = 0xfffd;
+
+static inline char* utf8_put(char* d, uint32_t cp) {
+	if (cp < 0x80) {
+		*d++ = (char) cp;
+	} else if (cp < 0x800) {
+		*d++ = (char) (0xc0 | (cp >> 6));
+		*d++ = (char) (0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+		*d++ = (char) (0xe0 | (cp >> 12));
+		*d++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+		*d++ = (char) (0x80 | (cp & 0x3f));
+	} else {
+		*d++ = (char) (0xf0 | (cp >> 18));
+		*d++ = (char) (0x80 | ((cp >> 12) & 0x3f));
+		*d++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+		*d++ = (char) (0x80 | (cp & 0x3f));
+	}
+	return d;
+}
+
+// Decode the code point at s[i], and advance i past it
+static inline uint32_t wide_next(const wchar_t* s, size_t n, size_t& i) {
+	uint32_t c = sizeof(wchar_t) == 2 ? (uint16_t) s[i++] : (uint32_t) s[i++];
+	if (c >= 0xd800 && c <= 0xdfff) {
+		if (sizeof(wchar_t) == 2 && c <= 0xdbff && i < n && (uint16_t) s[i] >= 0xdc00 && (uint16_t) s[i] <= 0xdfff)
+			return 0x10000 + ((c - 0xd800) << 10) + ((uint16_t) s[i++] - 0xdc00);
+		return utf8_replacement;
+	}
+	return c <= 0x10ffff ? c : utf8_replacement;
+}
+
+#ifdef TSF_SSE2
+// Load 8 wide characters into 16 bit lanes. Returns false if any of them don't fit, which can only happen with UTF-32.
+static inline bool wide_load8(const wchar_t* s, __m128i& v) {
+	if (sizeof(wchar_t) == 2) {
+		v = _mm_loadu_si128((const __m128i*) s);
+		return true;
+	}
+	__m128i a = _mm_loadu_si128((const __m128i*) s);
+	__m128i b = _mm_loadu_si128((const __m128i*) (s + 4));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(_mm_or_si128(a, b), 16), _mm_setzero_si128())) != 0xffff)
+		return false;
+	// Sign extend the low halves, so that the signed saturation of packs leaves them alone
+	a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+	b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+	v = _mm_packs_epi32(a, b);
+	return true;
+}
+#endif
+
+static inline size_t utf8_size(uint32_t cp) {
+	return cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+}
+
+// Transcode n wide characters to UTF-8, writing at most 'count' bytes to 'dst', and no null terminator.
+// Returns the number of bytes written, or if the string doesn't fit, a number larger than 'count' that
+// is enough for all of it.
+static size_t wide_to_utf8(char* dst, size_t count, const wchar_t* s, size_t n) {
+	// Enough room for any block of 8 characters, plus the low half of a surrogate pair that straddles the end
+	const size_t block_max = 9 * utf8_max_per_wchar;
+
+	char*       d   = dst;
+	char* const end = dst + count;
+	size_t      i   = 0;
+	while (i < n && (size_t) (end - d) >= block_max) {
+#ifdef TSF_SSE2
+		__m128i v;
+		if (i + 8 <= n && wide_load8(s + i, v)) {
+			const __m128i zero = _mm_setzero_si128();
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short) 0xff80)), zero)) == 0xffff) {
+				// 8 ASCII characters
+				_mm_storel_epi64((__m128i*) d, _mm_packus_epi16(v, v));
+				d += 8;
+				i += 8;
+				continue;
+			}
+			__m128i wide      = _mm_cmpeq_epi16(_mm_subs_epu16(_mm_set1_epi16(0x800), v), zero);
+			__m128i surrogate = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short) 0xf800)), _mm_set1_epi16((short) 0xd800));
+			if (_mm_movemask_epi8(_mm_andnot_si128(surrogate, wide)) == 0xffff) {
+				// 8 characters of 3 bytes each, which is what CJK text looks like
+				uint16_t c[8];
+				_mm_storeu_si128((__m128i*) c, v);
+				for (int k = 0; k < 8; k++) {
+					d[0] = (char) (0xe0 | (c[k] >> 12));
+					d[1] = (char) (0x80 | ((c[k] >> 6) & 0x3f));
+					d[2] = (char) (0x80 | (c[k] & 0x3f));
+					d += 3;
+				}
+				i += 8;
+				continue;
+			}
+		}
+#endif
+		// A mixed block. Handle it one character at a time, and try again after it.
+		for (size_t blockEnd = i + 8 < n ? i + 8 : n; i < blockEnd;)
+			d = utf8_put(d, wide_next(s, n, i));
+	}
+
+	// Near the end of the buffer, check the space for every character
+	while (i < n) {
+		size_t   start = i;
+		uint32_t cp    = wide_next(s, n, i);
+		if (utf8_size(cp) > (size_t) (end - d))
+			return (d - dst) + (n - start) * utf8_max_per_wchar;
+		d = utf8_put(d, cp);
+	}
+	return d - dst;
+}
+
+static int format_wstring(char* destination, size_t count, const char* format_str, const wchar_t* s) {
+	size_t n = wcslen(s);
+	// If it doesn't fit, our caller tries again with the size that we return
+	if (format_str[0] == '%' && format_str[1] == 's' && format_str[2] == 0)
+		return (int) wide_to_utf8(destination, count, s, n);
+
+	// There is a width or precision, so format the UTF-8 as a regular string
+	char        staticbuf[256];
+	std::string heapbuf;
+	char*       utf8 = staticbuf;
+	size_t      len  = wide_to_utf8(staticbuf, sizeof(staticbuf) - 1, s, n);
+	if (len > sizeof(staticbuf) - 1) {
+		heapbuf.resize(len + 1);
+		utf8 = &heapbuf[0];
+		len  = wide_to_utf8(utf8, len, s, n);
+	}
+	utf8[len] = 0;
+	return fmt_snprintf(destination, count, format_str, utf8);
+}
+
 template <typename TInt, int tbase, bool upcase>
 int format_integer(char* destination, TInt value) {
 	// we could theoretically do a lower base than 10, but then our static buffer would need to be bigger.
@@ -225,8 +364,8 @@ static inline int fmt_output_with_snprintf(char* outbuf, char fmt_type, char arg
 		SETTYPE2("", 's');
 		return format_string(outbuf, outputSize, argbuf, arg->CStr);
 	case fmtarg::TWStr:
-		SETTYPE2(wcharPrefix, wcharType);
-		return fmt_snprintf(outbuf, outputSize, argbuf, arg->WStr);
+		SETTYPE2("", 's');
+		return format_wstring(outbuf, outputSize, argbuf, arg->WStr);
 	case fmtarg::TI32:
 		if (fmt_type == 'c') {
 			SETTYPE2("", 'c');
@@ -386,9 +525,9 @@ TSF_FMT_API StrLenPair fmt_core(const context& context, const char* fmt, ssize_t
 							// give up. I first saw this on the Microsoft CRT when trying to write the "mu" symbol to an ascii string.
 							break;
 						}
-						// discard and try again with a larger buffer
+						// discard and try again with a larger buffer. A formatter that knows the size it needs returns that size.
 						output.MoveCurrentPos(-outputSize);
-						outputSize = outputSize * 2;
+						outputSize = written >= outputSize ? written + 1 : outputSize * 2;
 					}
 				}
 				tokenstart = -1;
@@ -440,6 +579,245 @@ TSF_FMT_API int fmt_snprintf(char* destination, size_t count, const char* format
 	return fmt_translate_snprintf_return_value(r, count);
 }
 
+// Binary logs. Every record starts with a varint header, which is (format_id << 1) for a record,
+// and (format_id << 1) | 1 for the definition of a format string. A definition is followed by the
+// length of the string, and the string. A record is followed by the number of arguments, and then
+// each argument is a fmtarg::Types byte, and its value.
+
+static const uint64_t binlog_max_format_id = 1 << 24;
+static const size_t   binlog_max_varint    = 10;
+
+static std::mutex                              binlog_lock;
+static std::vector<std::string>                binlog_formats;
+static std::unordered_map<std::string, size_t> binlog_ids;
+
+static inline char* put_varint(char* p, uint64_t v) {
+	while (v >= 0x80) {
+		*p++ = (char) (v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (char) v;
+	return p;
+}
+
+static inline uint64_t zigzag_encode(int64_t v) {
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v) {
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+// Returns 1 on success, 0 if the data ends before the varint does, and -1 if the varint is too long
+static inline int get_varint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+	v = 0;
+	for (int shift = 0; shift < 70; shift += 7) {
+		if (p == end)
+			return 0;
+		uint8_t b = *p++;
+		v |= (uint64_t) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 1;
+	}
+	return -1;
+}
+
+TSF_FMT_API uint32_t binlog_format_id(const char* fs) {
+	std::lock_guard<std::mutex> lock(binlog_lock);
+	auto                        it = binlog_ids.find(fs);
+	if (it != binlog_ids.end())
+		return (uint32_t) it->second;
+	binlog_ids[fs] = binlog_formats.size();
+	binlog_formats.push_back(fs);
+	return (uint32_t) binlog_formats.size() - 1;
+}
+
+char* binlog_writer::reserve(size_t bytes) {
+	if (Len + bytes > Buf.size())
+		Buf.resize(std::max(Buf.size() * 2, Len + bytes));
+	return &Buf[Len];
+}
+
+void binlog_writer::define(uint32_t format_id) {
+	std::string fs;
+	{
+		std::lock_guard<std::mutex> lock(binlog_lock);
+		if (format_id < binlog_formats.size())
+			fs = binlog_formats[format_id];
+	}
+	char* p = reserve(2 * binlog_max_varint + fs.size());
+	p       = put_varint(p, ((uint64_t) format_id << 1) | 1);
+	p       = put_varint(p, fs.size());
+	memcpy(p, fs.c_str(), fs.size());
+	Len = p + fs.size() - Buf.data();
+
+	if (format_id >= Defined.size())
+		Defined.resize(format_id + 1);
+	Defined[format_id] = true;
+}
+
+TSF_FMT_API void binlog_writer::write_core(uint32_t format_id, ssize_t nargs, const fmtarg* args) {
+	if (format_id >= Defined.size() || !Defined[format_id])
+		define(format_id);
+
+	// Reserve the worst case, so that we don't need to check for space along the way
+	size_t max = 2 * binlog_max_varint;
+	for (ssize_t i = 0; i < nargs; i++) {
+		max += 1 + binlog_max_varint;
+		if (args[i].Type == fmtarg::TCStr)
+			max += strlen(args[i].CStr);
+		else if (args[i].Type == fmtarg::TWStr)
+			max += binlog_max_varint + wcslen(args[i].WStr) * utf8_max_per_wchar;
+	}
+	char* p = reserve(max);
+	p       = put_varint(p, (uint64_t) format_id << 1);
+	p       = put_varint(p, nargs);
+	for (ssize_t i = 0; i < nargs; i++) {
+		const fmtarg& a = args[i];
+		*p++            = (char) (a.Type == fmtarg::TWStr ? fmtarg::TCStr : a.Type);
+		switch (a.Type) {
+		case fmtarg::TNull:
+			break;
+		case fmtarg::TPtr:
+			p = put_varint(p, (uint64_t) (uintptr_t) a.Ptr);
+			break;
+		case fmtarg::TCStr: {
+			size_t len = strlen(a.CStr);
+			p          = put_varint(p, len);
+			memcpy(p, a.CStr, len);
+			p += len;
+			break;
+		}
+		case fmtarg::TWStr: {
+			// Transcode after a gap that fits the largest length, then close the gap
+			size_t n   = wcslen(a.WStr);
+			size_t len = wide_to_utf8(p + binlog_max_varint, n * utf8_max_per_wchar, a.WStr, n);
+			char*  s   = put_varint(p, len);
+			memmove(s, p + binlog_max_varint, len);
+			p = s + len;
+			break;
+		}
+		case fmtarg::TI32:
+			p = put_varint(p, zigzag_encode(a.I32));
+			break;
+		case fmtarg::TU32:
+			p = put_varint(p, a.UI32);
+			break;
+		case fmtarg::TI64:
+			p = put_varint(p, zigzag_encode(a.I64));
+			break;
+		case fmtarg::TU64:
+			p = put_varint(p, a.UI64);
+			break;
+		case fmtarg::TDbl:
+			memcpy(p, &a.Dbl, 8);
+			p += 8;
+			break;
+		}
+	}
+	Len = p - Buf.data();
+}
+
+TSF_FMT_API bool binlog_writer::flush(FILE* file) {
+	bool ok = Len == 0 || fwrite(Buf.data(), 1, Len, file) == Len;
+	Len     = 0;
+	return ok;
+}
+
+TSF_FMT_API int binlog_reader::next(const uint8_t*& p, const uint8_t* end, std::string& text) {
+// Evaluate a get_varint, and return from next if it fails
+#define TSF_GET_VARINT(v)                    \
+	{                                        \
+		int res = get_varint(r, end, v);     \
+		if (res != 1)                        \
+			return res;                      \
+	}
+
+	while (p != end) {
+		const uint8_t* r = p;
+		uint64_t       head;
+		TSF_GET_VARINT(head);
+		uint64_t id = head >> 1;
+		if (id >= binlog_max_format_id)
+			return -1;
+
+		if (head & 1) {
+			uint64_t len;
+			TSF_GET_VARINT(len);
+			if (len > (uint64_t) (end - r))
+				return 0;
+			if (id >= Formats.size())
+				Formats.resize(id + 1);
+			Formats[id].assign((const char*) r, len);
+			p = r + len;
+			continue;
+		}
+
+		uint64_t nargs;
+		TSF_GET_VARINT(nargs);
+		if (id >= Formats.size() || nargs > 1024)
+			return -1;
+		if (Strings.size() < nargs)
+			Strings.resize(nargs);
+		Args.resize(nargs);
+		for (size_t i = 0; i < nargs; i++) {
+			if (r == end)
+				return 0;
+			fmtarg& a = Args[i];
+			a.Type    = (fmtarg::Types) *r++;
+			uint64_t v;
+			switch (a.Type) {
+			case fmtarg::TNull:
+				break;
+			case fmtarg::TPtr:
+				TSF_GET_VARINT(v);
+				a.Ptr = (const void*) (uintptr_t) v;
+				break;
+			case fmtarg::TCStr:
+				TSF_GET_VARINT(v);
+				if (v > (uint64_t) (end - r))
+					return 0;
+				// Strings[i] mustn't move once we've pointed at it, which is why Strings was sized up front
+				Strings[i].assign((const char*) r, v);
+				a.CStr = Strings[i].c_str();
+				r += v;
+				break;
+			case fmtarg::TI32:
+				TSF_GET_VARINT(v);
+				a.I32 = (int32_t) zigzag_decode(v);
+				break;
+			case fmtarg::TU32:
+				TSF_GET_VARINT(v);
+				a.UI32 = (uint32_t) v;
+				break;
+			case fmtarg::TI64:
+				TSF_GET_VARINT(v);
+				a.I64 = zigzag_decode(v);
+				break;
+			case fmtarg::TU64:
+				TSF_GET_VARINT(v);
+				a.UI64 = v;
+				break;
+			case fmtarg::TDbl:
+				if (end - r < 8)
+					return 0;
+				memcpy(&a.Dbl, r, 8);
+				r += 8;
+				break;
+			default:
+				return -1;
+			}
+		}
+		p = r;
+		context cx;
+		text = fmt_core(cx, Formats[id].c_str(), (ssize_t) nargs, Args.data());
+		return 1;
+	}
+	return 0;
+
+#undef TSF_GET_VARINT
+}
+
 } // namespace tsf
 
 #endif
\ No newline at end of file
@@ -21,7 +21,7 @@ Usage:
 tsf::fmt("%v %v", "abc", 123)        -->  "abc 123"     <== Use %v as a generic value type
 tsf::fmt("%s %d", "abc", 123)        -->  "abc 123"     <== Specific value types are fine too, unless they conflict with the provided type, in which case they are overridden
 tsf::fmt("%v", std::string("abc"))   -->  "abc"         <== std::string
-tsf::fmt("%v", std::wstring("abc"))  -->  "abc"         <== std::wstring
+tsf::fmt("%v", std::wstring("abc"))  -->  "abc"         <== std::wstring, and any other wide string, is written as UTF-8
 tsf::fmt("%.3f", 25.5)               -->  "25.500"      <== Use format strings as usual
 tsf::print("%v", "Hello world")      -->  "Hello world" <== Print to stdout
 tsf::print(stderr, "err %v", 5)      -->  "err 5"       <== Print to stderr (or any other FILE*)
@@ -59,7 +59,9 @@ typedef SSIZE_T ssize_t;
 
 #include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string>
+#include <vector>
 
 namespace tsf {
 
@@ -229,6 +231,77 @@ size_t print(const char* fs, const Args&... args)
 */
 TSF_FMT_API int fmt_snprintf(char* destination, size_t count, const char* format_str, ...);
 
+/* Binary logs
+
+Instead of formatting a message to text, a binlog_writer stores the ID of its format string, and
+its arguments in binary, packed with the same fmtarg conversions that fmt uses. Integers are
+varints (zigzag for signed types), doubles are 8 raw bytes, and strings are a length and their
+bytes. Wide strings are stored as UTF-8. Every log carries the definition of each format string
+that it uses, before the first record that uses it, so it can be decoded on its own, later, and
+in another process. binlog_reader turns the records back into text, with fmt_core.
+
+	static const uint32_t frameFmt = tsf::binlog_format_id("frame %v took %v us");
+	log.write(frameFmt, seq, micros);
+
+A binlog_writer is not thread safe. Use one per thread, or guard it with a lock.
+*/
+
+// Returns a small integer that identifies the format string 'fs' in binary logs. Every call with
+// an equal string returns the same ID. This takes a lock, so look the ID up once, and keep it.
+TSF_FMT_API uint32_t binlog_format_id(const char* fs);
+
+class binlog_writer
+{
+public:
+	template<typename... Args>
+	void write(uint32_t format_id, const Args&... args)
+	{
+		const auto num_args = sizeof...(Args);
+		fmtarg pack_array[num_args + 1]; // +1 for zero args case
+		internal::fmt_pack(pack_array, args...);
+		write_core(format_id, (ssize_t) num_args, pack_array);
+	}
+
+	TSF_FMT_API void write_core(uint32_t format_id, ssize_t nargs, const fmtarg* args);
+
+	const char* data() const { return Buf.data(); }
+	size_t      size() const { return Len; }
+
+	// Discard the bytes that have been written, but remember which format strings have been
+	// defined, so that the next bytes continue the same log
+	void clear() { Len = 0; }
+
+	// Forget everything, so that the next bytes start a new log
+	void reset() { Len = 0; Defined.clear(); }
+
+	// Write the bytes to 'file', and clear. Returns false if the write failed.
+	TSF_FMT_API bool flush(FILE* file);
+
+private:
+	std::string       Buf;     // Only the first Len bytes are used. The rest is room to grow, so that writes don't need to initialize it.
+	size_t            Len = 0;
+	std::vector<bool> Defined; // Format IDs that have been defined in this log
+
+	char* reserve(size_t bytes); // Returns a pointer to at least 'bytes' bytes, at the end of the log
+	void  define(uint32_t format_id);
+};
+
+class binlog_reader
+{
+public:
+	// Decode the next record in [p, end), and render it into 'text'. Definitions of format strings
+	// along the way are consumed silently. 'p' is moved past every byte that was consumed.
+	// Returns 1 when a record was decoded, 0 at the end of the data, or when the data ends in the
+	// middle of a record, in which case 'p' points at the start of that record, and -1 if the data
+	// is corrupt.
+	TSF_FMT_API int next(const uint8_t*& p, const uint8_t* end, std::string& text);
+
+private:
+	std::vector<std::string> Formats;
+	std::vector<std::string> Strings;
+	std::vector<fmtarg>      Args;
+};
+
 } // namespace tsf
 
 #endif
\ No newline at end of file